@@ -1,4 +1,6 @@
 #include "my_dispute.h"
+#include <crypt.h>
+#include <errno.h>
 
 // ASCII art for login screen from login-ascii.txt
 static const char *login_ascii[] = {
@@ -50,9 +52,9 @@ static void get_masked_input(WINDOW *win, char *buffer, int max_len, int y, int
 
   while (1)
   {
-    ch = wgetch(win);
+    ch = read_key(win);
 
-    if (ch == '\n' || ch == KEY_ENTER)
+    if (ch == '\n' || ch == KEY_ENTER || ch == KEY_F(10))
     {
       buffer[i] = '\0';
       break;
@@ -87,9 +89,9 @@ static void get_text_input(WINDOW *win, char *buffer, int max_len, int y, int x)
 
   while (1)
   {
-    ch = wgetch(win);
+    ch = read_key(win);
 
-    if (ch == '\n' || ch == KEY_ENTER)
+    if (ch == '\n' || ch == KEY_ENTER || ch == KEY_F(10))
     {
       buffer[i] = '\0';
       break;
@@ -139,23 +141,182 @@ int validate_password(char *password)
   return has_upper && has_special;
 }
 
-int authenticate_user(AppState *state, char *username, char *password)
+// Saved accounts.
+//
+// Users are registered again in every run, so a name alone proves
+// nothing about who owned it before a restart. The accounts file binds
+// each name registered here to a password hash, one "<hex name> <crypt
+// hash>" line per account: registering a saved name again takes its
+// password, and logging in under it registers it for this run. State
+// kept on disk under a name (private channel membership) is handed over
+// only after that check. Without a file (replays, tools) nothing is bound
+// and nothing is handed over.
+
+typedef struct
+{
+  char username[MAX_USERNAME_LEN];
+  char *hash;
+} Account;
+
+static char *accounts_path = NULL;
+static Account *accounts = NULL;
+static int account_count = 0;
+static struct crypt_data crypt_scratch; // Too big for the stack
+
+static void add_account(const char *username, const char *hash)
+{
+  Account *grown = realloc(accounts, sizeof(Account) * (account_count + 1));
+  char *copy = strdup(hash);
+  if (!grown || !copy)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  accounts = grown;
+  strcpy(accounts[account_count].username, username);
+  accounts[account_count++].hash = copy;
+}
+
+// Load the accounts file; a missing file is an empty one
+int accounts_init(const char *path)
 {
-  for (int i = 0; i < state->user_count; i++)
+  accounts_path = strdup(path);
+  if (!accounts_path)
   {
-    if (strcmp(state->users[i].username, username) == 0 &&
-        strcmp(state->users[i].password, password) == 0)
+    perror("strdup");
+    exit(1);
+  }
+
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    return errno == ENOENT;
+  }
+
+  char hex[2 * MAX_USERNAME_LEN + 1], hash[CRYPT_OUTPUT_SIZE];
+  while (fscanf(file, "%40s %383s", hex, hash) == 2)
+  {
+    size_t len = strlen(hex);
+    char username[MAX_USERNAME_LEN];
+    unsigned int byte = 0;
+    int valid = len > 0 && len % 2 == 0 && len / 2 < MAX_USERNAME_LEN;
+    for (size_t i = 0; valid && i < len; i += 2)
+    {
+      valid = sscanf(hex + i, "%2x", &byte) == 1 && byte != 0;
+      username[i / 2] = byte;
+    }
+    if (valid)
     {
+      username[len / 2] = '\0';
+      if (!account_credential(username))
+      {
+        add_account(username, hash);
+      }
+    }
+  }
+  fclose(file);
+  return 1;
+}
 
-      state->current_user_index = i;
-      state->users[i].is_online = 1;
-      return 1;
+// Saved password hash of a name, or NULL if it has no account
+const char *account_credential(const char *username)
+{
+  for (int i = 0; i < account_count; i++)
+  {
+    if (strcmp(accounts[i].username, username) == 0)
+    {
+      return accounts[i].hash;
     }
   }
+  return NULL;
+}
+
+static int password_matches(const char *hash, const char *password)
+{
+  const char *computed = crypt_r(password, hash, &crypt_scratch);
+  return computed && computed[0] != '*' && strcmp(computed, hash) == 0;
+}
+
+// Hash a password and append the account to the file
+static void save_account(const char *username, const char *password)
+{
+  char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+  const char *hash;
+  if (!crypt_gensalt_rn("$6$", 0, NULL, 0, salt, sizeof(salt)) ||
+      !(hash = crypt_r(password, salt, &crypt_scratch)) || hash[0] == '*')
+  {
+    return;
+  }
+
+  FILE *file = fopen(accounts_path, "a");
+  if (!file)
+  {
+    perror(accounts_path);
+    return;
+  }
+  for (const char *p = username; *p; p++)
+  {
+    fprintf(file, "%02x", (unsigned char)*p);
+  }
+  fprintf(file, " %s\n", hash);
+  if (fclose(file) != 0)
+  {
+    perror(accounts_path);
+    return;
+  }
+  add_account(username, hash);
+}
+
+int authenticate_user(AppState *state, char *username, char *password)
+{
+  metrics_count(METRIC_AUTH_ATTEMPTS, 1);
+  int known = roster_find_user(state, username, strlen(username));
+  if (known >= 0 && strcmp(state->users[known].password, password) == 0)
+  {
+    state->current_user_index = known;
+    set_user_online(state, known, 1);
+    inbox_deliver(state, known);
+    return 1;
+  }
+
+  // An account saved in an earlier run is registered for this one
+  const char *hash = accounts_path ? account_credential(username) : NULL;
+  if (hash && known < 0 && password_matches(hash, password) &&
+      add_new_user(state, username, "", password))
+  {
+    restore_channel_access(state, state->user_count - 1);
+    return 1;
+  }
 
+  metrics_count(METRIC_AUTH_FAILURES, 1);
   return 0;
 }
 
+// Register from the sign-up screen: a saved name takes its saved password,
+// and a new one is saved
+int register_account(AppState *state, char *username, char *email, char *password)
+{
+  const char *hash = accounts_path ? account_credential(username) : NULL;
+  if (hash && !password_matches(hash, password))
+  {
+    return 0;
+  }
+  if (!add_new_user(state, username, email, password))
+  {
+    return 0;
+  }
+
+  if (accounts_path)
+  {
+    if (!hash)
+    {
+      save_account(username, password);
+    }
+    restore_channel_access(state, state->user_count - 1);
+  }
+  return 1;
+}
+
 int add_new_user(AppState *state, char *username, char *email, char *password)
 {
   if (state->user_count >= MAX_USERS)
@@ -164,32 +325,44 @@ int add_new_user(AppState *state, char *username, char *email, char *password)
   }
 
   // Check if username already exists
-  for (int i = 0; i < state->user_count; i++)
+  if (roster_find_user(state, username, strlen(username)) >= 0)
   {
-    if (strcmp(state->users[i].username, username) == 0)
-    {
-      return 0;
-    }
+    return 0;
   }
 
   // Add new user
   strcpy(state->users[state->user_count].username, username);
+  state->users[state->user_count].name_width = text_width(username);
+  completion_add(COMPLETE_USERS, username);
+  roster_add_user(state->user_count, username);
   strcpy(state->users[state->user_count].email, email);
   strcpy(state->users[state->user_count].password, password);
   state->users[state->user_count].role = ROLE_USER; // Default role
-  state->users[state->user_count].is_online = 1;
+  set_user_online(state, state->user_count, 1);
 
   // Set muted_until to 0 (not muted) for all channels
   for (int i = 0; i < MAX_CHANNELS; i++)
   {
     state->users[state->user_count].muted_until[i] = 0;
+    state->users[state->user_count].mentions[i] = 0;
   }
 
+  // A new user starts caught up, unless markers were saved under this name
+  for (int i = 0; i < state->channel_count; i++)
+  {
+    state->users[state->user_count].last_read[i] = state->channels[i].last_seq;
+  }
+  restore_read_markers(state, state->user_count);
+
   // Set this user as current user
   state->current_user_index = state->user_count;
 
   // Increment user count
   state->user_count++;
+  replication_log_user(state, state->user_count - 1);
+
+  // Mail queued for this name before a restart
+  inbox_deliver(state, state->user_count - 1);
 
   return 1;
 }
@@ -270,7 +443,7 @@ int login_screen()
     mvwprintw(login_win, 6, 5, "Invalid username or password. Press any key...");
     wattroff(login_win, COLOR_PAIR(COLOR_BRIGHT_RED));
     wrefresh(login_win);
-    wgetch(login_win);
+    read_key(login_win);
   }
 
   delwin(login_win);
@@ -373,7 +546,7 @@ int register_screen()
 
   if (!valid)
   {
-    wgetch(reg_win);
+    read_key(reg_win);
     delwin(reg_win);
     delwin(ascii_win);
     return 0;
@@ -381,7 +554,7 @@ int register_screen()
 
   // Register user
   extern AppState app_state;
-  int success = add_new_user(&app_state, username, email, password);
+  int success = register_account(&app_state, username, email, password);
 
   if (!success)
   {
@@ -389,7 +562,7 @@ int register_screen()
     mvwprintw(reg_win, 10, 5, "Registration failed. Press any key...");
     wattroff(reg_win, COLOR_PAIR(COLOR_BRIGHT_RED));
     wrefresh(reg_win);
-    wgetch(reg_win);
+    read_key(reg_win);
   }
 
   delwin(reg_win);
@@ -0,0 +1,1164 @@
+#include "my_dispute.h"
+#include <ftw.h>
+#include <locale.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Headless microbenchmarks for the core and render paths.
+//
+// Every benchmark times each iteration individually and reports
+// percentiles as JSON on stdout, so results can be diffed or gated in CI.
+// Usage: my_dispute_bench [name-filter]
+
+AppState app_state;
+
+#define DEFAULT_ITERATIONS 20000
+#define DRAW_ITERATIONS 2000
+
+typedef struct
+{
+  const char *name;
+  long *samples;
+  int count;
+  int capacity;
+  char extra[160]; // Additional JSON fields, e.g. ", \"ratio\": 3.1"
+} BenchResult;
+
+static int first_result = 1;
+static unsigned int rng_state = 12345;
+
+// Deterministic xorshift so every run generates the same workload
+static unsigned int next_random()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void begin_result(BenchResult *result, const char *name, int iterations)
+{
+  result->name = name;
+  result->count = 0;
+  result->capacity = iterations;
+  result->extra[0] = '\0';
+  result->samples = malloc(sizeof(long) * iterations);
+  if (!result->samples)
+  {
+    perror("malloc");
+    exit(1);
+  }
+}
+
+static void record_sample(BenchResult *result, long ns)
+{
+  if (result->count < result->capacity)
+  {
+    result->samples[result->count++] = ns;
+  }
+}
+
+static int compare_long(const void *a, const void *b)
+{
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+static long percentile(BenchResult *result, double p)
+{
+  int index = (int)(p * (result->count - 1) + 0.5);
+  return result->samples[index];
+}
+
+static void emit_result(BenchResult *result)
+{
+  if (result->count == 0)
+  {
+    free(result->samples);
+    return;
+  }
+
+  qsort(result->samples, result->count, sizeof(long), compare_long);
+
+  double total = 0;
+  for (int i = 0; i < result->count; i++)
+  {
+    total += result->samples[i];
+  }
+
+  printf("%s    {\"name\": \"%s\", \"iterations\": %d, \"mean_ns\": %.1f, "
+         "\"min_ns\": %ld, \"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, "
+         "\"p999_ns\": %ld, \"max_ns\": %ld%s}",
+         first_result ? "" : ",\n", result->name, result->count, total / result->count,
+         result->samples[0], percentile(result, 0.50), percentile(result, 0.90),
+         percentile(result, 0.99), percentile(result, 0.999), result->samples[result->count - 1],
+         result->extra);
+  fflush(stdout);
+  first_result = 0;
+
+  free(result->samples);
+}
+
+// Reset the global state to the three default channels and user_count users,
+// with user 0 logged in as an administrator
+static void reset_state(int user_count)
+{
+  for (int i = 0; i < MAX_CHANNELS; i++)
+  {
+    free_channel(&app_state.channels[i]);
+  }
+  WINDOW *logo = app_state.logo_win;
+  WINDOW *channels = app_state.channels_win;
+  WINDOW *chat = app_state.chat_win;
+  WINDOW *input = app_state.input_win;
+  WINDOW *users = app_state.users_win;
+  editor_free(&app_state.input);
+  dm_free_all();
+  inbox_free_all();
+  list_view_free(&app_state.channel_list);
+  list_view_free(&app_state.user_list);
+  memset(&app_state, 0, sizeof(app_state));
+  editor_init(&app_state.input);
+  app_state.logo_win = logo;
+  app_state.channels_win = channels;
+  app_state.chat_win = chat;
+  app_state.input_win = input;
+  app_state.users_win = users;
+
+  init_channel(&app_state.channels[0], "general");
+  init_channel(&app_state.channels[1], "random");
+  init_channel(&app_state.channels[2], "help");
+  app_state.channel_count = 3;
+
+  for (int i = 0; i < user_count; i++)
+  {
+    char username[MAX_USERNAME_LEN];
+    snprintf(username, sizeof(username), "user%04d", i);
+    add_new_user(&app_state, username, "bench@example.com", "Passw0rd!");
+  }
+  app_state.current_user_index = 0;
+  if (user_count > 0)
+  {
+    app_state.users[0].role = ROLE_ADMIN;
+  }
+  app_state.current_channel_index = 0;
+}
+
+// Fill text with a message of 20-60 characters drawn from a fixed alphabet
+static void random_text(char *text)
+{
+  static const char *words[] = {"hello", "world", "anyone", "around", "ship", "it",
+                                "merge", "review", "lunch", "deploy", "ok", "thanks"};
+  int target = 20 + next_random() % 41;
+  int len = 0;
+  text[0] = '\0';
+  while (len < target)
+  {
+    const char *word = words[next_random() % (sizeof(words) / sizeof(words[0]))];
+    len += snprintf(text + len, MAX_MESSAGE_LEN - len, "%s%s", len ? " " : "", word);
+  }
+}
+
+static void fill_channel(Channel *channel, int count, const char **texts, int text_count)
+{
+  char text[MAX_MESSAGE_LEN];
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t sender = i % (app_state.user_count ? app_state.user_count : 1);
+    if (texts)
+    {
+      append_message(channel, sender, sender_name(&app_state, sender), texts[i % text_count],
+                     time(NULL));
+    }
+    else
+    {
+      random_text(text);
+      append_message(channel, sender, sender_name(&app_state, sender), text, time(NULL));
+    }
+  }
+}
+
+static void bench_send_message_empty()
+{
+  BenchResult result;
+  char text[MAX_MESSAGE_LEN];
+  begin_result(&result, "send_message_empty_channel", DEFAULT_ITERATIONS);
+  reset_state(10);
+
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    // Keep the channel nearly empty so no eviction happens
+    if (i % 64 == 0)
+    {
+      init_channel(&app_state.channels[0], "general");
+    }
+    random_text(text);
+    long start = now_ns();
+    send_message(&app_state, text);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+}
+
+static void bench_send_message_full()
+{
+  BenchResult result;
+  char text[MAX_MESSAGE_LEN];
+  begin_result(&result, "send_message_full_channel", DEFAULT_ITERATIONS);
+  reset_state(10);
+  fill_channel(&app_state.channels[0], MAX_MESSAGES, NULL, 0);
+
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    random_text(text);
+    long start = now_ns();
+    send_message(&app_state, text);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+}
+
+// Cost of the rate limit check on the ingest path, for a sender with
+// tokens to spare and for one who is being throttled
+static void bench_rate_limit()
+{
+  BenchResult result;
+  reset_state(10);
+
+  rate_limit_set(RATE_USER, 1000000000, 1000000000);
+  rate_limit_set(RATE_CHANNEL, 1000000000, 1000000000);
+  rate_limit_set(RATE_GLOBAL, 1000000000, 1000000000);
+  begin_result(&result, "rate_limit_accept", DEFAULT_ITERATIONS);
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    long start = now_ns();
+    rate_limit_check(&app_state, 1 + i % 9, i % 3);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+
+  rate_limit_set(RATE_USER, 1, 1);
+  begin_result(&result, "rate_limit_reject", DEFAULT_ITERATIONS);
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    long start = now_ns();
+    rate_limit_check(&app_state, 1 + i % 9, i % 3);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+
+  // Leave the other benchmarks unthrottled
+  for (int scope = 0; scope < RATE_SCOPES; scope++)
+  {
+    rate_limit_set(scope, 0, 0);
+  }
+}
+
+// Direct messages spread over many user pairs, most of which exchange only
+// a message or two; reports what the store costs per conversation
+static void bench_direct_messages()
+{
+  BenchResult result;
+  int iterations = 200000;
+  reset_state(MAX_USERS);
+
+  begin_result(&result, "dm_send_sparse_pairs", iterations);
+  for (int i = 0; i < iterations; i++)
+  {
+    int from = next_random() % MAX_USERS;
+    int to = next_random() % MAX_USERS;
+    long start = now_ns();
+    dm_send(from, to, "hey, got a minute?", 0);
+    record_sample(&result, now_ns() - start);
+  }
+  snprintf(result.extra, sizeof(result.extra),
+           ", \"conversations\": %ld, \"bytes_per_conversation\": %.0f",
+           dm_conversation_count(), (double)dm_memory_usage() / dm_conversation_count());
+  emit_result(&result);
+  dm_free_all();
+}
+
+static void bench_delete_channel()
+{
+  BenchResult result;
+  int rounds = 200;
+  begin_result(&result, "delete_channel_full", rounds);
+  reset_state(10);
+
+  for (int r = 0; r < rounds; r++)
+  {
+    // Fill every free slot with full channels, then delete the first one so
+    // the whole tail has to move
+    while (app_state.channel_count < MAX_CHANNELS)
+    {
+      char name[MAX_CHANNEL_NAME_LEN];
+      snprintf(name, sizeof(name), "bench-%d-%d", r, app_state.channel_count);
+      create_channel(&app_state, name);
+      fill_channel(&app_state.channels[app_state.channel_count - 1], MAX_MESSAGES, NULL, 0);
+    }
+    char victim[MAX_CHANNEL_NAME_LEN];
+    strcpy(victim, app_state.channels[3].name);
+
+    long start = now_ns();
+    delete_channel(&app_state, victim);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+}
+
+static void bench_authenticate_user()
+{
+  BenchResult result;
+  begin_result(&result, "authenticate_user_max_users", DEFAULT_ITERATIONS);
+  reset_state(MAX_USERS);
+
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    char username[MAX_USERNAME_LEN];
+    snprintf(username, sizeof(username), "user%04d", (int)(next_random() % MAX_USERS));
+    long start = now_ns();
+    authenticate_user(&app_state, username, "Passw0rd!");
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+
+  begin_result(&result, "authenticate_user_unknown", DEFAULT_ITERATIONS);
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    long start = now_ns();
+    authenticate_user(&app_state, "nobody", "Passw0rd!");
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+}
+
+static void bench_process_command()
+{
+  static const char *commands[] = {
+      "/msg random hello from the benchmark",
+      "/mute user0007 5",
+      "/setrole user0003 2",
+      "/create benchroom",
+      "/delete benchroom",
+      "/unknown command with args",
+  };
+  int command_count = sizeof(commands) / sizeof(commands[0]);
+
+  BenchResult result;
+  begin_result(&result, "process_command", DEFAULT_ITERATIONS);
+  reset_state(20);
+
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    char command[MAX_INPUT_LEN];
+    strcpy(command, commands[i % command_count]);
+    long start = now_ns();
+    process_command(&app_state, command);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+}
+
+static void bench_draw_frame(const char *name, const char **texts, int text_count)
+{
+  BenchResult result;
+  begin_result(&result, name, DRAW_ITERATIONS);
+  reset_state(40);
+  for (int i = 0; i < 40; i += 2)
+  {
+    set_user_online(&app_state, i, 0);
+  }
+  fill_channel(&app_state.channels[0], MAX_MESSAGES, texts, text_count);
+  editor_set_text(&app_state.input, "typing a message");
+
+  for (int i = 0; i < DRAW_ITERATIONS; i++)
+  {
+    long start = now_ns();
+    draw_logo(app_state.logo_win);
+    draw_channels(app_state.channels_win, &app_state, false);
+    draw_chat(app_state.chat_win, &app_state);
+    draw_users(app_state.users_win, &app_state, true);
+    draw_input(app_state.input_win, true, &app_state.input);
+    doupdate();
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+}
+
+static void bench_draw()
+{
+  static const char *cjk[] = {
+      "你好世界，今天大家过得怎么样？",
+      "これは日本語のメッセージです",
+      "한국어 메시지도 테스트합니다",
+      "混合 mixed 文本 text 测试",
+  };
+  static const char *emoji[] = {
+      "party time 🎉🎉🔥😀👍",
+      "🚀🚀🚀 deploy done ✅",
+      "👀 anyone? 🙏",
+      "👨‍👩‍👧 family emoji 🇫🇷 flags",
+  };
+
+  bench_draw_frame("draw_frame_ascii", NULL, 0);
+  bench_draw_frame("draw_frame_cjk", cjk, sizeof(cjk) / sizeof(cjk[0]));
+  bench_draw_frame("draw_frame_emoji", emoji, sizeof(emoji) / sizeof(emoji[0]));
+}
+
+// The user pane with a full roster: drawing renders only the rows in
+// view, and each filter keystroke rebuilds the list from the name index
+static void bench_roster()
+{
+  static const char *filters[] = {"user1", "r02", "9", "user4095"};
+  BenchResult result;
+  begin_result(&result, "draw_users_full_roster", DRAW_ITERATIONS);
+  reset_state(MAX_USERS);
+  for (int i = 0; i < DRAW_ITERATIONS; i++)
+  {
+    app_state.user_list.selected = i * 7 % MAX_USERS;
+    long start = now_ns();
+    draw_users(app_state.users_win, &app_state, true);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+
+  begin_result(&result, "roster_filter_keystroke", DEFAULT_ITERATIONS);
+  long matches = 0;
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    const char *filter = filters[i % 4];
+    list_view_filter_key(&app_state.user_list, 27);
+    for (int k = 0; filter[k]; k++)
+    {
+      list_view_filter_key(&app_state.user_list, filter[k]);
+    }
+    // Only the final keystroke is timed, against a freshly cleared list
+    list_view_filter_key(&app_state.user_list, KEY_BACKSPACE);
+    build_user_list(&app_state);
+    list_view_filter_key(&app_state.user_list, filter[strlen(filter) - 1]);
+    long start = now_ns();
+    build_user_list(&app_state);
+    record_sample(&result, now_ns() - start);
+    matches += app_state.user_list.count;
+  }
+  snprintf(result.extra, sizeof(result.extra), ", \"mean_matches\": %.1f",
+           (double)matches / DEFAULT_ITERATIONS);
+  emit_result(&result);
+  list_view_filter_key(&app_state.user_list, 27);
+}
+
+// Typing into the middle and at the end of a long pasted line, including
+// the input pane redraw, should cost the same as typing into a short one
+// Typed input mixing invalid and valid UTF-8: every bad byte or cut-short
+// sequence must become exactly one U+FFFD and leave the following valid
+// characters intact, with the cached width matching the stored text.
+static void check_editor_invalid_utf8()
+{
+  static const char typed[] = "a\xFF" "b\x80" "c\xC3" "d\xE4\xBD\xA0\xF0\x9F" "\xE4\xBD\xA0\xF8" "e";
+  static const char expected[] = "a\xEF\xBF\xBD" "b\xEF\xBF\xBD" "c\xEF\xBF\xBD"
+                                 "d\xE4\xBD\xA0\xEF\xBF\xBD\xE4\xBD\xA0\xEF\xBF\xBD" "e";
+  LineEditor ed;
+  char text[MAX_INPUT_LEN];
+
+  editor_init(&ed);
+  for (const char *p = typed; *p; p++)
+  {
+    editor_insert_byte(&ed, (unsigned char)*p);
+  }
+  editor_text(&ed, text, sizeof(text));
+  if (strcmp(text, expected) != 0 || ed.total_width != text_width(expected) ||
+      ed.cursor_col != ed.total_width || ed.total_width != 14)
+  {
+    fprintf(stderr, "editor: invalid UTF-8 stored as \"%s\", width %d\n", text, ed.total_width);
+    exit(1);
+  }
+  editor_free(&ed);
+}
+
+static void bench_editor()
+{
+  check_editor_invalid_utf8();
+
+  static const char *names[] = {"editor_keystroke_short_line", "editor_keystroke_long_line_end",
+                                "editor_keystroke_long_line_middle"};
+
+  for (int k = 0; k < 3; k++)
+  {
+    BenchResult result;
+    begin_result(&result, names[k], DEFAULT_ITERATIONS);
+    reset_state(1);
+    init_ui(&app_state);
+
+    for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+    {
+      // Rebuild the line (untimed) whenever it reaches the size limit
+      if (i % 200 == 0)
+      {
+        char line[MAX_INPUT_LEN];
+        int len = k == 0 ? 10 : 300;
+        memset(line, 'x', len);
+        line[len] = '\0';
+        editor_set_text(&app_state.input, line);
+        if (k == 2)
+        {
+          for (int j = 0; j < 150; j++)
+          {
+            editor_left(&app_state.input);
+          }
+        }
+        draw_input(app_state.input_win, true, &app_state.input);
+      }
+
+      long start = now_ns();
+      editor_handle_key(&app_state.input, 'a' + i % 26);
+      draw_input(app_state.input_win, true, &app_state.input);
+      record_sample(&result, now_ns() - start);
+    }
+    emit_result(&result);
+  }
+}
+
+static void bench_ingest_width()
+{
+  static const char *mixed[] = {
+      "plain ascii message of moderate length",
+      "你好世界，今天大家过得怎么样？",
+      "party time 🎉🎉🔥😀👍",
+  };
+  static const char *names[] = {"append_message_ascii", "append_message_cjk", "append_message_emoji"};
+
+  for (int k = 0; k < 3; k++)
+  {
+    BenchResult result;
+    begin_result(&result, names[k], DEFAULT_ITERATIONS);
+    reset_state(10);
+    fill_channel(&app_state.channels[0], MAX_MESSAGES, NULL, 0);
+    for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+    {
+      long start = now_ns();
+      append_message(&app_state.channels[0], 1, sender_name(&app_state, 1), mixed[k], time(NULL));
+      record_sample(&result, now_ns() - start);
+    }
+    emit_result(&result);
+  }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  (void)st;
+  (void)type;
+  (void)ftw;
+  return remove(path);
+}
+
+// Scrolling through history larger than the page cache budget: every
+// frame that lands on an uncached page faults it in from disk. The page
+// fetch is also timed on its own, counting only fetches that missed the
+// cache and so read and decompressed a block.
+static void bench_history()
+{
+  char dir[] = "/tmp/my_dispute_bench_XXXXXX";
+  if (!mkdtemp(dir))
+  {
+    perror("mkdtemp");
+    return;
+  }
+  history_init(dir, 256 * 1024);
+
+  BenchResult result;
+  begin_result(&result, "draw_chat_history_scroll", DRAW_ITERATIONS);
+  reset_state(10);
+  Channel *channel = &app_state.channels[0];
+  fill_channel(channel, 100000, NULL, 0);
+  history_flush(channel);
+
+  for (int i = 0; i < DRAW_ITERATIONS; i++)
+  {
+    app_state.chat_scroll = next_random() % channel->last_seq;
+    long start = now_ns();
+    draw_chat(app_state.chat_win, &app_state);
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+
+  begin_result(&result, "history_page_fetch_miss", DEFAULT_ITERATIONS);
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    uint32_t seq = 1 + next_random() % (channel->last_seq - MAX_MESSAGES);
+    long misses = history_cache_misses();
+    HistoryMessage msg;
+    long start = now_ns();
+    history_get(channel, seq, &msg);
+    long elapsed = now_ns() - start;
+    if (history_cache_misses() != misses)
+    {
+      record_sample(&result, elapsed);
+    }
+  }
+  snprintf(result.extra, sizeof(result.extra), ", \"compression_ratio\": %.2f",
+           (double)history_archived_raw_bytes() / history_archived_bytes());
+  emit_result(&result);
+
+  for (int i = 0; i < app_state.channel_count; i++)
+  {
+    history_remove(&app_state.channels[i]);
+  }
+  history_init(NULL, 0);
+  reset_state(1);
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Mail for a user who is logged out: direct messages and mentions are
+// queued one record at a time, then the terminal restarts and the user
+// logs in, which hands over the whole inbox in one read
+static void bench_inbox()
+{
+  char dir[] = "/tmp/my_dispute_bench_XXXXXX";
+  if (!mkdtemp(dir))
+  {
+    perror("mkdtemp");
+    return;
+  }
+  int rounds = 10;
+  int queued = 10000;
+  char text[MAX_MESSAGE_LEN];
+  BenchResult queue;
+  BenchResult login;
+  begin_result(&queue, "inbox_queue", rounds * queued);
+  begin_result(&login, "inbox_login_flush_10k", rounds);
+  long records = 0;
+  long delivered = 0;
+  size_t bytes = 0;
+
+  // Only users with a saved account get mail on disk
+  char accounts[sizeof(dir) + 32];
+  snprintf(accounts, sizeof(accounts), "%s/%s", dir, "accounts");
+  accounts_init(accounts);
+  reset_state(0);
+  register_account(&app_state, "user0001", "", "Passw0rd!");
+
+  for (int r = 0; r < rounds; r++)
+  {
+    inbox_init(dir);
+    reset_state(100);
+    set_user_online(&app_state, 1, 0);
+    for (int i = 0; i < queued; i++)
+    {
+      random_text(text);
+      int sender = 2 + next_random() % 98;
+      long start = now_ns();
+      if (i % 2)
+      {
+        inbox_queue_mention(&app_state, 1, sender, i % app_state.channel_count, text, i);
+      }
+      else
+      {
+        inbox_queue_direct(&app_state, sender, 1, text, i);
+      }
+      record_sample(&queue, now_ns() - start);
+    }
+
+    struct stat st;
+    char path[sizeof(dir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, "7573657230303031"); // user0001
+    bytes += stat(path, &st) == 0 ? st.st_size : 0;
+    records += queued;
+
+    // A restart: what is on disk now belongs to an earlier run
+    inbox_init(dir);
+    long before = inbox_delivered();
+    long start = now_ns();
+    authenticate_user(&app_state, "user0001", "Passw0rd!");
+    record_sample(&login, now_ns() - start);
+    if (inbox_delivered() - before != queued)
+    {
+      fprintf(stderr, "inbox: %ld of %d records delivered at login\n", inbox_delivered() - before,
+              queued);
+      exit(1);
+    }
+    delivered += inbox_delivered() - before;
+  }
+  snprintf(queue.extra, sizeof(queue.extra), ", \"bytes_per_record\": %.1f",
+           (double)bytes / records);
+  snprintf(login.extra, sizeof(login.extra), ", \"delivered_per_login\": %ld",
+           delivered / rounds);
+  emit_result(&queue);
+  emit_result(&login);
+
+  inbox_init(NULL);
+  reset_state(1);
+  nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Recording a counter and a latency sample, as deliver_message does for
+// every message, and rendering a scrape of a busy terminal
+static void bench_metrics()
+{
+  BenchResult result;
+  int iterations = 1000000;
+  begin_result(&result, "metrics_record", DEFAULT_ITERATIONS);
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    long start = now_ns();
+    for (int j = 0; j < iterations / DEFAULT_ITERATIONS; j++)
+    {
+      metrics_count(METRIC_DELIVERED, 1);
+      metrics_observe(METRIC_DELIVER_NS, j * 64);
+    }
+    record_sample(&result, (now_ns() - start) / (iterations / DEFAULT_ITERATIONS));
+  }
+  emit_result(&result);
+
+  reset_state(MAX_USERS);
+  while (app_state.channel_count < MAX_CHANNELS)
+  {
+    char name[MAX_CHANNEL_NAME_LEN];
+    snprintf(name, sizeof(name), "bench-%d", app_state.channel_count);
+    create_channel(&app_state, name);
+  }
+  begin_result(&result, "metrics_scrape", DEFAULT_ITERATIONS);
+  size_t len = 0;
+  for (int i = 0; i < DEFAULT_ITERATIONS; i++)
+  {
+    long start = now_ns();
+    metrics_text(&app_state, &len);
+    record_sample(&result, now_ns() - start);
+  }
+  snprintf(result.extra, sizeof(result.extra), ", \"bytes\": %zu", len);
+  emit_result(&result);
+}
+
+// The block codec on its own: page-sized runs of chat compressed with a
+// dictionary trained on earlier traffic, as sealed history stores them
+static void bench_compression()
+{
+  const int train_pages = 64;
+  const int page_count = 1000;
+  const int messages_per_page = 64;
+  size_t page_size = messages_per_page * (MAX_USERNAME_LEN + MAX_MESSAGE_LEN);
+
+  char *pages = malloc(page_size * (train_pages + page_count));
+  size_t *lengths = malloc(sizeof(size_t) * (train_pages + page_count));
+  char *compressed = malloc(page_size * page_count);
+  size_t *compressed_lengths = malloc(sizeof(size_t) * page_count);
+  char *out = malloc(page_size);
+  if (!pages || !lengths || !compressed || !compressed_lengths || !out)
+  {
+    perror("malloc");
+    exit(1);
+  }
+
+  char text[MAX_MESSAGE_LEN];
+  for (int p = 0; p < train_pages + page_count; p++)
+  {
+    char *page = pages + p * page_size;
+    size_t len = 0;
+    for (int m = 0; m < messages_per_page; m++)
+    {
+      random_text(text);
+      len += sprintf(page + len, "user%u%s", next_random() % 50, text);
+    }
+    lengths[p] = len;
+  }
+
+  // The first pages play the part of the segment the dictionary is
+  // trained on; they are laid out back to back
+  char dictionary[8192];
+  size_t sample_len = 0;
+  for (int p = 0; p < train_pages; p++)
+  {
+    memmove(pages + sample_len, pages + p * page_size, lengths[p]);
+    sample_len += lengths[p];
+  }
+  size_t dictionary_len = train_dictionary(pages, sample_len, dictionary, sizeof(dictionary));
+
+  BenchResult result;
+  begin_result(&result, "compress_page", page_count);
+  long raw_bytes = 0, stored_bytes = 0;
+  for (int p = 0; p < page_count; p++)
+  {
+    char *page = pages + (train_pages + p) * page_size;
+    long start = now_ns();
+    compressed_lengths[p] = compress_block(page, lengths[train_pages + p],
+                                           compressed + p * page_size, page_size, dictionary,
+                                           dictionary_len);
+    record_sample(&result, now_ns() - start);
+    raw_bytes += lengths[train_pages + p];
+    stored_bytes += compressed_lengths[p] ? compressed_lengths[p] : lengths[train_pages + p];
+  }
+  snprintf(result.extra, sizeof(result.extra),
+           ", \"compression_ratio\": %.2f, \"dictionary_bytes\": %zu",
+           (double)raw_bytes / stored_bytes, dictionary_len);
+  emit_result(&result);
+
+  begin_result(&result, "decompress_page", page_count);
+  long total_ns = 0;
+  for (int p = 0; p < page_count; p++)
+  {
+    if (!compressed_lengths[p])
+    {
+      continue;
+    }
+    long start = now_ns();
+    decompress_block(compressed + p * page_size, compressed_lengths[p], out,
+                     lengths[train_pages + p], dictionary, dictionary_len);
+    long elapsed = now_ns() - start;
+    record_sample(&result, elapsed);
+    total_ns += elapsed;
+  }
+  snprintf(result.extra, sizeof(result.extra), ", \"decompress_ms_per_gb\": %.1f",
+           total_ns / (raw_bytes / 1e9) / 1e6);
+  emit_result(&result);
+
+  free(pages);
+  free(lengths);
+  free(compressed);
+  free(compressed_lengths);
+  free(out);
+}
+
+// Delivery between two processes: a shared-memory ring pair that makes an
+// eventfd wakeup only for a sleeping reader, against a Unix socket with
+// one write per message. Latency is one-way: half the round trip when the
+// reader answers each message, send to receipt for a stream.
+// cpu_ns_per_message adds up both processes.
+#define TRANSPORT_PINGPONGS 20000
+#define TRANSPORT_STREAM 200000
+#define TRANSPORT_PAYLOAD 64
+
+typedef struct
+{
+  ShmRing forward; // Writer to reader
+  ShmRing back;
+  long latencies[TRANSPORT_STREAM]; // Stream receipt delays, filled in by the reader
+  long reader_wakeups;
+} TransportArea;
+
+typedef struct
+{
+  TransportArea *area;
+  int socket;        // -1 when using the rings
+  int wake_fds[2];   // eventfds for the forward and back rings
+  long wakeups;      // eventfd writes made by this process
+  char buffer[65536]; // Socket bytes read ahead
+  size_t buffered;
+} Transport;
+
+static void transport_send(Transport *t, int forward, const char *msg)
+{
+  if (t->socket >= 0)
+  {
+    if (write(t->socket, msg, TRANSPORT_PAYLOAD) != TRANSPORT_PAYLOAD)
+    {
+      perror("write");
+      exit(1);
+    }
+    return;
+  }
+
+  ShmRing *ring = forward ? &t->area->forward : &t->area->back;
+  while (!shm_ring_write(ring, 1, msg, TRANSPORT_PAYLOAD))
+  {
+    sched_yield();
+  }
+  if (shm_wake_needed(&ring->waiting))
+  {
+    uint64_t one = 1;
+    if (write(t->wake_fds[!forward], &one, sizeof(one)) < 0)
+    {
+      perror("eventfd");
+    }
+    t->wakeups++;
+  }
+}
+
+static void transport_receive(Transport *t, int forward, char *msg)
+{
+  if (t->socket >= 0)
+  {
+    // Read as much as is waiting, so a stream costs fewer reads than writes
+    while (t->buffered < TRANSPORT_PAYLOAD)
+    {
+      ssize_t got = read(t->socket, t->buffer + t->buffered, sizeof(t->buffer) - t->buffered);
+      if (got <= 0)
+      {
+        perror("read");
+        exit(1);
+      }
+      t->buffered += got;
+    }
+    memcpy(msg, t->buffer, TRANSPORT_PAYLOAD);
+    t->buffered -= TRANSPORT_PAYLOAD;
+    memmove(t->buffer, t->buffer + TRANSPORT_PAYLOAD, t->buffered);
+    return;
+  }
+
+  ShmRing *ring = forward ? &t->area->forward : &t->area->back;
+  int type;
+  size_t len;
+  while (1)
+  {
+    const void *record = shm_ring_peek(ring, &type, &len);
+    if (record)
+    {
+      memcpy(msg, record, TRANSPORT_PAYLOAD);
+      shm_ring_consume(ring);
+      return;
+    }
+    shm_sleep_begin(&ring->waiting);
+    if (!shm_ring_peek(ring, &type, &len))
+    {
+      uint64_t count;
+      if (read(t->wake_fds[!forward], &count, sizeof(count)) < 0)
+      {
+        perror("eventfd");
+      }
+    }
+    shm_sleep_end(&ring->waiting);
+  }
+}
+
+static long cpu_ns(struct rusage *usage)
+{
+  return (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000000L +
+         (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) * 1000L;
+}
+
+static void run_transport(const char *name, int use_socket, int stream)
+{
+  int count = stream ? TRANSPORT_STREAM : TRANSPORT_PINGPONGS;
+  TransportArea *area = mmap(NULL, sizeof(TransportArea), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  Transport *t = malloc(sizeof(Transport));
+  if (area == MAP_FAILED || !t)
+  {
+    perror("transport");
+    exit(1);
+  }
+  shm_ring_init(&area->forward);
+  shm_ring_init(&area->back);
+  area->reader_wakeups = 0;
+
+  int sockets[2] = {-1, -1};
+  t->area = area;
+  t->wakeups = 0;
+  t->buffered = 0;
+  t->wake_fds[0] = t->wake_fds[1] = -1;
+  if (use_socket ? socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0
+                 : (t->wake_fds[0] = eventfd(0, 0)) < 0 || (t->wake_fds[1] = eventfd(0, 0)) < 0)
+  {
+    perror("transport");
+    exit(1);
+  }
+
+  struct rusage before, after, reader;
+  getrusage(RUSAGE_SELF, &before);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    // The reader: answer each message, or time each one of a stream
+    char msg[TRANSPORT_PAYLOAD];
+    t->socket = sockets[1];
+    for (int i = 0; i < count; i++)
+    {
+      transport_receive(t, 1, msg);
+      if (stream)
+      {
+        long sent;
+        memcpy(&sent, msg, sizeof(sent));
+        area->latencies[i] = now_ns() - sent;
+      }
+      else
+      {
+        transport_send(t, 0, msg);
+      }
+    }
+    if (stream)
+    {
+      transport_send(t, 0, msg);
+    }
+    area->reader_wakeups = t->wakeups;
+    _exit(0);
+  }
+
+  t->socket = sockets[0];
+  BenchResult result;
+  begin_result(&result, name, count);
+  char msg[TRANSPORT_PAYLOAD] = {0};
+  for (int i = 0; i < count; i++)
+  {
+    long start = now_ns();
+    memcpy(msg, &start, sizeof(start));
+    transport_send(t, 1, msg);
+    if (!stream)
+    {
+      transport_receive(t, 0, msg);
+      record_sample(&result, (now_ns() - start) / 2);
+    }
+  }
+  if (stream)
+  {
+    transport_receive(t, 0, msg);
+    for (int i = 0; i < count; i++)
+    {
+      record_sample(&result, area->latencies[i]);
+    }
+  }
+
+  int status;
+  wait4(pid, &status, 0, &reader);
+  getrusage(RUSAGE_SELF, &after);
+  long messages = stream ? count : 2L * count;
+  long cpu = cpu_ns(&after) - cpu_ns(&before) + cpu_ns(&reader);
+  if (use_socket)
+  {
+    snprintf(result.extra, sizeof(result.extra), ", \"cpu_ns_per_message\": %.0f",
+             (double)cpu / messages);
+  }
+  else
+  {
+    snprintf(result.extra, sizeof(result.extra),
+             ", \"cpu_ns_per_message\": %.0f, \"wakeups_per_message\": %.4f",
+             (double)cpu / messages, (double)(t->wakeups + area->reader_wakeups) / messages);
+  }
+  emit_result(&result);
+
+  for (int i = 0; i < 2; i++)
+  {
+    if (sockets[i] >= 0)
+    {
+      close(sockets[i]);
+    }
+    if (t->wake_fds[i] >= 0)
+    {
+      close(t->wake_fds[i]);
+    }
+  }
+  munmap(area, sizeof(TransportArea));
+  free(t);
+}
+
+// The change log a primary streams to its replicas: the cost logging adds
+// to each message, then how fast a replica applies a captured log
+static void bench_replication()
+{
+  const int users = 1000;
+  const int messages = 40000;
+  const int applies = 5;
+  char text[MAX_MESSAGE_LEN];
+
+  BenchResult result;
+  begin_result(&result, "replication_log_message", messages);
+  replication_log_start();
+  reset_state(users);
+  for (int i = 0; i < messages; i++)
+  {
+    random_text(text);
+    long start = now_ns();
+    deliver_message(&app_state, i % app_state.channel_count, i % users, text, time(NULL));
+    record_sample(&result, now_ns() - start);
+  }
+  emit_result(&result);
+
+  size_t len;
+  const char *log = replication_log_data(&len);
+  char *captured = malloc(len);
+  if (!captured)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(captured, log, len);
+  replication_close();
+
+  begin_result(&result, "replication_apply_log", applies);
+  long records = 0;
+  double total_ns = 0;
+  for (int i = 0; i < applies; i++)
+  {
+    reset_state(0);
+    long start = now_ns();
+    records = replication_apply_log(&app_state, captured, len);
+    long elapsed = now_ns() - start;
+    record_sample(&result, elapsed);
+    total_ns += elapsed;
+  }
+  snprintf(result.extra, sizeof(result.extra),
+           ", \"records\": %ld, \"records_per_s\": %.0f, \"mb_per_s\": %.1f", records,
+           records * applies / (total_ns / 1e9), len * applies / (total_ns / 1e9) / (1024 * 1024));
+  emit_result(&result);
+
+  free(captured);
+  reset_state(1);
+}
+
+static void bench_transport()
+{
+  run_transport("transport_shm_pingpong", 0, 0);
+  run_transport("transport_socket_pingpong", 1, 0);
+  run_transport("transport_shm_stream", 0, 1);
+  run_transport("transport_socket_stream", 1, 1);
+}
+
+int main(int argc, char **argv)
+{
+  const char *filter = argc > 1 ? argv[1] : NULL;
+
+  setlocale(LC_ALL, "C.UTF-8");
+  // Render into a terminal attached to /dev/null
+  SCREEN *screen = init_headless_screen(50, 200);
+
+  reset_state(1);
+  init_ui(&app_state);
+
+  struct
+  {
+    const char *name;
+    void (*run)();
+  } benches[] = {
+      {"send_message", bench_send_message_empty},
+      {"send_message", bench_send_message_full},
+      {"append_message", bench_ingest_width},
+      {"rate_limit", bench_rate_limit},
+      {"direct_messages", bench_direct_messages},
+      {"delete_channel", bench_delete_channel},
+      {"authenticate_user", bench_authenticate_user},
+      {"process_command", bench_process_command},
+      {"draw_frame", bench_draw},
+      {"roster", bench_roster},
+      {"editor", bench_editor},
+      {"history", bench_history},
+      {"inbox", bench_inbox},
+      {"metrics", bench_metrics},
+      {"compression", bench_compression},
+      {"transport", bench_transport},
+      {"replication", bench_replication},
+  };
+
+  printf("{\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+  {
+    if (!filter || strstr(benches[i].name, filter))
+    {
+      benches[i].run();
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  endwin();
+  delscreen(screen);
+  return 0;
+}
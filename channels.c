@@ -1,5 +1,50 @@
 #include "my_dispute.h"
 
+// Channels every terminal starts with; they are always public
+const char *const default_channels[DEFAULT_CHANNEL_COUNT] = {"general", "random", "help"};
+
+// Release the heap storage owned by a channel and clear the slot
+void free_channel(Channel *channel)
+{
+  completion_remove(COMPLETE_CHANNELS, channel->name);
+  history_close(channel);
+  free(channel->text_arena);
+  free(channel->reaction_sets);
+  free(channel->grants);
+  memset(channel, 0, sizeof(Channel));
+}
+
+// Bytes used by a channel, including its heap-allocated text and reactions
+size_t channel_memory_usage(Channel *channel)
+{
+  return sizeof(Channel) + channel->arena_size + sizeof(ReactionSet) * channel->reaction_set_count;
+}
+
+// Reset a channel slot and give it a name
+void init_channel(Channel *channel, const char *name)
+{
+  free_channel(channel);
+  channel->free_reaction_set = -1;
+  strncpy(channel->name, name, MAX_CHANNEL_NAME_LEN - 1);
+  channel->name[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+  channel->name_width = text_width(channel->name);
+  completion_add(COMPLETE_CHANNELS, channel->name);
+  history_open(channel);
+}
+
+// Index of the channel with the given name, or -1 if there is none
+int find_channel(AppState *state, const char *name)
+{
+  for (int i = 0; i < state->channel_count; i++)
+  {
+    if (strcmp(state->channels[i].name, name) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
 int create_channel(AppState *state, char *name)
 {
   // Check if we already have too many channels
@@ -15,25 +60,20 @@ int create_channel(AppState *state, char *name)
   }
 
   // Check if channel with that name already exists
-  for (int i = 0; i < state->channel_count; i++)
+  if (find_channel(state, name) >= 0)
   {
-    if (strcmp(state->channels[i].name, name) == 0)
-    {
-      return 0;
-    }
+    return 0;
   }
 
   // Create the new channel
-  strcpy(state->channels[state->channel_count].name, name);
-  state->channels[state->channel_count].message_count = 0;
+  init_channel(&state->channels[state->channel_count], name);
+  save_channel_access(state, &state->channels[state->channel_count]);
+  replication_log_create(name);
 
   // Add a system message to the channel
-  Message *msg = &state->channels[state->channel_count].messages[0];
-  strcpy(msg->sender, "SYSTEM");
-  sprintf(msg->text, "Channel '%s' created by %s", name,
-          state->users[state->current_user_index].username);
-  msg->timestamp = time(NULL);
-  state->channels[state->channel_count].message_count = 1;
+  post_system_message(&state->channels[state->channel_count], "Channel '%s' created by %s", name,
+                      state->users[state->current_user_index].username);
+  replication_log_notice(&state->channels[state->channel_count]);
 
   // Increment channel count
   state->channel_count++;
@@ -43,17 +83,8 @@ int create_channel(AppState *state, char *name)
 
 int delete_channel(AppState *state, char *name)
 {
-  int channel_index = -1;
-
   // Find channel with the given name
-  for (int i = 0; i < state->channel_count; i++)
-  {
-    if (strcmp(state->channels[i].name, name) == 0)
-    {
-      channel_index = i;
-      break;
-    }
-  }
+  int channel_index = find_channel(state, name);
 
   // If channel not found
   if (channel_index == -1)
@@ -68,12 +99,29 @@ int delete_channel(AppState *state, char *name)
   }
 
   // Move all channels after this one up one slot
-  for (int i = channel_index; i < state->channel_count - 1; i++)
+  replication_log_delete(name);
+  history_remove(&state->channels[channel_index]);
+  free_channel(&state->channels[channel_index]);
+  memmove(&state->channels[channel_index], &state->channels[channel_index + 1],
+          sizeof(Channel) * (state->channel_count - channel_index - 1));
+
+  // The last slot's storage now belongs to its new position
+  memset(&state->channels[state->channel_count - 1], 0, sizeof(Channel));
+
+  // Per-user channel state is indexed the same way
+  int after = state->channel_count - channel_index - 1;
+  for (int i = 0; i < state->user_count; i++)
   {
-    strcpy(state->channels[i].name, state->channels[i + 1].name);
-    memcpy(&state->channels[i].messages, &state->channels[i + 1].messages,
-           sizeof(Message) * MAX_MESSAGES);
-    state->channels[i].message_count = state->channels[i + 1].message_count;
+    User *user = &state->users[i];
+    memmove(&user->muted_until[channel_index], &user->muted_until[channel_index + 1],
+            sizeof(time_t) * after);
+    memmove(&user->last_read[channel_index], &user->last_read[channel_index + 1],
+            sizeof(uint32_t) * after);
+    memmove(&user->mentions[channel_index], &user->mentions[channel_index + 1],
+            sizeof(uint16_t) * after);
+    user->muted_until[state->channel_count - 1] = 0;
+    user->last_read[state->channel_count - 1] = 0;
+    user->mentions[state->channel_count - 1] = 0;
   }
 
   // Decrement channel count
@@ -93,16 +141,43 @@ int delete_channel(AppState *state, char *name)
   return 1;
 }
 
+// Everything shown in the chat pane has been seen; a direct-message
+// conversation is closed and the current channel shows again
+void leave_chat_view(AppState *state)
+{
+  if (state->dm_open)
+  {
+    if (state->current_user_index >= 0)
+    {
+      Conversation *conv = dm_find(state->current_user_index, state->dm_peer);
+      if (conv)
+      {
+        dm_mark_read(conv, state->current_user_index);
+      }
+    }
+    state->dm_open = 0;
+  }
+  else
+  {
+    mark_channel_read(state, state->current_user_index, state->current_channel_index);
+  }
+}
+
 int join_channel(AppState *state, int channel_index)
 {
-  // Validate channel index
-  if (channel_index < 0 || channel_index >= state->channel_count)
+  // Validate channel index; hidden private channels can't be joined
+  if (channel_index < 0 || channel_index >= state->channel_count ||
+      !user_can(state, state->current_user_index, channel_index, PERM_READ))
   {
     return 0;
   }
 
+  leave_chat_view(state);
+
   // Switch to the new channel
   state->current_channel_index = channel_index;
+  state->chat_scroll = 0;
+  mark_channel_read(state, state->current_user_index, channel_index);
 
   return 1;
 }
\ No newline at end of file
@@ -0,0 +1,583 @@
+#include "my_dispute.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Scale test for a router in front of several shard hubs, all local.
+//
+// Starts --shards hubs listening on Unix sockets, a router hub in front of
+// them, then forks --terminals processes that each connect to the router
+// as one logged-in user, exactly as `my_dispute --connect` does. Once
+// every terminal sees every other one online, they post numbered
+// messages to --channels channels at --rate and send each other direct
+// messages, while the first terminal moves channels between shards. Every
+// terminal checks that each sender's messages arrive in order, and counts
+// them, so a message lost or reordered by a move shows up in the totals.
+//
+// Results are JSON on stdout, like my_dispute_loadgen's.
+
+AppState app_state;
+
+static struct
+{
+  const char *hub;
+  int shards;
+  int terminals;
+  int channels;
+  int duration;
+  double rate; // Messages per second per terminal
+  int pm_every; // Every n-th post is a direct message instead
+  int moves;
+} config = {"./my_dispute_hub", 4, 8, 16, 10, 500, 20, 4};
+
+// What each terminal reports, in memory shared with the coordinator
+typedef struct
+{
+  long sent;
+  long refused;
+  long delivered;    // Channel messages added, its own included
+  long out_of_order; // Arrived after a later one from the same sender and channel
+  long missed;       // Gap notices from the router
+  long dms_sent;
+  long dms_received;
+  long moves_sent;
+  long presence_ns; // Until every other terminal showed as online, -1 if never
+  Histogram latency;
+} TerminalResult;
+
+typedef struct
+{
+  int ready;    // Terminals that have seen everyone online
+  int started;  // Set by the coordinator to start sending
+  int finished; // Terminals done sending
+  long sent;    // Their messages, once finished
+  TerminalResult terminals[];
+} Shared;
+
+static Shared *shared;
+static char dir[64];
+static char move_secret[sizeof(dir) + 16]; // File the router takes moves with
+
+static unsigned int next_random(unsigned int *seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+static void terminal_name(int id, char *out, size_t size)
+{
+  snprintf(out, size, "term%02d", id);
+}
+
+// Run a hub with the given arguments, its output going to log. Returns
+// its pid, or -1.
+static pid_t start_hub(char **args, const char *log)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0)
+    {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execv(config.hub, args);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Wait up to five seconds for a hub to create its socket
+static int wait_for_socket(const char *path)
+{
+  for (int i = 0; i < 500; i++)
+  {
+    if (access(path, F_OK) == 0)
+    {
+      return 1;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "No hub came up on %s\n", path);
+  return 0;
+}
+
+// Count what arrived in each channel since the last call: sender order,
+// latency from the timestamp each message carries
+static void scan_channels(TerminalResult *result, long *scanned, long (*next)[MAX_CHANNELS])
+{
+  long now = stats_now_ns();
+  for (int c = 0; c < config.channels; c++)
+  {
+    Channel *channel = &app_state.channels[c];
+    long fresh = channel->last_seq - scanned[c];
+    scanned[c] = channel->last_seq;
+    if (fresh > channel->message_count)
+    {
+      // Scrolled out of the ring before it could be checked
+      result->delivered += fresh - channel->message_count;
+      fresh = channel->message_count;
+    }
+
+    for (int i = channel->message_count - fresh; i < channel->message_count; i++)
+    {
+      Message *msg = channel_message(channel, i);
+      int sender;
+      long n, sent_at;
+      if (sscanf(message_text(channel, msg), "cl:%d:%ld:%ld", &sender, &n, &sent_at) != 3)
+      {
+        result->missed += msg->sender_id == SYSTEM_SENDER_ID;
+        continue;
+      }
+      if (sender >= 0 && sender < config.terminals)
+      {
+        if (n < next[sender][c])
+        {
+          result->out_of_order++;
+        }
+        next[sender][c] = n + 1;
+      }
+      histogram_record(&result->latency, now - sent_at);
+      result->delivered++;
+    }
+  }
+}
+
+static int online_peers()
+{
+  int online = 0;
+  for (int i = 0; i < app_state.user_count; i++)
+  {
+    online += i != app_state.current_user_index && app_state.users[i].is_online;
+  }
+  return online;
+}
+
+// Read from the router for up to timeout_ms
+static void pump(TerminalResult *result, long *scanned, long (*next)[MAX_CHANNELS],
+                 int timeout_ms)
+{
+  struct pollfd none[1];
+  net_client_wait(none, 0, timeout_ms);
+  while (net_client_poll(&app_state) > 0)
+  {
+    scan_channels(result, scanned, next);
+  }
+  scan_channels(result, scanned, next);
+}
+
+// One terminal: a user logged in through the router
+static void run_terminal(int id, const char *router)
+{
+  TerminalResult *result = &shared->terminals[id];
+  unsigned int seed = 2654435761u * (id + 1);
+  long scanned[MAX_CHANNELS] = {0};
+  long (*next)[MAX_CHANNELS] = calloc(config.terminals, sizeof(*next));
+  if (!next)
+  {
+    perror("calloc");
+    exit(1);
+  }
+
+  char username[MAX_USERNAME_LEN];
+  char password[] = "Passw0rd!";
+  terminal_name(id, username, sizeof(username));
+  add_new_user(&app_state, username, "cluster@example.com", password);
+  authenticate_user(&app_state, username, password);
+  if (!net_load_move_secret(move_secret) || !net_client_connect(router))
+  {
+    _exit(1);
+  }
+  net_client_presence(&app_state, 1);
+
+  // Presence is merged from every shard; wait until it is complete
+  long start = stats_now_ns();
+  result->presence_ns = -1;
+  while (stats_now_ns() - start < 10000000000L)
+  {
+    pump(result, scanned, next, 10);
+    if (online_peers() == config.terminals - 1)
+    {
+      result->presence_ns = stats_now_ns() - start;
+      break;
+    }
+  }
+  __atomic_add_fetch(&shared->ready, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&shared->started, __ATOMIC_ACQUIRE))
+  {
+    pump(result, scanned, next, 1);
+  }
+
+  long interval_ns = (long)(1e9 / config.rate);
+  long begin = stats_now_ns();
+  long end = begin + config.duration * 1000000000L;
+  long next_send = begin;
+  long posted = 0;
+  long counts[MAX_CHANNELS] = {0};
+  int moves = id == 0 ? config.moves : 0;
+
+  while (stats_now_ns() < end)
+  {
+    long now = stats_now_ns();
+    if (now < next_send)
+    {
+      pump(result, scanned, next, (int)((next_send - now) / 1000000));
+      continue;
+    }
+    next_send += interval_ns;
+
+    // The first terminal moves channels at even intervals through the run
+    if (result->moves_sent < moves &&
+        now - begin >= (result->moves_sent + 1) * (end - begin) / (moves + 1))
+    {
+      int channel = result->moves_sent % config.channels;
+      int shard = (next_random(&seed) % (config.shards - 1) + 1 + result->moves_sent) %
+                  config.shards;
+      result->moves_sent += net_client_move(app_state.channels[channel].name, shard);
+    }
+
+    char text[MAX_MESSAGE_LEN];
+    posted++;
+    if (config.terminals > 1 && config.pm_every && posted % config.pm_every == 0)
+    {
+      int peer = (id + 1 + next_random(&seed) % (config.terminals - 1)) % config.terminals;
+      char name[MAX_USERNAME_LEN];
+      terminal_name(peer, name, sizeof(name));
+      snprintf(text, sizeof(text), "direct from %d", id);
+      result->dms_sent += send_private_message(&app_state, name, text);
+      continue;
+    }
+
+    int channel = next_random(&seed) % config.channels;
+    app_state.current_channel_index = channel;
+    snprintf(text, sizeof(text), "cl:%d:%ld:%ld", id, counts[channel], stats_now_ns());
+    if (send_message(&app_state, text))
+    {
+      counts[channel]++;
+      result->sent++;
+    }
+    else
+    {
+      result->refused++;
+    }
+  }
+
+  // Read until everything every terminal sent has arrived, or it stops
+  // arriving
+  __atomic_add_fetch(&shared->sent, result->sent, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&shared->finished, 1, __ATOMIC_RELEASE);
+  long quiet_since = stats_now_ns();
+  while (stats_now_ns() - quiet_since < 5000000000L)
+  {
+    long before = result->delivered;
+    pump(result, scanned, next, 100);
+    if (result->delivered != before)
+    {
+      quiet_since = stats_now_ns();
+    }
+    if (__atomic_load_n(&shared->finished, __ATOMIC_ACQUIRE) == config.terminals &&
+        result->delivered >= __atomic_load_n(&shared->sent, __ATOMIC_ACQUIRE))
+    {
+      break;
+    }
+  }
+
+  for (int peer = 0; peer < app_state.user_count; peer++)
+  {
+    Conversation *conv = dm_find(app_state.current_user_index, peer);
+    for (uint32_t i = 0; conv && peer != app_state.current_user_index && i < conv->count; i++)
+    {
+      result->dms_received += dm_message(conv, i)->sender_id == (uint32_t)peer;
+    }
+  }
+  net_client_presence(&app_state, 0);
+  net_client_close();
+  free(next);
+  _exit(0);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [options]\n", prog);
+  fprintf(stderr, "  --hub PATH      my_dispute_hub to start (default ./my_dispute_hub)\n");
+  fprintf(stderr, "  --shards N      shard hubs behind the router, 1-%d (default 4)\n",
+          NET_MAX_SHARDS);
+  fprintf(stderr, "  --terminals N   terminals connected to the router (default 8)\n");
+  fprintf(stderr, "  --channels N    channels to spread messages over (default 16)\n");
+  fprintf(stderr, "  --duration S    seconds of traffic (default 10)\n");
+  fprintf(stderr, "  --rate R        messages per second per terminal (default 500)\n");
+  fprintf(stderr, "  --pm N          every N-th post is a direct message, 0 = none (default 20)\n");
+  fprintf(stderr, "  --moves N       channel moves during the run (default 4)\n");
+}
+
+static int parse_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (i + 1 >= argc)
+    {
+      return 0;
+    }
+
+    if (strcmp(argv[i], "--hub") == 0)
+    {
+      config.hub = argv[++i];
+    }
+    else if (strcmp(argv[i], "--shards") == 0)
+    {
+      config.shards = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--terminals") == 0)
+    {
+      config.terminals = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--channels") == 0)
+    {
+      config.channels = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--duration") == 0)
+    {
+      config.duration = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--rate") == 0)
+    {
+      config.rate = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--pm") == 0)
+    {
+      config.pm_every = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--moves") == 0)
+    {
+      config.moves = atoi(argv[++i]);
+    }
+    else
+    {
+      return 0;
+    }
+  }
+
+  if (config.shards < 1 || config.shards > NET_MAX_SHARDS || config.terminals < 1 ||
+      config.terminals > NET_MAX_CONNECTIONS || config.channels < 1 ||
+      config.channels > MAX_CHANNELS || config.duration < 1 || config.rate <= 0 ||
+      config.pm_every < 0 || config.moves < 0)
+  {
+    fprintf(stderr, "shards must be 1-%d, terminals 1-%d, channels 1-%d, duration >= 1\n",
+            NET_MAX_SHARDS, NET_MAX_CONNECTIONS, MAX_CHANNELS);
+    return 0;
+  }
+  return 1;
+}
+
+// The router's summary line, printed when it stops
+static void router_summary(const char *log, char *out, size_t size)
+{
+  out[0] = '\0';
+  FILE *file = fopen(log, "r");
+  char line[512];
+  while (file && fgets(line, sizeof(line), file))
+  {
+    if (strncmp(line, "Routed ", 7) == 0)
+    {
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(out, size, "%s", line);
+    }
+  }
+  if (file)
+  {
+    fclose(file);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (!parse_args(argc, argv))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if (config.shards < 2)
+  {
+    config.moves = 0;
+  }
+
+  snprintf(dir, sizeof(dir), "/tmp/my_dispute_cluster.XXXXXX");
+  if (!mkdtemp(dir))
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  size_t shared_size = sizeof(Shared) + sizeof(TerminalResult) * config.terminals;
+  shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+  {
+    perror("mmap");
+    return 1;
+  }
+
+  // Moves are refused without the router's move secret
+  snprintf(move_secret, sizeof(move_secret), "%s/move.secret", dir);
+  FILE *secret = fopen(move_secret, "w");
+  if (!secret)
+  {
+    perror(move_secret);
+    return 1;
+  }
+  fprintf(secret, "cluster%d\n", (int)getpid());
+  fclose(secret);
+
+  // Shards first, then the router in front of them
+  pid_t hubs[NET_MAX_SHARDS + 1];
+  int hub_count = 0;
+  char names[NET_MAX_SHARDS + 1][64];
+  char sockets[NET_MAX_SHARDS + 1][sizeof(dir) + 80];
+  char logs[NET_MAX_SHARDS + 1][sizeof(dir) + 80];
+  int ok = 1;
+  for (int i = 0; i <= config.shards && ok; i++)
+  {
+    int router = i == config.shards;
+    snprintf(names[i], sizeof(names[i]), "cluster%d-%s%d", (int)getpid(),
+             router ? "router" : "shard", i);
+    snprintf(sockets[i], sizeof(sockets[i]), "%s/%s.sock", dir, names[i]);
+    snprintf(logs[i], sizeof(logs[i]), "%s/%s.log", dir, names[i]);
+
+    char *args[10 + 2 * NET_MAX_SHARDS];
+    int n = 0;
+    args[n++] = (char *)config.hub;
+    args[n++] = "--name";
+    args[n++] = names[i];
+    args[n++] = "--listen";
+    args[n++] = sockets[i];
+    args[n++] = "--high-water";
+    args[n++] = "67108864"; // Measure the cluster, not the queue bound
+    for (int s = 0; router && s < config.shards; s++)
+    {
+      args[n++] = "--shard";
+      args[n++] = sockets[s];
+    }
+    if (router)
+    {
+      args[n++] = "--move-secret";
+      args[n++] = move_secret;
+    }
+    args[n] = NULL;
+    hubs[hub_count] = start_hub(args, logs[i]);
+    ok = hubs[hub_count++] > 0 && wait_for_socket(sockets[i]);
+  }
+
+  long setup_start = stats_now_ns();
+  pid_t *terminals = malloc(sizeof(pid_t) * config.terminals);
+  if (!terminals)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  int terminal_count = 0;
+
+  // Every terminal starts with the same channels, as if it had heard of them
+  for (int c = 0; c < config.channels; c++)
+  {
+    char name[MAX_CHANNEL_NAME_LEN];
+    snprintf(name, sizeof(name), "c%02d", c);
+    init_channel(&app_state.channels[c], name);
+  }
+  app_state.channel_count = config.channels;
+  app_state.current_user_index = -1;
+
+  for (int i = 0; i < config.terminals && ok; i++)
+  {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      run_terminal(i, sockets[config.shards]);
+    }
+    ok = pid > 0;
+    terminals[terminal_count++] = pid;
+  }
+
+  while (ok && __atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) < config.terminals)
+  {
+    usleep(1000);
+  }
+  long setup_ns = stats_now_ns() - setup_start;
+  __atomic_store_n(&shared->started, 1, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < terminal_count; i++)
+  {
+    int status;
+    waitpid(terminals[i], &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  for (int i = hub_count - 1; i >= 0; i--)
+  {
+    kill(hubs[i], SIGTERM);
+    waitpid(hubs[i], NULL, 0);
+  }
+  char summary[512];
+  router_summary(logs[config.shards], summary, sizeof(summary));
+
+  // Everything each terminal sent should reach every terminal
+  TerminalResult total = {0};
+  int presence_complete = 0;
+  long presence_ns = 0;
+  for (int i = 0; i < config.terminals; i++)
+  {
+    TerminalResult *result = &shared->terminals[i];
+    total.sent += result->sent;
+    total.refused += result->refused;
+    total.delivered += result->delivered;
+    total.out_of_order += result->out_of_order;
+    total.missed += result->missed;
+    total.dms_sent += result->dms_sent;
+    total.dms_received += result->dms_received;
+    total.moves_sent += result->moves_sent;
+    presence_complete += result->presence_ns >= 0;
+    if (result->presence_ns > presence_ns)
+    {
+      presence_ns = result->presence_ns;
+    }
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+      total.latency.counts[b] += result->latency.counts[b];
+    }
+    total.latency.total += result->latency.total;
+    if (result->latency.max > total.latency.max)
+    {
+      total.latency.max = result->latency.max;
+    }
+  }
+  long expected = total.sent * config.terminals;
+
+  printf("{\n  \"shards\": %d, \"terminals\": %d, \"channels\": %d, \"rate_per_terminal\": %.1f,\n",
+         config.shards, config.terminals, config.channels, config.rate);
+  printf("  \"setup_ms\": %.1f, \"presence_complete\": %d, \"presence_ms\": %.1f,\n",
+         setup_ns / 1e6, presence_complete, presence_ns / 1e6);
+  printf("  \"messages\": %ld, \"refused\": %ld, \"messages_per_sec\": %.1f,\n", total.sent,
+         total.refused, (double)total.sent / config.duration);
+  printf("  \"deliveries\": %ld, \"expected_deliveries\": %ld, \"lost\": %ld, "
+         "\"out_of_order\": %ld, \"gap_notices\": %ld,\n",
+         total.delivered, expected, expected - total.delivered, total.out_of_order,
+         total.missed);
+  printf("  \"delivery_latency_ns\": {\"p50\": %ld, \"p99\": %ld, \"p999\": %ld, \"max\": %ld},\n",
+         histogram_percentile(&total.latency, 0.50), histogram_percentile(&total.latency, 0.99),
+         histogram_percentile(&total.latency, 0.999), total.latency.max);
+  printf("  \"direct_messages\": %ld, \"direct_messages_received\": %ld,\n", total.dms_sent,
+         total.dms_received);
+  printf("  \"moves_requested\": %ld,\n  \"router\": \"%s\"\n}\n", total.moves_sent, summary);
+
+  for (int i = 0; i < hub_count; i++)
+  {
+    unlink(logs[i]);
+    unlink(sockets[i]);
+  }
+  unlink(move_secret);
+  rmdir(dir);
+  free(terminals);
+  return ok ? 0 : 1;
+}
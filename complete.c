@@ -0,0 +1,419 @@
+#include "my_dispute.h"
+
+// Tab completion for the input field.
+//
+// Command names, usernames and channel names each live in a prefix trie
+// that is updated as users register and channels come and go, so a
+// lookup walks only the typed prefix and the completion it returns. Every
+// node counts the words below it, which lets the n-th match be found
+// without listing the others; repeated Tabs use that to cycle.
+//
+// Children are kept as sorted sibling lists: names are short and share
+// prefixes heavily, so a list is far smaller than a 256-way table and
+// still takes only a few steps per byte.
+
+typedef struct
+{
+  unsigned char byte;
+  int first_child;  // Node index, -1 if none
+  int next_sibling; // Next child of the same parent, in byte order
+  int words;        // Words ending in this subtree
+  int ends;         // Words ending exactly here
+} TrieNode;
+
+typedef struct
+{
+  TrieNode *nodes; // Node 0 is the root
+  int count;
+  int capacity;
+} Trie;
+
+static Trie tries[COMPLETE_KINDS];
+
+// The commands process_command understands, without the slash
+static const char *command_names[] = {"create",  "delete",  "invite",  "kick",
+                                      "mod",     "move",    "msg",     "mute",
+                                      "pm",      "private", "promote", "retention",
+                                      "setrole", "stats"};
+
+// Commands whose first argument is a username or a channel name
+static const char *user_commands[] = {"invite", "kick", "mod", "mute", "pm", "setrole"};
+static const char *channel_commands[] = {"delete", "move", "msg"};
+
+// Cycling state while Tab is pressed repeatedly on an ambiguous word
+static struct
+{
+  int kind;
+  char prefix[MAX_INPUT_LEN];
+  int index;
+  int word_start; // Byte offset where the completed word starts
+} cycle;
+
+static int new_node(Trie *trie, unsigned char byte)
+{
+  if (trie->count == trie->capacity)
+  {
+    trie->capacity = trie->capacity ? trie->capacity * 2 : 64;
+    trie->nodes = realloc(trie->nodes, sizeof(TrieNode) * trie->capacity);
+    if (!trie->nodes)
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  TrieNode *node = &trie->nodes[trie->count];
+  node->byte = byte;
+  node->first_child = -1;
+  node->next_sibling = -1;
+  node->words = 0;
+  node->ends = 0;
+  return trie->count++;
+}
+
+// Child of node labelled byte, created in sorted position if asked to
+static int child(Trie *trie, int node, unsigned char byte, int create)
+{
+  int prev = -1;
+  int next = trie->nodes[node].first_child;
+  while (next >= 0 && trie->nodes[next].byte < byte)
+  {
+    prev = next;
+    next = trie->nodes[next].next_sibling;
+  }
+  if (next >= 0 && trie->nodes[next].byte == byte)
+  {
+    return next;
+  }
+  if (!create)
+  {
+    return -1;
+  }
+
+  int added = new_node(trie, byte);
+  trie->nodes[added].next_sibling = next;
+  if (prev >= 0)
+  {
+    trie->nodes[prev].next_sibling = added;
+  }
+  else
+  {
+    trie->nodes[node].first_child = added;
+  }
+  return added;
+}
+
+// Node reached by a prefix, or -1 when no word starts with it
+static int find_prefix(Trie *trie, const char *prefix, size_t len)
+{
+  if (trie->count == 0)
+  {
+    return -1;
+  }
+  int node = 0;
+  for (size_t i = 0; i < len && node >= 0; i++)
+  {
+    node = child(trie, node, prefix[i], 0);
+  }
+  return node >= 0 && trie->nodes[node].words > 0 ? node : -1;
+}
+
+void completion_add(int kind, const char *word)
+{
+  Trie *trie = &tries[kind];
+  if (!word[0])
+  {
+    return;
+  }
+  if (trie->count == 0)
+  {
+    new_node(trie, 0);
+  }
+
+  int node = 0;
+  trie->nodes[0].words++;
+  for (const char *p = word; *p; p++)
+  {
+    node = child(trie, node, *p, 1);
+    trie->nodes[node].words++;
+  }
+  trie->nodes[node].ends++;
+}
+
+// Forget one occurrence of a word. Emptied nodes stay in place and are
+// reused if the word comes back.
+void completion_remove(int kind, const char *word)
+{
+  Trie *trie = &tries[kind];
+  size_t len = strlen(word);
+  int node = find_prefix(trie, word, len);
+  if (!word[0] || node < 0 || trie->nodes[node].ends == 0)
+  {
+    return;
+  }
+
+  trie->nodes[node].ends--;
+  node = 0;
+  trie->nodes[0].words--;
+  for (size_t i = 0; i < len; i++)
+  {
+    node = child(trie, node, word[i], 0);
+    trie->nodes[node].words--;
+  }
+}
+
+// Write the n-th word (in byte order) below node, after the len bytes of
+// prefix already in out
+static void nth_word(Trie *trie, int node, int n, char *out, size_t len, size_t size)
+{
+  while (n >= trie->nodes[node].ends && len + 1 < size)
+  {
+    n -= trie->nodes[node].ends;
+    int next = trie->nodes[node].first_child;
+    while (next >= 0 && n >= trie->nodes[next].words)
+    {
+      n -= trie->nodes[next].words;
+      next = trie->nodes[next].next_sibling;
+    }
+    if (next < 0)
+    {
+      break;
+    }
+    out[len++] = trie->nodes[next].byte;
+    node = next;
+  }
+  out[len] = '\0';
+}
+
+// Number of words starting with prefix. When there are any, out receives
+// the index-th of them (wrapping around).
+int completion_lookup(int kind, const char *prefix, int index, char *out, size_t size)
+{
+  Trie *trie = &tries[kind];
+  size_t len = strlen(prefix);
+  int node = find_prefix(trie, prefix, len);
+  if (node < 0 || len >= size)
+  {
+    return 0;
+  }
+
+  int matches = trie->nodes[node].words;
+  memcpy(out, prefix, len);
+  nth_word(trie, node, index % matches, out, len, size);
+  return matches;
+}
+
+// Extend prefix in out as far as every match agrees
+static void common_prefix(int kind, const char *prefix, char *out, size_t size)
+{
+  Trie *trie = &tries[kind];
+  size_t len = strlen(prefix);
+  int node = find_prefix(trie, prefix, len);
+  memcpy(out, prefix, len);
+
+  while (node >= 0 && trie->nodes[node].ends == 0 && len + 1 < size)
+  {
+    // Follow the only child that still has words, if there is just one
+    int only = -1;
+    for (int c = trie->nodes[node].first_child; c >= 0; c = trie->nodes[c].next_sibling)
+    {
+      if (trie->nodes[c].words > 0)
+      {
+        if (only >= 0)
+        {
+          only = -1;
+          break;
+        }
+        only = c;
+      }
+    }
+    if (only < 0)
+    {
+      break;
+    }
+    out[len++] = trie->nodes[only].byte;
+    node = only;
+  }
+  out[len] = '\0';
+}
+
+static int in_list(const char *word, size_t len, const char **list, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    if (strlen(list[i]) == len && strncmp(list[i], word, len) == 0)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A completion the current user may see: hidden private channels are
+// never offered
+static int visible(AppState *state, int kind, const char *word)
+{
+  if (kind != COMPLETE_CHANNELS)
+  {
+    return 1;
+  }
+  int channel = find_channel(state, word);
+  return channel >= 0 && user_can(state, state->current_user_index, channel, PERM_READ);
+}
+
+// Narrow the matches of prefix to the channels the current user may see.
+// Returns how many there are; out receives the only one, or as much as
+// they all share, so a hidden channel never shows through either.
+static int visible_channels(AppState *state, const char *prefix, int matches, char *out,
+                            size_t size)
+{
+  char candidate[MAX_INPUT_LEN];
+  int count = 0;
+  for (int i = 0; i < matches; i++)
+  {
+    completion_lookup(COMPLETE_CHANNELS, prefix, i, candidate, sizeof(candidate));
+    if (!visible(state, COMPLETE_CHANNELS, candidate))
+    {
+      continue;
+    }
+    if (count++ == 0)
+    {
+      snprintf(out, size, "%s", candidate);
+      continue;
+    }
+    size_t len = 0;
+    while (out[len] && out[len] == candidate[len])
+    {
+      len++;
+    }
+    out[len] = '\0';
+  }
+  return count;
+}
+
+// Replace the word before the cursor, from byte offset start, with text
+static void replace_word(LineEditor *ed, int start, const char *text, int add_space)
+{
+  while (ed->gap_start > start)
+  {
+    editor_backspace(ed);
+  }
+  editor_insert_text(ed, text);
+  if (add_space)
+  {
+    editor_insert_byte(ed, ' ');
+  }
+}
+
+// Complete the word before the cursor in the input field. The first Tab
+// completes a unique match, or as much as all matches share; further
+// Tabs (repeat set) cycle through the matches. Returns 0 when there is
+// nothing to complete, so the caller can give Tab its other meaning.
+int complete_input(AppState *state, int repeat)
+{
+  LineEditor *ed = &state->input;
+  char match[MAX_INPUT_LEN];
+
+  if (repeat)
+  {
+    // Step to the next match the user may see
+    for (int tries_left = MAX_CHANNELS + 1; tries_left > 0; tries_left--)
+    {
+      cycle.index++;
+      if (!completion_lookup(cycle.kind, cycle.prefix, cycle.index, match, sizeof(match)))
+      {
+        return 0;
+      }
+      if (visible(state, cycle.kind, match))
+      {
+        replace_word(ed, cycle.word_start, match, 0);
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  // The cursor must be at the end of a word
+  const char *line = ed->buf;
+  int end = ed->gap_start;
+  if (end == 0 || line[end - 1] == ' ' ||
+      (ed->gap_end < ed->capacity && ed->buf[ed->gap_end] != ' '))
+  {
+    return 0;
+  }
+  int start = end;
+  while (start > 0 && line[start - 1] != ' ')
+  {
+    start--;
+  }
+
+  // What the word is decides where its completions come from
+  int kind;
+  int skip = 0;
+  const char *space = memchr(line, ' ', end);
+  if (line[0] == '/' && start == 0)
+  {
+    kind = COMPLETE_COMMANDS;
+    skip = 1;
+  }
+  else if (line[start] == '@')
+  {
+    kind = COMPLETE_USERS;
+    skip = 1;
+  }
+  else if (line[0] == '/' && space && start == space - line + 1 &&
+           in_list(line + 1, space - line - 1, user_commands,
+                   sizeof(user_commands) / sizeof(user_commands[0])))
+  {
+    kind = COMPLETE_USERS;
+  }
+  else if (line[0] == '/' && space && start == space - line + 1 &&
+           in_list(line + 1, space - line - 1, channel_commands,
+                   sizeof(channel_commands) / sizeof(channel_commands[0])))
+  {
+    kind = COMPLETE_CHANNELS;
+  }
+  else
+  {
+    return 0;
+  }
+
+  if (kind == COMPLETE_COMMANDS && tries[kind].count == 0)
+  {
+    for (size_t i = 0; i < sizeof(command_names) / sizeof(command_names[0]); i++)
+    {
+      completion_add(COMPLETE_COMMANDS, command_names[i]);
+    }
+  }
+
+  char prefix[MAX_INPUT_LEN];
+  memcpy(prefix, line + start + skip, end - start - skip);
+  prefix[end - start - skip] = '\0';
+
+  int matches = completion_lookup(kind, prefix, 0, match, sizeof(match));
+  if (kind == COMPLETE_CHANNELS && matches > 0)
+  {
+    matches = visible_channels(state, prefix, matches, match, sizeof(match));
+  }
+  if (matches == 0)
+  {
+    return 0;
+  }
+
+  if (matches == 1)
+  {
+    replace_word(ed, start + skip, match, 1);
+    return 1;
+  }
+
+  // Several matches: extend to what they share, then cycle from the first
+  if (kind != COMPLETE_CHANNELS)
+  {
+    common_prefix(kind, prefix, match, sizeof(match));
+  }
+  replace_word(ed, start + skip, match, 0);
+  cycle.kind = kind;
+  strcpy(cycle.prefix, prefix);
+  cycle.index = -1;
+  cycle.word_start = start + skip;
+  return 1;
+}
@@ -0,0 +1,389 @@
+#include "my_dispute.h"
+#include <pthread.h>
+
+// Block compression for archived history.
+//
+// A small LZ77 codec in the style of LZ4. A compressed block is a series
+// of sequences, each a token byte (literal count in the high nibble, match
+// length minus MIN_MATCH in the low nibble), extra length bytes for either
+// count when its nibble is 15, the literals, and a 2-byte little-endian
+// match offset. The last sequence carries literals only and ends the block.
+//
+// Matches may reach back past the start of the block into a preset
+// dictionary. A page of chat repeats little within itself but shares
+// names and common phrases with the rest of its channel, so a dictionary
+// trained on earlier traffic is what makes page-sized blocks compress.
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 14
+#define TRAIN_GRAM 8     // Substring length whose frequency is counted
+#define TRAIN_SEGMENT 32 // Length of each dictionary piece
+#define TRAIN_HASH_BITS 16
+
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static unsigned int hash4(uint32_t value)
+{
+  return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static unsigned int hash_gram(const unsigned char *p)
+{
+  uint64_t value;
+  memcpy(&value, p, 8);
+  return (value * 0x9E3779B97F4A7C15ull) >> (64 - TRAIN_HASH_BITS);
+}
+
+// Write the extra bytes of a length whose nibble was 15
+static unsigned char *put_length(unsigned char *op, unsigned char *end, size_t len)
+{
+  while (len >= 255)
+  {
+    if (op >= end)
+    {
+      return NULL;
+    }
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op >= end)
+  {
+    return NULL;
+  }
+  *op++ = len;
+  return op;
+}
+
+// Emit one sequence: literals, then a match unless match_len is 0
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end,
+                                   const unsigned char *literals, size_t literal_len,
+                                   size_t offset, size_t match_len)
+{
+  if (op >= end)
+  {
+    return NULL;
+  }
+  size_t match_code = match_len ? match_len - MIN_MATCH : 0;
+  unsigned char *token = op++;
+  *token = (literal_len < 15 ? literal_len : 15) << 4 | (match_code < 15 ? match_code : 15);
+
+  if (literal_len >= 15 && !(op = put_length(op, end, literal_len - 15)))
+  {
+    return NULL;
+  }
+  if ((size_t)(end - op) < literal_len)
+  {
+    return NULL;
+  }
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (match_len)
+  {
+    if (end - op < 2)
+    {
+      return NULL;
+    }
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (match_code >= 15 && !(op = put_length(op, end, match_code - 15)))
+    {
+      return NULL;
+    }
+  }
+  return op;
+}
+
+// Compress len bytes of src into dst. Returns the compressed length, or 0
+// when the result would not be smaller than the input (store it raw).
+// The match table is allocated per call, so threads may compress at once.
+size_t compress_block(const char *src, size_t len, char *dst, size_t capacity, const char *dict,
+                      size_t dict_len)
+{
+  int32_t *table = malloc(sizeof(int32_t) << HASH_BITS);
+  if (!table)
+  {
+    perror("malloc");
+    exit(1);
+  }
+
+  if (dict_len > MAX_OFFSET)
+  {
+    dict += dict_len - MAX_OFFSET;
+    dict_len = MAX_OFFSET;
+  }
+  if (capacity > len)
+  {
+    capacity = len;
+  }
+
+  // Matches are found in the dictionary and the block as one window
+  size_t total = dict_len + len;
+  unsigned char *window = malloc(total ? total : 1);
+  if (!window)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(window, dict, dict_len);
+  memcpy(window + dict_len, src, len);
+
+  memset(table, 0xFF, sizeof(int32_t) << HASH_BITS);
+  for (size_t i = 0; i + MIN_MATCH <= dict_len; i++)
+  {
+    table[hash4(read32(window + i))] = i;
+  }
+
+  unsigned char *op = (unsigned char *)dst;
+  unsigned char *end = op + capacity;
+  size_t anchor = dict_len;
+  size_t i = dict_len;
+  while (i + MIN_MATCH <= total)
+  {
+    uint32_t value = read32(window + i);
+    unsigned int h = hash4(value);
+    int32_t candidate = table[h];
+    table[h] = i;
+
+    if (candidate < 0 || i - candidate > MAX_OFFSET || read32(window + candidate) != value)
+    {
+      i++;
+      continue;
+    }
+
+    size_t match_len = MIN_MATCH;
+    while (i + match_len < total && window[candidate + match_len] == window[i + match_len])
+    {
+      match_len++;
+    }
+
+    op = put_sequence(op, end, window + anchor, i - anchor, i - candidate, match_len);
+    if (!op)
+    {
+      free(window);
+      free(table);
+      return 0;
+    }
+    i += match_len;
+    anchor = i;
+  }
+
+  op = put_sequence(op, end, window + anchor, total - anchor, 0, 0);
+  free(window);
+  free(table);
+  if (!op || op >= end)
+  {
+    return 0;
+  }
+  return op - (unsigned char *)dst;
+}
+
+// Read the extra bytes of a length whose nibble was 15
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *len)
+{
+  unsigned char byte;
+  do
+  {
+    if (*ip >= end)
+    {
+      return 0;
+    }
+    byte = *(*ip)++;
+    *len += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+// Decompress a block that must expand to exactly raw_len bytes, using the
+// same dictionary it was compressed with. Returns 0 on malformed input.
+int decompress_block(const char *src, size_t len, char *dst, size_t raw_len, const char *dict,
+                     size_t dict_len)
+{
+  if (dict_len > MAX_OFFSET)
+  {
+    dict += dict_len - MAX_OFFSET;
+    dict_len = MAX_OFFSET;
+  }
+
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *end = ip + len;
+  size_t op = 0;
+
+  while (ip < end)
+  {
+    unsigned char token = *ip++;
+
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && !get_length(&ip, end, &literal_len))
+    {
+      return 0;
+    }
+    if (literal_len > (size_t)(end - ip) || literal_len > raw_len - op)
+    {
+      return 0;
+    }
+    memcpy(dst + op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+
+    if (ip == end)
+    {
+      break;
+    }
+
+    if (end - ip < 2)
+    {
+      return 0;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t match_len = (token & 15) + MIN_MATCH;
+    if ((token & 15) == 15 && !get_length(&ip, end, &match_len))
+    {
+      return 0;
+    }
+    if (offset == 0 || offset > op + dict_len || match_len > raw_len - op)
+    {
+      return 0;
+    }
+
+    // Copy the part of the match that lies in the dictionary, then the
+    // rest from output already written; overlapping copies repeat bytes
+    if (offset > op)
+    {
+      size_t from_dict = offset - op;
+      if (from_dict > match_len)
+      {
+        from_dict = match_len;
+      }
+      memcpy(dst + op, dict + dict_len - (offset - op), from_dict);
+      op += from_dict;
+      match_len -= from_dict;
+    }
+    if (offset >= match_len)
+    {
+      memcpy(dst + op, dst + op - offset, match_len);
+      op += match_len;
+    }
+    else
+    {
+      for (size_t k = 0; k < match_len; k++, op++)
+      {
+        dst[op] = dst[op - offset];
+      }
+    }
+  }
+
+  return op == raw_len;
+}
+
+// Build a dictionary of at most capacity bytes from sample data.
+//
+// The samples are split into one epoch per dictionary piece; from each
+// epoch the TRAIN_SEGMENT-byte stretch whose substrings are most frequent
+// across all samples is kept, and its substrings stop counting so later
+// pieces cover something new. Returns the dictionary length.
+size_t train_dictionary(const char *samples, size_t len, char *dict, size_t capacity)
+{
+  const unsigned char *data = (const unsigned char *)samples;
+  size_t pieces = capacity / TRAIN_SEGMENT;
+  if (pieces == 0 || len < TRAIN_SEGMENT * 2)
+  {
+    return 0;
+  }
+
+  unsigned int *freq = calloc(1 << TRAIN_HASH_BITS, sizeof(unsigned int));
+  if (!freq)
+  {
+    perror("calloc");
+    exit(1);
+  }
+  for (size_t i = 0; i + TRAIN_GRAM <= len; i++)
+  {
+    freq[hash_gram(data + i)]++;
+  }
+
+  size_t epoch = len / pieces;
+  if (epoch < TRAIN_SEGMENT)
+  {
+    epoch = TRAIN_SEGMENT;
+  }
+
+  size_t dict_len = 0;
+  const int grams = TRAIN_SEGMENT - TRAIN_GRAM + 1;
+  for (size_t start = 0; start + TRAIN_SEGMENT <= len && dict_len + TRAIN_SEGMENT <= capacity;
+       start += epoch)
+  {
+    size_t stop = start + epoch < len ? start + epoch : len;
+
+    // Slide a window of grams substrings across the epoch
+    unsigned long score = 0;
+    for (int j = 0; j < grams; j++)
+    {
+      score += freq[hash_gram(data + start + j)];
+    }
+    unsigned long best_score = score;
+    size_t best = start;
+    for (size_t p = start + 1; p + TRAIN_SEGMENT <= stop; p++)
+    {
+      score -= freq[hash_gram(data + p - 1)];
+      score += freq[hash_gram(data + p + grams - 1)];
+      if (score > best_score)
+      {
+        best_score = score;
+        best = p;
+      }
+    }
+
+    // Skip epochs with nothing that repeats elsewhere
+    if (best_score < 2UL * grams)
+    {
+      continue;
+    }
+
+    memcpy(dict + dict_len, data + best, TRAIN_SEGMENT);
+    dict_len += TRAIN_SEGMENT;
+    for (int j = 0; j < grams; j++)
+    {
+      freq[hash_gram(data + best + j)] = 0;
+    }
+  }
+
+  free(freq);
+  return dict_len;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table()
+{
+  for (uint32_t n = 0; n < 256; n++)
+  {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+    {
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[n] = c;
+  }
+}
+
+// CRC-32 (IEEE) of a buffer. Safe to call from several threads.
+uint32_t checksum32(const char *data, size_t len)
+{
+  pthread_once(&crc_table_once, build_crc_table);
+
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc = crc_table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
@@ -0,0 +1,252 @@
+#include "my_dispute.h"
+
+// Direct messages.
+//
+// Conversations live apart from the channel table, in a growable array
+// indexed by an open-addressing hash table keyed on the ordered pair of
+// user indices. A conversation costs only its own record and hash slot
+// until its first message; its log and text then grow by doubling, so
+// memory follows the messages actually sent rather than the number of
+// pairs. Like a channel, a conversation keeps its newest DM_MAX_MESSAGES
+// messages.
+
+#define DM_MAX_MESSAGES MAX_MESSAGES
+#define DM_MIN_SLOTS 64
+#define DM_MIN_MESSAGES 4
+#define DM_MIN_TEXT 128
+
+static Conversation *conversations = NULL;
+static uint32_t conversation_count = 0;
+static uint32_t conversation_capacity = 0;
+
+// Hash slots hold a conversation index, or -1 when empty
+static int32_t *slots = NULL;
+static uint32_t slot_count = 0;
+
+// Heap bytes held by message logs and texts
+static size_t log_bytes = 0;
+
+static void *grow(void *ptr, size_t size)
+{
+  void *grown = realloc(ptr, size);
+  if (!grown)
+  {
+    perror("realloc");
+    exit(1);
+  }
+  return grown;
+}
+
+static uint32_t pair_slot(uint32_t low, uint32_t high, uint32_t count)
+{
+  uint64_t key = (uint64_t)low << 32 | high;
+  return (key * 0x9E3779B97F4A7C15ull) >> 32 & (count - 1);
+}
+
+// Double the hash table and reinsert every conversation
+static void grow_slots()
+{
+  uint32_t count = slot_count ? slot_count * 2 : DM_MIN_SLOTS;
+  int32_t *table = malloc(sizeof(int32_t) * count);
+  if (!table)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memset(table, 0xFF, sizeof(int32_t) * count);
+
+  for (uint32_t i = 0; i < conversation_count; i++)
+  {
+    uint32_t slot = pair_slot(conversations[i].low_user, conversations[i].high_user, count);
+    while (table[slot] >= 0)
+    {
+      slot = (slot + 1) & (count - 1);
+    }
+    table[slot] = i;
+  }
+
+  free(slots);
+  slots = table;
+  slot_count = count;
+}
+
+// Find the conversation between two users, creating it if asked to.
+// Returns NULL when there is none. The pointer stays valid only until the
+// next conversation is created.
+static Conversation *lookup(int user_a, int user_b, int create)
+{
+  uint32_t low = user_a < user_b ? user_a : user_b;
+  uint32_t high = user_a < user_b ? user_b : user_a;
+
+  if (slot_count)
+  {
+    uint32_t slot = pair_slot(low, high, slot_count);
+    while (slots[slot] >= 0)
+    {
+      Conversation *conv = &conversations[slots[slot]];
+      if (conv->low_user == low && conv->high_user == high)
+      {
+        return conv;
+      }
+      slot = (slot + 1) & (slot_count - 1);
+    }
+  }
+
+  if (!create)
+  {
+    return NULL;
+  }
+
+  // Keep the table at most half full so probes stay short
+  if ((conversation_count + 1) * 2 > slot_count)
+  {
+    grow_slots();
+  }
+  if (conversation_count == conversation_capacity)
+  {
+    conversation_capacity = conversation_capacity ? conversation_capacity * 2 : DM_MIN_SLOTS;
+    conversations = grow(conversations, sizeof(Conversation) * conversation_capacity);
+  }
+
+  Conversation *conv = &conversations[conversation_count];
+  memset(conv, 0, sizeof(Conversation));
+  conv->low_user = low;
+  conv->high_user = high;
+
+  uint32_t slot = pair_slot(low, high, slot_count);
+  while (slots[slot] >= 0)
+  {
+    slot = (slot + 1) & (slot_count - 1);
+  }
+  slots[slot] = conversation_count++;
+  return conv;
+}
+
+Conversation *dm_find(int user_a, int user_b)
+{
+  return lookup(user_a, user_b, 0);
+}
+
+// The conversation between two users, created empty if there is none yet
+Conversation *dm_conversation(int user_a, int user_b)
+{
+  return lookup(user_a, user_b, 1);
+}
+
+Message *dm_message(Conversation *conv, uint32_t index)
+{
+  return &conv->messages[index];
+}
+
+const char *dm_text(Conversation *conv, Message *msg)
+{
+  return conv->text + msg->text_offset;
+}
+
+// Drop the oldest quarter of a full conversation and slide the remaining
+// texts down to the start of the buffer
+static void drop_oldest(Conversation *conv)
+{
+  uint32_t drop = DM_MAX_MESSAGES / 4;
+  uint32_t base = conv->messages[drop].text_offset;
+
+  memmove(conv->messages, conv->messages + drop, sizeof(Message) * (conv->count - drop));
+  conv->count -= drop;
+  memmove(conv->text, conv->text + base, conv->text_used - base);
+  conv->text_used -= base;
+  for (uint32_t i = 0; i < conv->count; i++)
+  {
+    conv->messages[i].text_offset -= base;
+  }
+}
+
+// Append a message to a conversation; sender_id may be SYSTEM_SENDER_ID
+void dm_append(Conversation *conv, uint32_t sender_id, const char *text, time_t timestamp)
+{
+  if (conv->count == DM_MAX_MESSAGES)
+  {
+    drop_oldest(conv);
+  }
+
+  if (conv->count == conv->capacity)
+  {
+    uint32_t capacity = conv->capacity ? conv->capacity * 2 : DM_MIN_MESSAGES;
+    conv->messages = grow(conv->messages, sizeof(Message) * capacity);
+    log_bytes += sizeof(Message) * (capacity - conv->capacity);
+    conv->capacity = capacity;
+  }
+
+  size_t len = strnlen(text, MAX_MESSAGE_LEN - 1);
+  if (conv->text_used + len + 1 > conv->text_size)
+  {
+    uint32_t size = conv->text_size ? conv->text_size : DM_MIN_TEXT;
+    while (conv->text_used + len + 1 > size)
+    {
+      size *= 2;
+    }
+    conv->text = grow(conv->text, size);
+    log_bytes += size - conv->text_size;
+    conv->text_size = size;
+  }
+
+  Message *msg = &conv->messages[conv->count++];
+  msg->timestamp = timestamp;
+  msg->sender_id = sender_id;
+  msg->text_offset = conv->text_used;
+  msg->text_len = len;
+  msg->width = text_width_n(text, len);
+  msg->reactions = 0;
+  memcpy(conv->text + conv->text_used, text, len);
+  conv->text[conv->text_used + len] = '\0';
+  conv->text_used += len + 1;
+  conv->last_seq++;
+}
+
+// Send a direct message from one user to another. The sender has read
+// everything up to and including their own message.
+Conversation *dm_send(int from, int to, const char *text, time_t timestamp)
+{
+  Conversation *conv = lookup(from, to, 1);
+  dm_append(conv, from, text, timestamp);
+  stats_count_message();
+  metrics_count(METRIC_DIRECT_MESSAGES, 1);
+  dm_mark_read(conv, from);
+  return conv;
+}
+
+void dm_mark_read(Conversation *conv, int user_index)
+{
+  conv->read_seq[(uint32_t)user_index == conv->low_user ? 0 : 1] = conv->last_seq;
+}
+
+uint32_t dm_unread(Conversation *conv, int user_index)
+{
+  return conv->last_seq - conv->read_seq[(uint32_t)user_index == conv->low_user ? 0 : 1];
+}
+
+long dm_conversation_count()
+{
+  return conversation_count;
+}
+
+// Bytes used by the whole direct-message store
+size_t dm_memory_usage()
+{
+  return sizeof(Conversation) * conversation_capacity + sizeof(int32_t) * slot_count + log_bytes;
+}
+
+// Release every conversation
+void dm_free_all()
+{
+  for (uint32_t i = 0; i < conversation_count; i++)
+  {
+    free(conversations[i].messages);
+    free(conversations[i].text);
+  }
+  free(conversations);
+  free(slots);
+  conversations = NULL;
+  slots = NULL;
+  conversation_count = conversation_capacity = slot_count = 0;
+  log_bytes = 0;
+}
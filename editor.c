@@ -0,0 +1,458 @@
+#include "my_dispute.h"
+
+// Single-line input editor backed by a gap buffer.
+//
+// The text lives in buf with a gap at the cursor: bytes [0, gap_start) are
+// before the cursor and [gap_end, capacity) after it. Inserting or deleting
+// at the cursor only moves the gap edges, so typing is O(1) per keystroke
+// however long the line is. The cursor always sits on a UTF-8 character
+// boundary, so no character is ever split by the gap.
+//
+// The editor also tracks what draw_input needs to repaint: the display
+// column where the content first changed since the last draw, so a
+// keystroke at the end of a line repaints a single cell.
+
+#define EDITOR_INITIAL_SIZE 64
+#define EDITOR_MAX_BYTES (MAX_INPUT_LEN - 1)
+
+void editor_init(LineEditor *ed)
+{
+  memset(ed, 0, sizeof(LineEditor));
+  ed->capacity = EDITOR_INITIAL_SIZE;
+  ed->buf = malloc(ed->capacity);
+  if (!ed->buf)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  ed->gap_end = ed->capacity;
+  ed->history_pos = -1;
+  ed->dirty_pos = -1;
+  ed->full_redraw = 1;
+}
+
+void editor_free(LineEditor *ed)
+{
+  free(ed->buf);
+  for (int i = 0; i < INPUT_HISTORY_SIZE; i++)
+  {
+    free(ed->history[i]);
+  }
+  free(ed->saved_line);
+  memset(ed, 0, sizeof(LineEditor));
+}
+
+int editor_length(LineEditor *ed)
+{
+  return ed->capacity - (ed->gap_end - ed->gap_start);
+}
+
+// Byte at logical position pos, skipping over the gap
+static char byte_at(LineEditor *ed, int pos)
+{
+  return pos < ed->gap_start ? ed->buf[pos] : ed->buf[pos + ed->gap_end - ed->gap_start];
+}
+
+// Decode the character at logical position pos; returns its byte length
+int editor_char_at(LineEditor *ed, int pos, unsigned int *cp)
+{
+  if (pos < ed->gap_start)
+  {
+    return utf8_decode(ed->buf + pos, ed->gap_start - pos, cp);
+  }
+  int physical = pos + ed->gap_end - ed->gap_start;
+  return utf8_decode(ed->buf + physical, ed->capacity - physical, cp);
+}
+
+// Copy the text into out as a NUL-terminated string
+void editor_text(LineEditor *ed, char *out, int size)
+{
+  int before = ed->gap_start;
+  int after = ed->capacity - ed->gap_end;
+
+  if (before > size - 1)
+  {
+    before = size - 1;
+  }
+  memcpy(out, ed->buf, before);
+
+  if (after > size - 1 - before)
+  {
+    after = size - 1 - before;
+  }
+  memcpy(out + before, ed->buf + ed->gap_end, after);
+  out[before + after] = '\0';
+}
+
+// Remember that content from the current cursor onwards must be repainted
+static void mark_dirty(LineEditor *ed)
+{
+  if (ed->dirty_pos < 0 || ed->gap_start < ed->dirty_pos)
+  {
+    ed->dirty_pos = ed->gap_start;
+    ed->dirty_col = ed->cursor_col;
+  }
+}
+
+static void grow(LineEditor *ed, int need)
+{
+  int capacity = ed->capacity;
+  while (capacity - editor_length(ed) < need)
+  {
+    capacity *= 2;
+  }
+
+  char *buf = malloc(capacity);
+  if (!buf)
+  {
+    perror("malloc");
+    exit(1);
+  }
+
+  int after = ed->capacity - ed->gap_end;
+  memcpy(buf, ed->buf, ed->gap_start);
+  memcpy(buf + capacity - after, ed->buf + ed->gap_end, after);
+  free(ed->buf);
+  ed->buf = buf;
+  ed->gap_end = capacity - after;
+  ed->capacity = capacity;
+}
+
+// Insert one complete character (or a run of ASCII) at the cursor
+static int insert_bytes(LineEditor *ed, const char *bytes, int len, int width)
+{
+  if (editor_length(ed) + len > EDITOR_MAX_BYTES)
+  {
+    return 0;
+  }
+  if (ed->gap_end - ed->gap_start < len)
+  {
+    grow(ed, len);
+  }
+
+  mark_dirty(ed);
+  memcpy(ed->buf + ed->gap_start, bytes, len);
+  ed->gap_start += len;
+  ed->cursor_col += width;
+  ed->total_width += width;
+  return 1;
+}
+
+// Replacement for a byte that cannot start or continue a character. It is
+// stored as U+FFFD so the buffer stays valid UTF-8 and total_width matches
+// what draw_input renders.
+static int insert_invalid(LineEditor *ed)
+{
+  ed->pending_len = 0;
+  ed->pending_need = 0;
+  return insert_bytes(ed, "\xEF\xBF\xBD", 3, 1);
+}
+
+// Feed one byte from the keyboard. Multibyte UTF-8 characters arrive one
+// byte per key and are buffered until complete. A sequence cut short by a
+// new character, an invalid lead byte and a stray continuation byte each
+// become one U+FFFD.
+int editor_insert_byte(LineEditor *ed, int byte)
+{
+  if ((byte & 0xC0) != 0x80 && ed->pending_len > 0 && !insert_invalid(ed))
+  {
+    return 0;
+  }
+
+  if (byte < 0x80)
+  {
+    char c = byte;
+    return insert_bytes(ed, &c, 1, 1);
+  }
+
+  if ((byte & 0xC0) != 0x80)
+  {
+    if ((byte & 0xF8) == 0xF8)
+    {
+      return insert_invalid(ed);
+    }
+    // Lead byte starts a new sequence
+    ed->pending[0] = byte;
+    ed->pending_len = 1;
+    ed->pending_need = (byte & 0xE0) == 0xC0 ? 2 : (byte & 0xF0) == 0xE0 ? 3 : 4;
+    return 1;
+  }
+
+  if (ed->pending_len == 0)
+  {
+    return insert_invalid(ed);
+  }
+
+  ed->pending[ed->pending_len++] = byte;
+  if (ed->pending_len < ed->pending_need)
+  {
+    return 1;
+  }
+
+  unsigned int cp;
+  int len = ed->pending_len;
+  ed->pending_len = 0;
+  ed->pending_need = 0;
+  utf8_decode(ed->pending, len, &cp);
+  return insert_bytes(ed, ed->pending, len, codepoint_width(cp));
+}
+
+// Insert a string at the cursor, e.g. a completion or pasted text
+int editor_insert_text(LineEditor *ed, const char *text)
+{
+  for (const char *p = text; *p; p++)
+  {
+    if (!editor_insert_byte(ed, (unsigned char)*p))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Start of the character before logical position pos
+static int previous_char(LineEditor *ed, int pos)
+{
+  do
+  {
+    pos--;
+  } while (pos > 0 && ((unsigned char)byte_at(ed, pos) & 0xC0) == 0x80);
+  return pos;
+}
+
+void editor_backspace(LineEditor *ed)
+{
+  if (ed->gap_start == 0)
+  {
+    return;
+  }
+
+  int start = previous_char(ed, ed->gap_start);
+  unsigned int cp;
+  utf8_decode(ed->buf + start, ed->gap_start - start, &cp);
+  int width = codepoint_width(cp);
+
+  ed->gap_start = start;
+  ed->cursor_col -= width;
+  ed->total_width -= width;
+  mark_dirty(ed);
+}
+
+void editor_delete(LineEditor *ed)
+{
+  if (ed->gap_end == ed->capacity)
+  {
+    return;
+  }
+
+  unsigned int cp;
+  int len = utf8_decode(ed->buf + ed->gap_end, ed->capacity - ed->gap_end, &cp);
+  mark_dirty(ed);
+  ed->gap_end += len;
+  ed->total_width -= codepoint_width(cp);
+}
+
+// Delete the word before the cursor, plus any spaces after it
+void editor_delete_word(LineEditor *ed)
+{
+  while (ed->gap_start > 0 && ed->buf[ed->gap_start - 1] == ' ')
+  {
+    editor_backspace(ed);
+  }
+  while (ed->gap_start > 0 && ed->buf[ed->gap_start - 1] != ' ')
+  {
+    editor_backspace(ed);
+  }
+}
+
+void editor_left(LineEditor *ed)
+{
+  if (ed->gap_start == 0)
+  {
+    return;
+  }
+
+  int start = previous_char(ed, ed->gap_start);
+  int len = ed->gap_start - start;
+  unsigned int cp;
+  utf8_decode(ed->buf + start, len, &cp);
+
+  // Move the character from before the gap to after it
+  ed->gap_start -= len;
+  ed->gap_end -= len;
+  memmove(ed->buf + ed->gap_end, ed->buf + ed->gap_start, len);
+  ed->cursor_col -= codepoint_width(cp);
+}
+
+void editor_right(LineEditor *ed)
+{
+  if (ed->gap_end == ed->capacity)
+  {
+    return;
+  }
+
+  unsigned int cp;
+  int len = utf8_decode(ed->buf + ed->gap_end, ed->capacity - ed->gap_end, &cp);
+
+  memmove(ed->buf + ed->gap_start, ed->buf + ed->gap_end, len);
+  ed->gap_start += len;
+  ed->gap_end += len;
+  ed->cursor_col += codepoint_width(cp);
+}
+
+void editor_home(LineEditor *ed)
+{
+  int len = ed->gap_start;
+  memmove(ed->buf + ed->gap_end - len, ed->buf, len);
+  ed->gap_start = 0;
+  ed->gap_end -= len;
+  ed->cursor_col = 0;
+}
+
+void editor_end(LineEditor *ed)
+{
+  int len = ed->capacity - ed->gap_end;
+  memmove(ed->buf + ed->gap_start, ed->buf + ed->gap_end, len);
+  ed->gap_start += len;
+  ed->gap_end = ed->capacity;
+  ed->cursor_col = ed->total_width;
+}
+
+// Replace the whole line, leaving the cursor at the end
+void editor_set_text(LineEditor *ed, const char *text)
+{
+  ed->gap_start = 0;
+  ed->gap_end = ed->capacity;
+  ed->cursor_col = 0;
+  ed->total_width = 0;
+  ed->pending_len = 0;
+  ed->dirty_pos = 0;
+  ed->dirty_col = 0;
+  editor_insert_text(ed, text);
+}
+
+void editor_clear(LineEditor *ed)
+{
+  editor_set_text(ed, "");
+}
+
+// Add the current line to the history ring and clear it
+void editor_commit(LineEditor *ed)
+{
+  if (editor_length(ed) > 0)
+  {
+    char text[MAX_INPUT_LEN];
+    editor_text(ed, text, sizeof(text));
+
+    int slot = (ed->history_head + ed->history_count) % INPUT_HISTORY_SIZE;
+    if (ed->history_count == INPUT_HISTORY_SIZE)
+    {
+      // Ring is full: overwrite the oldest entry
+      slot = ed->history_head;
+      ed->history_head = (ed->history_head + 1) % INPUT_HISTORY_SIZE;
+    }
+    else
+    {
+      ed->history_count++;
+    }
+    free(ed->history[slot]);
+    ed->history[slot] = strdup(text);
+  }
+
+  ed->history_pos = -1;
+  free(ed->saved_line);
+  ed->saved_line = NULL;
+  editor_clear(ed);
+}
+
+// Step through history: direction -1 = older, +1 = newer
+void editor_history(LineEditor *ed, int direction)
+{
+  if (ed->history_count == 0)
+  {
+    return;
+  }
+
+  int pos = ed->history_pos;
+  if (pos == -1)
+  {
+    if (direction > 0)
+    {
+      return;
+    }
+    // Keep the line being typed so stepping back down restores it
+    char text[MAX_INPUT_LEN];
+    editor_text(ed, text, sizeof(text));
+    free(ed->saved_line);
+    ed->saved_line = strdup(text);
+    pos = ed->history_count;
+  }
+
+  pos += direction;
+  if (pos < 0)
+  {
+    return;
+  }
+
+  if (pos >= ed->history_count)
+  {
+    ed->history_pos = -1;
+    editor_set_text(ed, ed->saved_line ? ed->saved_line : "");
+    return;
+  }
+
+  ed->history_pos = pos;
+  editor_set_text(ed, ed->history[(ed->history_head + pos) % INPUT_HISTORY_SIZE]);
+}
+
+// Apply an editing key; returns 1 if the key was consumed
+int editor_handle_key(LineEditor *ed, int ch)
+{
+  switch (ch)
+  {
+  case KEY_LEFT:
+  case 2: // Ctrl-B
+    editor_left(ed);
+    return 1;
+  case KEY_RIGHT:
+  case 6: // Ctrl-F
+    editor_right(ed);
+    return 1;
+  case KEY_HOME:
+  case 1: // Ctrl-A
+    editor_home(ed);
+    return 1;
+  case KEY_END:
+  case 5: // Ctrl-E
+    editor_end(ed);
+    return 1;
+  case KEY_UP:
+    editor_history(ed, -1);
+    return 1;
+  case KEY_DOWN:
+    editor_history(ed, 1);
+    return 1;
+  case KEY_BACKSPACE:
+  case 127:
+  case 8:
+    editor_backspace(ed);
+    return 1;
+  case KEY_DC:
+    editor_delete(ed);
+    return 1;
+  case 23: // Ctrl-W
+    editor_delete_word(ed);
+    return 1;
+  case 21: // Ctrl-U
+    editor_clear(ed);
+    return 1;
+  }
+
+  if ((ch >= 32 && ch < 127) || (ch >= 0x80 && ch <= 0xFF))
+  {
+    editor_insert_byte(ed, ch);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,2110 @@
+#include "my_dispute.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+// On-disk channel history with a demand-paged cache and background
+// retention.
+//
+// Every message a channel ingests is also appended to that channel's
+// history on disk, while Channel.messages keeps only the newest
+// MAX_MESSAGES as a hot tail. Older messages are read back a page at a
+// time through a global LRU cache with a fixed memory budget, so memory
+// use does not grow with the amount of history.
+//
+// History lives in <dir>/<hex channel name>/. Messages are grouped into
+// pages of PAGE_MESSAGES; message seq (1-based, see Channel.last_seq) is
+// on page (seq - 1) / PAGE_MESSAGES. New messages go to an open segment,
+// named after its first page, which is sealed once it holds
+// SEGMENT_MESSAGES. A sealed segment is immutable, is named after the
+// range of pages it holds, and has a sparse index file with one entry
+// per page: the page's byte offset and its newest timestamp.
+//
+// Sealing compresses each page into its own block (see compress.c) with
+// a dictionary trained on the channel's first sealed segment, so reading
+// one page back only decompresses that page. Every block carries a
+// checksum of its uncompressed bytes. A full open segment is closed and
+// handed to the compactor thread to seal, so ingest only ever appends;
+// until the sealed files replace it, its pages are read from the closed
+// open segment. Without a compactor thread sealing happens inline.
+//
+// A compactor thread applies each channel's retention policy. Expired
+// history is cut at a watermark (messages below first_seq are no longer
+// readable), then segments wholly below it are deleted, segments that
+// are mostly expired are rewritten without the expired pages, and runs
+// of small segments are merged. It only ever touches sealed segments, so
+// ingest never waits for it, and it paces its own I/O to a byte rate.
+// Deleted channels are renamed into a trash directory and purged by the
+// same thread. A channel's directory also holds its retention policy and
+// its access state (see permissions.c).
+//
+// Record layout: uint16 sender length, uint16 text length, int64
+// timestamp, sender bytes, text bytes. Block layout: uint32 uncompressed
+// length, uint32 CRC-32 of the uncompressed bytes, then the compressed
+// bytes, or the raw page when compression would not make it smaller.
+
+#define SEGMENT_MESSAGES 4096
+#define PAGE_MESSAGES 64
+#define PAGES_PER_SEGMENT (SEGMENT_MESSAGES / PAGE_MESSAGES)
+#define RECORD_HEADER 12
+#define PAGE_HASH_SIZE 1024
+#define DEFAULT_CACHE_BUDGET (4 * 1024 * 1024)
+#define MERGE_TARGET_BYTES (4 * 1024 * 1024) // Size compaction merges up to
+#define SMALL_SEGMENT_BYTES (MERGE_TARGET_BYTES / 4)
+#define COMPACT_INTERVAL 30 // Seconds between compaction passes
+#define MAX_THROTTLE_SLEEP_NS 100000000L
+#define TRASH_PREFIX ".trash-"
+#define RETENTION_FILE "retention"
+#define ACCESS_FILE "access"
+#define BLOCK_HEADER 8
+#define DICTIONARY_SIZE 8192
+#define DICTIONARY_FILE "dictionary"
+#define MAX_PAGE_BYTES (PAGE_MESSAGES * (RECORD_HEADER + 2 * 65535))
+
+typedef struct
+{
+  uint32_t offset; // Byte offset of the page in the segment
+  uint32_t newest; // Newest timestamp on the page, for age retention
+} IndexEntry;
+
+typedef struct
+{
+  uint32_t first_page;
+  uint32_t last_page;
+  uint32_t bytes;
+} Segment;
+
+// A full open segment waiting for the compactor to seal it
+typedef struct
+{
+  uint32_t first_page;
+  uint32_t bytes;
+  IndexEntry index[PAGES_PER_SEGMENT];
+  int failed; // Left as is for history_open to seal at the next start
+} PendingSeal;
+
+struct ChannelHistory
+{
+  int id; // Page cache key, unique for the life of the process
+  char dir[512];
+
+  // Owned by the main thread
+  FILE *active; // Open segment being appended to
+  uint32_t active_first_page;
+  uint32_t active_count; // Records in the open segment
+  uint32_t active_bytes;
+  IndexEntry active_index[PAGES_PER_SEGMENT];
+  int unflushed;
+
+  // Set once, by whichever thread seals the first segment, before that
+  // segment is published; readers only use it to decode sealed pages
+  char *dictionary;
+  uint32_t dictionary_len;
+
+  // Shared with the compactor
+  pthread_mutex_t lock; // Guards segments, pending, policy, first_seq and closed
+  Segment *segments;    // Sealed segments in page order
+  int segment_count;
+  int segment_capacity;
+  PendingSeal *pending; // Full segments not sealed yet, oldest first
+  int pending_count;
+  int pending_capacity;
+  RetentionPolicy policy;
+  uint32_t first_seq; // Oldest readable message; older ones have expired
+  uint32_t last_seq;
+  int closed;
+  int refs; // Held by the compactor while it works on this history
+  struct ChannelHistory *next;
+};
+
+// A decoded page of PAGE_MESSAGES consecutive messages
+typedef struct HistoryPage
+{
+  int history_id;
+  uint32_t page;
+  int count; // May be short for the last page of the open segment
+  size_t bytes;
+  HistoryMessage *messages;
+  struct HistoryPage *lru_prev; // Towards most recently used
+  struct HistoryPage *lru_next;
+  struct HistoryPage *hash_next;
+} HistoryPage;
+
+static char *history_root = NULL;
+static int next_history_id = 1;
+
+// Page cache: hash table for lookup, doubly linked list for LRU order.
+// Only the main thread uses it.
+static HistoryPage *page_hash[PAGE_HASH_SIZE];
+static HistoryPage *lru_head = NULL;
+static HistoryPage *lru_tail = NULL;
+static size_t cache_budget = DEFAULT_CACHE_BUDGET;
+static size_t cache_bytes = 0;
+static long cache_hits = 0;
+static long cache_misses = 0;
+
+// Open histories, for the compactor to walk
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compactor_wake = PTHREAD_COND_INITIALIZER;
+static ChannelHistory *histories = NULL;
+
+static pthread_t compactor_thread;
+static int compactor_running = 0;
+static int compactor_stop = 0;
+static int compactor_kick = 0;
+static int seal_kick = 0; // A segment was handed over for sealing
+static long compact_rate = 0; // Bytes per second of compactor I/O, 0 for unlimited
+
+// Compaction results, written by the compactor and read by /stats. The
+// bytes and time the rate is made of change together under registry_lock.
+static long reclaimed_bytes = 0;
+static long compacted_bytes = 0;
+static long compaction_ns = 0;
+
+// Sealed page bytes before and after compression, written by whichever
+// thread seals
+static long archived_raw_bytes = 0;
+static long archived_bytes = 0;
+
+// Enable history under dir with a page cache of budget bytes, or disable
+// it when dir is NULL. Channels initialized before this call are unaffected.
+int history_init(const char *dir, size_t budget)
+{
+  if (!dir)
+  {
+    free(history_root);
+    history_root = NULL;
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+  {
+    perror(dir);
+    return 0;
+  }
+
+  free(history_root);
+  history_root = strdup(dir);
+  if (budget > 0)
+  {
+    cache_budget = budget;
+  }
+  return 1;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(a, b);
+}
+
+// List the channels that have history on disk, in name order. Returns
+// how many names were stored, at most max.
+int history_channels(char names[][MAX_CHANNEL_NAME_LEN], int max)
+{
+  if (!history_root)
+  {
+    return 0;
+  }
+  DIR *dir = opendir(history_root);
+  if (!dir)
+  {
+    return 0;
+  }
+
+  int count = 0;
+  struct dirent *entry;
+  while (count < max && (entry = readdir(dir)))
+  {
+    // Directory names are the hex-encoded channel name
+    int len = strlen(entry->d_name);
+    if (len == 0 || len % 2 != 0 || len / 2 >= MAX_CHANNEL_NAME_LEN)
+    {
+      continue;
+    }
+    char *name = names[count];
+    int valid = 1;
+    for (int i = 0; i < len && valid; i += 2)
+    {
+      unsigned int byte;
+      valid = isxdigit((unsigned char)entry->d_name[i]) &&
+              isxdigit((unsigned char)entry->d_name[i + 1]) &&
+              sscanf(entry->d_name + i, "%2x", &byte) == 1 && byte != 0;
+      name[i / 2] = byte;
+    }
+    if (valid)
+    {
+      name[len / 2] = '\0';
+      count++;
+    }
+  }
+  closedir(dir);
+
+  qsort(names, count, MAX_CHANNEL_NAME_LEN, compare_names);
+  return count;
+}
+
+static void segment_path(ChannelHistory *history, Segment *segment, const char *ext, char *out,
+                         size_t size)
+{
+  snprintf(out, size, "%s/%010u-%010u.%s", history->dir, segment->first_page, segment->last_page,
+           ext);
+}
+
+static void open_segment_path(ChannelHistory *history, uint32_t first_page, char *out,
+                              size_t size)
+{
+  snprintf(out, size, "%s/%010u.open", history->dir, first_page);
+}
+
+static unsigned int page_hash_index(int history_id, uint32_t page)
+{
+  return ((unsigned int)history_id * 2654435761u ^ page * 40503u) % PAGE_HASH_SIZE;
+}
+
+static void lru_unlink(HistoryPage *page)
+{
+  if (page->lru_prev)
+    page->lru_prev->lru_next = page->lru_next;
+  else
+    lru_head = page->lru_next;
+  if (page->lru_next)
+    page->lru_next->lru_prev = page->lru_prev;
+  else
+    lru_tail = page->lru_prev;
+  page->lru_prev = page->lru_next = NULL;
+}
+
+static void lru_push_front(HistoryPage *page)
+{
+  page->lru_next = lru_head;
+  page->lru_prev = NULL;
+  if (lru_head)
+    lru_head->lru_prev = page;
+  lru_head = page;
+  if (!lru_tail)
+    lru_tail = page;
+}
+
+static void drop_page(HistoryPage *page)
+{
+  HistoryPage **link = &page_hash[page_hash_index(page->history_id, page->page)];
+  while (*link != page)
+  {
+    link = &(*link)->hash_next;
+  }
+  *link = page->hash_next;
+
+  lru_unlink(page);
+  cache_bytes -= page->bytes;
+  free(page);
+}
+
+// Evict least recently used pages until the cache fits its budget. A
+// single page larger than the whole budget is still allowed in.
+static void enforce_budget()
+{
+  while (cache_bytes > cache_budget && lru_tail)
+  {
+    drop_page(lru_tail);
+  }
+}
+
+static void drop_history_pages(int history_id)
+{
+  HistoryPage *page = lru_head;
+  while (page)
+  {
+    HistoryPage *next = page->lru_next;
+    if (page->history_id == history_id)
+    {
+      drop_page(page);
+    }
+    page = next;
+  }
+}
+
+// Parse records from buf, filling the page index; returns bytes consumed
+static uint32_t scan_records(const char *buf, uint32_t len, uint32_t *count, IndexEntry *index)
+{
+  uint32_t pos = 0;
+  *count = 0;
+  while (pos + RECORD_HEADER <= len && *count < SEGMENT_MESSAGES)
+  {
+    uint16_t name_len, text_len;
+    int64_t ts;
+    memcpy(&name_len, buf + pos, 2);
+    memcpy(&text_len, buf + pos + 2, 2);
+    memcpy(&ts, buf + pos + 4, 8);
+    uint32_t record = RECORD_HEADER + name_len + text_len;
+    if (pos + record > len)
+    {
+      break;
+    }
+
+    IndexEntry *entry = &index[*count / PAGE_MESSAGES];
+    if (*count % PAGE_MESSAGES == 0)
+    {
+      entry->offset = pos;
+      entry->newest = 0;
+    }
+    if ((uint32_t)ts > entry->newest)
+    {
+      entry->newest = ts;
+    }
+
+    pos += record;
+    (*count)++;
+  }
+  return pos;
+}
+
+static char *read_file(const char *path, uint32_t *len)
+{
+  *len = 0;
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *buf = malloc(size > 0 ? size : 1);
+  if (!buf || fread(buf, 1, size, file) != (size_t)size)
+  {
+    free(buf);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+  *len = size;
+  return buf;
+}
+
+static void load_retention(ChannelHistory *history)
+{
+  char path[600];
+  snprintf(path, sizeof(path), "%s/" RETENTION_FILE, history->dir);
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    return;
+  }
+
+  long max_age = 0;
+  unsigned long max_messages = 0, max_bytes = 0, first_seq = 1;
+  if (fscanf(file, "%ld %lu %lu %lu", &max_age, &max_messages, &max_bytes, &first_seq) == 4)
+  {
+    history->policy.max_age = max_age;
+    history->policy.max_messages = max_messages;
+    history->policy.max_bytes = max_bytes;
+    history->first_seq = first_seq > 0 ? first_seq : 1;
+  }
+  fclose(file);
+}
+
+// Persist the policy and watermark; caller holds history->lock
+static void save_retention(ChannelHistory *history)
+{
+  char path[600], tmp_path[610];
+  snprintf(path, sizeof(path), "%s/" RETENTION_FILE, history->dir);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *file = fopen(tmp_path, "w");
+  if (!file)
+  {
+    return;
+  }
+  fprintf(file, "%ld %lu %lu %lu\n", history->policy.max_age,
+          (unsigned long)history->policy.max_messages, (unsigned long)history->policy.max_bytes,
+          (unsigned long)history->first_seq);
+  if (fclose(file) != 0 || rename(tmp_path, path) != 0)
+  {
+    unlink(tmp_path);
+  }
+}
+
+// Replace the channel's saved access state (see permissions.c)
+void history_save_access(Channel *channel, const char *text, size_t len)
+{
+  ChannelHistory *history = channel->history;
+  if (!history)
+  {
+    return;
+  }
+
+  char path[600], tmp_path[610];
+  snprintf(path, sizeof(path), "%s/" ACCESS_FILE, history->dir);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *file = fopen(tmp_path, "w");
+  if (!file)
+  {
+    return;
+  }
+  fwrite(text, 1, len, file);
+  if (fclose(file) != 0 || rename(tmp_path, path) != 0)
+  {
+    unlink(tmp_path);
+  }
+}
+
+// The channel's saved access state, NUL-terminated, or NULL if it has none
+char *history_load_access(Channel *channel)
+{
+  if (!channel->history)
+  {
+    return NULL;
+  }
+
+  char path[600];
+  uint32_t len;
+  snprintf(path, sizeof(path), "%s/" ACCESS_FILE, channel->history->dir);
+  char *text = read_file(path, &len);
+  if (!text)
+  {
+    return NULL;
+  }
+  char *terminated = realloc(text, len + 1);
+  if (!terminated)
+  {
+    perror("realloc");
+    exit(1);
+  }
+  terminated[len] = '\0';
+  return terminated;
+}
+
+// Insert a sealed segment in page order; caller holds history->lock
+static void insert_segment(ChannelHistory *history, Segment *segment)
+{
+  if (history->segment_count == history->segment_capacity)
+  {
+    history->segment_capacity = history->segment_capacity ? history->segment_capacity * 2 : 16;
+    history->segments = realloc(history->segments, sizeof(Segment) * history->segment_capacity);
+    if (!history->segments)
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  int i = history->segment_count;
+  while (i > 0 && history->segments[i - 1].first_page > segment->first_page)
+  {
+    history->segments[i] = history->segments[i - 1];
+    i--;
+  }
+  history->segments[i] = *segment;
+  history->segment_count++;
+}
+
+// Order by first page, and the widest segment first among equals
+static int compare_segments(const void *a, const void *b)
+{
+  const Segment *x = a;
+  const Segment *y = b;
+  if (x->first_page != y->first_page)
+  {
+    return x->first_page < y->first_page ? -1 : 1;
+  }
+  return (x->last_page < y->last_page) - (x->last_page > y->last_page);
+}
+
+static void delete_segment_files(ChannelHistory *history, Segment *segment)
+{
+  char path[600];
+  segment_path(history, segment, "seg", path, sizeof(path));
+  unlink(path);
+  segment_path(history, segment, "idx", path, sizeof(path));
+  unlink(path);
+}
+
+// Load the channel's compression dictionary. The file stores its length
+// and checksum ahead of the bytes.
+static void load_dictionary(ChannelHistory *history)
+{
+  char path[600];
+  snprintf(path, sizeof(path), "%s/" DICTIONARY_FILE, history->dir);
+  uint32_t len;
+  char *buf = read_file(path, &len);
+  if (!buf)
+  {
+    return;
+  }
+
+  uint32_t dictionary_len, checksum;
+  if (len >= 8)
+  {
+    memcpy(&dictionary_len, buf, 4);
+    memcpy(&checksum, buf + 4, 4);
+    if (dictionary_len == len - 8 && checksum32(buf + 8, dictionary_len) == checksum)
+    {
+      history->dictionary = malloc(dictionary_len ? dictionary_len : 1);
+      if (!history->dictionary)
+      {
+        perror("malloc");
+        exit(1);
+      }
+      memcpy(history->dictionary, buf + 8, dictionary_len);
+      history->dictionary_len = dictionary_len;
+    }
+    else
+    {
+      fprintf(stderr, "%s: corrupt dictionary\n", path);
+    }
+  }
+  free(buf);
+}
+
+// Train the channel's dictionary on the segment about to be sealed and
+// save it. It never changes afterwards, since every sealed block depends
+// on it.
+static void train_channel_dictionary(ChannelHistory *history, const char *samples, uint32_t len)
+{
+  char dictionary[DICTIONARY_SIZE];
+  uint32_t dictionary_len = train_dictionary(samples, len, dictionary, sizeof(dictionary));
+  uint32_t checksum = checksum32(dictionary, dictionary_len);
+
+  char path[600], tmp_path[610];
+  snprintf(path, sizeof(path), "%s/" DICTIONARY_FILE, history->dir);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE *file = fopen(tmp_path, "wb");
+  int ok = file && fwrite(&dictionary_len, 4, 1, file) == 1 && fwrite(&checksum, 4, 1, file) == 1 &&
+           fwrite(dictionary, 1, dictionary_len, file) == dictionary_len;
+  if (file)
+  {
+    ok = fclose(file) == 0 && ok;
+  }
+  if (!ok || rename(tmp_path, path) != 0)
+  {
+    // Without a saved dictionary, compress this channel without one
+    perror(path);
+    unlink(tmp_path);
+    dictionary_len = 0;
+  }
+
+  history->dictionary = malloc(dictionary_len ? dictionary_len : 1);
+  if (!history->dictionary)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(history->dictionary, dictionary, dictionary_len);
+  history->dictionary_len = dictionary_len;
+}
+
+static int open_active_segment(ChannelHistory *history)
+{
+  char path[600];
+  open_segment_path(history, history->active_first_page, path, sizeof(path));
+  history->active = fopen(path, "ab");
+  if (!history->active)
+  {
+    perror(path);
+    return 0;
+  }
+  return 1;
+}
+
+// Compress the full open segment that starts at first_page, whose page
+// offsets are in open_index, page by page into its sealed form and write
+// its sparse index. The sealed files are complete before the open segment
+// is removed, so a crash in between leaves a duplicate that history_open
+// discards. Returns 0 when the open segment had to be kept instead.
+static int seal_segment(ChannelHistory *history, uint32_t first_page, IndexEntry *open_index)
+{
+  long start_ns = stats_now_ns();
+  char open_path[600], tmp_path[610], path[600];
+  open_segment_path(history, first_page, open_path, sizeof(open_path));
+
+  uint32_t raw_len;
+  char *raw = read_file(open_path, &raw_len);
+  if (!raw)
+  {
+    perror(open_path);
+  }
+  if (raw && !history->dictionary)
+  {
+    train_channel_dictionary(history, raw, raw_len);
+  }
+
+  Segment segment = {first_page, first_page + PAGES_PER_SEGMENT - 1, 0};
+  IndexEntry index[PAGES_PER_SEGMENT];
+  char *block = malloc(BLOCK_HEADER + MAX_PAGE_BYTES);
+  if (!block)
+  {
+    perror("malloc");
+    exit(1);
+  }
+
+  segment_path(history, &segment, "seg", path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE *out = raw ? fopen(tmp_path, "wb") : NULL;
+  int ok = out != NULL;
+  for (int i = 0; i < PAGES_PER_SEGMENT && ok; i++)
+  {
+    uint32_t start = open_index[i].offset;
+    uint32_t end = i + 1 < PAGES_PER_SEGMENT ? open_index[i + 1].offset : raw_len;
+    uint32_t page_len = end - start;
+    uint32_t checksum = checksum32(raw + start, page_len);
+
+    uint32_t stored = compress_block(raw + start, page_len, block + BLOCK_HEADER, MAX_PAGE_BYTES,
+                                     history->dictionary, history->dictionary_len);
+    if (stored == 0)
+    {
+      memcpy(block + BLOCK_HEADER, raw + start, page_len);
+      stored = page_len;
+    }
+    memcpy(block, &page_len, 4);
+    memcpy(block + 4, &checksum, 4);
+
+    index[i].offset = segment.bytes;
+    index[i].newest = open_index[i].newest;
+    ok = fwrite(block, 1, BLOCK_HEADER + stored, out) == BLOCK_HEADER + stored;
+    segment.bytes += BLOCK_HEADER + stored;
+  }
+  if (out)
+  {
+    ok = fclose(out) == 0 && ok;
+  }
+  free(block);
+  free(raw);
+
+  if (ok)
+  {
+    segment_path(history, &segment, "idx", path, sizeof(path));
+    FILE *index_file = fopen(path, "wb");
+    ok = index_file && fwrite(index, sizeof(IndexEntry), PAGES_PER_SEGMENT, index_file) ==
+                           PAGES_PER_SEGMENT;
+    if (index_file)
+    {
+      ok = fclose(index_file) == 0 && ok;
+    }
+    segment_path(history, &segment, "seg", path, sizeof(path));
+    ok = ok && rename(tmp_path, path) == 0;
+  }
+  if (!ok)
+  {
+    // Keep the open segment rather than lose it; history_open tries to
+    // seal it again at the next start
+    perror(path);
+    unlink(tmp_path);
+    return 0;
+  }
+  __atomic_add_fetch(&archived_raw_bytes, raw_len, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&archived_bytes, segment.bytes, __ATOMIC_RELAXED);
+
+  // Publish the sealed segment in place of the pending one. A reader that
+  // opened the open segment before this still has it after the unlink.
+  pthread_mutex_lock(&history->lock);
+  insert_segment(history, &segment);
+  for (int i = 0; i < history->pending_count; i++)
+  {
+    if (history->pending[i].first_page == first_page)
+    {
+      memmove(&history->pending[i], &history->pending[i + 1],
+              sizeof(PendingSeal) * (history->pending_count - i - 1));
+      history->pending_count--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&history->lock);
+  unlink(open_path);
+  metrics_observe(METRIC_SEAL_NS, stats_now_ns() - start_ns);
+  return 1;
+}
+
+static void start_next_segment(ChannelHistory *history)
+{
+  history->active_first_page += PAGES_PER_SEGMENT;
+  history->active_count = 0;
+  history->active_bytes = 0;
+  history->unflushed = 0;
+  open_active_segment(history);
+}
+
+// Seal the full open segment right away and start the next one
+static void seal_active_segment(ChannelHistory *history)
+{
+  fclose(history->active);
+  history->active = NULL;
+  seal_segment(history, history->active_first_page, history->active_index);
+  start_next_segment(history);
+}
+
+// Find the sealed segments on disk. A compaction interrupted between
+// installing its output and deleting its inputs leaves segments that
+// overlap; the wider one always holds every live page, so the segments
+// it contains are deleted. Returns the first pages of open segments in
+// ascending order.
+static uint32_t *scan_segments(ChannelHistory *history, int *open_count)
+{
+  uint32_t *open_pages = NULL;
+  *open_count = 0;
+
+  DIR *dir = opendir(history->dir);
+  if (!dir)
+  {
+    return NULL;
+  }
+
+  struct dirent *entry;
+  char path[1024];
+  while ((entry = readdir(dir)))
+  {
+    unsigned int first, last;
+    char ext[8];
+    int len = strlen(entry->d_name);
+
+    if (len > 4 && strcmp(entry->d_name + len - 4, ".tmp") == 0)
+    {
+      snprintf(path, sizeof(path), "%s/%s", history->dir, entry->d_name);
+      unlink(path);
+    }
+    else if (sscanf(entry->d_name, "%10u-%10u.%7s", &first, &last, ext) == 3 &&
+             strcmp(ext, "seg") == 0)
+    {
+      snprintf(path, sizeof(path), "%s/%s", history->dir, entry->d_name);
+      struct stat st;
+      if (stat(path, &st) == 0)
+      {
+        Segment segment = {first, last, st.st_size};
+        insert_segment(history, &segment);
+      }
+    }
+    else if (sscanf(entry->d_name, "%10u.%7s", &first, ext) == 2 && strcmp(ext, "open") == 0)
+    {
+      open_pages = realloc(open_pages, sizeof(uint32_t) * (*open_count + 1));
+      if (!open_pages)
+      {
+        perror("realloc");
+        exit(1);
+      }
+      int i = (*open_count)++;
+      while (i > 0 && open_pages[i - 1] > first)
+      {
+        open_pages[i] = open_pages[i - 1];
+        i--;
+      }
+      open_pages[i] = first;
+    }
+  }
+  closedir(dir);
+
+  if (history->segment_count > 1)
+  {
+    qsort(history->segments, history->segment_count, sizeof(Segment), compare_segments);
+  }
+
+  int kept = 0;
+  for (int i = 0; i < history->segment_count; i++)
+  {
+    Segment *segment = &history->segments[i];
+    if (kept > 0 && segment->first_page <= history->segments[kept - 1].last_page)
+    {
+      delete_segment_files(history, segment);
+      continue;
+    }
+    history->segments[kept++] = *segment;
+  }
+  history->segment_count = kept;
+  return open_pages;
+}
+
+// Read the open segment at active_first_page back into the active state
+static void load_open_segment(ChannelHistory *history)
+{
+  char path[600];
+  open_segment_path(history, history->active_first_page, path, sizeof(path));
+  uint32_t file_len;
+  char *buf = read_file(path, &file_len);
+  history->active_count = 0;
+  history->active_bytes = 0;
+  if (!buf)
+  {
+    return;
+  }
+
+  history->active_bytes = scan_records(buf, file_len, &history->active_count,
+                                       history->active_index);
+  free(buf);
+
+  // Drop a record torn by a crash mid-write
+  if (history->active_bytes < file_len && truncate(path, history->active_bytes) != 0)
+  {
+    perror(path);
+  }
+}
+
+static Segment *find_segment(ChannelHistory *history, uint32_t page);
+
+// Attach on-disk history to a freshly initialized channel and continue
+// its sequence numbers from what is already stored. Only the open
+// segment is scanned; sealed segments are never read at startup.
+void history_open(Channel *channel)
+{
+  if (!history_root)
+  {
+    return;
+  }
+
+  ChannelHistory *history = calloc(1, sizeof(ChannelHistory));
+  if (!history)
+  {
+    perror("calloc");
+    exit(1);
+  }
+  history->id = next_history_id++;
+  history->first_seq = 1;
+  pthread_mutex_init(&history->lock, NULL);
+
+  // Hex-encode the name so any channel name is a safe directory name
+  int len = snprintf(history->dir, sizeof(history->dir), "%s/", history_root);
+  for (const unsigned char *p = (const unsigned char *)channel->name; *p; p++)
+  {
+    len += snprintf(history->dir + len, sizeof(history->dir) - len, "%02x", *p);
+  }
+  if (mkdir(history->dir, 0755) != 0 && errno != EEXIST)
+  {
+    perror(history->dir);
+    pthread_mutex_destroy(&history->lock);
+    free(history);
+    return;
+  }
+
+  load_retention(history);
+
+  load_dictionary(history);
+
+  int open_count;
+  uint32_t *open_pages = scan_segments(history, &open_count);
+  if (history->segment_count > 0)
+  {
+    history->active_first_page = history->segments[history->segment_count - 1].last_page + 1;
+  }
+
+  // The newest open segment is the one to append to. An older one that a
+  // sealed segment covers was sealed just before a crash and is a
+  // duplicate; any other failed to seal and is sealed now.
+  char path[600];
+  for (int i = 0; i < open_count; i++)
+  {
+    history->active_first_page = open_pages[i];
+    open_segment_path(history, history->active_first_page, path, sizeof(path));
+    if (find_segment(history, open_pages[i]))
+    {
+      unlink(path);
+      continue;
+    }
+
+    load_open_segment(history);
+    if (i == open_count - 1)
+    {
+      break;
+    }
+    if (history->active_count == SEGMENT_MESSAGES && open_active_segment(history))
+    {
+      seal_active_segment(history);
+      fclose(history->active);
+      history->active = NULL;
+    }
+  }
+  free(open_pages);
+  if (history->segment_count > 0 &&
+      history->active_first_page <= history->segments[history->segment_count - 1].last_page)
+  {
+    history->active_first_page = history->segments[history->segment_count - 1].last_page + 1;
+    load_open_segment(history);
+  }
+
+  if (!open_active_segment(history))
+  {
+    free(history->segments);
+    pthread_mutex_destroy(&history->lock);
+    free(history);
+    return;
+  }
+
+  history->last_seq = history->active_first_page * PAGE_MESSAGES + history->active_count;
+  channel->history = history;
+  channel->last_seq = history->last_seq;
+
+  if (history->active_count == SEGMENT_MESSAGES)
+  {
+    seal_active_segment(history);
+  }
+
+  pthread_mutex_lock(&registry_lock);
+  history->next = histories;
+  histories = history;
+  pthread_mutex_unlock(&registry_lock);
+}
+
+static void destroy_history(ChannelHistory *history)
+{
+  pthread_mutex_destroy(&history->lock);
+  free(history->dictionary);
+  free(history->segments);
+  free(history->pending);
+  free(history);
+}
+
+void history_close(Channel *channel)
+{
+  ChannelHistory *history = channel->history;
+  if (!history)
+  {
+    return;
+  }
+  channel->history = NULL;
+
+  if (history->active)
+  {
+    fclose(history->active);
+    history->active = NULL;
+  }
+  drop_history_pages(history->id);
+
+  pthread_mutex_lock(&history->lock);
+  history->closed = 1;
+  pthread_mutex_unlock(&history->lock);
+
+  // Unregister; if the compactor is working on it, it frees it when done
+  pthread_mutex_lock(&registry_lock);
+  ChannelHistory **link = &histories;
+  while (*link && *link != history)
+  {
+    link = &(*link)->next;
+  }
+  if (*link)
+  {
+    *link = history->next;
+  }
+  int busy = history->refs > 0;
+  pthread_mutex_unlock(&registry_lock);
+
+  if (!busy)
+  {
+    destroy_history(history);
+  }
+}
+
+static void wake_compactor()
+{
+  pthread_mutex_lock(&registry_lock);
+  compactor_kick = 1;
+  pthread_cond_signal(&compactor_wake);
+  pthread_mutex_unlock(&registry_lock);
+}
+
+// Close the channel's history and delete it from disk. The directory is
+// only renamed here; the compactor deletes its files in the background.
+void history_remove(Channel *channel)
+{
+  ChannelHistory *history = channel->history;
+  if (!history)
+  {
+    return;
+  }
+
+  char dir_path[sizeof(history->dir)];
+  char trash_path[sizeof(history->dir) + 64];
+  strcpy(dir_path, history->dir);
+  snprintf(trash_path, sizeof(trash_path), "%s/" TRASH_PREFIX "%ld-%d", history_root,
+           (long)time(NULL), history->id);
+  history_close(channel);
+
+  if (rename(dir_path, trash_path) != 0)
+  {
+    perror(dir_path);
+    return;
+  }
+  wake_compactor();
+}
+
+// Close the full open segment and queue it for the compactor to seal,
+// then start the next one. Sealing inline instead would stall ingest
+// while the segment is compressed and written.
+static void hand_off_active_segment(ChannelHistory *history)
+{
+  if (!compactor_running)
+  {
+    seal_active_segment(history);
+    return;
+  }
+
+  fclose(history->active);
+  history->active = NULL;
+
+  pthread_mutex_lock(&history->lock);
+  if (history->pending_count == history->pending_capacity)
+  {
+    history->pending_capacity = history->pending_capacity ? history->pending_capacity * 2 : 4;
+    history->pending = realloc(history->pending, sizeof(PendingSeal) * history->pending_capacity);
+    if (!history->pending)
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  PendingSeal *pending = &history->pending[history->pending_count++];
+  pending->first_page = history->active_first_page;
+  pending->bytes = history->active_bytes;
+  memcpy(pending->index, history->active_index, sizeof(pending->index));
+  pending->failed = 0;
+  pthread_mutex_unlock(&history->lock);
+
+  start_next_segment(history);
+
+  pthread_mutex_lock(&registry_lock);
+  seal_kick = 1;
+  pthread_cond_signal(&compactor_wake);
+  pthread_mutex_unlock(&registry_lock);
+}
+
+// Append the message that just became channel->last_seq. Writes are
+// buffered; history_flush pushes them to the file. Returns 0 if the
+// record could not be written, which leaves the history without that seq.
+int history_append(Channel *channel, time_t timestamp, const char *sender, const char *text,
+                   size_t text_len)
+{
+  ChannelHistory *history = channel->history;
+  if (!history)
+  {
+    return 1;
+  }
+  // The segment after a full one may have failed to open; try it again
+  if (!history->active && !open_active_segment(history))
+  {
+    return 0;
+  }
+
+  uint16_t name_len = strlen(sender);
+  uint16_t len = text_len;
+  int64_t ts = timestamp;
+
+  IndexEntry *entry = &history->active_index[history->active_count / PAGE_MESSAGES];
+  if (history->active_count % PAGE_MESSAGES == 0)
+  {
+    entry->offset = history->active_bytes;
+    entry->newest = 0;
+  }
+  if ((uint32_t)timestamp > entry->newest)
+  {
+    entry->newest = timestamp;
+  }
+
+  size_t written = fwrite(&name_len, 2, 1, history->active) + fwrite(&len, 2, 1, history->active) +
+                   fwrite(&ts, 8, 1, history->active) +
+                   fwrite(sender, 1, name_len, history->active) +
+                   fwrite(text, 1, len, history->active);
+  if (written != 3u + name_len + len)
+  {
+    return 0;
+  }
+  history->active_bytes += RECORD_HEADER + name_len + len;
+  history->active_count++;
+  history->unflushed = 1;
+  __atomic_store_n(&history->last_seq, channel->last_seq, __ATOMIC_RELAXED);
+
+  if (history->active_count == SEGMENT_MESSAGES)
+  {
+    hand_off_active_segment(history);
+  }
+  return 1;
+}
+
+void history_flush(Channel *channel)
+{
+  if (channel->history && channel->history->unflushed)
+  {
+    long start = stats_now_ns();
+    fflush(channel->history->active);
+    channel->history->unflushed = 0;
+    metrics_observe(METRIC_FLUSH_NS, stats_now_ns() - start);
+  }
+}
+
+// Find the sealed segment holding a page; caller holds history->lock
+static Segment *find_segment(ChannelHistory *history, uint32_t page)
+{
+  int low = 0, high = history->segment_count - 1;
+  while (low <= high)
+  {
+    int mid = (low + high) / 2;
+    Segment *segment = &history->segments[mid];
+    if (page < segment->first_page)
+    {
+      high = mid - 1;
+    }
+    else if (page > segment->last_page)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      return segment;
+    }
+  }
+  return NULL;
+}
+
+// Unpack a sealed page block and verify its checksum. Returns the page's
+// records, or NULL when the block is damaged.
+static char *decode_block(ChannelHistory *history, const char *block, uint32_t len,
+                          uint32_t *raw_len)
+{
+  uint32_t checksum;
+  if (len < BLOCK_HEADER)
+  {
+    return NULL;
+  }
+  memcpy(raw_len, block, 4);
+  memcpy(&checksum, block + 4, 4);
+  uint32_t stored = len - BLOCK_HEADER;
+  if (*raw_len > MAX_PAGE_BYTES || stored > *raw_len)
+  {
+    return NULL;
+  }
+
+  char *raw = malloc(*raw_len ? *raw_len : 1);
+  if (!raw)
+  {
+    perror("malloc");
+    exit(1);
+  }
+
+  int ok = 1;
+  if (stored == *raw_len)
+  {
+    memcpy(raw, block + BLOCK_HEADER, stored);
+  }
+  else
+  {
+    ok = decompress_block(block + BLOCK_HEADER, stored, raw, *raw_len, history->dictionary,
+                          history->dictionary_len);
+  }
+  if (!ok || checksum32(raw, *raw_len) != checksum)
+  {
+    free(raw);
+    return NULL;
+  }
+  return raw;
+}
+
+// Where a page waiting to be sealed lies in its closed open segment, with
+// that file opened; caller holds history->lock. Returns 0 if no pending
+// segment holds the page.
+static int find_pending_page(ChannelHistory *history, uint32_t page_number, int *fd,
+                             uint32_t *start, uint32_t *end)
+{
+  for (int i = 0; i < history->pending_count; i++)
+  {
+    PendingSeal *pending = &history->pending[i];
+    if (page_number >= pending->first_page &&
+        page_number < pending->first_page + PAGES_PER_SEGMENT)
+    {
+      uint32_t slot = page_number - pending->first_page;
+      char path[600];
+      open_segment_path(history, pending->first_page, path, sizeof(path));
+      *fd = open(path, O_RDONLY);
+      *start = pending->index[slot].offset;
+      *end = slot + 1 < PAGES_PER_SEGMENT ? pending->index[slot + 1].offset : pending->bytes;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Read one page from disk and decode it into a single allocation
+static HistoryPage *load_page(ChannelHistory *history, uint32_t page_number)
+{
+  uint32_t start, end;
+  int fd;
+  int sealed = 0; // The page is a compressed block rather than raw records
+
+  if (page_number >= history->active_first_page)
+  {
+    uint32_t slot = page_number - history->active_first_page;
+    if (slot * PAGE_MESSAGES >= history->active_count)
+    {
+      return NULL;
+    }
+    if (history->unflushed)
+    {
+      fflush(history->active);
+      history->unflushed = 0;
+    }
+    start = history->active_index[slot].offset;
+    end = (slot + 1) * PAGE_MESSAGES < history->active_count
+              ? history->active_index[slot + 1].offset
+              : history->active_bytes;
+
+    char path[600];
+    open_segment_path(history, history->active_first_page, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+  }
+  else
+  {
+    // A full segment waiting to be sealed is read from its closed open
+    // segment. A sealed one is looked up in its sparse index; both files
+    // are opened under the lock so the compactor cannot swap them in
+    // between.
+    char path[600], index_path[600];
+    int index_fd = -1;
+    Segment found = {0, 0, 0};
+    pthread_mutex_lock(&history->lock);
+    sealed = !find_pending_page(history, page_number, &fd, &start, &end);
+    Segment *segment = sealed ? find_segment(history, page_number) : NULL;
+    if (segment)
+    {
+      found = *segment;
+      segment_path(history, &found, "seg", path, sizeof(path));
+      segment_path(history, &found, "idx", index_path, sizeof(index_path));
+      fd = open(path, O_RDONLY);
+      index_fd = open(index_path, O_RDONLY);
+    }
+    pthread_mutex_unlock(&history->lock);
+    if (sealed && !segment)
+    {
+      return NULL;
+    }
+
+    if (sealed)
+    {
+      IndexEntry bounds[2];
+      int slot = page_number - found.first_page;
+      int entries = page_number < found.last_page ? 2 : 1;
+      ssize_t got = index_fd >= 0 ? pread(index_fd, bounds, sizeof(IndexEntry) * entries,
+                                          sizeof(IndexEntry) * slot)
+                                  : -1;
+      if (index_fd >= 0)
+      {
+        close(index_fd);
+      }
+      if (got != (ssize_t)(sizeof(IndexEntry) * entries))
+      {
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+        return NULL;
+      }
+      start = bounds[0].offset;
+      end = entries == 2 ? bounds[1].offset : found.bytes;
+    }
+  }
+
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  if (end <= start || end - start > BLOCK_HEADER + MAX_PAGE_BYTES)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  uint32_t raw_len = end - start;
+  char *raw = malloc(raw_len);
+  if (!raw)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  ssize_t got = pread(fd, raw, raw_len, start);
+  close(fd);
+  if (got != (ssize_t)raw_len)
+  {
+    free(raw);
+    return NULL;
+  }
+
+  if (sealed)
+  {
+    char *block = raw;
+    raw = decode_block(history, block, got, &raw_len);
+    free(block);
+    if (!raw)
+    {
+      return NULL;
+    }
+  }
+
+  // Page header, message array and text share one allocation; text is
+  // copied with a terminator per string
+  size_t bytes = sizeof(HistoryPage) + sizeof(HistoryMessage) * PAGE_MESSAGES + raw_len +
+                 2 * PAGE_MESSAGES;
+  HistoryPage *page = malloc(bytes);
+  if (!page)
+  {
+    perror("malloc");
+    exit(1);
+  }
+
+  memset(page, 0, sizeof(HistoryPage));
+  page->page = page_number;
+  page->bytes = bytes;
+  page->messages = (HistoryMessage *)(page + 1);
+  char *text = (char *)(page->messages + PAGE_MESSAGES);
+
+  uint32_t pos = 0;
+  while (page->count < PAGE_MESSAGES && pos + RECORD_HEADER <= raw_len)
+  {
+    uint16_t name_len, text_len;
+    int64_t ts;
+    memcpy(&name_len, raw + pos, 2);
+    memcpy(&text_len, raw + pos + 2, 2);
+    memcpy(&ts, raw + pos + 4, 8);
+    if (pos + RECORD_HEADER + name_len + text_len > raw_len)
+    {
+      break;
+    }
+
+    HistoryMessage *msg = &page->messages[page->count++];
+    msg->timestamp = ts;
+    msg->sender = text;
+    memcpy(text, raw + pos + RECORD_HEADER, name_len);
+    text[name_len] = '\0';
+    msg->sender_width = text_width_n(text, name_len);
+    text += name_len + 1;
+
+    msg->text = text;
+    memcpy(text, raw + pos + RECORD_HEADER + name_len, text_len);
+    text[text_len] = '\0';
+    msg->width = text_width_n(text, text_len);
+    text += text_len + 1;
+
+    pos += RECORD_HEADER + name_len + text_len;
+  }
+
+  free(raw);
+  return page;
+}
+
+// Oldest message still in history; earlier ones have expired
+uint32_t history_first_seq(Channel *channel)
+{
+  if (!channel->history)
+  {
+    return 1;
+  }
+  return __atomic_load_n(&channel->history->first_seq, __ATOMIC_RELAXED);
+}
+
+// Look up message seq (1-based) of a channel, faulting its page in from
+// disk when it is not cached. The returned message stays valid until the
+// next history call.
+int history_get(Channel *channel, uint32_t seq, HistoryMessage *out)
+{
+  ChannelHistory *history = channel->history;
+  if (!history || seq == 0 || seq < history_first_seq(channel) || seq > channel->last_seq)
+  {
+    return 0;
+  }
+
+  uint32_t page_number = (seq - 1) / PAGE_MESSAGES;
+  int slot = (seq - 1) % PAGE_MESSAGES;
+
+  unsigned int bucket = page_hash_index(history->id, page_number);
+  HistoryPage *page = page_hash[bucket];
+  while (page && (page->history_id != history->id || page->page != page_number))
+  {
+    page = page->hash_next;
+  }
+
+  // A short page cached from the open segment may have grown since
+  if (page && slot >= page->count)
+  {
+    drop_page(page);
+    page = NULL;
+  }
+
+  if (page)
+  {
+    cache_hits++;
+    lru_unlink(page);
+    lru_push_front(page);
+  }
+  else
+  {
+    cache_misses++;
+    page = load_page(history, page_number);
+    if (!page || slot >= page->count)
+    {
+      free(page);
+      return 0;
+    }
+
+    // Make room first so the page being returned is never the one evicted
+    cache_bytes += page->bytes;
+    enforce_budget();
+    page->history_id = history->id;
+    page->hash_next = page_hash[bucket];
+    page_hash[bucket] = page;
+    lru_push_front(page);
+  }
+
+  *out = page->messages[slot];
+  return 1;
+}
+
+// Replace the channel's retention policy and apply it right away
+void history_set_retention(Channel *channel, RetentionPolicy *policy)
+{
+  ChannelHistory *history = channel->history;
+  if (!history)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&history->lock);
+  history->policy = *policy;
+  save_retention(history);
+  pthread_mutex_unlock(&history->lock);
+  wake_compactor();
+}
+
+int history_retention(Channel *channel, RetentionPolicy *policy)
+{
+  ChannelHistory *history = channel->history;
+  if (!history)
+  {
+    return 0;
+  }
+
+  pthread_mutex_lock(&history->lock);
+  *policy = history->policy;
+  pthread_mutex_unlock(&history->lock);
+  return 1;
+}
+
+size_t history_cache_bytes()
+{
+  return cache_bytes;
+}
+
+long history_cache_hits()
+{
+  return cache_hits;
+}
+
+long history_cache_misses()
+{
+  return cache_misses;
+}
+
+// Size of all pages sealed so far, before and after compression
+long history_archived_raw_bytes()
+{
+  return __atomic_load_n(&archived_raw_bytes, __ATOMIC_RELAXED);
+}
+
+long history_archived_bytes()
+{
+  return __atomic_load_n(&archived_bytes, __ATOMIC_RELAXED);
+}
+
+long history_reclaimed_bytes()
+{
+  return __atomic_load_n(&reclaimed_bytes, __ATOMIC_RELAXED);
+}
+
+// Bytes read and written per second of compaction work
+long history_compaction_rate()
+{
+  pthread_mutex_lock(&registry_lock);
+  long ns = compaction_ns;
+  long bytes = compacted_bytes;
+  pthread_mutex_unlock(&registry_lock);
+  return ns > 0 ? (long)(bytes * 1e9 / ns) : 0;
+}
+
+// Compactor thread
+
+static long throttle_start = 0;
+static long throttle_bytes = 0;
+
+static int stopping()
+{
+  return __atomic_load_n(&compactor_stop, __ATOMIC_RELAXED);
+}
+
+// Account for bytes of compactor I/O, sleeping as needed so the average
+// stays under compact_rate. Returns 0 once the compactor is stopping.
+static int throttle(long bytes)
+{
+  if (compact_rate <= 0)
+  {
+    return !stopping();
+  }
+
+  long now = stats_now_ns();
+  if (throttle_start == 0 || now - throttle_start > 1000000000L)
+  {
+    // Idle for a while: start a new window rather than bursting
+    throttle_start = now;
+    throttle_bytes = 0;
+  }
+  throttle_bytes += bytes;
+
+  long due = throttle_start + (long)(throttle_bytes * 1e9 / compact_rate);
+  while (!stopping() && (now = stats_now_ns()) < due)
+  {
+    long wait = due - now < MAX_THROTTLE_SLEEP_NS ? due - now : MAX_THROTTLE_SLEEP_NS;
+    struct timespec ts = {0, wait};
+    nanosleep(&ts, NULL);
+  }
+  return !stopping();
+}
+
+// Copy pages [first, last] of a sealed segment to out, filling index with
+// entries rebased to out_offset. Returns bytes copied, or -1 on failure.
+static long copy_pages(ChannelHistory *history, Segment *segment, uint32_t first, uint32_t last,
+                       FILE *out, long out_offset, IndexEntry *index)
+{
+  char path[600];
+  segment_path(history, segment, "idx", path, sizeof(path));
+  uint32_t index_len;
+  IndexEntry *entries = (IndexEntry *)read_file(path, &index_len);
+  uint32_t pages = segment->last_page - segment->first_page + 1;
+  if (!entries || index_len != pages * sizeof(IndexEntry))
+  {
+    free(entries);
+    return -1;
+  }
+
+  uint32_t from = first - segment->first_page;
+  uint32_t to = last - segment->first_page;
+  uint32_t start = entries[from].offset;
+  uint32_t end = to + 1 < pages ? entries[to + 1].offset : segment->bytes;
+  for (uint32_t i = from; i <= to; i++)
+  {
+    index[i - from].offset = entries[i].offset - start + out_offset;
+    index[i - from].newest = entries[i].newest;
+  }
+  free(entries);
+
+  segment_path(history, segment, "seg", path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+
+  char buf[65536];
+  uint32_t pos = start;
+  while (pos < end)
+  {
+    size_t chunk = end - pos < sizeof(buf) ? end - pos : sizeof(buf);
+    ssize_t got = pread(fd, buf, chunk, pos);
+    if (got <= 0 || fwrite(buf, 1, got, out) != (size_t)got || !throttle(2 * got))
+    {
+      close(fd);
+      return -1;
+    }
+    pos += got;
+  }
+  close(fd);
+  return end - start;
+}
+
+// Rewrite segments [from, to) of a snapshot as one segment, dropping the
+// pages before keep_page. The new segment is built in temporary files and
+// swapped in under the lock, so readers see either the old segments or
+// the new one.
+static void rewrite_segments(ChannelHistory *history, Segment *snapshot, int from, int to,
+                             uint32_t keep_page)
+{
+  char seg_tmp[600], idx_tmp[600], path[600];
+  snprintf(seg_tmp, sizeof(seg_tmp), "%s/compact.seg.tmp", history->dir);
+  snprintf(idx_tmp, sizeof(idx_tmp), "%s/compact.idx.tmp", history->dir);
+
+  Segment merged = {snapshot[from].first_page > keep_page ? snapshot[from].first_page : keep_page,
+                    snapshot[to - 1].last_page, 0};
+  uint32_t pages = merged.last_page - merged.first_page + 1;
+  IndexEntry *index = malloc(sizeof(IndexEntry) * pages);
+  if (!index)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  FILE *out = fopen(seg_tmp, "wb");
+  if (!out)
+  {
+    free(index);
+    return;
+  }
+
+  long start_ns = stats_now_ns();
+  long written = 0;
+  long old_bytes = 0;
+  int ok = 1;
+  for (int i = from; i < to && ok; i++)
+  {
+    Segment *segment = &snapshot[i];
+    uint32_t first = segment->first_page > merged.first_page ? segment->first_page
+                                                             : merged.first_page;
+    long copied = copy_pages(history, segment, first, segment->last_page, out, written,
+                             index + (first - merged.first_page));
+    ok = copied >= 0;
+    written += copied;
+    old_bytes += segment->bytes;
+  }
+  ok = fclose(out) == 0 && ok;
+  merged.bytes = written;
+
+  if (ok)
+  {
+    FILE *index_file = fopen(idx_tmp, "wb");
+    ok = index_file && fwrite(index, sizeof(IndexEntry), pages, index_file) == pages;
+    if (index_file)
+    {
+      ok = fclose(index_file) == 0 && ok;
+    }
+  }
+  free(index);
+
+  // Swap the new segment in unless the channel went away meanwhile
+  pthread_mutex_lock(&history->lock);
+  if (ok && !history->closed)
+  {
+    segment_path(history, &merged, "idx", path, sizeof(path));
+    ok = rename(idx_tmp, path) == 0;
+    segment_path(history, &merged, "seg", path, sizeof(path));
+    ok = ok && rename(seg_tmp, path) == 0;
+  }
+  else
+  {
+    ok = 0;
+  }
+
+  if (ok)
+  {
+    int kept = 0;
+    for (int i = 0; i < history->segment_count; i++)
+    {
+      Segment *segment = &history->segments[i];
+      if (segment->first_page >= snapshot[from].first_page &&
+          segment->last_page <= snapshot[to - 1].last_page)
+      {
+        continue;
+      }
+      history->segments[kept++] = *segment;
+    }
+    history->segment_count = kept;
+    insert_segment(history, &merged);
+    for (int i = from; i < to; i++)
+    {
+      delete_segment_files(history, &snapshot[i]);
+    }
+  }
+  pthread_mutex_unlock(&history->lock);
+
+  if (!ok)
+  {
+    unlink(seg_tmp);
+    unlink(idx_tmp);
+    return;
+  }
+
+  __atomic_add_fetch(&reclaimed_bytes, old_bytes - written, __ATOMIC_RELAXED);
+  long took = stats_now_ns() - start_ns;
+  pthread_mutex_lock(&registry_lock);
+  compacted_bytes += old_bytes + written;
+  compaction_ns += took;
+  pthread_mutex_unlock(&registry_lock);
+}
+
+// First page to keep under a retention policy. Whole pages expire at a
+// time, and only sealed ones.
+static uint32_t retention_cut(ChannelHistory *history, Segment *snapshot, int count,
+                              RetentionPolicy *policy, uint32_t last_seq)
+{
+  uint32_t cut = 0;
+
+  if (policy->max_messages > 0 && last_seq > policy->max_messages)
+  {
+    cut = (last_seq - policy->max_messages) / PAGE_MESSAGES;
+  }
+
+  if (policy->max_age > 0 || policy->max_bytes > 0)
+  {
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+      total += snapshot[i].bytes;
+    }
+
+    time_t oldest_allowed = time(NULL) - policy->max_age;
+    int done = 0;
+    for (int i = 0; i < count && !done; i++)
+    {
+      char path[600];
+      segment_path(history, &snapshot[i], "idx", path, sizeof(path));
+      uint32_t len;
+      IndexEntry *entries = (IndexEntry *)read_file(path, &len);
+      uint32_t pages = snapshot[i].last_page - snapshot[i].first_page + 1;
+      if (!entries || len != pages * sizeof(IndexEntry) || !throttle(len))
+      {
+        free(entries);
+        break;
+      }
+
+      for (uint32_t p = 0; p < pages; p++)
+      {
+        uint32_t end = p + 1 < pages ? entries[p + 1].offset : snapshot[i].bytes;
+        int too_old = policy->max_age > 0 && (time_t)entries[p].newest < oldest_allowed;
+        int too_big = policy->max_bytes > 0 && total > policy->max_bytes;
+        if (!too_old && !too_big)
+        {
+          done = 1;
+          break;
+        }
+        total -= end - entries[p].offset;
+        if (snapshot[i].first_page + p + 1 > cut)
+        {
+          cut = snapshot[i].first_page + p + 1;
+        }
+      }
+      free(entries);
+    }
+  }
+
+  if (count == 0)
+  {
+    return 0;
+  }
+  if (cut > snapshot[count - 1].last_page + 1)
+  {
+    cut = snapshot[count - 1].last_page + 1;
+  }
+  return cut;
+}
+
+static void compact_history(ChannelHistory *history)
+{
+  pthread_mutex_lock(&history->lock);
+  if (history->closed)
+  {
+    pthread_mutex_unlock(&history->lock);
+    return;
+  }
+  int count = history->segment_count;
+  Segment *snapshot = malloc(sizeof(Segment) * (count ? count : 1));
+  if (!snapshot)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(snapshot, history->segments, sizeof(Segment) * count);
+  RetentionPolicy policy = history->policy;
+  uint32_t first_seq = history->first_seq;
+  pthread_mutex_unlock(&history->lock);
+
+  uint32_t last_seq = __atomic_load_n(&history->last_seq, __ATOMIC_RELAXED);
+  uint32_t cut = retention_cut(history, snapshot, count, &policy, last_seq);
+
+  // Publish the new watermark before any file goes away
+  if (cut * PAGE_MESSAGES + 1 > first_seq)
+  {
+    first_seq = cut * PAGE_MESSAGES + 1;
+    pthread_mutex_lock(&history->lock);
+    if (!history->closed)
+    {
+      __atomic_store_n(&history->first_seq, first_seq, __ATOMIC_RELAXED);
+      save_retention(history);
+    }
+    pthread_mutex_unlock(&history->lock);
+  }
+  uint32_t keep_page = (first_seq - 1) / PAGE_MESSAGES;
+
+  // Segments that have wholly expired are deleted outright
+  int first_live = 0;
+  while (first_live < count && snapshot[first_live].last_page < keep_page)
+  {
+    first_live++;
+  }
+  if (first_live > 0)
+  {
+    long freed = 0;
+    pthread_mutex_lock(&history->lock);
+    if (!history->closed)
+    {
+      int kept = 0;
+      for (int i = 0; i < history->segment_count; i++)
+      {
+        if (history->segments[i].last_page < keep_page)
+        {
+          freed += history->segments[i].bytes;
+          delete_segment_files(history, &history->segments[i]);
+          continue;
+        }
+        history->segments[kept++] = history->segments[i];
+      }
+      history->segment_count = kept;
+    }
+    pthread_mutex_unlock(&history->lock);
+    __atomic_add_fetch(&reclaimed_bytes, freed, __ATOMIC_RELAXED);
+  }
+
+  // Rewrite segments that are at least a quarter expired, and merge runs
+  // of small adjacent segments up to MERGE_TARGET_BYTES
+  int i = first_live;
+  while (i < count && !stopping())
+  {
+    Segment *segment = &snapshot[i];
+    uint32_t pages = segment->last_page - segment->first_page + 1;
+    uint32_t expired = segment->first_page < keep_page ? keep_page - segment->first_page : 0;
+    int mostly_expired = expired * 4 >= pages && expired > 0;
+    if (!mostly_expired && segment->bytes >= SMALL_SEGMENT_BYTES)
+    {
+      i++;
+      continue;
+    }
+
+    int run_end = i + 1;
+    uint64_t run_bytes = (uint64_t)segment->bytes * (pages - expired) / pages;
+    while (run_end < count && snapshot[run_end].bytes < SMALL_SEGMENT_BYTES &&
+           snapshot[run_end].first_page == snapshot[run_end - 1].last_page + 1 &&
+           run_bytes + snapshot[run_end].bytes <= MERGE_TARGET_BYTES)
+    {
+      run_bytes += snapshot[run_end].bytes;
+      run_end++;
+    }
+
+    // A lone small segment has nothing to merge with
+    if (run_end - i > 1 || mostly_expired)
+    {
+      long start = stats_now_ns();
+      rewrite_segments(history, snapshot, i, run_end, keep_page);
+      metrics_observe(METRIC_COMPACT_NS, stats_now_ns() - start);
+    }
+    i = run_end;
+  }
+
+  free(snapshot);
+}
+
+// Delete a directory of plain files, returning the bytes freed
+static long purge_directory(const char *path)
+{
+  long bytes = 0;
+  DIR *dir = opendir(path);
+  if (!dir)
+  {
+    return 0;
+  }
+
+  struct dirent *entry;
+  char file[1024];
+  while ((entry = readdir(dir)))
+  {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+    {
+      continue;
+    }
+    snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+    struct stat st;
+    if (stat(file, &st) == 0)
+    {
+      bytes += st.st_size;
+    }
+    unlink(file);
+    if (!throttle(4096))
+    {
+      break;
+    }
+  }
+  closedir(dir);
+  rmdir(path);
+  return bytes;
+}
+
+// Delete the history of deleted channels
+static void purge_trash()
+{
+  DIR *dir = opendir(history_root);
+  if (!dir)
+  {
+    return;
+  }
+
+  struct dirent *entry;
+  char path[1024];
+  while ((entry = readdir(dir)) && !stopping())
+  {
+    if (strncmp(entry->d_name, TRASH_PREFIX, strlen(TRASH_PREFIX)) == 0)
+    {
+      snprintf(path, sizeof(path), "%s/%s", history_root, entry->d_name);
+      __atomic_add_fetch(&reclaimed_bytes, purge_directory(path), __ATOMIC_RELAXED);
+    }
+  }
+  closedir(dir);
+}
+
+// Seal the segments ingest handed over, oldest first. A segment that
+// fails to seal stays readable where it is and is retried at the next
+// start.
+static void seal_pending(ChannelHistory *history)
+{
+  while (1)
+  {
+    PendingSeal next;
+    int found = 0;
+    pthread_mutex_lock(&history->lock);
+    for (int i = 0; i < history->pending_count && !history->closed && !found; i++)
+    {
+      if (!history->pending[i].failed)
+      {
+        next = history->pending[i];
+        found = 1;
+      }
+    }
+    pthread_mutex_unlock(&history->lock);
+    if (!found)
+    {
+      return;
+    }
+    if (seal_segment(history, next.first_page, next.index))
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&history->lock);
+    for (int i = 0; i < history->pending_count; i++)
+    {
+      if (history->pending[i].first_page == next.first_page)
+      {
+        history->pending[i].failed = 1;
+      }
+    }
+    pthread_mutex_unlock(&history->lock);
+  }
+}
+
+static void *compactor_main(void *arg)
+{
+  (void)arg;
+  int compact_due = 1;
+
+  // Background work yields the CPU to ingest and drawing when they contend
+  setpriority(PRIO_PROCESS, gettid(), 10);
+
+  struct timespec deadline = {0, 0};
+
+  while (1)
+  {
+    // Segments waiting to be sealed are sealed even when stopping, so a
+    // clean exit leaves none for the next start to seal
+    int stop = stopping();
+
+    // Walk the open histories in id order, holding a reference so the
+    // main thread cannot free the one being worked on
+    int cursor = 0;
+    while (1)
+    {
+      pthread_mutex_lock(&registry_lock);
+      ChannelHistory *next = NULL;
+      for (ChannelHistory *h = histories; h; h = h->next)
+      {
+        if (h->id > cursor && (!next || h->id < next->id))
+        {
+          next = h;
+        }
+      }
+      if (next)
+      {
+        next->refs++;
+      }
+      pthread_mutex_unlock(&registry_lock);
+      if (!next)
+      {
+        break;
+      }
+
+      cursor = next->id;
+      seal_pending(next);
+      if (compact_due && !stop)
+      {
+        compact_history(next);
+      }
+
+      pthread_mutex_lock(&registry_lock);
+      next->refs--;
+      int orphaned = next->refs == 0 && next->closed;
+      pthread_mutex_unlock(&registry_lock);
+      if (orphaned)
+      {
+        destroy_history(next);
+      }
+    }
+    if (stop)
+    {
+      break;
+    }
+
+    if (compact_due)
+    {
+      purge_trash();
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += COMPACT_INTERVAL;
+    }
+
+    // Sleep until the next pass, or until woken for new work or to stop.
+    // A segment to seal wakes the thread without starting a compaction pass.
+    int timed_out = 0;
+    pthread_mutex_lock(&registry_lock);
+    while (!compactor_stop && !compactor_kick && !seal_kick && !timed_out)
+    {
+      timed_out = pthread_cond_timedwait(&compactor_wake, &registry_lock, &deadline) == ETIMEDOUT;
+    }
+    compact_due = compactor_kick || timed_out;
+    compactor_kick = 0;
+    seal_kick = 0;
+    pthread_mutex_unlock(&registry_lock);
+  }
+  return NULL;
+}
+
+// Start the background compactor, limiting its I/O to rate bytes per
+// second (0 for unlimited)
+int history_start_compactor(long rate)
+{
+  if (!history_root || compactor_running)
+  {
+    return 0;
+  }
+
+  compact_rate = rate;
+  compactor_stop = 0;
+  compactor_kick = 0;
+  seal_kick = 0;
+  if (pthread_create(&compactor_thread, NULL, compactor_main, NULL) != 0)
+  {
+    perror("pthread_create");
+    return 0;
+  }
+  compactor_running = 1;
+  return 1;
+}
+
+void history_stop_compactor()
+{
+  if (!compactor_running)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&registry_lock);
+  __atomic_store_n(&compactor_stop, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&compactor_wake);
+  pthread_mutex_unlock(&registry_lock);
+  pthread_join(compactor_thread, NULL);
+  compactor_running = 0;
+}
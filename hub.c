@@ -0,0 +1,217 @@
+#include "my_dispute.h"
+#include <signal.h>
+
+// Hub for my_dispute terminals sharing channels on one host.
+//
+// Start one hub, then any number of `my_dispute --shared NAME`. Public
+// channel messages go from each terminal to the hub over its ring in
+// shared memory; the hub orders them, keeps the newest of each channel in
+// the shared history segment and tells every terminal to read them from
+// there. See shm.c for the layout and the wakeup protocol.
+//
+// With --listen the hub also serves terminals elsewhere over a socket
+// (`my_dispute --connect ADDRESS`), each with a bounded outbound queue;
+// see net.c.
+//
+// With --shard (once per shard) the hub is a router: it keeps no channel
+// and no history of its own but forwards each message to the shard hub its
+// channel name hashes to, and relays what the shards publish to its remote
+// terminals. It has no shared-memory segment, so same-host terminals also
+// use --connect. Shards are ordinary hubs started with --listen.
+//
+// With --metrics the hub also answers Prometheus scrapes; see metrics.c.
+
+AppState app_state;
+
+static volatile int running = 1;
+
+static void stop(int sig)
+{
+  (void)sig;
+  running = 0;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [--name NAME] [--listen ADDRESS [--high-water BYTES]] [--shard ADDRESS]...\n"
+          "          [--secret FILE] [--move-secret FILE] [--metrics ADDRESS]\n",
+          prog);
+  fprintf(stderr, "  --name NAME      hub name terminals pass to --shared (default \"default\")\n");
+  fprintf(stderr, "  --listen ADDRESS\n");
+  fprintf(stderr, "                   also serve remote terminals on [HOST:]PORT or a Unix\n");
+  fprintf(stderr, "                   socket PATH; they pass the same ADDRESS to --connect.\n");
+  fprintf(stderr, "                   Without HOST only this host can connect; HOST * is\n");
+  fprintf(stderr, "                   every interface, which needs --secret\n");
+  fprintf(stderr, "  --high-water BYTES\n");
+  fprintf(stderr, "                   bytes queued per remote terminal before it resyncs\n");
+  fprintf(stderr, "                   from the history (default %d)\n", NET_DEFAULT_HIGH_WATER);
+  fprintf(stderr, "  --shard ADDRESS  route channels to the hub listening on ADDRESS; give\n");
+  fprintf(stderr, "                   one per shard, up to %d, in the same order each run,\n",
+          NET_MAX_SHARDS);
+  fprintf(stderr, "                   and --listen for the terminals\n");
+  fprintf(stderr, "  --secret FILE    require the secret on the first line of FILE from\n");
+  fprintf(stderr, "                   terminals and routers, and send it to shards\n");
+  fprintf(stderr, "  --move-secret FILE\n");
+  fprintf(stderr, "                   on a router, take /move only from terminals that give\n");
+  fprintf(stderr, "                   the secret on the first line of FILE; without it no\n");
+  fprintf(stderr, "                   channel is moved\n");
+  fprintf(stderr, "  --metrics ADDRESS\n");
+  fprintf(stderr, "                   serve Prometheus metrics over HTTP on [HOST:]PORT or a\n");
+  fprintf(stderr, "                   Unix socket PATH\n");
+}
+
+// Relay messages until a signal stops the hub. A router has no
+// shared-memory clients.
+static void run(int shared)
+{
+  static struct pollfd
+      fds[2 + SHM_MAX_CLIENTS + 1 + NET_MAX_CONNECTIONS + NET_MAX_SHARDS + METRICS_MAX_FDS];
+  int routed = 0;
+
+  while (running)
+  {
+    // What the shards published last time round goes out first
+    long start = stats_now_ns();
+    int moved = routed + net_router_relay();
+    moved += shared ? shm_hub_relay() : 0;
+    moved += net_server_relay();
+    if (moved)
+    {
+      metrics_observe(METRIC_FANOUT_NS, stats_now_ns() - start);
+    }
+
+    // Sleep only when nothing is left to move; connections are checked
+    // either way
+    int idle = (!shared || shm_hub_sleep_begin()) && !moved;
+    int shm_count = shared ? shm_hub_fds(fds) : 0;
+    int net_count = shm_count + net_server_fds(fds + shm_count);
+    int router_count = net_count + net_router_fds(fds + net_count);
+    int count = router_count + metrics_fds(fds + router_count);
+    int ready = poll(fds, count, idle ? 1000 : 0);
+    if (shared)
+    {
+      shm_hub_sleep_end();
+    }
+    routed = 0;
+    if (ready > 0)
+    {
+      if (shared)
+      {
+        shm_hub_events(fds, shm_count);
+      }
+      net_server_events(fds + shm_count, net_count - shm_count);
+      routed = net_router_events(fds + net_count, router_count - net_count);
+      metrics_events(&app_state, fds + router_count, count - router_count);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = "default";
+  const char *listen_address = NULL;
+  long high_water = NET_DEFAULT_HIGH_WATER;
+  const char *shard_addresses[NET_MAX_SHARDS];
+  int shard_count = 0;
+  const char *metrics_address = NULL;
+  const char *secret_path = NULL;
+  const char *move_secret_path = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
+    {
+      name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+    {
+      listen_address = argv[++i];
+    }
+    else if (strcmp(argv[i], "--high-water") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+    {
+      high_water = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc && shard_count < NET_MAX_SHARDS)
+    {
+      shard_addresses[shard_count++] = argv[++i];
+    }
+    else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+    {
+      metrics_address = argv[++i];
+    }
+    else if (strcmp(argv[i], "--secret") == 0 && i + 1 < argc)
+    {
+      secret_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--move-secret") == 0 && i + 1 < argc)
+    {
+      move_secret_path = argv[++i];
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (shard_count && !listen_address)
+  {
+    fprintf(stderr, "A router serves terminals only over --listen\n");
+    return 1;
+  }
+
+  int opened = (!secret_path || net_load_secret(secret_path)) &&
+               (!move_secret_path || net_load_move_secret(move_secret_path)) &&
+               (shard_count || shm_hub_open(name)) &&
+               (!listen_address || net_server_open(listen_address, high_water)) &&
+               (!metrics_address || metrics_open(metrics_address));
+  for (int i = 0; opened && i < shard_count; i++)
+  {
+    opened = net_router_add_shard(shard_addresses[i]);
+  }
+  if (!opened)
+  {
+    metrics_close();
+    net_router_close();
+    net_server_close();
+    if (!shard_count)
+    {
+      shm_hub_close();
+    }
+    return 1;
+  }
+
+  // No SA_RESTART, so a signal also ends the hub's poll()
+  struct sigaction action = {0};
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  if (!shard_count)
+  {
+    printf("Hub '%s' running; start terminals with: my_dispute --shared %s\n", name, name);
+  }
+  if (listen_address)
+  {
+    printf("Serving remote terminals on %s: my_dispute --connect %s\n", listen_address,
+           listen_address);
+  }
+  if (shard_count)
+  {
+    printf("Routing channels across %d shards\n", shard_count);
+  }
+  if (metrics_address)
+  {
+    printf("Serving metrics on %s\n", metrics_address);
+  }
+  fflush(stdout);
+  run(!shard_count);
+  metrics_close();
+  net_router_close();
+  net_server_close();
+  if (!shard_count)
+  {
+    shm_hub_close();
+  }
+  return 0;
+}
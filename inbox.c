@@ -0,0 +1,597 @@
+#include "my_dispute.h"
+#include <crypt.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Inboxes for users who are offline.
+//
+// A direct message to a user who is not logged in, or a channel message
+// that mentions them, is queued in their inbox and handed over as one
+// batch the next time they log in (authenticate_user). Direct messages
+// sent during this run are already in the conversation store, so their
+// inbox records only matter if the terminal restarts before the user
+// comes back; mentions are delivered from the inbox either way, since
+// the channel may have scrolled them out by then.
+//
+// Inboxes live in <dir>/<hex username>, one append-only file per user, so
+// queueing is one write() and delivery is one read() however much is
+// waiting. Without a directory (replays, tools) they are kept in memory.
+// A file is tied to the recipient's saved account: its header holds the
+// password hash from the accounts file, and an inbox found on disk is
+// delivered only if that is still the hash of the name logging in;
+// otherwise it is thrown away unread. Users with no saved account get
+// nothing on disk, so their mentions are kept in memory for this run.
+//
+// File layout: "MDIB", a version byte, the account's hash as a varint
+// length and its bytes, then records, each a varint kind:
+//   RUN:     8 bytes of run id; the records after it were queued by that run
+//   DIRECT:  varint timestamp, sender name, text
+//   MENTION: varint timestamp, sender name, channel name, text
+// where a name or text is a varint length and its bytes. A record cut
+// short by a crash ends the inbox.
+
+#define INBOX_MAGIC "MDIB"
+#define INBOX_VERSION 2
+#define RECORD_RUN 0
+#define RECORD_DIRECT 1
+#define RECORD_MENTION 2
+#define SENDER_CACHE 256
+#define MAX_RECORD (1 + 5 + 2 * (5 + MAX_USERNAME_LEN) + 5 + MAX_MESSAGE_LEN)
+#define MAX_HEADER (4 + 1 + 5 + CRYPT_OUTPUT_SIZE)
+
+typedef struct
+{
+  char username[MAX_USERNAME_LEN];
+  int has_mail; // A file exists, or data holds records
+  int on_disk;  // The mail waiting is in the file
+  int marked;   // This run's RUN record is in the file
+  char *data;   // Records kept in memory
+  size_t len;
+  size_t capacity;
+} Inbox;
+
+// A record decoded for delivery; pointers into the loaded inbox
+typedef struct
+{
+  int kind;
+  int own_run; // Queued by this run
+  time_t timestamp;
+  const char *sender;
+  uint32_t sender_len;
+  const char *channel;
+  uint32_t channel_len;
+  const char *text;
+  uint32_t text_len;
+  int peer; // Conversation it goes to
+} QueuedRecord;
+
+static char *inbox_dir = NULL;
+static Inbox *inboxes = NULL;
+static int inbox_count = 0;
+static int inbox_capacity = 0;
+static int user_inbox[MAX_USERS]; // Inbox index + 1 per user index, 0 if not looked up
+static uint64_t run_id = 0;
+static long queued_records = 0;
+static long delivered_records = 0;
+
+static size_t put_varint(char *out, uint32_t value)
+{
+  size_t len = 0;
+  while (value >= 0x80)
+  {
+    out[len++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[len++] = value;
+  return len;
+}
+
+static size_t put_name(char *out, const char *name, size_t len)
+{
+  size_t used = put_varint(out, len);
+  memcpy(out + used, name, len);
+  return used + len;
+}
+
+// Bounds-checked reader over a loaded inbox
+typedef struct
+{
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  int failed;
+} Reader;
+
+static uint32_t read_varint(Reader *r)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    if (r->pos >= r->len)
+    {
+      r->failed = 1;
+      return 0;
+    }
+    unsigned char byte = r->data[r->pos++];
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      return value;
+    }
+  }
+  r->failed = 1;
+  return 0;
+}
+
+static const char *read_name(Reader *r, uint32_t *len, uint32_t max)
+{
+  *len = read_varint(r);
+  if (r->failed || *len > max || *len > r->len - r->pos)
+  {
+    r->failed = 1;
+    return NULL;
+  }
+  const char *name = (const char *)r->data + r->pos;
+  r->pos += *len;
+  return name;
+}
+
+static void inbox_path(const char *username, char *out, size_t size)
+{
+  int len = snprintf(out, size, "%s/", inbox_dir);
+  for (const char *p = username; *p && len + 3 < (int)size; p++)
+  {
+    len += snprintf(out + len, size - len, "%02x", (unsigned char)*p);
+  }
+}
+
+static Inbox *add_inbox(const char *username)
+{
+  if (inbox_count == inbox_capacity)
+  {
+    inbox_capacity = inbox_capacity ? inbox_capacity * 2 : 16;
+    inboxes = realloc(inboxes, sizeof(Inbox) * inbox_capacity);
+    if (!inboxes)
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  Inbox *inbox = &inboxes[inbox_count++];
+  memset(inbox, 0, sizeof(Inbox));
+  snprintf(inbox->username, sizeof(inbox->username), "%s", username);
+  return inbox;
+}
+
+// The inbox of a registered user, created empty if asked to. Returns
+// NULL when there is none.
+static Inbox *user_box(AppState *state, int user_index, int create)
+{
+  if (user_inbox[user_index] == 0)
+  {
+    for (int i = 0; i < inbox_count; i++)
+    {
+      if (strcmp(inboxes[i].username, state->users[user_index].username) == 0)
+      {
+        user_inbox[user_index] = i + 1;
+        break;
+      }
+    }
+  }
+  if (user_inbox[user_index] == 0 && create)
+  {
+    add_inbox(state->users[user_index].username);
+    user_inbox[user_index] = inbox_count;
+  }
+  return user_inbox[user_index] ? &inboxes[user_inbox[user_index] - 1] : NULL;
+}
+
+void inbox_free_all()
+{
+  for (int i = 0; i < inbox_count; i++)
+  {
+    free(inboxes[i].data);
+  }
+  free(inboxes);
+  inboxes = NULL;
+  inbox_count = 0;
+  inbox_capacity = 0;
+  memset(user_inbox, 0, sizeof(user_inbox));
+}
+
+// Keep inboxes under dir, noting which users have mail waiting there, or
+// in memory when dir is NULL. Returns 0 if dir can't be used.
+int inbox_init(const char *dir)
+{
+  inbox_free_all();
+  free(inbox_dir);
+  inbox_dir = NULL;
+  run_id = 0; // Mail already on disk counts as an earlier run's
+  if (!dir)
+  {
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+  {
+    perror(dir);
+    return 0;
+  }
+  DIR *listing = opendir(dir);
+  if (!listing)
+  {
+    perror(dir);
+    return 0;
+  }
+  inbox_dir = strdup(dir);
+
+  // File names are the hex-encoded username
+  struct dirent *entry;
+  while ((entry = readdir(listing)))
+  {
+    int len = strlen(entry->d_name);
+    if (len == 0 || len % 2 != 0 || len / 2 >= MAX_USERNAME_LEN)
+    {
+      continue;
+    }
+    char name[MAX_USERNAME_LEN];
+    int valid = 1;
+    for (int i = 0; i < len && valid; i += 2)
+    {
+      unsigned int byte;
+      valid = sscanf(entry->d_name + i, "%2x", &byte) == 1 && byte != 0;
+      name[i / 2] = byte;
+    }
+    name[len / 2] = '\0';
+    if (valid)
+    {
+      Inbox *inbox = add_inbox(name);
+      inbox->has_mail = 1;
+      inbox->on_disk = 1;
+    }
+  }
+  closedir(listing);
+  return 1;
+}
+
+// Append one encoded record to an inbox: to its file if the user has a
+// saved account, otherwise to memory
+static void queue_record(Inbox *inbox, const char *record, size_t len)
+{
+  queued_records++;
+  const char *credential = inbox_dir ? account_credential(inbox->username) : NULL;
+  if (!credential)
+  {
+    if (inbox->len + len > inbox->capacity)
+    {
+      inbox->capacity = inbox->capacity ? inbox->capacity * 2 : 1024;
+      if (inbox->capacity < inbox->len + len)
+      {
+        inbox->capacity = inbox->len + len;
+      }
+      inbox->data = realloc(inbox->data, inbox->capacity);
+      if (!inbox->data)
+      {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    memcpy(inbox->data + inbox->len, record, len);
+    inbox->len += len;
+    inbox->has_mail = 1;
+    return;
+  }
+
+  char path[512];
+  inbox_path(inbox->username, path, sizeof(path));
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    return;
+  }
+
+  // Header and run marker go out in the same write as the record
+  char buffer[MAX_HEADER + 1 + 8 + MAX_RECORD];
+  size_t used = 0;
+  if (lseek(fd, 0, SEEK_END) == 0)
+  {
+    memcpy(buffer, INBOX_MAGIC, 4);
+    buffer[4] = INBOX_VERSION;
+    used = 5 + put_name(buffer + 5, credential, strnlen(credential, CRYPT_OUTPUT_SIZE));
+    inbox->marked = 0;
+  }
+  if (!inbox->marked)
+  {
+    if (!run_id)
+    {
+      run_id = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid() << 16 ^ stats_now_ns();
+    }
+    buffer[used++] = RECORD_RUN;
+    memcpy(buffer + used, &run_id, sizeof(run_id));
+    used += sizeof(run_id);
+  }
+  memcpy(buffer + used, record, len);
+  used += len;
+
+  if (write(fd, buffer, used) == (ssize_t)used)
+  {
+    inbox->marked = 1;
+    inbox->has_mail = 1;
+    inbox->on_disk = 1;
+  }
+  close(fd);
+}
+
+// Queue a direct message for a user who is offline. Only needed on disk:
+// this run already holds it in the conversation.
+void inbox_queue_direct(AppState *state, int from, int to, const char *text, time_t timestamp)
+{
+  if (!inbox_dir || relayed_user(state, to) || !account_credential(state->users[to].username))
+  {
+    return;
+  }
+  char record[MAX_RECORD];
+  const char *sender = state->users[from].username;
+  size_t len = put_varint(record, RECORD_DIRECT);
+  len += put_varint(record + len, (uint32_t)timestamp);
+  len += put_name(record + len, sender, strlen(sender));
+  len += put_name(record + len, text, strnlen(text, MAX_MESSAGE_LEN - 1));
+  queue_record(user_box(state, to, 1), record, len);
+}
+
+// Queue a channel message that mentions a user who is offline
+void inbox_queue_mention(AppState *state, int user_index, uint32_t sender_id, int channel_index,
+                         const char *text, time_t timestamp)
+{
+  if (relayed_user(state, user_index))
+  {
+    return;
+  }
+  char record[MAX_RECORD];
+  const char *sender = sender_name(state, sender_id);
+  const char *channel = state->channels[channel_index].name;
+  size_t len = put_varint(record, RECORD_MENTION);
+  len += put_varint(record + len, (uint32_t)timestamp);
+  len += put_name(record + len, sender, strnlen(sender, MAX_USERNAME_LEN - 1));
+  len += put_name(record + len, channel, strlen(channel));
+  len += put_name(record + len, text, strnlen(text, MAX_MESSAGE_LEN - 1));
+  queue_record(user_box(state, user_index, 1), record, len);
+}
+
+// Read a user's whole inbox file in one go. Returns NULL if it is gone.
+static char *load_file(const char *path, size_t *len)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return NULL;
+  }
+  char *data = malloc(st.st_size ? st.st_size : 1);
+  if (!data)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  size_t got = 0;
+  while (got < (size_t)st.st_size)
+  {
+    ssize_t n = read(fd, data + got, st.st_size - got);
+    if (n <= 0)
+    {
+      break;
+    }
+    got += n;
+  }
+  close(fd);
+  *len = got;
+  return data;
+}
+
+// Split an inbox into records. A file's header must name credential, the
+// recipient's account hash; memory inboxes (credential NULL) have no
+// header. Returns how many were read; the rest, if any, was cut short.
+static int decode(const char *data, size_t len, const char *credential, QueuedRecord **out)
+{
+  Reader r = {(const unsigned char *)data, len, 0, 0};
+  *out = NULL;
+  if (credential)
+  {
+    if (len < 5 || memcmp(data, INBOX_MAGIC, 4) != 0 || data[4] != INBOX_VERSION)
+    {
+      return 0;
+    }
+    r.pos = 5;
+    uint32_t saved_len;
+    const char *saved = read_name(&r, &saved_len, CRYPT_OUTPUT_SIZE);
+    if (r.failed || saved_len != strlen(credential) || memcmp(saved, credential, saved_len) != 0)
+    {
+      return 0;
+    }
+  }
+
+  // Every record takes at least four bytes
+  QueuedRecord *records = malloc(sizeof(QueuedRecord) * (len / 4 + 1));
+  if (!records)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  int count = 0;
+  int own_run = !credential; // Memory inboxes hold only this run's records
+  while (r.pos < r.len)
+  {
+    QueuedRecord record = {0};
+    record.kind = read_varint(&r);
+    if (record.kind == RECORD_RUN)
+    {
+      uint64_t id = 0;
+      if (r.failed || r.len - r.pos < sizeof(id))
+      {
+        break;
+      }
+      memcpy(&id, r.data + r.pos, sizeof(id));
+      r.pos += sizeof(id);
+      own_run = id == run_id;
+      continue;
+    }
+
+    record.own_run = own_run;
+    record.timestamp = read_varint(&r);
+    record.sender = read_name(&r, &record.sender_len, MAX_USERNAME_LEN - 1);
+    if (record.kind == RECORD_MENTION)
+    {
+      record.channel = read_name(&r, &record.channel_len, MAX_CHANNEL_NAME_LEN - 1);
+    }
+    record.text = read_name(&r, &record.text_len, MAX_MESSAGE_LEN - 1);
+    if (r.failed || (record.kind != RECORD_DIRECT && record.kind != RECORD_MENTION))
+    {
+      break;
+    }
+    records[count++] = record;
+  }
+  *out = records;
+  return count;
+}
+
+// Hand a user everything waiting in their inbox, as one batch: direct
+// messages go to the conversation with their sender, mentions to the
+// conversation with whoever mentioned them, and anything from a sender
+// not registered in this run to the user's own conversation. Returns the
+// number of messages delivered.
+int inbox_deliver(AppState *state, int user_index)
+{
+  Inbox *inbox = user_box(state, user_index, 0);
+  if (!inbox || !inbox->has_mail || relayed_user(state, user_index))
+  {
+    return 0;
+  }
+
+  // A file queued for another account under this name (the accounts file
+  // was reset, or this is a new registration) is dropped unread
+  char path[512];
+  char *data;
+  size_t len = 0;
+  const char *credential = NULL;
+  if (inbox->on_disk)
+  {
+    inbox_path(inbox->username, path, sizeof(path));
+    data = load_file(path, &len);
+    credential = account_credential(inbox->username);
+  }
+  else
+  {
+    data = inbox->data;
+    len = inbox->len;
+  }
+
+  QueuedRecord *records = NULL;
+  int count = data && (credential || !inbox->on_disk) ? decode(data, len, credential, &records) : 0;
+
+  // A conversation keeps only its newest MAX_MESSAGES, so older records
+  // for a peer beyond that are skipped rather than added and dropped
+  int *per_peer = calloc(state->user_count, sizeof(int));
+  if (!per_peer)
+  {
+    perror("calloc");
+    exit(1);
+  }
+  // Senders resolved so far, direct-mapped by name hash: a big inbox
+  // comes from a few senders, each looked up among the users once
+  QueuedRecord *resolved[SENDER_CACHE] = {0};
+  for (int i = 0; i < count; i++)
+  {
+    QueuedRecord *record = &records[i];
+    uint32_t hash = 2166136261u;
+    for (uint32_t c = 0; c < record->sender_len; c++)
+    {
+      hash = (hash ^ (unsigned char)record->sender[c]) * 16777619u;
+    }
+    QueuedRecord **slot = &resolved[hash % SENDER_CACHE];
+    if (*slot && (*slot)->sender_len == record->sender_len &&
+        memcmp((*slot)->sender, record->sender, record->sender_len) == 0)
+    {
+      record->peer = (*slot)->peer;
+    }
+    else
+    {
+      int sender = roster_find_user(state, record->sender, record->sender_len);
+      record->peer = sender >= 0 ? sender : user_index;
+      *slot = record;
+    }
+    per_peer[record->peer] += !(record->kind == RECORD_DIRECT && record->own_run);
+  }
+
+  int delivered = 0;
+  for (int i = 0; i < count; i++)
+  {
+    QueuedRecord *record = &records[i];
+    if (record->kind == RECORD_DIRECT && record->own_run)
+    {
+      continue;
+    }
+    if (per_peer[record->peer]-- > MAX_MESSAGES)
+    {
+      continue;
+    }
+
+    char text[MAX_MESSAGE_LEN];
+    uint32_t sender_id = record->peer;
+    if (record->kind == RECORD_DIRECT && record->peer != user_index)
+    {
+      snprintf(text, sizeof(text), "%.*s", (int)record->text_len, record->text);
+    }
+    else if (record->kind == RECORD_DIRECT)
+    {
+      sender_id = SYSTEM_SENDER_ID;
+      snprintf(text, sizeof(text), "%.*s: %.*s", (int)record->sender_len, record->sender,
+               (int)record->text_len, record->text);
+    }
+    else
+    {
+      sender_id = SYSTEM_SENDER_ID;
+      snprintf(text, sizeof(text), "%.*s mentioned you in #%.*s: %.*s", (int)record->sender_len,
+               record->sender, (int)record->channel_len, record->channel, (int)record->text_len,
+               record->text);
+    }
+
+    Conversation *conv = dm_conversation(user_index, record->peer);
+    dm_append(conv, sender_id, text, record->timestamp);
+    if (record->peer != user_index)
+    {
+      dm_mark_read(conv, record->peer);
+    }
+    delivered++;
+  }
+  free(per_peer);
+  free(records);
+
+  if (inbox->on_disk)
+  {
+    free(data);
+    unlink(path);
+  }
+  inbox->len = 0;
+  inbox->has_mail = 0;
+  inbox->on_disk = 0;
+  inbox->marked = 0;
+  delivered_records += delivered;
+  return delivered;
+}
+
+// Records queued and delivered since the start, for the stats overlay
+long inbox_queued()
+{
+  return queued_records;
+}
+
+long inbox_delivered()
+{
+  return delivered_records;
+}
@@ -0,0 +1,267 @@
+#include "my_dispute.h"
+
+// Scrolling, filterable channel and user lists.
+//
+// Each side pane shows a ListView: the entries that pass its filter, a
+// selected position and the first position on screen. Drawing touches
+// only the rows in view, and the viewport follows the selection.
+//
+// The user list is rebuilt only when the roster or the filter changes.
+// Narrowing a filter by another character re-checks just the previous
+// matches. Any other change starts from an index: one bitset of online
+// users and one bitset per byte value of the users whose names contain
+// it (ignoring case). ANDing the bitsets for the filter's bytes leaves
+// only candidates that can possibly match, so a substring test runs on
+// those alone. There are at most MAX_CHANNELS channels, so their list is
+// simply rebuilt on every draw.
+//
+// Exact lookups by name, such as resolving an @mention, go through an
+// open-addressed hash table from name to user index instead of a scan.
+
+#define NAME_SLOTS (2 * MAX_USERS) // A power of two, at most half full
+
+static uint64_t online_users[USER_SET_WORDS];
+static uint64_t name_has_byte[256][USER_SET_WORDS];
+static unsigned long roster_version = 1;
+static int name_slots[NAME_SLOTS]; // User index + 1, 0 if empty
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Index a newly registered user's name
+void roster_add_user(int user_index, const char *name)
+{
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+  {
+    user_set_add(name_has_byte[tolower(*p)], user_index);
+  }
+
+  uint32_t slot = name_hash(name, strlen(name)) & (NAME_SLOTS - 1);
+  while (name_slots[slot] && name_slots[slot] != user_index + 1)
+  {
+    slot = (slot + 1) & (NAME_SLOTS - 1);
+  }
+  name_slots[slot] = user_index + 1;
+  roster_version++;
+}
+
+// Index of the user named by the first len bytes of name, -1 if none
+int roster_find_user(AppState *state, const char *name, size_t len)
+{
+  if (len == 0 || len >= MAX_USERNAME_LEN)
+  {
+    return -1;
+  }
+
+  uint32_t slot = name_hash(name, len) & (NAME_SLOTS - 1);
+  for (; name_slots[slot]; slot = (slot + 1) & (NAME_SLOTS - 1))
+  {
+    int index = name_slots[slot] - 1;
+    const char *username = state->users[index].username;
+    if (index < state->user_count && strncmp(username, name, len) == 0 && username[len] == '\0')
+    {
+      return index;
+    }
+  }
+  return -1;
+}
+
+void set_user_online(AppState *state, int user_index, int online)
+{
+  state->users[user_index].is_online = online;
+  if (online)
+  {
+    user_set_add(online_users, user_index);
+  }
+  else
+  {
+    user_set_remove(online_users, user_index);
+  }
+  roster_version++;
+}
+
+void list_view_free(ListView *view)
+{
+  free(view->entries);
+  memset(view, 0, sizeof(ListView));
+}
+
+static void append_entry(ListView *view, int entry)
+{
+  if (view->count == view->capacity)
+  {
+    view->capacity = view->capacity ? view->capacity * 2 : 64;
+    view->entries = realloc(view->entries, sizeof(int) * view->capacity);
+    if (!view->entries)
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  view->entries[view->count++] = entry;
+}
+
+// Keep the selection inside the list and on screen with rows visible rows
+void list_view_scroll(ListView *view, int rows)
+{
+  if (view->selected >= view->count)
+  {
+    view->selected = view->count - 1;
+  }
+  if (view->selected < 0)
+  {
+    view->selected = 0;
+  }
+  if (view->selected < view->scroll)
+  {
+    view->scroll = view->selected;
+  }
+  else if (view->selected >= view->scroll + rows)
+  {
+    view->scroll = view->selected - rows + 1;
+  }
+  if (view->scroll > view->count - rows)
+  {
+    view->scroll = view->count - rows;
+  }
+  if (view->scroll < 0)
+  {
+    view->scroll = 0;
+  }
+}
+
+// Position of an entry in the list, or -1
+int list_view_find(ListView *view, int entry)
+{
+  for (int i = 0; i < view->count; i++)
+  {
+    if (view->entries[i] == entry)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Apply a key typed into a list pane to its filter: printable characters
+// extend it, Backspace shortens it and Escape clears it. Returns 0 for
+// keys that are not filter edits.
+int list_view_filter_key(ListView *view, int ch)
+{
+  if (ch == 27)
+  {
+    view->filter_len = 0;
+  }
+  else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8)
+  {
+    // Drop a whole UTF-8 character
+    while (view->filter_len > 0 &&
+           ((unsigned char)view->filter[--view->filter_len] & 0xC0) == 0x80)
+    {
+    }
+  }
+  else if (ch >= 32 && ch < 256 && ch != 127 && view->filter_len < LIST_FILTER_LEN - 1)
+  {
+    view->filter[view->filter_len++] = ch;
+  }
+  else
+  {
+    return 0;
+  }
+  view->filter[view->filter_len] = '\0';
+  view->selected = 0;
+  view->scroll = 0;
+  return 1;
+}
+
+// Rebuild the channel list: channels the current user can see whose name
+// contains the filter. The open channel is selected when it is listed.
+void build_channel_list(AppState *state)
+{
+  ListView *view = &state->channel_list;
+  view->count = 0;
+  for (int i = 0; i < state->channel_count; i++)
+  {
+    if (user_can(state, state->current_user_index, i, PERM_READ) &&
+        (!view->filter_len || strcasestr(state->channels[i].name, view->filter)))
+    {
+      append_entry(view, i);
+    }
+  }
+  int position = list_view_find(view, state->current_channel_index);
+  view->selected = position >= 0 ? position : 0;
+}
+
+// Bring the user list up to date with the roster and the filter
+void build_user_list(AppState *state)
+{
+  ListView *view = &state->user_list;
+  if (view->built_version == roster_version && strcmp(view->built_filter, view->filter) == 0)
+  {
+    return;
+  }
+
+  int selected_user = view->selected < view->count ? view->entries[view->selected] : -1;
+
+  if (view->built_version == roster_version && view->built_filter[0] &&
+      strncmp(view->filter, view->built_filter, strlen(view->built_filter)) == 0)
+  {
+    // A longer filter only removes matches
+    int kept = 0;
+    for (int i = 0; i < view->count; i++)
+    {
+      if (strcasestr(state->users[view->entries[i]].username, view->filter))
+      {
+        view->entries[kept++] = view->entries[i];
+      }
+    }
+    view->count = kept;
+  }
+  else
+  {
+    uint64_t candidates[USER_SET_WORDS];
+    memcpy(candidates, online_users, sizeof(candidates));
+    for (const unsigned char *p = (const unsigned char *)view->filter; *p; p++)
+    {
+      for (int w = 0; w < USER_SET_WORDS; w++)
+      {
+        candidates[w] &= name_has_byte[tolower(*p)][w];
+      }
+    }
+
+    view->count = 0;
+    for (int w = 0; w < USER_SET_WORDS; w++)
+    {
+      for (uint64_t bits = candidates[w]; bits; bits &= bits - 1)
+      {
+        int user = w * 64 + __builtin_ctzll(bits);
+        if (user < state->user_count &&
+            (!view->filter_len || strcasestr(state->users[user].username, view->filter)))
+        {
+          append_entry(view, user);
+        }
+      }
+    }
+  }
+
+  view->built_version = roster_version;
+  strcpy(view->built_filter, view->filter);
+
+  // Stay on the same user when they are still listed
+  if (selected_user >= 0 && view->filter_len == 0)
+  {
+    int position = list_view_find(view, selected_user);
+    view->selected = position >= 0 ? position : view->selected;
+  }
+  if (view->selected >= view->count)
+  {
+    view->selected = view->count ? view->count - 1 : 0;
+  }
+}
@@ -0,0 +1,427 @@
+#include "my_dispute.h"
+#include <pthread.h>
+#include <math.h>
+
+// Synthetic multi-user load generator for the messaging core.
+//
+// Every simulated user is a thread running one session against the real
+// AppState: it registers through add_new_user, logs in through
+// authenticate_user, then sends channel messages, private messages and
+// reactions. Channel choice follows a Zipf distribution so a few channels
+// are hot and most are quiet, as in real communities.
+//
+// The core is single-threaded, so sessions take state_lock around each
+// call, exactly like a server would serialize access to it. An observer
+// thread plays the role of a reader and measures end-to-end delivery
+// latency from the send timestamp embedded in each message.
+//
+// Rate limits are off unless --rate-limit turns them on. --flooders makes
+// the first sessions ignore --rate and send as fast as they can, so the
+// cost of throttling them can be read off the other sessions' latency.
+
+AppState app_state;
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct
+{
+  int users;
+  int channels;
+  int duration;
+  double zipf;
+  double rate; // Per-user messages per second, 0 = as fast as possible
+  int pm_percent;
+  int reaction_percent;
+  int flooders; // Sessions that ignore the rate and send flat out
+} config = {1000, 20, 10, 1.1, 0, 5, 5, 0};
+
+// Cumulative Zipf distribution over channel ranks
+static double zipf_cdf[MAX_CHANNELS];
+
+// Messages appended by the load generator per channel, and how many of
+// them the observer has already measured (both guarded by state_lock)
+static long appended[MAX_CHANNELS];
+static long observed[MAX_CHANNELS];
+
+static volatile int running = 1;
+
+// Sessions wait on start_cond until every user has logged in and the
+// main thread starts the clock
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int sessions_ready = 0;
+static int started = 0;
+
+// Totals, guarded by state_lock
+static long sent_messages = 0;
+static long sent_pms = 0;
+static long failed_pms = 0;
+static long sent_reactions = 0;
+static long flood_messages = 0;
+static Histogram send_latency;
+static Histogram flood_send_latency;
+static Histogram delivery_latency;
+
+static unsigned int next_random(unsigned int *seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+static int pick_channel(unsigned int *seed)
+{
+  double u = (next_random(seed) % 1000000) / 1000000.0;
+  for (int i = 0; i < config.channels; i++)
+  {
+    if (u <= zipf_cdf[i])
+    {
+      return i;
+    }
+  }
+  return config.channels - 1;
+}
+
+static void build_zipf()
+{
+  double total = 0;
+  for (int i = 0; i < config.channels; i++)
+  {
+    total += 1.0 / pow(i + 1, config.zipf);
+  }
+
+  double cumulative = 0;
+  for (int i = 0; i < config.channels; i++)
+  {
+    cumulative += 1.0 / pow(i + 1, config.zipf) / total;
+    zipf_cdf[i] = cumulative;
+  }
+}
+
+static long rss_kb()
+{
+  long pages = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm)
+  {
+    if (fscanf(statm, "%*s %ld", &pages) != 1)
+    {
+      pages = 0;
+    }
+    fclose(statm);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void *session_thread(void *arg)
+{
+  int id = (int)(long)arg;
+  unsigned int seed = 2654435761u * (id + 1);
+  char username[MAX_USERNAME_LEN];
+  char password[] = "Passw0rd!";
+  int user_index;
+
+  snprintf(username, sizeof(username), "load%05d", id);
+
+  // Register and log in through the same paths as the UI
+  pthread_mutex_lock(&state_lock);
+  add_new_user(&app_state, username, "load@example.com", password);
+  authenticate_user(&app_state, username, password);
+  user_index = app_state.current_user_index;
+  sessions_ready++;
+  while (!started)
+  {
+    pthread_cond_wait(&start_cond, &state_lock);
+  }
+  pthread_mutex_unlock(&state_lock);
+
+  int flooder = id < config.flooders;
+  long interval_ns = config.rate > 0 && !flooder ? (long)(1e9 / config.rate) : 0;
+  long next_send = stats_now_ns();
+
+  while (running)
+  {
+    if (interval_ns)
+    {
+      long now = stats_now_ns();
+      if (now < next_send)
+      {
+        struct timespec pause = {0, next_send - now};
+        nanosleep(&pause, NULL);
+      }
+      next_send += interval_ns;
+    }
+
+    int action = next_random(&seed) % 100;
+    int channel = pick_channel(&seed);
+    char text[MAX_MESSAGE_LEN];
+    long start = stats_now_ns();
+
+    pthread_mutex_lock(&state_lock);
+    app_state.current_user_index = user_index;
+    app_state.current_channel_index = channel;
+
+    if (action < config.pm_percent)
+    {
+      int peer = next_random(&seed) % config.users;
+      snprintf(text, sizeof(text), "lg:%ld private hello", start);
+      if (send_private_message(&app_state, app_state.users[peer].username, text))
+      {
+        sent_pms++;
+      }
+      else
+      {
+        failed_pms++;
+      }
+    }
+    else if (action < config.pm_percent + config.reaction_percent)
+    {
+      Channel *target = &app_state.channels[channel];
+      if (target->message_count > 0)
+      {
+        add_reaction(&app_state, target->message_count - 1, "+!*"[next_random(&seed) % 3]);
+        sent_reactions++;
+      }
+    }
+    else
+    {
+      snprintf(text, sizeof(text), "lg:%ld message from %s to channel %d", start, username, channel);
+      if (send_message(&app_state, text))
+      {
+        appended[channel]++;
+        sent_messages++;
+        flood_messages += flooder;
+      }
+    }
+
+    histogram_record(flooder ? &flood_send_latency : &send_latency, stats_now_ns() - start);
+    pthread_mutex_unlock(&state_lock);
+  }
+
+  return NULL;
+}
+
+// Poll every channel for messages it has not seen yet and record the time
+// since they were sent, as a reader refreshing its view would see them
+static void *observer_thread(void *arg)
+{
+  (void)arg;
+
+  while (running)
+  {
+    pthread_mutex_lock(&state_lock);
+    long now = stats_now_ns();
+    for (int c = 0; c < config.channels; c++)
+    {
+      Channel *channel = &app_state.channels[c];
+      long fresh = appended[c] - observed[c];
+      if (fresh > channel->message_count)
+      {
+        fresh = channel->message_count;
+      }
+
+      for (int i = channel->message_count - fresh; i < channel->message_count; i++)
+      {
+        const char *text = message_text(channel, channel_message(channel, i));
+        if (strncmp(text, "lg:", 3) == 0)
+        {
+          histogram_record(&delivery_latency, now - atol(text + 3));
+        }
+      }
+      observed[c] = appended[c];
+    }
+    pthread_mutex_unlock(&state_lock);
+
+    usleep(1000);
+  }
+
+  return NULL;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [options]\n", prog);
+  fprintf(stderr, "  --users N       simulated sessions, one thread each (default 1000)\n");
+  fprintf(stderr, "  --channels N    channels to spread traffic over (default 20)\n");
+  fprintf(stderr, "  --duration S    seconds to run after all sessions log in (default 10)\n");
+  fprintf(stderr, "  --zipf S        Zipf exponent for channel popularity (default 1.1)\n");
+  fprintf(stderr, "  --rate R        messages per second per user, 0 = unthrottled (default 0)\n");
+  fprintf(stderr, "  --pm P          percent of actions that are private messages (default 5)\n");
+  fprintf(stderr, "  --reactions P   percent of actions that are reactions (default 5)\n");
+  fprintf(stderr, "  --flooders N    sessions that ignore --rate and send flat out (default 0)\n");
+  fprintf(stderr, "  --rate-limit SCOPE=RATE[/BURST]\n");
+  fprintf(stderr, "                  enable a user, channel or global rate limit (repeatable)\n");
+}
+
+static int parse_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (i + 1 >= argc)
+    {
+      return 0;
+    }
+
+    if (strcmp(argv[i], "--users") == 0)
+    {
+      config.users = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--channels") == 0)
+    {
+      config.channels = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--duration") == 0)
+    {
+      config.duration = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--zipf") == 0)
+    {
+      config.zipf = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--rate") == 0)
+    {
+      config.rate = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--pm") == 0)
+    {
+      config.pm_percent = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--reactions") == 0)
+    {
+      config.reaction_percent = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--flooders") == 0)
+    {
+      config.flooders = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--rate-limit") == 0)
+    {
+      if (!rate_limit_configure(argv[++i]))
+      {
+        return 0;
+      }
+    }
+    else
+    {
+      return 0;
+    }
+  }
+
+  if (config.users < 1 || config.users > MAX_USERS || config.channels < 1 ||
+      config.channels > MAX_CHANNELS || config.duration < 1)
+  {
+    fprintf(stderr, "users must be 1-%d, channels 1-%d, duration >= 1\n", MAX_USERS, MAX_CHANNELS);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  if (!parse_args(argc, argv))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Default channels plus enough extra ones for the requested spread
+  init_channel(&app_state.channels[0], "general");
+  init_channel(&app_state.channels[1], "random");
+  init_channel(&app_state.channels[2], "help");
+  app_state.channel_count = 3;
+  app_state.current_user_index = -1;
+  for (int i = app_state.channel_count; i < config.channels; i++)
+  {
+    char name[MAX_CHANNEL_NAME_LEN];
+    snprintf(name, sizeof(name), "load-%02d", i);
+    init_channel(&app_state.channels[i], name);
+    app_state.channel_count++;
+  }
+
+  build_zipf();
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+
+  pthread_t *sessions = malloc(sizeof(pthread_t) * config.users);
+  pthread_t observer;
+  if (!sessions)
+  {
+    perror("malloc");
+    return 1;
+  }
+
+  long setup_start = stats_now_ns();
+  for (int i = 0; i < config.users; i++)
+  {
+    if (pthread_create(&sessions[i], &attr, session_thread, (void *)(long)i) != 0)
+    {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  pthread_create(&observer, NULL, observer_thread, NULL);
+
+  while (__atomic_load_n(&sessions_ready, __ATOMIC_ACQUIRE) < config.users)
+  {
+    usleep(1000);
+  }
+  long setup_ns = stats_now_ns() - setup_start;
+
+  pthread_mutex_lock(&state_lock);
+  started = 1;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&state_lock);
+
+  printf("{\n  \"users\": %d, \"channels\": %d, \"zipf\": %.2f, \"rate_per_user\": %.2f,\n",
+         config.users, config.channels, config.zipf, config.rate);
+  printf("  \"login_ms\": %.1f,\n  \"timeline\": [\n", setup_ns / 1e6);
+
+  long last_total = 0;
+  for (int second = 1; second <= config.duration; second++)
+  {
+    sleep(1);
+    // Read the counters without the lock so a saturated core cannot stall
+    // the reporting
+    long total = __atomic_load_n(&sent_messages, __ATOMIC_RELAXED) +
+                 __atomic_load_n(&sent_pms, __ATOMIC_RELAXED) +
+                 __atomic_load_n(&sent_reactions, __ATOMIC_RELAXED);
+
+    printf("    {\"t\": %d, \"ops_per_sec\": %ld, \"rss_kb\": %ld}%s\n", second, total - last_total,
+           rss_kb(), second == config.duration ? "" : ",");
+    fflush(stdout);
+    last_total = total;
+  }
+
+  long measured_messages = __atomic_load_n(&sent_messages, __ATOMIC_RELAXED);
+  running = 0;
+  for (int i = 0; i < config.users; i++)
+  {
+    pthread_join(sessions[i], NULL);
+  }
+  pthread_join(observer, NULL);
+
+  printf("  ],\n");
+  printf("  \"messages\": %ld, \"private_messages\": %ld, \"failed_private_messages\": %ld, "
+         "\"reactions\": %ld,\n",
+         sent_messages, sent_pms, failed_pms, sent_reactions);
+  printf("  \"rate_limited\": %ld, \"flood_messages\": %ld,\n", rate_limit_dropped(), flood_messages);
+  printf("  \"messages_per_sec\": %.1f,\n", (double)measured_messages / config.duration);
+  printf("  \"send_latency_ns\": {\"p50\": %ld, \"p99\": %ld, \"p999\": %ld, \"max\": %ld},\n",
+         histogram_percentile(&send_latency, 0.50), histogram_percentile(&send_latency, 0.99),
+         histogram_percentile(&send_latency, 0.999), send_latency.max);
+  printf("  \"delivery_latency_ns\": {\"p50\": %ld, \"p99\": %ld, \"p999\": %ld, \"max\": %ld},\n",
+         histogram_percentile(&delivery_latency, 0.50), histogram_percentile(&delivery_latency, 0.99),
+         histogram_percentile(&delivery_latency, 0.999), delivery_latency.max);
+  if (config.flooders)
+  {
+    printf("  \"flood_send_latency_ns\": {\"p50\": %ld, \"p99\": %ld, \"max\": %ld},\n",
+           histogram_percentile(&flood_send_latency, 0.50),
+           histogram_percentile(&flood_send_latency, 0.99), flood_send_latency.max);
+  }
+  printf("  \"rss_kb\": %ld\n}\n", rss_kb());
+
+  free(sessions);
+  return 0;
+}
@@ -1,14 +1,47 @@
 #include "my_dispute.h"
+#include <locale.h>
 
 AppState app_state;
 
+#define DEFAULT_COMPACT_RATE_KB 8192
+
+// Results of handle_key
+#define KEY_RESULT_CONTINUE 0
+#define KEY_RESULT_QUIT 1
+#define KEY_RESULT_LOGOUT 2
+
+// How long to wait for the rest of a bracketed paste before drawing
+#define PASTE_WAIT_MS 50
+
+// Set between the start and end markers of a bracketed paste
+static int in_paste = 0;
+
 void initialize_app()
 {
   // Initialize default channels
-  strcpy(app_state.channels[0].name, "general");
-  strcpy(app_state.channels[1].name, "random");
-  strcpy(app_state.channels[2].name, "help");
-  app_state.channel_count = 3;
+  for (int i = 0; i < DEFAULT_CHANNEL_COUNT; i++)
+  {
+    init_channel(&app_state.channels[i], default_channels[i]);
+  }
+  app_state.channel_count = DEFAULT_CHANNEL_COUNT;
+
+  // Channels from earlier sessions, or imported, come back with their history
+  char names[MAX_CHANNELS][MAX_CHANNEL_NAME_LEN];
+  int count = history_channels(names, MAX_CHANNELS);
+  for (int i = 0; i < count && app_state.channel_count < MAX_CHANNELS; i++)
+  {
+    // Private conversations once kept as PM_ channels stay private
+    if (find_channel(&app_state, names[i]) < 0 && strncmp(names[i], "PM_", 3) != 0)
+    {
+      init_channel(&app_state.channels[app_state.channel_count++], names[i]);
+    }
+  }
+
+  // Their access state too; members are handed back as they log in
+  for (int i = 0; i < app_state.channel_count; i++)
+  {
+    load_channel_access(&app_state.channels[i]);
+  }
 
   // Initialize with no users (they will be added via registration)
   app_state.user_count = 0;
@@ -16,25 +49,14 @@ void initialize_app()
   // Set current indexes
   app_state.current_channel_index = 0;
   app_state.current_user_index = -1; // Not logged in yet
+
+  editor_init(&app_state.input);
 }
 
-void run_auth_screen()
+// Show the register/login menu until a user is authenticated.
+// Returns 1 once someone is logged in, 0 if the user chose to exit (F10).
+int run_auth_screen()
 {
-  clear();
-
-  // Initial authentication screen
-  int max_y, max_x;
-  getmaxyx(stdscr, max_y, max_x);
-
-  // Create a window for the login form
-  int form_height = 10;
-  int form_width = 40;
-  int start_y = (max_y - form_height) / 2;
-  int start_x = (max_x - form_width) / 2;
-
-  WINDOW *auth_win = newwin(form_height, form_width, start_y, start_x);
-  box(auth_win, 0, 0);
-
   // Add cyberpunk style colors
   start_color();
   init_pair(COLOR_NEON_YELLOW, COLOR_YELLOW, COLOR_BLACK);
@@ -43,211 +65,749 @@ void run_auth_screen()
   init_pair(COLOR_BRIGHT_RED, COLOR_RED, COLOR_BLACK);
   init_pair(COLOR_DARK_BLUE, COLOR_BLUE, COLOR_BLACK);
 
-  // Display title
-  wattron(auth_win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
-  mvwprintw(auth_win, 1, (form_width - 12) / 2, "MY DISPUTE");
-  wattroff(auth_win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+  while (1)
+  {
+    clear();
+
+    // Initial authentication screen
+    int max_y, max_x;
+    getmaxyx(stdscr, max_y, max_x);
 
-  // Display options
-  wattron(auth_win, COLOR_PAIR(COLOR_NEON_GREEN));
-  mvwprintw(auth_win, 4, 5, "1. New User (Register)");
-  mvwprintw(auth_win, 6, 5, "2. Existing User (Login)");
-  wattroff(auth_win, COLOR_PAIR(COLOR_NEON_GREEN));
+    // Create a window for the login form
+    int form_height = 10;
+    int form_width = 40;
+    int start_y = (max_y - form_height) / 2;
+    int start_x = (max_x - form_width) / 2;
 
-  wattron(auth_win, COLOR_PAIR(COLOR_NEON_YELLOW));
-  mvwprintw(auth_win, 8, 5, "Select an option (1 or 2): ");
-  wattroff(auth_win, COLOR_PAIR(COLOR_NEON_YELLOW));
+    WINDOW *auth_win = newwin(form_height, form_width, start_y, start_x);
+    box(auth_win, 0, 0);
+    keypad(auth_win, TRUE);
 
-  wrefresh(auth_win);
+    // Display title
+    wattron(auth_win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+    mvwprintw(auth_win, 1, (form_width - 12) / 2, "MY DISPUTE");
+    wattroff(auth_win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
 
-  // Get user choice
-  int choice = wgetch(auth_win);
+    // Display options
+    wattron(auth_win, COLOR_PAIR(COLOR_NEON_GREEN));
+    mvwprintw(auth_win, 4, 5, replication_read_only() ? "1. (Register on the primary)"
+                                                      : "1. New User (Register)");
+    mvwprintw(auth_win, 6, 5, "2. Existing User (Login)");
+    wattroff(auth_win, COLOR_PAIR(COLOR_NEON_GREEN));
 
-  if (choice == '1')
-  {
-    // Register new user
-    int success = register_screen();
-    if (!success)
+    wattron(auth_win, COLOR_PAIR(COLOR_NEON_YELLOW));
+    mvwprintw(auth_win, 8, 5, "Select an option (1 or 2): ");
+    wattroff(auth_win, COLOR_PAIR(COLOR_NEON_YELLOW));
+
+    wrefresh(auth_win);
+
+    // Get user choice
+    int choice = read_key(auth_win);
+    int success = 0;
+
+    if (choice == '1' && !replication_read_only())
     {
-      // Registration failed, return to auth screen
-      delwin(auth_win);
-      run_auth_screen();
-      return;
+      // Register new user
+      success = register_screen();
     }
-  }
-  else if (choice == '2')
-  {
-    // Login existing user
-    int success = login_screen();
-    if (!success)
+    else if (choice == '2')
+    {
+      // Login existing user
+      success = login_screen();
+    }
+    else if (choice == KEY_F(10))
     {
-      // Login failed, return to auth screen
       delwin(auth_win);
-      run_auth_screen();
-      return;
+      return 0;
+    }
+
+    delwin(auth_win);
+
+    // On failure or an invalid choice, redisplay the auth screen
+    if (success)
+    {
+      return 1;
     }
   }
+}
+
+// Delete the main UI windows so they can be rebuilt after the next login
+static void close_windows()
+{
+  delwin(app_state.logo_win);
+  delwin(app_state.channels_win);
+  delwin(app_state.chat_win);
+  delwin(app_state.input_win);
+  delwin(app_state.users_win);
+}
+
+// Join the next channel up or down the channel list. When a filter hides
+// the open channel, either direction starts from the first match.
+static void step_channel_list(int direction)
+{
+  ListView *list = &app_state.channel_list;
+  build_channel_list(&app_state);
+  int position = list_view_find(list, app_state.current_channel_index);
+  if (position < 0)
+  {
+    position = list->count ? 0 : -1;
+  }
+  else if (position + direction >= 0 && position + direction < list->count)
+  {
+    position += direction;
+  }
   else
   {
-    // Invalid choice, redisplay auth screen
-    delwin(auth_win);
-    run_auth_screen();
-    return;
+    position = -1;
   }
 
-  delwin(auth_win);
+  if (position >= 0)
+  {
+    join_channel(&app_state, list->entries[position]);
+  }
 }
 
-int main()
+// Wait for the next key. Linked to a hub or replicating, also wake for
+// messages other terminals posted and changes from the primary, and
+// report them as KEY_SHARED_EVENT. Metrics scrapes are answered meanwhile.
+static int read_session_key(WINDOW *win)
 {
-  // Initialize ncurses
-  initscr();
-  cbreak();
-  noecho();             // Don't echo input automatically
-  keypad(stdscr, TRUE); // Enable special keys
+  if (!link_attached() && !replication_active() && !metrics_active())
+  {
+    return read_key(win);
+  }
+  if (replay_active())
+  {
+    // Scripts run on virtual time; take whatever has arrived so far
+    link_poll(&app_state);
+    replication_poll(&app_state);
+    return read_key(win);
+  }
 
-  // Enable keypad mode for all windows
-  // This allows arrow keys to be captured in each window
+  while (1)
+  {
+    int ch = read_key_nowait(win, 0);
+    if (ch != ERR)
+    {
+      return ch;
+    }
 
-  // Initialize application state
-  initialize_app();
+    // Serving replicas and scrapes needs their sockets watched between
+    // keys too
+    struct pollfd fds[1 + REPLICATION_MAX_FDS + METRICS_MAX_FDS];
+    fds[0] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+    int replication_count = 1 + replication_fds(fds + 1);
+    int count = replication_count + metrics_fds(fds + replication_count);
+    int timeout_ms = replication_timeout_ms();
+    int news = 0;
+    if (link_attached())
+    {
+      news = link_wait(fds, count, timeout_ms);
+    }
+    else if (poll(fds, count, timeout_ms) < 0)
+    {
+      fds[0].revents = 0;
+    }
+    metrics_events(&app_state, fds + replication_count, count - replication_count);
+    if (replication_events(&app_state, fds + 1, replication_count - 1) > 0 || news)
+    {
+      return KEY_SHARED_EVENT;
+    }
+    if (fds[0].revents)
+    {
+      return read_key(win);
+    }
+  }
+}
 
-  // Display authentication screen
-  run_auth_screen();
+// Apply one key to the application state.
+// Returns KEY_RESULT_QUIT on F10 and KEY_RESULT_LOGOUT on a scripted logout.
+static int handle_key(int ch, int *current_focus)
+{
+  // Set while consecutive Tabs cycle through completions
+  static int completing = 0;
+  int was_completing = completing;
+  completing = 0;
 
-  // If we reach here, user is authenticated, initialize UI
-  init_ui(&app_state);
+  // Inside a bracketed paste everything is literal text for the input
+  // field; line breaks are joined with spaces so the paste stays one message,
+  // and other control bytes and keypad keys are dropped rather than run as
+  // editing commands
+  if (ch == KEY_PASTE_BEGIN)
+  {
+    in_paste = 1;
+    *current_focus = 1;
+  }
+  else if (ch == KEY_PASTE_END)
+  {
+    in_paste = 0;
+  }
+  else if (in_paste)
+  {
+    if (ch == '\n' || ch == '\t')
+    {
+      editor_insert_byte(&app_state.input, ' ');
+    }
+    else if ((ch >= ' ' && ch < 0x7F) || (ch >= 0x80 && ch <= 0xFF))
+    {
+      editor_insert_byte(&app_state.input, ch);
+    }
+  }
+  // In the input field Tab completes the word before the cursor; when
+  // there is nothing to complete it moves focus as everywhere else
+  else if (ch == '\t' && *current_focus == 1 && complete_input(&app_state, was_completing))
+  {
+    completing = 1;
+  }
+  // Handle key explicitly by value to ensure arrow keys work
+  else if (ch == '\t' || ch == 9)
+  {
+    // Tab key: cycle through focuses
+    *current_focus = (*current_focus + 1) % 3;
+  }
+  else if (ch == KEY_BTAB)
+  {
+    // Shift-Tab always moves focus, backwards
+    *current_focus = (*current_focus + 2) % 3;
+  }
+  else if (ch == KEY_UP || ch == 259)
+  {
+    // Explicit check for up arrow
+    if (*current_focus == 0)
+    {
+      // Navigate channel list up
+      step_channel_list(-1);
+    }
+    else if (*current_focus == 1)
+    {
+      // Recall an older line from the input history
+      editor_history(&app_state.input, -1);
+    }
+    else if (*current_focus == 2)
+    {
+      // Navigate user list up
+      navigate_users(&app_state, -1);
+    }
+  }
+  else if (ch == KEY_DOWN || ch == 258)
+  {
+    // Explicit check for down arrow
+    if (*current_focus == 0)
+    {
+      // Navigate channel list down
+      step_channel_list(1);
+    }
+    else if (*current_focus == 1)
+    {
+      // Step forward through the input history
+      editor_history(&app_state.input, 1);
+    }
+    else if (*current_focus == 2)
+    {
+      // Navigate user list down
+      navigate_users(&app_state, 1);
+    }
+  }
+  else if (ch == '\n' || ch == KEY_ENTER || ch == 10 || ch == 13)
+  {
+    if (*current_focus == 1)
+    {
+      // Input field has focus, process entered command/message
+      char input[MAX_INPUT_LEN];
+      editor_text(&app_state.input, input, sizeof(input));
+      editor_commit(&app_state.input);
+      handle_input(&app_state, input);
+      app_state.chat_scroll = 0;
+    }
+    else if (*current_focus == 0)
+    {
+      // Channel selection confirmed; the arrow keys already switched to
+      // it, so this brings it back from a direct-message view or joins
+      // the first match of a filter that hides the open channel
+      ListView *list = &app_state.channel_list;
+      build_channel_list(&app_state);
+      if (list->selected < list->count)
+      {
+        join_channel(&app_state, list->entries[list->selected]);
+      }
+    }
+    else if (*current_focus == 2)
+    {
+      // User selection confirmed - start a private message
+      start_pm_with_selected_user(&app_state);
+      // Switch focus to input field
+      *current_focus = 1;
+    }
+  }
+  else if (ch == KEY_SHARED_EVENT)
+  {
+    // Add what other terminals sent through the hub
+    link_poll(&app_state);
+  }
+  else if (ch == KEY_F(10))
+  {
+    // Exit application
+    return KEY_RESULT_QUIT;
+  }
+  else if (ch == KEY_REPLAY_LOGOUT)
+  {
+    // Scripted logout: return to the auth screen as another user
+    leave_chat_view(&app_state);
+    set_user_online(&app_state, app_state.current_user_index, 0);
+    app_state.current_user_index = -1;
+    return KEY_RESULT_LOGOUT;
+  }
+  else if (ch == KEY_PPAGE || ch == KEY_NPAGE)
+  {
+    // Scroll the chat pane by a screenful; draw_chat clamps at the top
+    int rows = getmaxy(app_state.chat_win) - 4;
+    app_state.chat_scroll += ch == KEY_PPAGE ? rows : -rows;
+    if (app_state.chat_scroll < 0)
+    {
+      app_state.chat_scroll = 0;
+    }
+  }
+  else if (*current_focus == 0 && list_view_filter_key(&app_state.channel_list, ch))
+  {
+    // Typing in the channel list narrows it
+  }
+  else if (*current_focus == 2 && list_view_filter_key(&app_state.user_list, ch))
+  {
+    // Typing in the user list narrows it
+  }
+  else if (*current_focus == 1)
+  {
+    // Editing keys and text (only in input field)
+    editor_handle_key(&app_state.input, ch);
+  }
 
-  // Enable keypad for all windows
-  keypad(app_state.logo_win, TRUE);
-  keypad(app_state.channels_win, TRUE);
-  keypad(app_state.chat_win, TRUE);
-  keypad(app_state.input_win, TRUE);
-  keypad(app_state.users_win, TRUE);
+  return KEY_RESULT_CONTINUE;
+}
 
-  // Main input loop
-  char input[MAX_INPUT_LEN] = {0};
-  int input_pos = 0;
-  int ch;
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [--replay SCRIPT] [--frames CSV]\n", prog);
+  fprintf(stderr, "  --replay SCRIPT  read keystrokes and clock events from SCRIPT and\n");
+  fprintf(stderr, "                   render to a headless terminal\n");
+  fprintf(stderr, "  --frames CSV     record per-frame timings to CSV\n");
+  fprintf(stderr, "  --history DIR    keep channel history on disk in DIR (default\n");
+  fprintf(stderr, "                   " DEFAULT_HISTORY_DIR ", none when replaying)\n");
+  fprintf(stderr, "  --history-cache KB\n");
+  fprintf(stderr, "                   memory budget for history pages read back from disk\n");
+  fprintf(stderr, "  --compact-rate KB\n");
+  fprintf(stderr, "                   history compaction I/O limit per second (default %d,\n",
+          DEFAULT_COMPACT_RATE_KB);
+  fprintf(stderr, "                   0 for unlimited)\n");
+  fprintf(stderr, "  --rate-limit SCOPE=RATE[/BURST]\n");
+  fprintf(stderr, "                   messages per second allowed per user, channel or\n");
+  fprintf(stderr, "                   global scope, 0 for unlimited (repeatable; all are\n");
+  fprintf(stderr, "                   unlimited by default)\n");
+  fprintf(stderr, "  --shared NAME    share channels with other terminals on this host\n");
+  fprintf(stderr, "                   through the hub NAME (see my_dispute_hub); no local\n");
+  fprintf(stderr, "                   history unless --history is given\n");
+  fprintf(stderr, "  --connect ADDRESS\n");
+  fprintf(stderr, "                   share channels through a hub elsewhere, serving on\n");
+  fprintf(stderr, "                   [HOST:]PORT or a Unix socket PATH (my_dispute_hub\n");
+  fprintf(stderr, "                   --listen); no local history unless --history is given\n");
+  fprintf(stderr, "  --secret FILE    shared secret of the hub (see my_dispute_hub --secret)\n");
+  fprintf(stderr, "  --move-secret FILE\n");
+  fprintf(stderr, "                   secret /move gives the router (see my_dispute_hub\n");
+  fprintf(stderr, "                   --move-secret)\n");
+  fprintf(stderr, "  --replicate PATH serve read replicas on the Unix socket PATH\n");
+  fprintf(stderr, "  --replica-of PATH\n");
+  fprintf(stderr, "                   follow the primary serving on PATH, read-only until\n");
+  fprintf(stderr, "                   an admin runs /promote; no local history unless\n");
+  fprintf(stderr, "                   --history is given\n");
+  fprintf(stderr, "  --replica-secret FILE\n");
+  fprintf(stderr, "                   secret on the first line of FILE that replicas present\n");
+  fprintf(stderr, "                   to the primary; needed with --replicate and --replica-of\n");
+  fprintf(stderr, "  --metrics ADDRESS\n");
+  fprintf(stderr, "                   serve Prometheus metrics over HTTP on [HOST:]PORT or a\n");
+  fprintf(stderr, "                   Unix socket PATH while someone is logged in\n");
+}
 
-  // Current focus (0=channels, 1=input, 2=users)
-  int current_focus = 1; // Start with input field focus
+int main(int argc, char **argv)
+{
+  const char *replay_path = NULL;
+  const char *frames_path = NULL;
+  const char *history_dir = NULL;
+  long history_cache_kb = 0;
+  long compact_rate_kb = DEFAULT_COMPACT_RATE_KB;
+  const char *shared_name = NULL;
+  const char *connect_address = NULL;
+  const char *secret_path = NULL;
+  const char *move_secret_path = NULL;
+  const char *replicate_path = NULL;
+  const char *primary_path = NULL;
+  const char *replica_secret_path = NULL;
+  const char *metrics_address = NULL;
 
-  while (1)
+  for (int i = 1; i < argc; i++)
   {
-    // Draw UI elements with focus indicators
-    draw_logo(app_state.logo_win);
-    draw_channels(app_state.channels_win, &app_state, current_focus == 0);
-    draw_chat(app_state.chat_win, &app_state);
-    draw_users(app_state.users_win, &app_state, current_focus == 2);
-    draw_input(app_state.input_win, current_focus == 1, input); // Pass current input to draw
-
-    // Debug: Display key pressed to identify issues
-    if (current_focus == 1)
+    if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
     {
-      mvwprintw(app_state.input_win, 0, 40, "Last key: %d  ", ch);
-      wrefresh(app_state.input_win);
+      replay_path = argv[++i];
     }
-
-    // Get user input based on current focus
-    if (current_focus == 0)
+    else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+    {
+      frames_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc)
+    {
+      history_dir = argv[++i];
+    }
+    else if (strcmp(argv[i], "--history-cache") == 0 && i + 1 < argc)
+    {
+      history_cache_kb = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--compact-rate") == 0 && i + 1 < argc)
+    {
+      compact_rate_kb = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--shared") == 0 && i + 1 < argc)
+    {
+      shared_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+    {
+      connect_address = argv[++i];
+    }
+    else if (strcmp(argv[i], "--secret") == 0 && i + 1 < argc)
+    {
+      secret_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--move-secret") == 0 && i + 1 < argc)
+    {
+      move_secret_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--replicate") == 0 && i + 1 < argc)
+    {
+      replicate_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--replica-of") == 0 && i + 1 < argc)
+    {
+      primary_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--replica-secret") == 0 && i + 1 < argc)
+    {
+      replica_secret_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
     {
-      // Channel list has focus
-      ch = wgetch(app_state.channels_win);
+      metrics_address = argv[++i];
     }
-    else if (current_focus == 1)
+    else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc &&
+             rate_limit_configure(argv[i + 1]))
     {
-      // Input field has focus
-      ch = wgetch(app_state.input_win);
+      i++;
     }
     else
     {
-      // User list has focus
-      ch = wgetch(app_state.users_win);
+      usage(argv[0]);
+      return 1;
     }
+  }
+
+  // Join the hub or the primary, and start serving replicas and metrics,
+  // before the terminal is taken over so errors stay readable. A replica
+  // takes every change from its primary and can't also link to a hub.
+  if ((shared_name && connect_address) || (primary_path && (shared_name || connect_address)) ||
+      ((replicate_path || primary_path) && !replica_secret_path))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if ((shared_name && !shm_client_attach(shared_name)) ||
+      (secret_path && !net_load_secret(secret_path)) ||
+      (move_secret_path && !net_load_move_secret(move_secret_path)) ||
+      (connect_address && !net_client_connect(connect_address)) ||
+      (replica_secret_path && !replication_load_secret(replica_secret_path)) ||
+      (primary_path && !replication_follow(primary_path)) ||
+      (replicate_path && !replication_serve(replicate_path)) ||
+      (metrics_address && !metrics_open(metrics_address)))
+  {
+    replication_close();
+    return 1;
+  }
+
+  // Use the terminal's locale so ncursesw renders UTF-8 text
+  setlocale(LC_ALL, "");
 
-    // Handle key explicitly by value to ensure arrow keys work
-    if (ch == '\t' || ch == 9)
+  FILE *frames = NULL;
+  if (frames_path)
+  {
+    frames = fopen(frames_path, "w");
+    if (!frames)
     {
-      // Tab key: cycle through focuses
-      current_focus = (current_focus + 1) % 3;
+      perror(frames_path);
+      return 1;
     }
-    else if (ch == KEY_UP || ch == 259)
+    fprintf(frames, "frame,virtual_time,key,keys,handle_ns,draw_ns\n");
+  }
+
+  // Channels pick up their on-disk history as they are initialized. It is
+  // opened before the terminal is taken over, so a failure stays readable.
+  if (!history_dir && !replay_path && !shared_name && !connect_address && !primary_path)
+  {
+    history_dir = DEFAULT_HISTORY_DIR;
+  }
+  if (history_dir && !history_init(history_dir, history_cache_kb * 1024))
+  {
+    replication_close();
+    return 1;
+  }
+
+  // Initialize ncurses, headless when replaying a script
+  SCREEN *screen = NULL;
+  if (replay_path)
+  {
+    if (!replay_open(replay_path))
     {
-      // Explicit check for up arrow
-      if (current_focus == 0 && app_state.current_channel_index > 0)
+      return 1;
+    }
+    screen = init_headless_screen(50, 200);
+  }
+  else
+  {
+    initscr();
+    stats_watch_output();
+  }
+  cbreak();
+  noecho();             // Don't echo input automatically
+  keypad(stdscr, TRUE); // Enable special keys
+
+  // Ask the terminal to bracket pastes so they arrive as one literal burst
+  define_key("\033[200~", KEY_PASTE_BEGIN);
+  define_key("\033[201~", KEY_PASTE_END);
+  if (!screen)
+  {
+    printf("\033[?2004h");
+    fflush(stdout);
+  }
+
+  // Initialize application state
+  initialize_app();
+
+  // A replica needs the primary's users before anyone can log in
+  if (primary_path)
+  {
+    replication_catch_up(&app_state, 5000);
+  }
+  if (history_dir)
+  {
+    history_start_compactor(compact_rate_kb * 1024);
+  }
+
+  // Replays start from a clean slate so they stay deterministic
+  if (!replay_path)
+  {
+    load_read_markers(&app_state, READ_MARKERS_FILE);
+    accounts_init(DEFAULT_ACCOUNTS_FILE);
+    inbox_init(DEFAULT_INBOX_DIR);
+  }
+
+  long frame = 0;
+
+  // Each pass through this loop is one login session
+  while (1)
+  {
+    // Users registered on the primary meanwhile can log in
+    replication_poll(&app_state);
+    if (!run_auth_screen())
+    {
+      break;
+    }
+
+    // User is authenticated, initialize UI
+    init_ui(&app_state);
+
+    // Enable keypad for all windows
+    // This allows arrow keys to be captured in each window
+    keypad(app_state.logo_win, TRUE);
+    keypad(app_state.channels_win, TRUE);
+    keypad(app_state.chat_win, TRUE);
+    keypad(app_state.input_win, TRUE);
+    keypad(app_state.users_win, TRUE);
+
+    // Main input loop
+    int ch = 0;
+    long handle_ns = 0;
+    long input_at = 0;
+    int keys = 0;
+    int quit = 0;
+
+    // Current focus (0=channels, 1=input, 2=users)
+    int current_focus = 1; // Start with input field focus
+
+    // The previous user may have left a private channel open
+    if (!user_can(&app_state, app_state.current_user_index, app_state.current_channel_index,
+                  PERM_READ))
+    {
+      app_state.current_channel_index = 0;
+    }
+
+    // Catch up on what the hub relayed while nobody was logged in, and
+    // let other terminals know who is here
+    link_poll(&app_state);
+    link_presence(&app_state, 1);
+
+    // The channel shown on login counts as read
+    mark_channel_read(&app_state, app_state.current_user_index, app_state.current_channel_index);
+
+    while (1)
+    {
+      long draw_start = stats_now_ns();
+      long t;
+
+      // Draw UI elements with focus indicators, timing each pane
+      draw_logo(app_state.logo_win);
+
+      t = stats_now_ns();
+      draw_channels(app_state.channels_win, &app_state, current_focus == 0);
+      stats_record(STATS_DRAW_CHANNELS, stats_now_ns() - t);
+
+      t = stats_now_ns();
+      draw_chat(app_state.chat_win, &app_state);
+      stats_record(STATS_DRAW_CHAT, stats_now_ns() - t);
+
+      t = stats_now_ns();
+      draw_users(app_state.users_win, &app_state, current_focus == 2);
+      stats_record(STATS_DRAW_USERS, stats_now_ns() - t);
+
+      // The overlay and the output accounting are instrumentation, so their
+      // cost is kept out of the input latency they report on
+      long overhead_start = stats_now_ns();
+      draw_stats_overlay(&app_state);
+      long overhead = stats_now_ns() - overhead_start;
+
+      t = stats_now_ns();
+      draw_input(app_state.input_win, current_focus == 1, &app_state.input);
+      stats_record(STATS_DRAW_INPUT, stats_now_ns() - t);
+
+      // Send the whole frame to the terminal at once
+      overhead_start = stats_now_ns();
+      stats_begin_output();
+      overhead += stats_now_ns() - overhead_start;
+      doupdate();
+      long painted = stats_now_ns();
+      stats_end_output();
+
+      if (input_at)
       {
-        // Navigate channel list up
-        app_state.current_channel_index--;
+        stats_record(STATS_INPUT_LATENCY, painted - input_at - overhead);
       }
-      else if (current_focus == 2)
+
+      if (frames)
       {
-        // Navigate user list up
-        navigate_users(&app_state, -1);
+        fprintf(frames, "%ld,%ld,%d,%d,%ld,%ld\n", frame, (long)app_time(), ch, keys, handle_ns,
+                painted - draw_start);
       }
-    }
-    else if (ch == KEY_DOWN || ch == 258)
-    {
-      // Explicit check for down arrow
-      if (current_focus == 0 && app_state.current_channel_index < app_state.channel_count - 1)
+      frame++;
+
+      // Push this frame's history writes to disk before waiting for input
+      for (int i = 0; i < app_state.channel_count; i++)
       {
-        // Navigate channel list down
-        app_state.current_channel_index++;
+        history_flush(&app_state.channels[i]);
       }
-      else if (current_focus == 2)
+
+      // Get user input based on current focus
+      if (current_focus == 0)
       {
-        // Navigate user list down
-        navigate_users(&app_state, 1);
+        // Channel list has focus
+        ch = read_session_key(app_state.channels_win);
       }
-    }
-    else if (ch == '\n' || ch == KEY_ENTER || ch == 10 || ch == 13)
-    {
-      if (current_focus == 1)
+      else if (current_focus == 1)
       {
-        // Input field has focus, process entered command/message
-        input[input_pos] = '\0';
-        handle_input(&app_state, input);
-        input_pos = 0;
-        memset(input, 0, MAX_INPUT_LEN);
+        // Input field has focus
+        ch = read_session_key(app_state.input_win);
       }
-      else if (current_focus == 0)
+      else
       {
-        // Channel selection confirmed
-        // Already set by arrow keys
+        // User list has focus
+        ch = read_session_key(app_state.users_win);
       }
-      else if (current_focus == 2)
+
+      long handle_start = stats_now_ns();
+      input_at = handle_start;
+      keys = 0;
+
+      // Apply the key, then everything else already waiting, so a burst
+      // such as a paste is handled as one edit and produces one frame.
+      // During a bracketed paste, wait briefly for the rest of it.
+      int result = handle_key(ch, &current_focus);
+      keys++;
+      while (result == KEY_RESULT_CONTINUE)
       {
-        // User selection confirmed - start a private message
-        start_pm_with_selected_user(&app_state);
-        // Switch focus to input field
-        current_focus = 1;
+        WINDOW *focus_win = current_focus == 0   ? app_state.channels_win
+                            : current_focus == 1 ? app_state.input_win
+                                                 : app_state.users_win;
+        int next = read_key_nowait(focus_win, in_paste ? PASTE_WAIT_MS : 0);
+        if (next == ERR)
+        {
+          break;
+        }
+        result = handle_key(next, &current_focus);
+        keys++;
       }
-    }
-    else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8)
-    {
-      // Handle backspace (only in input field)
-      if (current_focus == 1 && input_pos > 0)
+
+      if (result == KEY_RESULT_QUIT)
+      {
+        quit = 1;
+        break;
+      }
+      if (result == KEY_RESULT_LOGOUT)
       {
-        input_pos--;
-        input[input_pos] = '\0';
+        break;
       }
+
+      handle_ns = stats_now_ns() - handle_start;
     }
-    else if (ch == KEY_F(10))
+
+    close_windows();
+
+    leave_chat_view(&app_state);
+    link_presence(&app_state, 0);
+    if (!replay_path)
     {
-      // Exit application
-      break;
+      save_read_markers(&app_state, READ_MARKERS_FILE);
+    }
+
+    // The next user starts with an empty line and no history
+    editor_free(&app_state.input);
+    editor_init(&app_state.input);
+
+    if (app_state.stats_win)
+    {
+      delwin(app_state.stats_win);
+      app_state.stats_win = NULL;
     }
-    else if (current_focus == 1 && isprint(ch) && input_pos < MAX_INPUT_LEN - 1)
+    if (quit)
     {
-      // Add character to input (only in input field)
-      input[input_pos++] = ch;
-      input[input_pos] = '\0';
+      break;
     }
   }
 
   // Cleanup
+  history_stop_compactor();
+  link_close();
+  replication_close();
+  metrics_close();
+  if (!screen)
+  {
+    printf("\033[?2004l");
+    fflush(stdout);
+  }
   cleanup_ui();
   endwin();
+  if (screen)
+  {
+    delscreen(screen);
+  }
+  if (frames)
+  {
+    fclose(frames);
+  }
+  replay_close();
 
   return 0;
-}
\ No newline at end of file
+}
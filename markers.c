@@ -0,0 +1,508 @@
+#include "my_dispute.h"
+
+// Per-user read markers and unread/mention badges.
+//
+// Every channel numbers its messages with a sequence counter, and every
+// user remembers the sequence number they have read up to in each channel,
+// so the unread count is a subtraction and nothing ever rescans history.
+// Mentions are counted when a message is sent and cleared when the user
+// reads the channel.
+//
+// Markers are saved as a small binary file of varints:
+//   "MDRM" version
+//   channel count, then per channel: name length, name, last_seq
+//   user count, then per user: name length, name, entry count, then per
+//     entry: channel number, unread count, mention count
+//   hub epoch, channel count, then per channel: name length, name, seq
+// Only channels with something unread get an entry, so a user who is caught
+// up everywhere costs a few bytes. Users are not persisted themselves, so
+// markers loaded for a name are applied when that user registers.
+//
+// The last part is where a terminal on a hub was in the hub's history
+// (link_position). A terminal restarted against the same hub run resumes
+// from there instead of applying the messages the hub still holds again,
+// which with --history would also write them to disk twice. Version 1
+// files have no such part.
+
+#define MARKERS_MAGIC "MDRM"
+#define MARKERS_VERSION 2
+
+typedef struct
+{
+  int channel; // Index into saved_channels
+  uint32_t unread;
+  uint16_t mentions;
+} SavedEntry;
+
+typedef struct
+{
+  char username[MAX_USERNAME_LEN];
+  SavedEntry *entries;
+  int entry_count;
+  int restored; // Applied to a registered user; their live markers win
+} SavedUser;
+
+typedef struct
+{
+  char name[MAX_CHANNEL_NAME_LEN];
+  uint32_t last_seq;
+} SavedChannel;
+
+// Markers loaded from disk
+static SavedChannel *saved_channels = NULL;
+static int saved_channel_count = 0;
+static SavedUser *saved_users = NULL;
+static int saved_user_count = 0;
+
+// Hub position loaded from disk, kept for runs that are not on a hub
+static uint64_t saved_epoch = 0;
+static char saved_hub_names[NET_MAX_ROUTED][MAX_CHANNEL_NAME_LEN];
+static uint64_t saved_hub_seqs[NET_MAX_ROUTED];
+static int saved_hub_count = 0;
+
+void mark_channel_read(AppState *state, int user_index, int channel_index)
+{
+  if (user_index < 0 || channel_index < 0 || channel_index >= state->channel_count)
+  {
+    return;
+  }
+  state->users[user_index].last_read[channel_index] = state->channels[channel_index].last_seq;
+  state->users[user_index].mentions[channel_index] = 0;
+}
+
+uint32_t channel_unread(AppState *state, int user_index, int channel_index)
+{
+  return state->channels[channel_index].last_seq - state->users[user_index].last_read[channel_index];
+}
+
+// Count @name mentions in a message just sent to a channel
+void count_mentions(AppState *state, int channel_index, int sender_index, const char *text)
+{
+  for (const char *p = strchr(text, '@'); p; p = strchr(p + 1, '@'))
+  {
+    // A mention starts a word
+    if (p > text && !isspace((unsigned char)p[-1]))
+    {
+      continue;
+    }
+
+    const char *name = p + 1;
+    int i = roster_find_user(state, name, strcspn(name, " \t,.:;!?)"));
+
+    // Only someone who can see the channel hears about the mention
+    if (i >= 0 && i != sender_index && state->users[i].mentions[channel_index] < UINT16_MAX &&
+        user_can(state, i, channel_index, PERM_READ))
+    {
+      state->users[i].mentions[channel_index]++;
+      if (!state->users[i].is_online && sender_index >= 0)
+      {
+        inbox_queue_mention(state, i, sender_index, channel_index, text, app_time());
+      }
+    }
+  }
+}
+
+static void free_saved_markers()
+{
+  for (int i = 0; i < saved_user_count; i++)
+  {
+    free(saved_users[i].entries);
+  }
+  free(saved_users);
+  free(saved_channels);
+  saved_users = NULL;
+  saved_channels = NULL;
+  saved_user_count = 0;
+  saved_channel_count = 0;
+}
+
+static void write_varint(FILE *file, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    fputc((value & 0x7F) | 0x80, file);
+    value >>= 7;
+  }
+  fputc(value, file);
+}
+
+static void write_name(FILE *file, const char *name)
+{
+  size_t len = strlen(name);
+  write_varint(file, len);
+  fwrite(name, 1, len, file);
+}
+
+// Bounds-checked reader over the loaded file
+typedef struct
+{
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  int failed;
+} Reader;
+
+static uint32_t read_varint(Reader *r)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    if (r->pos >= r->len)
+    {
+      r->failed = 1;
+      return 0;
+    }
+    unsigned char byte = r->data[r->pos++];
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      return value;
+    }
+  }
+  r->failed = 1;
+  return 0;
+}
+
+static uint64_t read_varint64(Reader *r)
+{
+  uint64_t value = 0;
+  for (int shift = 0; shift < 70; shift += 7)
+  {
+    if (r->pos >= r->len)
+    {
+      r->failed = 1;
+      return 0;
+    }
+    unsigned char byte = r->data[r->pos++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      return value;
+    }
+  }
+  r->failed = 1;
+  return 0;
+}
+
+static void read_name(Reader *r, char *out, size_t size)
+{
+  uint32_t len = read_varint(r);
+  if (r->failed || len >= size || len > r->len - r->pos)
+  {
+    r->failed = 1;
+    out[0] = '\0';
+    return;
+  }
+  memcpy(out, r->data + r->pos, len);
+  out[len] = '\0';
+  r->pos += len;
+}
+
+// Load markers saved by a previous run. Channel sequence counters continue
+// from where they were; user markers wait for restore_read_markers.
+int load_read_markers(AppState *state, const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    return 0;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  unsigned char *data = size > 0 ? malloc(size) : NULL;
+  if (!data || fread(data, 1, size, file) != (size_t)size)
+  {
+    free(data);
+    fclose(file);
+    return 0;
+  }
+  fclose(file);
+
+  Reader r = {data, size, 0, 0};
+  if (size < 5 || memcmp(data, MARKERS_MAGIC, 4) != 0 || data[4] < 1 ||
+      data[4] > MARKERS_VERSION)
+  {
+    free(data);
+    return 0;
+  }
+  r.pos = 5;
+
+  free_saved_markers();
+
+  uint32_t channel_count = read_varint(&r);
+  if (!r.failed && channel_count <= r.len)
+  {
+    saved_channels = calloc(channel_count ? channel_count : 1, sizeof(SavedChannel));
+    for (uint32_t i = 0; i < channel_count && !r.failed; i++)
+    {
+      read_name(&r, saved_channels[i].name, MAX_CHANNEL_NAME_LEN);
+      saved_channels[i].last_seq = read_varint(&r);
+      saved_channel_count++;
+    }
+  }
+
+  uint32_t user_count = read_varint(&r);
+  if (!r.failed && user_count <= r.len)
+  {
+    saved_users = calloc(user_count ? user_count : 1, sizeof(SavedUser));
+    for (uint32_t i = 0; i < user_count && !r.failed; i++)
+    {
+      SavedUser *user = &saved_users[saved_user_count++];
+      read_name(&r, user->username, MAX_USERNAME_LEN);
+      uint32_t entry_count = read_varint(&r);
+      if (r.failed || entry_count > (uint32_t)saved_channel_count)
+      {
+        r.failed = 1;
+        break;
+      }
+      user->entries = calloc(entry_count ? entry_count : 1, sizeof(SavedEntry));
+      for (uint32_t j = 0; j < entry_count && !r.failed; j++)
+      {
+        SavedEntry *entry = &user->entries[user->entry_count++];
+        uint32_t channel = read_varint(&r);
+        entry->unread = read_varint(&r);
+        uint32_t mentions = read_varint(&r);
+        entry->mentions = mentions > UINT16_MAX ? UINT16_MAX : mentions;
+        if (channel >= (uint32_t)saved_channel_count)
+        {
+          r.failed = 1;
+        }
+        entry->channel = channel;
+      }
+    }
+  }
+
+  saved_hub_count = 0;
+  if (!r.failed && data[4] >= 2)
+  {
+    saved_epoch = read_varint64(&r);
+    uint32_t hub_count = read_varint(&r);
+    for (uint32_t i = 0; i < hub_count && i < NET_MAX_ROUTED && !r.failed; i++)
+    {
+      read_name(&r, saved_hub_names[i], MAX_CHANNEL_NAME_LEN);
+      saved_hub_seqs[i] = read_varint64(&r);
+      saved_hub_count++;
+    }
+  }
+
+  free(data);
+
+  if (r.failed)
+  {
+    free_saved_markers();
+    saved_hub_count = 0;
+    return 0;
+  }
+  link_resume(saved_epoch, saved_hub_names, saved_hub_seqs, saved_hub_count);
+
+  for (int i = 0; i < saved_channel_count; i++)
+  {
+    // A channel with on-disk history already knows its own sequence
+    int channel = find_channel(state, saved_channels[i].name);
+    if (channel >= 0 && !state->channels[channel].history &&
+        state->channels[channel].last_seq < saved_channels[i].last_seq)
+    {
+      state->channels[channel].last_seq = saved_channels[i].last_seq;
+    }
+  }
+
+  return 1;
+}
+
+// Apply saved markers to a user who has just registered
+void restore_read_markers(AppState *state, int user_index)
+{
+  User *user = &state->users[user_index];
+
+  for (int i = 0; i < saved_user_count; i++)
+  {
+    SavedUser *saved = &saved_users[i];
+    if (saved->restored || strcmp(saved->username, user->username) != 0)
+    {
+      continue;
+    }
+
+    // Channels without an entry were read to the end when saved
+    for (int c = 0; c < saved_channel_count; c++)
+    {
+      int channel = find_channel(state, saved_channels[c].name);
+      if (channel >= 0 && state->channels[channel].last_seq >= saved_channels[c].last_seq)
+      {
+        user->last_read[channel] = saved_channels[c].last_seq;
+        user->mentions[channel] = 0;
+      }
+    }
+    for (int e = 0; e < saved->entry_count; e++)
+    {
+      SavedEntry *entry = &saved->entries[e];
+      int channel = find_channel(state, saved_channels[entry->channel].name);
+      if (channel >= 0 && state->channels[channel].last_seq >= saved_channels[entry->channel].last_seq)
+      {
+        user->last_read[channel] = saved_channels[entry->channel].last_seq - entry->unread;
+        user->mentions[channel] = entry->mentions;
+      }
+    }
+
+    saved->restored = 1;
+    return;
+  }
+}
+
+// Save the markers of every registered user, plus those loaded for users
+// who have not registered again in this run. Written to a temporary file
+// and renamed, so a crash never leaves a truncated file behind.
+int save_read_markers(AppState *state, const char *path)
+{
+  char tmp_path[256];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *file = fopen(tmp_path, "wb");
+  if (!file)
+  {
+    return 0;
+  }
+
+  // Channel table: live channels, then saved ones that no longer exist
+  // but are still referenced by unrestored users
+  int *saved_to_table = calloc(saved_channel_count ? saved_channel_count : 1, sizeof(int));
+  int table_count = state->channel_count;
+  for (int c = 0; c < saved_channel_count; c++)
+  {
+    int channel = find_channel(state, saved_channels[c].name);
+    saved_to_table[c] = channel >= 0 ? channel : table_count++;
+  }
+
+  fwrite(MARKERS_MAGIC, 1, 4, file);
+  fputc(MARKERS_VERSION, file);
+
+  write_varint(file, table_count);
+  for (int i = 0; i < state->channel_count; i++)
+  {
+    write_name(file, state->channels[i].name);
+    write_varint(file, state->channels[i].last_seq);
+  }
+  for (int c = 0; c < saved_channel_count; c++)
+  {
+    if (saved_to_table[c] >= state->channel_count)
+    {
+      write_name(file, saved_channels[c].name);
+      write_varint(file, saved_channels[c].last_seq);
+    }
+  }
+
+  int pending = 0;
+  for (int i = 0; i < saved_user_count; i++)
+  {
+    pending += !saved_users[i].restored;
+  }
+  write_varint(file, state->user_count + pending);
+
+  for (int i = 0; i < state->user_count; i++)
+  {
+    User *user = &state->users[i];
+    int entries = 0;
+    for (int c = 0; c < state->channel_count; c++)
+    {
+      entries += channel_unread(state, i, c) > 0 || user->mentions[c] > 0;
+    }
+
+    write_name(file, user->username);
+    write_varint(file, entries);
+    for (int c = 0; c < state->channel_count; c++)
+    {
+      uint32_t unread = channel_unread(state, i, c);
+      if (unread > 0 || user->mentions[c] > 0)
+      {
+        write_varint(file, c);
+        write_varint(file, unread);
+        write_varint(file, user->mentions[c]);
+      }
+    }
+  }
+
+  for (int i = 0; i < saved_user_count; i++)
+  {
+    SavedUser *saved = &saved_users[i];
+    if (saved->restored)
+    {
+      continue;
+    }
+
+    // Messages posted since the markers were loaded are unread for them
+    int entries = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+      {
+        write_name(file, saved->username);
+        write_varint(file, entries);
+      }
+      for (int c = 0; c < saved_channel_count; c++)
+      {
+        int table = saved_to_table[c];
+        uint32_t unread = 0;
+        uint16_t mentions = 0;
+        for (int e = 0; e < saved->entry_count; e++)
+        {
+          if (saved->entries[e].channel == c)
+          {
+            unread = saved->entries[e].unread;
+            mentions = saved->entries[e].mentions;
+          }
+        }
+        if (table < state->channel_count)
+        {
+          unread += state->channels[table].last_seq - saved_channels[c].last_seq;
+        }
+        if (unread == 0 && mentions == 0)
+        {
+          continue;
+        }
+
+        if (pass == 0)
+        {
+          entries++;
+        }
+        else
+        {
+          write_varint(file, table);
+          write_varint(file, unread);
+          write_varint(file, mentions);
+        }
+      }
+    }
+  }
+
+  free(saved_to_table);
+
+  // Off a hub, the position from the last run on one is kept for the next
+  uint64_t epoch = 0;
+  char hub_names[NET_MAX_ROUTED][MAX_CHANNEL_NAME_LEN];
+  uint64_t hub_seqs[NET_MAX_ROUTED];
+  int hub_count = link_position(&epoch, hub_names, hub_seqs, NET_MAX_ROUTED);
+  if (!epoch)
+  {
+    epoch = saved_epoch;
+    hub_count = saved_hub_count;
+    memcpy(hub_names, saved_hub_names, sizeof(saved_hub_names));
+    memcpy(hub_seqs, saved_hub_seqs, sizeof(saved_hub_seqs));
+  }
+  write_varint(file, epoch);
+  write_varint(file, hub_count);
+  for (int i = 0; i < hub_count; i++)
+  {
+    write_name(file, hub_names[i]);
+    write_varint(file, hub_seqs[i]);
+  }
+
+  int ok = !ferror(file);
+  if (fclose(file) != 0 || !ok || rename(tmp_path, path) != 0)
+  {
+    unlink(tmp_path);
+    return 0;
+  }
+  return 1;
+}
@@ -1,153 +1,345 @@
 #include "my_dispute.h"
 
-int send_message(AppState *state, char *text)
+// Smallest text arena a channel allocates
+#define MIN_ARENA_SIZE 4096
+
+// Return the message at a logical index (0 = oldest) of the ring buffer
+Message *channel_message(Channel *channel, int index)
 {
-  // Check if the user is muted in this channel
-  time_t now = time(NULL);
-  if (state->users[state->current_user_index].muted_until[state->current_channel_index] > now)
+  int slot = channel->first_message + index;
+  if (slot >= MAX_MESSAGES)
   {
-    // User is muted, don't allow sending message
-    Channel *channel = &state->channels[state->current_channel_index];
-    if (channel->message_count < MAX_MESSAGES)
-    {
-      Message *msg = &channel->messages[channel->message_count];
-      strcpy(msg->sender, "SYSTEM");
-      sprintf(msg->text, "You are muted in this channel and cannot send messages");
-      msg->timestamp = now;
-      channel->message_count++;
-    }
-    return 0;
+    slot -= MAX_MESSAGES;
   }
+  return &channel->messages[slot];
+}
 
-  // Check if text is empty
-  if (strlen(text) == 0)
+const char *message_text(Channel *channel, Message *msg)
+{
+  return channel->text_arena + msg->text_offset;
+}
+
+const char *sender_name(AppState *state, uint32_t sender_id)
+{
+  if (sender_id == SYSTEM_SENDER_ID || sender_id >= (uint32_t)state->user_count)
   {
-    return 0;
+    return SYSTEM_SENDER_NAME;
+  }
+  return state->users[sender_id].username;
+}
+
+int sender_width(AppState *state, uint32_t sender_id)
+{
+  if (sender_id == SYSTEM_SENDER_ID || sender_id >= (uint32_t)state->user_count)
+  {
+    return sizeof(SYSTEM_SENDER_NAME) - 1;
   }
+  return state->users[sender_id].name_width;
+}
 
-  // Get the current channel
-  Channel *channel = &state->channels[state->current_channel_index];
+// Make room for need more bytes in the text arena. When the arena is full
+// the live texts are copied into a new arena with 50% headroom, so the cost
+// of compaction is amortized over the appends that filled that headroom.
+static void reserve_arena(Channel *channel, uint32_t need)
+{
+  if (channel->arena_used + need <= channel->arena_size)
+  {
+    return;
+  }
+
+  uint32_t live = 0;
+  for (int i = 0; i < channel->message_count; i++)
+  {
+    live += channel_message(channel, i)->text_len + 1;
+  }
+
+  uint32_t new_size = (live + need) * 3 / 2;
+  new_size = (new_size + MIN_ARENA_SIZE - 1) / MIN_ARENA_SIZE * MIN_ARENA_SIZE;
+
+  char *arena = malloc(new_size);
+  if (!arena)
+  {
+    perror("malloc");
+    exit(1);
+  }
 
+  uint32_t used = 0;
+  for (int i = 0; i < channel->message_count; i++)
+  {
+    Message *msg = channel_message(channel, i);
+    memcpy(arena + used, channel->text_arena + msg->text_offset, msg->text_len + 1);
+    msg->text_offset = used;
+    used += msg->text_len + 1;
+  }
+
+  free(channel->text_arena);
+  channel->text_arena = arena;
+  channel->arena_used = used;
+  channel->arena_size = new_size;
+}
+
+static void release_reactions(Channel *channel, Message *msg)
+{
+  if (msg->reactions)
+  {
+    int set = msg->reactions - 1;
+    channel->reaction_sets[set].next_free = channel->free_reaction_set;
+    channel->free_reaction_set = set;
+    msg->reactions = 0;
+  }
+}
+
+// Append a message to a channel, evicting the oldest one if the channel is
+// full. Display widths are measured here once so rendering never has to.
+// sender is the sender's name, which on-disk history stores with the text.
+Message *append_message(Channel *channel, uint32_t sender_id, const char *sender, const char *text,
+                        time_t timestamp)
+{
   // Check if there's room for a new message
   if (channel->message_count >= MAX_MESSAGES)
   {
-    // If full, remove oldest message (shift all messages)
-    for (int i = 0; i < MAX_MESSAGES - 1; i++)
-    {
-      memcpy(&channel->messages[i], &channel->messages[i + 1], sizeof(Message));
-    }
+    // If full, drop the oldest message from the ring
+    release_reactions(channel, &channel->messages[channel->first_message]);
+    channel->first_message = (channel->first_message + 1) % MAX_MESSAGES;
     channel->message_count--;
   }
 
-  // Add the new message
-  Message *msg = &channel->messages[channel->message_count];
-  strcpy(msg->sender, state->users[state->current_user_index].username);
-  strncpy(msg->text, text, MAX_MESSAGE_LEN - 1);
-  msg->text[MAX_MESSAGE_LEN - 1] = '\0'; // Ensure null termination
-  msg->timestamp = time(NULL);
+  size_t len = strnlen(text, MAX_MESSAGE_LEN - 1);
+  reserve_arena(channel, len + 1);
 
-  // Clear reactions
-  memset(msg->reactions, 0, MAX_REACTIONS);
-  memset(msg->reaction_count, 0, sizeof(int) * MAX_REACTIONS);
+  // Add the new message
+  Message *msg = channel_message(channel, channel->message_count);
+  msg->sender_id = sender_id;
+  msg->text_offset = channel->arena_used;
+  msg->text_len = len;
+  memcpy(channel->text_arena + channel->arena_used, text, len);
+  channel->text_arena[channel->arena_used + len] = '\0';
+  channel->arena_used += len + 1;
+  msg->timestamp = timestamp;
+  msg->width = text_width_n(text, len);
+  msg->reactions = 0;
 
   // Increment message count
   channel->message_count++;
+  channel->last_seq++;
+  stats_count_message();
 
-  return 1;
+  // A seq missing from disk would be asked for by every reader of the
+  // history, so a channel whose history can't be written stops keeping one
+  if (channel->history && !history_append(channel, timestamp, sender, text, len))
+  {
+    history_close(channel);
+    post_system_message(channel, "Can't write the history of #%s; this run keeps it in memory only",
+                        channel->name);
+  }
+
+  return msg;
 }
 
-int send_private_message(AppState *state, char *username, char *text)
+// Add a formatted SYSTEM message to a channel
+void post_system_message(Channel *channel, const char *fmt, ...)
 {
-  // Find user with given username
-  int user_index = -1;
-  for (int i = 0; i < state->user_count; i++)
+  char text[MAX_MESSAGE_LEN];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+
+  append_message(channel, SYSTEM_SENDER_ID, SYSTEM_SENDER_NAME, text, app_time());
+}
+
+// Add a user's message to a channel and update read state: mentions are
+// counted, and a sender who was caught up has also read their own message
+void deliver_message(AppState *state, int channel_index, uint32_t sender_id, const char *text,
+                     time_t timestamp)
+{
+  long start = metrics_sampled() ? stats_now_ns() : 0;
+  Channel *channel = &state->channels[channel_index];
+
+  uint32_t seq_before = channel->last_seq;
+  append_message(channel, sender_id, sender_name(state, sender_id), text, timestamp);
+  replication_log_append(channel, sender_id, text, strnlen(text, MAX_MESSAGE_LEN - 1), timestamp);
+  count_mentions(state, channel_index, sender_id, text);
+
+  if (sender_id < (uint32_t)state->user_count)
   {
-    if (strcmp(state->users[i].username, username) == 0)
+    User *sender = &state->users[sender_id];
+    if (sender->last_read[channel_index] == seq_before)
     {
-      user_index = i;
-      break;
+      sender->last_read[channel_index] = channel->last_seq;
     }
   }
+  metrics_count(METRIC_DELIVERED, 1);
+  if (start)
+  {
+    metrics_observe(METRIC_DELIVER_NS, stats_now_ns() - start);
+  }
+}
 
-  // If user not found or not online
-  if (user_index == -1 || !state->users[user_index].is_online)
+// Password of users known only from a hub. It can't be typed (Enter ends
+// the field), so nobody can log in as them here.
+#define REMOTE_PASSWORD "\n"
+
+// Local channel for one a hub relays, created when this terminal lacks it
+int relayed_channel(AppState *state, const char *name)
+{
+  int index = find_channel(state, name);
+  if (index < 0 && state->channel_count < MAX_CHANNELS)
   {
-    // Notify the sender
-    Channel *channel = &state->channels[state->current_channel_index];
-    if (channel->message_count < MAX_MESSAGES)
-    {
-      Message *msg = &channel->messages[channel->message_count];
-      strcpy(msg->sender, "SYSTEM");
-      sprintf(msg->text, "User '%s' is not online or doesn't exist", username);
-      msg->timestamp = time(NULL);
-      channel->message_count++;
-    }
-    return 0;
+    index = state->channel_count++;
+    init_channel(&state->channels[index], name);
+    save_channel_access(state, &state->channels[index]);
+    replication_log_create(name);
   }
+  return index;
+}
 
-  // Check if we can create a private message
-  // For simplicity, we'll use a special channel "PM_<username1>_<username2>"
-  char pm_channel_name[MAX_CHANNEL_NAME_LEN];
+// Local user for a relayed sender, registered offline the first time they
+// appear
+uint32_t relayed_sender(AppState *state, const char *name)
+{
+  int known = roster_find_user(state, name, strlen(name));
+  if (known >= 0)
+  {
+    return known;
+  }
 
-  // Sort usernames alphabetically to ensure consistent channel naming
-  if (strcmp(state->users[state->current_user_index].username, username) < 0)
+  int current = state->current_user_index;
+  if (!add_new_user(state, (char *)name, "", REMOTE_PASSWORD))
   {
-    sprintf(pm_channel_name, "PM_%s_%s",
-            state->users[state->current_user_index].username, username);
+    return SYSTEM_SENDER_ID;
   }
-  else
+  int index = state->user_count - 1;
+  set_user_online(state, index, 0);
+  state->current_user_index = current;
+  return index;
+}
+
+// Whether a user is known here only because a hub relayed them
+int relayed_user(AppState *state, int user_index)
+{
+  return strcmp(state->users[user_index].password, REMOTE_PASSWORD) == 0;
+}
+
+int send_message(AppState *state, char *text)
+{
+  // Private channels take messages from their members only
+  if (!user_can(state, state->current_user_index, state->current_channel_index, PERM_SEND))
   {
-    sprintf(pm_channel_name, "PM_%s_%s",
-            username, state->users[state->current_user_index].username);
+    return 0;
   }
 
-  // Check if PM channel already exists
-  int pm_channel_index = -1;
-  for (int i = 0; i < state->channel_count; i++)
+  // Check if the user is muted in this channel
+  time_t now = app_time();
+  if (state->users[state->current_user_index].muted_until[state->current_channel_index] > now)
   {
-    if (strcmp(state->channels[i].name, pm_channel_name) == 0)
+    // User is muted, don't allow sending message
+    post_system_message(&state->channels[state->current_channel_index],
+                        "You are muted in this channel and cannot send messages");
+    return 0;
+  }
+
+  // Check if text is empty
+  if (strlen(text) == 0)
+  {
+    return 0;
+  }
+
+  // Drop the message if the sender, the channel or the server is over its
+  // rate limit. Only the sender hears about it, from SYSTEM in their own
+  // conversation, so the notice takes no room in the channel.
+  int refused = rate_limit_check(state, state->current_user_index, state->current_channel_index);
+  if (refused >= 0)
+  {
+    char notice[MAX_MESSAGE_LEN];
+    if (rate_limit_notice(state, state->current_user_index, refused, notice, sizeof(notice)))
     {
-      pm_channel_index = i;
-      break;
+      dm_append(dm_conversation(state->current_user_index, state->current_user_index),
+                SYSTEM_SENDER_ID, notice, app_time());
     }
+    return 0;
   }
 
-  // If PM channel doesn't exist, create it
-  if (pm_channel_index == -1)
+  // Terminals sharing a hub post public messages through it and add them
+  // when they come back, in the order every other terminal sees them
+  if (link_attached() && !state->channels[state->current_channel_index].is_private)
   {
-    if (state->channel_count >= MAX_CHANNELS)
+    if (!link_send(state, state->current_channel_index, text, now))
     {
-      // No room for new channels
+      post_system_message(&state->channels[state->current_channel_index],
+                          "The hub is unreachable or not keeping up; message not sent");
       return 0;
     }
+    return 1;
+  }
+
+  deliver_message(state, state->current_channel_index, state->current_user_index, text, now);
+  return 1;
+}
 
-    // Create new PM channel
-    strcpy(state->channels[state->channel_count].name, pm_channel_name);
-    state->channels[state->channel_count].message_count = 0;
+int send_private_message(AppState *state, char *username, char *text)
+{
+  // Find user with given username
+  int user_index = roster_find_user(state, username, strlen(username));
 
-    // Add a system message to mark channel creation
-    Message *msg = &state->channels[state->channel_count].messages[0];
-    strcpy(msg->sender, "SYSTEM");
-    sprintf(msg->text, "Private conversation between %s and %s",
-            state->users[state->current_user_index].username, username);
-    msg->timestamp = time(NULL);
-    state->channels[state->channel_count].message_count = 1;
+  if (user_index == -1)
+  {
+    post_system_message(&state->channels[state->current_channel_index],
+                        "User '%s' doesn't exist", username);
+    return 0;
+  }
 
-    pm_channel_index = state->channel_count;
-    state->channel_count++;
+  if (strlen(text) == 0)
+  {
+    return 0;
   }
 
-  // Switch to the PM channel
-  int old_channel = state->current_channel_index;
-  state->current_channel_index = pm_channel_index;
+  // Users on other terminals can only be reached while they are logged in
+  if (!state->users[user_index].is_online && relayed_user(state, user_index))
+  {
+    dm_append(dm_conversation(state->current_user_index, user_index), SYSTEM_SENDER_ID,
+              "User is not online; message not delivered", app_time());
+    return 0;
+  }
 
-  // Send the message
-  int result = send_message(state, text);
+  // Direct messages count against the sender's and the global rate limits
+  int refused = rate_limit_check(state, state->current_user_index, -1);
+  if (refused >= 0)
+  {
+    char notice[MAX_MESSAGE_LEN];
+    if (rate_limit_notice(state, state->current_user_index, refused, notice, sizeof(notice)))
+    {
+      Conversation *conv = dm_find(state->current_user_index, user_index);
+      if (!conv)
+      {
+        conv = dm_conversation(state->current_user_index, state->current_user_index);
+      }
+      dm_append(conv, SYSTEM_SENDER_ID, notice, app_time());
+    }
+    return 0;
+  }
 
-  // Switch back to the original channel
-  state->current_channel_index = old_channel;
+  time_t now = app_time();
+  dm_send(state->current_user_index, user_index, text, now);
 
-  return result;
+  // Someone who is logged out finds it in their inbox at their next login.
+  // A terminal on a hub holds only its own user; everyone else gets the
+  // message through the hub.
+  if (!state->users[user_index].is_online)
+  {
+    inbox_queue_direct(state, state->current_user_index, user_index, text, now);
+  }
+  else if (link_attached() && user_index != state->current_user_index &&
+           !link_direct(state, user_index, text, now))
+  {
+    Conversation *conv = dm_find(state->current_user_index, user_index);
+    if (conv)
+    {
+      dm_append(conv, SYSTEM_SENDER_ID, "The hub is unreachable; message not delivered", now);
+    }
+  }
+  return 1;
 }
 
 int add_reaction(AppState *state, int message_index, char reaction)
@@ -162,26 +354,51 @@ int add_reaction(AppState *state, int message_index, char reaction)
   }
 
   // Get the message
-  Message *msg = &channel->messages[message_index];
+  Message *msg = channel_message(channel, message_index);
+
+  // Reaction sets are allocated on first reaction
+  if (!msg->reactions)
+  {
+    int set = channel->free_reaction_set;
+    if (set >= 0)
+    {
+      channel->free_reaction_set = channel->reaction_sets[set].next_free;
+    }
+    else
+    {
+      ReactionSet *sets = realloc(channel->reaction_sets,
+                                  sizeof(ReactionSet) * (channel->reaction_set_count + 1));
+      if (!sets)
+      {
+        return 0;
+      }
+      channel->reaction_sets = sets;
+      set = channel->reaction_set_count++;
+    }
+    memset(&channel->reaction_sets[set], 0, sizeof(ReactionSet));
+    msg->reactions = set + 1;
+  }
+
+  ReactionSet *reactions = &channel->reaction_sets[msg->reactions - 1];
 
   // Check if reaction already exists for this message
   for (int i = 0; i < MAX_REACTIONS; i++)
   {
-    if (msg->reactions[i] == reaction)
+    if (reactions->emoji[i] == reaction)
     {
       // Increment the count for this reaction
-      msg->reaction_count[i]++;
+      reactions->count[i]++;
       return 1;
     }
-    else if (msg->reactions[i] == 0)
+    else if (reactions->emoji[i] == 0)
     {
       // Found an empty reaction slot, add the new reaction
-      msg->reactions[i] = reaction;
-      msg->reaction_count[i] = 1;
+      reactions->emoji[i] = reaction;
+      reactions->count[i] = 1;
       return 1;
     }
   }
 
   // If we get here, all reaction slots are full
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,531 @@
+#include "my_dispute.h"
+#include <errno.h>
+#include <sys/socket.h>
+
+// Metrics endpoint in the Prometheus text format.
+//
+// With --metrics ADDRESS a terminal or hub answers HTTP GETs for /metrics
+// on [HOST:]PORT or a Unix socket PATH, from the same loop that serves its
+// other sockets (curl --unix-socket PATH http://localhost/metrics).
+//
+// Counters and latency histograms are recorded on hot paths such as
+// deliver_message, so each thread adds to a block of its own with plain
+// relaxed stores: no lock, no atomic read-modify-write, and no cache line
+// another thread writes. A scrape sums the blocks with relaxed loads, so a
+// sample recorded during it may or may not be counted yet, never torn.
+// Blocks are never freed because counters must outlive their thread.
+// Where a message costs less than reading the clock twice, only one in
+// METRICS_SAMPLE_EVERY is timed; its counter still sees every one.
+//
+// Everything else (per-channel counts, clients, queue depths, memory) is
+// read from the owning module at scrape time on the loop's own thread, so
+// it costs nothing until someone asks.
+
+typedef struct
+{
+  uint64_t counters[METRIC_COUNTERS];
+  uint64_t buckets[METRIC_HISTOGRAMS][METRICS_BUCKETS];
+  uint64_t sums[METRIC_HISTOGRAMS]; // ns
+} __attribute__((aligned(64))) MetricsBlock;
+
+// Threads past the first METRICS_MAX_THREADS - 1 share the last block,
+// which is updated with atomic adds instead
+static MetricsBlock blocks[METRICS_MAX_THREADS];
+static int blocks_claimed = 0;
+static __thread MetricsBlock *own_block = NULL;
+
+typedef struct
+{
+  const char *name;
+  const char *help;
+  const char *labels;
+} MetricInfo;
+
+static const MetricInfo counter_info[METRIC_COUNTERS] = {
+    {"my_dispute_messages_delivered_total", "Channel messages delivered on this terminal", ""},
+    {"my_dispute_direct_messages_total", "Direct messages sent", ""},
+    {"my_dispute_auth_attempts_total", "Login attempts", ""},
+    {"my_dispute_auth_failures_total", "Login attempts with a wrong name or password", ""},
+    {"my_dispute_moderation_actions_total", "Successful moderation commands", "action=\"mute\""},
+    {"my_dispute_moderation_actions_total", "", "action=\"role\""},
+    {"my_dispute_moderation_actions_total", "", "action=\"moderator\""},
+    {"my_dispute_moderation_actions_total", "", "action=\"kick\""},
+};
+
+static const MetricInfo histogram_info[METRIC_HISTOGRAMS] = {
+    {"my_dispute_deliver_seconds", "Adding a channel message and its read state (sampled)", ""},
+    {"my_dispute_fanout_seconds", "Hub passes relaying new messages to every terminal", ""},
+    {"my_dispute_persist_seconds", "Writing channel history to disk", "op=\"flush\""},
+    {"my_dispute_persist_seconds", "", "op=\"seal\""},
+    {"my_dispute_persist_seconds", "", "op=\"compact\""},
+};
+
+static MetricsBlock *block()
+{
+  if (!own_block)
+  {
+    int index = __atomic_fetch_add(&blocks_claimed, 1, __ATOMIC_RELAXED);
+    own_block = &blocks[index < METRICS_MAX_THREADS ? index : METRICS_MAX_THREADS - 1];
+  }
+  return own_block;
+}
+
+static void add(MetricsBlock *b, uint64_t *value, uint64_t n)
+{
+  if (b == &blocks[METRICS_MAX_THREADS - 1])
+  {
+    __atomic_fetch_add(value, n, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+  }
+}
+
+void metrics_count(int counter, long n)
+{
+  MetricsBlock *b = block();
+  add(b, &b->counters[counter], n);
+}
+
+// Bucket k holds samples up to 1024 ns * 2^k
+static int bucket(long ns)
+{
+  if (ns <= 1024)
+  {
+    return 0;
+  }
+  int index = 64 - __builtin_clzl((unsigned long)(ns - 1) >> 10);
+  return index < METRICS_BUCKETS - 1 ? index : METRICS_BUCKETS - 1;
+}
+
+void metrics_observe(int histogram, long ns)
+{
+  MetricsBlock *b = block();
+  add(b, &b->buckets[histogram][bucket(ns)], 1);
+  add(b, &b->sums[histogram], ns > 0 ? ns : 0);
+}
+
+// Whether this call on a hot path should be timed: reading the clock
+// twice costs more than the work it brackets, so one call in
+// METRICS_SAMPLE_EVERY per thread is
+int metrics_sampled()
+{
+  static __thread unsigned int calls = 0;
+  return calls++ % METRICS_SAMPLE_EVERY == 0;
+}
+
+static uint64_t sum_blocks(const uint64_t *first)
+{
+  // Same field in every block, one block apart
+  size_t offset = (const char *)first - (const char *)&blocks[0];
+  uint64_t total = 0;
+  for (int i = 0; i < METRICS_MAX_THREADS; i++)
+  {
+    total += __atomic_load_n((const uint64_t *)((const char *)&blocks[i] + offset),
+                             __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+// The exposition is built in one buffer reused across scrapes
+static char *text = NULL;
+static size_t text_len = 0;
+static size_t text_capacity = 0;
+
+static void emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void emit(const char *fmt, ...)
+{
+  if (!text)
+  {
+    text_capacity = 16384;
+    text = malloc(text_capacity);
+    if (!text)
+    {
+      perror("malloc");
+      exit(1);
+    }
+  }
+  while (1)
+  {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text + text_len, text_capacity - text_len, fmt, args);
+    va_end(args);
+    if (len >= 0 && text_len + len < text_capacity)
+    {
+      text_len += len;
+      return;
+    }
+    text_capacity *= 2;
+    text = realloc(text, text_capacity);
+    if (!text)
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+}
+
+// HELP and TYPE once per family; families with labels are listed together
+static void family(const char *name, const char *help, const char *type, const char **last)
+{
+  if (*last && strcmp(*last, name) == 0)
+  {
+    return;
+  }
+  emit("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  *last = name;
+}
+
+// A label value with backslashes, quotes and newlines escaped
+static const char *label(const char *value)
+{
+  static char escaped[2 * MAX_CHANNEL_NAME_LEN + 1];
+  size_t len = 0;
+  for (const char *p = value; *p && len + 2 < sizeof(escaped); p++)
+  {
+    if (*p == '\\' || *p == '"' || *p == '\n')
+    {
+      escaped[len++] = '\\';
+    }
+    escaped[len++] = *p == '\n' ? 'n' : *p;
+  }
+  escaped[len] = '\0';
+  return escaped;
+}
+
+static void emit_histogram(int histogram)
+{
+  const MetricInfo *info = &histogram_info[histogram];
+  const char *sep = info->labels[0] ? "," : "";
+  uint64_t cumulative = 0;
+  for (int k = 0; k < METRICS_BUCKETS; k++)
+  {
+    cumulative += sum_blocks(&blocks[0].buckets[histogram][k]);
+    if (k == METRICS_BUCKETS - 1)
+    {
+      emit("%s_bucket{%s%sle=\"+Inf\"} %llu\n", info->name, info->labels, sep,
+           (unsigned long long)cumulative);
+    }
+    else
+    {
+      emit("%s_bucket{%s%sle=\"%.7g\"} %llu\n", info->name, info->labels, sep,
+           1024e-9 * (1L << k), (unsigned long long)cumulative);
+    }
+  }
+  const char *begin = info->labels[0] ? "{" : "";
+  const char *end = info->labels[0] ? "}" : "";
+  emit("%s_sum%s%s%s %.9f\n", info->name, begin, info->labels, end,
+       sum_blocks(&blocks[0].sums[histogram]) / 1e9);
+  emit("%s_count%s%s%s %llu\n", info->name, begin, info->labels, end,
+       (unsigned long long)cumulative);
+}
+
+// Render every metric. The text stays valid until the next call.
+const char *metrics_text(AppState *state, size_t *len)
+{
+  text_len = 0;
+  const char *last = NULL;
+
+  for (int i = 0; i < METRIC_COUNTERS; i++)
+  {
+    const MetricInfo *info = &counter_info[i];
+    family(info->name, info->help, "counter", &last);
+    emit("%s%s%s%s %llu\n", info->name, info->labels[0] ? "{" : "", info->labels,
+         info->labels[0] ? "}" : "", (unsigned long long)sum_blocks(&blocks[0].counters[i]));
+  }
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++)
+  {
+    family(histogram_info[i].name, histogram_info[i].help, "histogram", &last);
+    emit_histogram(i);
+  }
+
+  // Messages per channel: a terminal's own channels, or a hub's shared ones
+  TransportStats shm, sockets, shards, replicas;
+  shm_hub_stats(&shm);
+  net_server_stats(&sockets);
+  net_router_stats(&shards);
+  replication_stats(&replicas);
+  family("my_dispute_channel_messages_total", "Messages ever posted to a channel", "counter",
+         &last);
+  for (int i = 0; i < state->channel_count; i++)
+  {
+    emit("my_dispute_channel_messages_total{channel=\"%s\"} %u\n",
+         label(state->channels[i].name), state->channels[i].last_seq);
+  }
+  for (int i = 0; shm.memory_bytes && i < shm_hub_channel_count(); i++)
+  {
+    emit("my_dispute_channel_messages_total{channel=\"%s\"} %llu\n",
+         label(shm_hub_channel_name(i)), (unsigned long long)shm_hub_last_seq(i));
+  }
+
+  int online = 0;
+  for (int i = 0; i < state->user_count; i++)
+  {
+    online += state->users[i].is_online;
+  }
+  family("my_dispute_users_online", "Users logged in on this terminal or seen online through a hub",
+         "gauge", &last);
+  emit("my_dispute_users_online %d\n", online);
+
+  static const char *transports[] = {"shm", "socket", "shard", "replica"};
+  TransportStats *stats[] = {&shm, &sockets, &shards, &replicas};
+  family("my_dispute_connected_clients",
+         "Terminals, shards or replicas this process serves or reaches", "gauge", &last);
+  for (int t = 0; t < 4; t++)
+  {
+    emit("my_dispute_connected_clients{transport=\"%s\"} %d\n", transports[t], stats[t]->count);
+  }
+  family("my_dispute_queue_bytes", "Bytes waiting to be sent to or read from them", "gauge",
+         &last);
+  for (int t = 0; t < 4; t++)
+  {
+    emit("my_dispute_queue_bytes{transport=\"%s\"} %zu\n", transports[t],
+         stats[t]->queued_bytes);
+  }
+  family("my_dispute_queue_deepest_bytes", "Bytes waiting for the one furthest behind", "gauge",
+         &last);
+  for (int t = 0; t < 4; t++)
+  {
+    emit("my_dispute_queue_deepest_bytes{transport=\"%s\"} %zu\n", transports[t],
+         stats[t]->deepest_bytes);
+  }
+
+  size_t channel_bytes = 0;
+  for (int i = 0; i < state->channel_count; i++)
+  {
+    channel_bytes += channel_memory_usage(&state->channels[i]);
+  }
+  family("my_dispute_memory_bytes", "Heap and shared memory held, by subsystem", "gauge", &last);
+  emit("my_dispute_memory_bytes{subsystem=\"channels\"} %zu\n", channel_bytes);
+  emit("my_dispute_memory_bytes{subsystem=\"direct_messages\"} %zu\n", dm_memory_usage());
+  emit("my_dispute_memory_bytes{subsystem=\"history_cache\"} %zu\n", history_cache_bytes());
+  emit("my_dispute_memory_bytes{subsystem=\"shm_segments\"} %zu\n", shm.memory_bytes);
+  emit("my_dispute_memory_bytes{subsystem=\"socket_queues\"} %zu\n", sockets.memory_bytes);
+  emit("my_dispute_memory_bytes{subsystem=\"shard_queues\"} %zu\n", shards.memory_bytes);
+  emit("my_dispute_memory_bytes{subsystem=\"replication_log\"} %zu\n", replicas.memory_bytes);
+
+  *len = text_len;
+  return text;
+}
+
+// Server side
+
+typedef struct
+{
+  int fd; // -1 while the slot is free
+  long opened;
+  char request[1024];
+  size_t len;
+  char *response; // Set once the request is answered
+  size_t response_len;
+  size_t sent;
+} Scrape;
+
+static int listen_fd = -1;
+static char listen_path[108];
+static Scrape scrapes[METRICS_MAX_SCRAPES];
+static int polled[METRICS_MAX_SCRAPES]; // Scrape behind each pollfd after the first
+
+int metrics_open(const char *address)
+{
+  listen_fd = net_listen(address);
+  if (listen_fd < 0)
+  {
+    return 0;
+  }
+  if (strchr(address, '/'))
+  {
+    snprintf(listen_path, sizeof(listen_path), "%s", address);
+  }
+  for (int i = 0; i < METRICS_MAX_SCRAPES; i++)
+  {
+    scrapes[i].fd = -1;
+    scrapes[i].response = NULL;
+  }
+  return 1;
+}
+
+int metrics_active()
+{
+  return listen_fd >= 0;
+}
+
+static void end_scrape(Scrape *scrape)
+{
+  close(scrape->fd);
+  scrape->fd = -1;
+  free(scrape->response);
+  scrape->response = NULL;
+}
+
+// Take new connections; with every slot busy the oldest one gives way,
+// so a client that connects and says nothing can't lock scrapers out
+static void accept_scrapes()
+{
+  int fd;
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+  {
+    Scrape *slot = NULL;
+    for (int i = 0; i < METRICS_MAX_SCRAPES; i++)
+    {
+      if (scrapes[i].fd < 0)
+      {
+        slot = &scrapes[i];
+        break;
+      }
+      if (!slot || scrapes[i].opened < slot->opened)
+      {
+        slot = &scrapes[i];
+      }
+    }
+    if (slot->fd >= 0)
+    {
+      end_scrape(slot);
+    }
+    slot->fd = fd;
+    slot->opened = stats_now_ns();
+    slot->len = 0;
+  }
+}
+
+// Write as much of the response as the socket takes, hanging up once it
+// is all out or the connection failed
+static void flush_scrape(Scrape *scrape)
+{
+  while (scrape->sent < scrape->response_len)
+  {
+    ssize_t sent = send(scrape->fd, scrape->response + scrape->sent,
+                        scrape->response_len - scrape->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        end_scrape(scrape);
+      }
+      return;
+    }
+    scrape->sent += sent;
+  }
+  end_scrape(scrape);
+}
+
+// Answer a complete request. The response is copied out of the shared
+// exposition buffer and written as the socket drains, so a slow reader
+// never holds up the loop.
+static void respond(AppState *state, Scrape *scrape)
+{
+  char header[256];
+  int found = strncmp(scrape->request, "GET /metrics ", 13) == 0 ||
+              strncmp(scrape->request, "GET / ", 6) == 0;
+  size_t len = 0;
+  const char *body = found ? metrics_text(state, &len) : "Not found\n";
+  if (!found)
+  {
+    len = strlen(body);
+  }
+  int header_len = snprintf(header, sizeof(header),
+                            "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n",
+                            found ? "200 OK" : "404 Not Found",
+                            found ? "text/plain; version=0.0.4" : "text/plain", len);
+
+  scrape->response = malloc(header_len + len);
+  if (!scrape->response)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(scrape->response, header, header_len);
+  memcpy(scrape->response + header_len, body, len);
+  scrape->response_len = header_len + len;
+  scrape->sent = 0;
+  flush_scrape(scrape);
+}
+
+// Descriptors to poll for scrapes. Returns how many were written to fds
+// (at most METRICS_MAX_FDS), 0 when there is no endpoint.
+int metrics_fds(struct pollfd *fds)
+{
+  if (listen_fd < 0)
+  {
+    return 0;
+  }
+  int count = 0;
+  fds[count++] = (struct pollfd){listen_fd, POLLIN, 0};
+  for (int i = 0; i < METRICS_MAX_SCRAPES; i++)
+  {
+    if (scrapes[i].fd >= 0)
+    {
+      polled[count - 1] = i;
+      fds[count++] = (struct pollfd){scrapes[i].fd, scrapes[i].response ? POLLOUT : POLLIN, 0};
+    }
+  }
+  return count;
+}
+
+// Read what poll() reported for the descriptors from metrics_fds, answer
+// every request that is complete and write out pending responses
+void metrics_events(AppState *state, struct pollfd *fds, int count)
+{
+  for (int f = 1; f < count; f++)
+  {
+    Scrape *scrape = &scrapes[polled[f - 1]];
+    if (!fds[f].revents || scrape->fd != fds[f].fd)
+    {
+      continue;
+    }
+    if (scrape->response)
+    {
+      flush_scrape(scrape);
+      continue;
+    }
+    ssize_t got = recv(scrape->fd, scrape->request + scrape->len,
+                       sizeof(scrape->request) - 1 - scrape->len, 0);
+    if (got <= 0)
+    {
+      end_scrape(scrape);
+      continue;
+    }
+    scrape->len += got;
+    scrape->request[scrape->len] = '\0';
+    if (strstr(scrape->request, "\r\n\r\n") || strstr(scrape->request, "\n\n"))
+    {
+      respond(state, scrape);
+    }
+    else if (scrape->len == sizeof(scrape->request) - 1)
+    {
+      end_scrape(scrape);
+    }
+  }
+  if (count > 0 && (fds[0].revents & POLLIN))
+  {
+    accept_scrapes();
+  }
+}
+
+void metrics_close()
+{
+  if (listen_fd < 0)
+  {
+    return;
+  }
+  for (int i = 0; i < METRICS_MAX_SCRAPES; i++)
+  {
+    if (scrapes[i].fd >= 0)
+    {
+      end_scrape(&scrapes[i]);
+    }
+  }
+  close(listen_fd);
+  listen_fd = -1;
+  if (listen_path[0])
+  {
+    unlink(listen_path);
+  }
+  free(text);
+  text = NULL;
+  text_len = text_capacity = 0;
+}
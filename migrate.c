@@ -0,0 +1,751 @@
+#include "my_dispute.h"
+
+// Streaming export and import of channel history.
+//
+// export walks every channel that has history on disk and writes out its
+// messages oldest first. import reads such a stream and appends each
+// message straight to that channel's on-disk history with its original
+// sender and timestamp. It bypasses send_message and the in-memory ring:
+// segments are sealed and compressed as they fill, exactly as during a
+// live session, and memory use does not grow with the size of the input.
+//
+// JSONL format, one object per line:
+//   {"type":"channel","name":"general","access":"private 0\n"}
+//   {"type":"message","channel":"general","ts":1700000000,"sender":"alice","text":"hi"}
+// Channel records are optional on import; they create channels that have
+// no messages. access is the channel's saved access state (see
+// permissions.c); a channel imported without it is public. Private
+// channels are exported only with --private.
+//
+// Binary format: the magic "MDX1", then records. A channel record is the
+// byte 'C', a uint16 name length and the name, and applies to the records
+// that follow it. An access record is the byte 'A', a uint16 length and
+// the access state. A message record is the byte 'M', an int64
+// timestamp, uint16 sender and text lengths, then the sender and text.
+// Integers are little-endian.
+//
+// Saved accounts are not exported, so users travel only as the sender name
+// of each message and the member names in access state; other record
+// types are skipped.
+
+AppState app_state;
+
+#define BINARY_MAGIC "MDX1"
+
+static struct
+{
+  long messages;
+  long channels;
+  long truncated; // Messages whose sender or text was cut to fit
+  long skipped;   // Records that were malformed or not applicable
+  long withheld;  // Private channels left out of an export
+  long unwritten; // Messages the history could not store
+} totals;
+
+static void put_u16(FILE *out, unsigned int value)
+{
+  fputc(value & 0xFF, out);
+  fputc(value >> 8 & 0xFF, out);
+}
+
+static void put_i64(FILE *out, int64_t value)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    fputc((uint64_t)value >> (8 * i) & 0xFF, out);
+  }
+}
+
+static void put_json_string(FILE *out, const char *s)
+{
+  fputc('"', out);
+  for (const unsigned char *p = (const unsigned char *)s; *p; p++)
+  {
+    if (*p == '"' || *p == '\\')
+    {
+      fputc('\\', out);
+      fputc(*p, out);
+    }
+    else if (*p == '\n')
+    {
+      fputs("\\n", out);
+    }
+    else if (*p == '\t')
+    {
+      fputs("\\t", out);
+    }
+    else if (*p < 0x20)
+    {
+      fprintf(out, "\\u%04x", *p);
+    }
+    else
+    {
+      fputc(*p, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void export_history(FILE *out, int binary, int include_private)
+{
+  char names[MAX_CHANNELS][MAX_CHANNEL_NAME_LEN];
+  int count = history_channels(names, MAX_CHANNELS);
+
+  if (binary)
+  {
+    fwrite(BINARY_MAGIC, 1, 4, out);
+  }
+
+  // Channels are exported one at a time through a single slot, so only
+  // one channel's history is open at once
+  Channel *channel = &app_state.channels[0];
+  for (int i = 0; i < count; i++)
+  {
+    init_channel(channel, names[i]);
+    if (!channel->history)
+    {
+      continue;
+    }
+    load_channel_access(channel);
+    if (channel->is_private && !include_private)
+    {
+      totals.withheld++;
+      continue;
+    }
+    totals.channels++;
+
+    char *access = history_load_access(channel);
+    if (binary)
+    {
+      fputc('C', out);
+      put_u16(out, strlen(channel->name));
+      fputs(channel->name, out);
+      if (access && strlen(access) <= 0xFFFF)
+      {
+        fputc('A', out);
+        put_u16(out, strlen(access));
+        fputs(access, out);
+      }
+    }
+    else
+    {
+      fputs("{\"type\":\"channel\",\"name\":", out);
+      put_json_string(out, channel->name);
+      if (access)
+      {
+        fputs(",\"access\":", out);
+        put_json_string(out, access);
+      }
+      fputs("}\n", out);
+    }
+    free(access);
+
+    for (uint32_t seq = history_first_seq(channel); seq <= channel->last_seq; seq++)
+    {
+      HistoryMessage msg;
+      if (!history_get(channel, seq, &msg))
+      {
+        continue;
+      }
+
+      if (binary)
+      {
+        fputc('M', out);
+        put_i64(out, msg.timestamp);
+        put_u16(out, strlen(msg.sender));
+        put_u16(out, strlen(msg.text));
+        fputs(msg.sender, out);
+        fputs(msg.text, out);
+      }
+      else
+      {
+        fputs("{\"type\":\"message\",\"channel\":", out);
+        put_json_string(out, channel->name);
+        fprintf(out, ",\"ts\":%lld,\"sender\":", (long long)msg.timestamp);
+        put_json_string(out, msg.sender);
+        fputs(",\"text\":", out);
+        put_json_string(out, msg.text);
+        fputs("}\n", out);
+      }
+      totals.messages++;
+    }
+  }
+  free_channel(channel);
+}
+
+// Find or create the channel a record names
+static Channel *import_channel(const char *name)
+{
+  int index = find_channel(&app_state, name);
+  if (index >= 0)
+  {
+    return &app_state.channels[index];
+  }
+
+  if (app_state.channel_count >= MAX_CHANNELS || name[0] == '\0' ||
+      strlen(name) >= MAX_CHANNEL_NAME_LEN)
+  {
+    return NULL;
+  }
+
+  Channel *channel = &app_state.channels[app_state.channel_count];
+  init_channel(channel, name);
+  if (!channel->history)
+  {
+    free_channel(channel);
+    return NULL;
+  }
+  app_state.channel_count++;
+  totals.channels++;
+  return channel;
+}
+
+// Longest prefix of text within max bytes that does not split a character
+static size_t utf8_prefix(const char *text, size_t len, size_t max)
+{
+  if (len <= max)
+  {
+    return len;
+  }
+  while (max > 0 && ((unsigned char)text[max] & 0xC0) == 0x80)
+  {
+    max--;
+  }
+  return max;
+}
+
+static void import_message(Channel *channel, int64_t timestamp, const char *sender,
+                           size_t sender_len, const char *text, size_t text_len)
+{
+  // Keep within the limits the interactive path enforces
+  char name[MAX_USERNAME_LEN];
+  size_t name_len = utf8_prefix(sender, sender_len, MAX_USERNAME_LEN - 1);
+  size_t len = utf8_prefix(text, text_len, MAX_MESSAGE_LEN - 1);
+  if (name_len < sender_len || len < text_len)
+  {
+    totals.truncated++;
+  }
+  memcpy(name, sender, name_len);
+  name[name_len] = '\0';
+
+  channel->last_seq++;
+  if (!history_append(channel, timestamp, name, text, len))
+  {
+    channel->last_seq--;
+    totals.unwritten++;
+    return;
+  }
+  totals.messages++;
+}
+
+// Parse exactly four hex digits
+static int parse_hex4(const char *p, unsigned int *value)
+{
+  *value = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    if (!isxdigit((unsigned char)p[i]))
+    {
+      return 0;
+    }
+    *value = *value << 4 | (isdigit((unsigned char)p[i]) ? p[i] - '0' : (p[i] | 0x20) - 'a' + 10);
+  }
+  return 1;
+}
+
+// Decode the JSON string whose opening quote *p points at, in place.
+// Returns the decoded string (NUL-terminated, length in *len) and leaves
+// *p past the closing quote, or returns NULL when it is malformed.
+static char *parse_json_string(char **p, size_t *len)
+{
+  char *read = *p + 1;
+  char *start = read;
+  char *write = read;
+
+  while (*read != '"')
+  {
+    if (*read == '\0')
+    {
+      return NULL;
+    }
+    if (*read != '\\')
+    {
+      *write++ = *read++;
+      continue;
+    }
+
+    read++;
+    switch (*read++)
+    {
+    case '"':
+      *write++ = '"';
+      break;
+    case '\\':
+      *write++ = '\\';
+      break;
+    case '/':
+      *write++ = '/';
+      break;
+    case 'b':
+      *write++ = '\b';
+      break;
+    case 'f':
+      *write++ = '\f';
+      break;
+    case 'n':
+      *write++ = '\n';
+      break;
+    case 'r':
+      *write++ = '\r';
+      break;
+    case 't':
+      *write++ = '\t';
+      break;
+    case 'u':
+    {
+      unsigned int cp, low;
+      if (!parse_hex4(read, &cp))
+      {
+        return NULL;
+      }
+      read += 4;
+      if (cp >= 0xD800 && cp < 0xDC00 && read[0] == '\\' && read[1] == 'u' &&
+          parse_hex4(read + 2, &low) && low >= 0xDC00 && low < 0xE000)
+      {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        read += 6;
+      }
+      if (cp == 0 || (cp >= 0xD800 && cp < 0xE000))
+      {
+        return NULL;
+      }
+
+      // Encode as UTF-8; never longer than the escape it replaces
+      if (cp < 0x80)
+      {
+        *write++ = cp;
+      }
+      else if (cp < 0x800)
+      {
+        *write++ = 0xC0 | cp >> 6;
+        *write++ = 0x80 | (cp & 0x3F);
+      }
+      else if (cp < 0x10000)
+      {
+        *write++ = 0xE0 | cp >> 12;
+        *write++ = 0x80 | (cp >> 6 & 0x3F);
+        *write++ = 0x80 | (cp & 0x3F);
+      }
+      else
+      {
+        *write++ = 0xF0 | cp >> 18;
+        *write++ = 0x80 | (cp >> 12 & 0x3F);
+        *write++ = 0x80 | (cp >> 6 & 0x3F);
+        *write++ = 0x80 | (cp & 0x3F);
+      }
+      break;
+    }
+    default:
+      return NULL;
+    }
+  }
+
+  *p = read + 1;
+  *write = '\0';
+  *len = write - start;
+  return start;
+}
+
+static char *skip_space(char *p)
+{
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+  {
+    p++;
+  }
+  return p;
+}
+
+// Import one JSONL line: a flat object of string and integer fields
+static void import_json_line(char *line)
+{
+  char *type = NULL, *name = NULL, *channel_name = NULL, *sender = NULL, *text = NULL;
+  char *access = NULL;
+  size_t sender_len = 0, text_len = 0, access_len = 0, len;
+  long long ts = 0;
+  int has_ts = 0;
+
+  char *p = skip_space(line);
+  if (*p == '\0')
+  {
+    return;
+  }
+  if (*p++ != '{')
+  {
+    totals.skipped++;
+    return;
+  }
+
+  p = skip_space(p);
+  while (*p != '}')
+  {
+    char *key;
+    if (*p != '"' || !(key = parse_json_string(&p, &len)))
+    {
+      totals.skipped++;
+      return;
+    }
+    p = skip_space(p);
+    if (*p++ != ':')
+    {
+      totals.skipped++;
+      return;
+    }
+    p = skip_space(p);
+
+    if (*p == '"')
+    {
+      char *value = parse_json_string(&p, &len);
+      if (!value)
+      {
+        totals.skipped++;
+        return;
+      }
+      if (strcmp(key, "type") == 0)
+      {
+        type = value;
+      }
+      else if (strcmp(key, "name") == 0)
+      {
+        name = value;
+      }
+      else if (strcmp(key, "channel") == 0)
+      {
+        channel_name = value;
+      }
+      else if (strcmp(key, "sender") == 0)
+      {
+        sender = value;
+        sender_len = len;
+      }
+      else if (strcmp(key, "text") == 0)
+      {
+        text = value;
+        text_len = len;
+      }
+      else if (strcmp(key, "access") == 0)
+      {
+        access = value;
+        access_len = len;
+      }
+    }
+    else
+    {
+      // Numbers and literals; only ts is used
+      char *end;
+      long long number = strtoll(p, &end, 10);
+      if (end == p)
+      {
+        while (isalpha((unsigned char)*end))
+        {
+          end++;
+        }
+        if (end == p)
+        {
+          totals.skipped++;
+          return;
+        }
+      }
+      else if (strcmp(key, "ts") == 0)
+      {
+        ts = number;
+        has_ts = 1;
+      }
+      p = end;
+    }
+
+    p = skip_space(p);
+    if (*p == ',')
+    {
+      p = skip_space(p + 1);
+    }
+    else if (*p != '}')
+    {
+      totals.skipped++;
+      return;
+    }
+  }
+
+  if (type && strcmp(type, "message") == 0 && channel_name && sender && text && has_ts)
+  {
+    Channel *channel = import_channel(channel_name);
+    if (channel)
+    {
+      import_message(channel, ts, sender, sender_len, text, text_len);
+      return;
+    }
+  }
+  else if (type && strcmp(type, "channel") == 0 && name)
+  {
+    Channel *channel = import_channel(name);
+    if (channel)
+    {
+      if (access)
+      {
+        history_save_access(channel, access, access_len);
+      }
+      return;
+    }
+  }
+  totals.skipped++;
+}
+
+static void import_jsonl(FILE *in)
+{
+  char *line = NULL;
+  size_t capacity = 0;
+  while (getline(&line, &capacity, in) != -1)
+  {
+    import_json_line(line);
+  }
+  free(line);
+}
+
+static int get_u16(FILE *in, unsigned int *value)
+{
+  int low = fgetc(in);
+  int high = fgetc(in);
+  if (high == EOF)
+  {
+    return 0;
+  }
+  *value = low | high << 8;
+  return 1;
+}
+
+static int get_i64(FILE *in, int64_t *value)
+{
+  unsigned char bytes[8];
+  if (fread(bytes, 1, 8, in) != 8)
+  {
+    return 0;
+  }
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+  {
+    v = v << 8 | bytes[i];
+  }
+  *value = v;
+  return 1;
+}
+
+// Import the binary format; the magic has already been read
+static int import_binary(FILE *in)
+{
+  static char sender[65536], text[65536];
+  char name[65536];
+  Channel *channel = NULL;
+  int type;
+
+  while ((type = fgetc(in)) != EOF)
+  {
+    unsigned int name_len, sender_len, text_len;
+    int64_t ts;
+
+    if (type == 'C')
+    {
+      if (!get_u16(in, &name_len) || fread(name, 1, name_len, in) != name_len)
+      {
+        break;
+      }
+      name[name_len] = '\0';
+      channel = memchr(name, '\0', name_len) ? NULL : import_channel(name);
+      if (!channel)
+      {
+        totals.skipped++;
+      }
+    }
+    else if (type == 'A')
+    {
+      if (!get_u16(in, &text_len) || fread(text, 1, text_len, in) != text_len)
+      {
+        break;
+      }
+      if (channel)
+      {
+        history_save_access(channel, text, text_len);
+      }
+      else
+      {
+        totals.skipped++;
+      }
+    }
+    else if (type == 'M')
+    {
+      if (!get_i64(in, &ts) || !get_u16(in, &sender_len) || !get_u16(in, &text_len) ||
+          fread(sender, 1, sender_len, in) != sender_len ||
+          fread(text, 1, text_len, in) != text_len)
+      {
+        break;
+      }
+      if (channel && !memchr(sender, '\0', sender_len))
+      {
+        import_message(channel, ts, sender, sender_len, text, text_len);
+      }
+      else
+      {
+        totals.skipped++;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "unknown record type %d\n", type);
+      return 0;
+    }
+  }
+
+  if (type != EOF)
+  {
+    fprintf(stderr, "input ends in the middle of a record\n");
+    return 0;
+  }
+  return 1;
+}
+
+static int import_history(FILE *in)
+{
+  // JSONL starts with '{' or whitespace, the binary format with its magic
+  int first = fgetc(in);
+  if (first == BINARY_MAGIC[0])
+  {
+    char magic[3];
+    if (fread(magic, 1, 3, in) != 3 || memcmp(magic, BINARY_MAGIC + 1, 3) != 0)
+    {
+      fprintf(stderr, "not a my_dispute export\n");
+      return 0;
+    }
+    return import_binary(in);
+  }
+
+  if (first != EOF)
+  {
+    ungetc(first, in);
+  }
+  import_jsonl(in);
+  return 1;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s export|import [options] [FILE]\n", prog);
+  fprintf(stderr, "  --history DIR   history directory (default " DEFAULT_HISTORY_DIR ")\n");
+  fprintf(stderr, "  --format F      export format: jsonl (default) or binary; import\n");
+  fprintf(stderr, "                  detects the format\n");
+  fprintf(stderr, "  --private       export private channels too\n");
+  fprintf(stderr, "FILE defaults to standard output for export and standard input for\n");
+  fprintf(stderr, "import. Do not import while my_dispute is running on the same history.\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *history_dir = DEFAULT_HISTORY_DIR;
+  const char *path = NULL;
+  int binary = 0;
+  int include_private = 0;
+
+  if (argc < 2 || (strcmp(argv[1], "export") != 0 && strcmp(argv[1], "import") != 0))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  int exporting = strcmp(argv[1], "export") == 0;
+
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--history") == 0 && i + 1 < argc)
+    {
+      history_dir = argv[++i];
+    }
+    else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "binary") == 0 || strcmp(argv[i], "jsonl") == 0)
+      {
+        binary = strcmp(argv[i], "binary") == 0;
+      }
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--private") == 0)
+    {
+      include_private = 1;
+    }
+    else if (!path && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0))
+    {
+      path = argv[i];
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!history_init(history_dir, 0))
+  {
+    return 1;
+  }
+
+  FILE *file = exporting ? stdout : stdin;
+  if (path && strcmp(path, "-") != 0)
+  {
+    file = fopen(path, exporting ? "wb" : "rb");
+    if (!file)
+    {
+      perror(path);
+      return 1;
+    }
+  }
+
+  long start = stats_now_ns();
+  int ok = 1;
+  if (exporting)
+  {
+    export_history(file, binary, include_private);
+  }
+  else
+  {
+    ok = import_history(file);
+    for (int i = 0; i < app_state.channel_count; i++)
+    {
+      free_channel(&app_state.channels[i]);
+    }
+  }
+  if (fflush(file) != 0 || (file != stdout && file != stdin && fclose(file) != 0))
+  {
+    perror(path ? path : "output");
+    ok = 0;
+  }
+  double seconds = (stats_now_ns() - start) / 1e9;
+
+  fprintf(stderr, "%s %ld messages in %ld channels in %.2f s (%.0f msgs/s)\n",
+          exporting ? "exported" : "imported", totals.messages, totals.channels, seconds,
+          seconds > 0 ? totals.messages / seconds : 0.0);
+  if (totals.truncated || totals.skipped)
+  {
+    fprintf(stderr, "%ld messages truncated to fit, %ld records skipped\n", totals.truncated,
+            totals.skipped);
+  }
+  if (totals.unwritten)
+  {
+    fprintf(stderr, "%ld messages could not be written to the history\n", totals.unwritten);
+    ok = 0;
+  }
+  if (totals.withheld)
+  {
+    fprintf(stderr, "%ld private channels left out; --private exports them\n", totals.withheld);
+  }
+  return ok ? 0 : 1;
+}
@@ -9,6 +9,9 @@
 #include <time.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <poll.h>
 
 // Color pairs
 #define COLOR_NEON_YELLOW 1
@@ -30,45 +33,276 @@
 #define MAX_MESSAGE_LEN 256
 #define MAX_CHANNEL_NAME_LEN 30
 #define MAX_INPUT_LEN 512
-#define MAX_USERS 100
+#define MAX_USERS 4096
 #define MAX_CHANNELS 30
 #define MAX_MESSAGES 1000
 #define MAX_REACTIONS 10
+#define INPUT_HISTORY_SIZE 50
+
+// Channel permissions, as returned by channel_permissions
+#define PERM_READ 1     // See the channel and its messages
+#define PERM_SEND 2     // Post to it
+#define PERM_MODERATE 4 // Mute, invite and remove users
+#define PERM_ADMIN 8    // Create and delete channels, retention, roles
+
+// Words in a bitset with one bit per user index
+#define USER_SET_WORDS ((MAX_USERS + 63) / 64)
+
+// Sender ID used for messages generated by the application itself
+#define SYSTEM_SENDER_ID UINT32_MAX
+#define SYSTEM_SENDER_NAME "SYSTEM"
+
+// Runtime statistics histograms
+#define STATS_INPUT_LATENCY 0 // Key read to doupdate() completion, ns
+#define STATS_DRAW_CHANNELS 1
+#define STATS_DRAW_CHAT 2
+#define STATS_DRAW_USERS 3
+#define STATS_DRAW_INPUT 4
+#define STATS_OVERLAY 5     // Cost of the /stats overlay itself, ns
+#define STATS_FRAME_BYTES 6 // Terminal bytes written per frame
+#define STATS_METRIC_COUNT 7
+
+// HDR-style histogram buckets: STATS_SUB_BUCKETS linear steps per power of two
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
 
 // UI dimensions and positions
+#define INPUT_FIELD_X 16 // Column where typed text starts in the input pane
 #define LOGO_HEIGHT 30
 #define LOGO_WIDTH 60
 #define USER_LIST_WIDTH 25
 #define CHANNEL_LIST_WIDTH 60
 #define INPUT_HEIGHT 3
 
+// Rate limit scopes
+#define RATE_USER 0
+#define RATE_CHANNEL 1
+#define RATE_GLOBAL 2
+#define RATE_SCOPES 3
+
+// Same-host shared-memory transport
+#define SHM_RING_BYTES (64 * 1024) // Each direction of each client's ring pair
+#define SHM_MAX_CLIENTS 64
+#define SHM_HISTORY_SLOTS 1024 // Newest messages per channel readable in place
+
+// Remote terminals served by the hub over TCP or a Unix socket
+#define NET_MAX_CONNECTIONS 1024
+#define NET_DEFAULT_HIGH_WATER (256 * 1024) // Bytes queued per connection, at most
+#define NET_MAX_SHARDS 16                   // Shard hubs one router spreads channels over
+#define NET_MAX_ROUTED (NET_MAX_SHARDS * MAX_CHANNELS) // Channels one router serves, at most
+#define NET_SECRET_LEN 64                   // Bytes of a shared secret used, at most
+
+// Read replicas following a primary terminal's change log
+#define REPLICATION_MAX_REPLICAS 8
+#define REPLICATION_MAX_FDS (REPLICATION_MAX_REPLICAS + 2)
+#define LINK_MAX_WAIT_FDS (REPLICATION_MAX_FDS + METRICS_MAX_FDS + 1) // Caller fds link_wait polls
+
+// Metrics endpoint: counters and latency histograms recorded per thread
+#define METRICS_MAX_SCRAPES 4 // Scrapes read at once; a new one evicts the oldest
+#define METRICS_MAX_FDS (METRICS_MAX_SCRAPES + 1)
+#define METRICS_MAX_THREADS 16 // Threads with their own counters; later ones share one
+#define METRICS_BUCKETS 26     // Histogram buckets of 1024 ns * 2^k, the last one +Inf
+#define METRICS_SAMPLE_EVERY 16 // Hot-path calls per one that is timed
+#define METRIC_DELIVERED 0     // Channel messages delivered on this terminal
+#define METRIC_DIRECT_MESSAGES 1
+#define METRIC_AUTH_ATTEMPTS 2
+#define METRIC_AUTH_FAILURES 3
+#define METRIC_MUTES 4
+#define METRIC_ROLE_CHANGES 5
+#define METRIC_MODERATOR_CHANGES 6
+#define METRIC_KICKS 7
+#define METRIC_COUNTERS 8
+#define METRIC_DELIVER_NS 0 // deliver_message, one call in METRICS_SAMPLE_EVERY, ns
+#define METRIC_FANOUT_NS 1  // A hub pass that relayed messages to its terminals, ns
+#define METRIC_FLUSH_NS 2   // Pushing buffered history to its file, ns
+#define METRIC_SEAL_NS 3    // Compressing and writing a full history segment, ns
+#define METRIC_COMPACT_NS 4 // Rewriting history to apply retention, ns
+#define METRIC_HISTOGRAMS 5
+
 // Structures
+
+// Messages per second and the burst allowed on top; rate 0 means no limit
+typedef struct
+{
+  uint32_t rate;
+  uint32_t burst;
+} RateLimit;
+
+typedef struct
+{
+  uint32_t tokens;
+  time_t refilled; // app_time of the last refill
+} TokenBucket;
+
 typedef struct
 {
   char username[MAX_USERNAME_LEN];
   char email[MAX_EMAIL_LEN];
   char password[MAX_PASSWORD_LEN];
+  int name_width; // Display columns of username, computed at registration
   int role;
   int is_online;
   time_t muted_until[MAX_CHANNELS]; // Time until when user is muted on each channel
+  uint32_t last_read[MAX_CHANNELS]; // Channel sequence number read up to
+  uint16_t mentions[MAX_CHANNELS];  // @mentions since last_read
+  TokenBucket send_bucket;
+  uint32_t throttled;        // Messages dropped since the last throttling notice
+  time_t throttle_notice_at; // When that notice was posted
 } User;
 
 typedef struct
 {
-  char text[MAX_MESSAGE_LEN];
-  char sender[MAX_USERNAME_LEN];
+  char emoji[MAX_REACTIONS]; // Unicode emoji reactions
+  int count[MAX_REACTIONS];
+  int next_free; // Free list link while the set is unused
+} ReactionSet;
+
+typedef struct
+{
   time_t timestamp;
-  char reactions[MAX_REACTIONS]; // Unicode emoji reactions
-  int reaction_count[MAX_REACTIONS];
+  uint32_t sender_id;   // Index into AppState.users, or SYSTEM_SENDER_ID
+  uint32_t text_offset; // Offset of the NUL-terminated text in the channel arena
+  uint16_t text_len;    // Text length in bytes, excluding the terminator
+  uint16_t width;       // Display columns of text, computed at ingest
+  uint16_t reactions;   // 1-based index into Channel.reaction_sets, 0 if none
 } Message;
 
+// A direct-message conversation between two users, kept out of the
+// channel table
+typedef struct
+{
+  uint32_t low_user; // Smaller user index of the pair
+  uint32_t high_user;
+  Message *messages; // Oldest first, NULL until the first message
+  uint32_t count;
+  uint32_t capacity;
+  char *text; // NUL-terminated message texts in send order
+  uint32_t text_used;
+  uint32_t text_size;
+  uint32_t last_seq;    // Messages ever sent in the conversation
+  uint32_t read_seq[2]; // last_seq seen by low_user and high_user
+} Conversation;
+
+// A message read back from on-disk history; strings point into the page cache
+typedef struct
+{
+  time_t timestamp;
+  const char *sender;
+  const char *text;
+  uint16_t sender_width;
+  uint16_t width;
+} HistoryMessage;
+
+typedef struct ChannelHistory ChannelHistory;
+
+// How much history a channel keeps on disk; 0 means no limit
+typedef struct
+{
+  long max_age;          // Seconds
+  uint32_t max_messages;
+  uint64_t max_bytes;
+} RetentionPolicy;
+
+// Membership saved with a channel for a name not registered this run
+typedef struct
+{
+  char username[MAX_USERNAME_LEN];
+  int moderator;
+} AccessGrant;
+
 typedef struct
 {
   char name[MAX_CHANNEL_NAME_LEN];
-  Message messages[MAX_MESSAGES];
+  int name_width; // Display columns of name
+  Message messages[MAX_MESSAGES]; // Ring buffer, oldest entry at first_message
+  int first_message;
   int message_count;
+  uint32_t last_seq; // Sequence number of the newest message, 0 if none
+  char *text_arena; // Bump-allocated message text, compacted when full
+  uint32_t arena_used;
+  uint32_t arena_size;
+  ReactionSet *reaction_sets; // Allocated only for messages with reactions
+  int reaction_set_count;
+  int free_reaction_set; // Head of the free list, -1 if empty
+  ChannelHistory *history; // On-disk history, NULL when disabled
+  TokenBucket send_bucket;
+  int is_private; // Only members can see a private channel
+  uint64_t members[USER_SET_WORDS];    // Bitset of user indices
+  uint64_t moderators[USER_SET_WORDS]; // Channel moderators, also members
+  AccessGrant *grants; // Saved membership not yet claimed by a login
+  int grant_count;
 } Channel;
 
+// Single-producer, single-consumer byte ring in shared memory. Records are
+// 8-byte aligned; head and tail only grow and wrap modulo 2^32.
+typedef struct
+{
+  uint32_t head __attribute__((aligned(64))); // Bytes ever written, by the producer only
+  uint32_t tail __attribute__((aligned(64))); // Bytes ever read, by the consumer only
+  uint32_t waiting __attribute__((aligned(64))); // Consumer is going to sleep
+  uint32_t overflowed; // Producer dropped a record for want of room
+  char data[SHM_RING_BYTES];
+} ShmRing;
+
+typedef struct
+{
+  unsigned int counts[STATS_BUCKETS];
+  unsigned long total;
+  long max;
+} Histogram;
+
+// Peers a transport serves and what is queued for them, for metrics
+typedef struct
+{
+  int count;
+  size_t queued_bytes;  // Waiting across all peers
+  size_t deepest_bytes; // Waiting for the peer furthest behind
+  size_t memory_bytes;  // Buffers the transport holds
+} TransportStats;
+
+// Gap-buffer line editor for the input pane
+typedef struct
+{
+  char *buf;
+  int capacity;
+  int gap_start; // Cursor position in bytes
+  int gap_end;
+  int cursor_col;  // Display column of the cursor
+  int total_width; // Display columns of the whole line
+  char pending[4]; // Partial UTF-8 sequence being typed
+  int pending_len;
+  int pending_need;
+  char *history[INPUT_HISTORY_SIZE]; // Ring of submitted lines
+  int history_head;
+  int history_count;
+  int history_pos; // Entry being browsed, -1 when editing a new line
+  char *saved_line;
+  // Redraw tracking for draw_input
+  int dirty_pos; // First byte changed since the last draw, -1 if none
+  int dirty_col; // Display column of dirty_pos
+  int full_redraw;
+  int drawn_focus;
+  int drawn_end_col; // Field column just past the last drawn character
+  int scroll_pos;    // First visible byte when the line is wider than the field
+  int scroll_col;
+} LineEditor;
+
+// A scrolling side-pane list, narrowed by a typed filter
+#define LIST_FILTER_LEN 32
+typedef struct
+{
+  int *entries; // Channel or user indices that pass the filter, in order
+  int count;
+  int capacity;
+  int selected; // Position in entries
+  int scroll;   // First position on screen
+  char filter[LIST_FILTER_LEN];
+  int filter_len;
+  unsigned long built_version; // Roster version entries were built from
+  char built_filter[LIST_FILTER_LEN];
+} ListView;
+
 // Global state
 typedef struct
 {
@@ -83,16 +317,26 @@ typedef struct
   WINDOW *chat_win;
   WINDOW *input_win;
   WINDOW *users_win;
+  LineEditor input;
+  WINDOW *stats_win; // /stats overlay, NULL when hidden
+  int show_stats;
+  int chat_scroll; // Messages scrolled back from the newest in the chat pane
+  int dm_open;     // Chat pane shows the conversation with dm_peer, not a channel
+  int dm_peer;
+  ListView channel_list;
+  ListView user_list;
 } AppState;
 
 // Function declarations
 // UI
+SCREEN *init_headless_screen(int lines, int cols);
 void init_ui(AppState *state);
 void draw_logo(WINDOW *win);
 void draw_channels(WINDOW *win, AppState *state, bool has_focus);
 void draw_chat(WINDOW *win, AppState *state);
 void draw_users(WINDOW *win, AppState *state, bool has_focus);
-void draw_input(WINDOW *win, bool has_focus, char *current_input);
+void draw_input(WINDOW *win, bool has_focus, LineEditor *ed);
+void draw_stats_overlay(AppState *state);
 void handle_input(AppState *state, char *input);
 void cleanup_ui();
 
@@ -101,12 +345,46 @@ int login_screen();
 int register_screen();
 int authenticate_user(AppState *state, char *username, char *password);
 int add_new_user(AppState *state, char *username, char *email, char *password);
+#define DEFAULT_ACCOUNTS_FILE "my_dispute.accounts"
+int accounts_init(const char *path);
+const char *account_credential(const char *username);
+int register_account(AppState *state, char *username, char *email, char *password);
 int validate_password(char *password);
 
 // Channels
+#define DEFAULT_CHANNEL_COUNT 3
+extern const char *const default_channels[DEFAULT_CHANNEL_COUNT];
+void init_channel(Channel *channel, const char *name);
+void free_channel(Channel *channel);
+size_t channel_memory_usage(Channel *channel);
+int find_channel(AppState *state, const char *name);
 int create_channel(AppState *state, char *name);
 int delete_channel(AppState *state, char *name);
 int join_channel(AppState *state, int channel_index);
+void leave_chat_view(AppState *state);
+
+// Membership and permissions
+void user_set_add(uint64_t *set, int user_index);
+void user_set_remove(uint64_t *set, int user_index);
+int user_set_has(const uint64_t *set, int user_index);
+int channel_permissions(AppState *state, int user_index, int channel_index);
+int user_can(AppState *state, int user_index, int channel_index, int perm);
+int set_channel_private(AppState *state, int channel_index, int is_private);
+int invite_user(AppState *state, char *username, int channel_index);
+int kick_user(AppState *state, char *username, int channel_index);
+int toggle_channel_moderator(AppState *state, char *username, int channel_index);
+void save_channel_access(AppState *state, Channel *channel);
+int load_channel_access(Channel *channel);
+void restore_channel_access(AppState *state, int user_index);
+
+// Read markers
+#define READ_MARKERS_FILE "my_dispute.marks"
+void mark_channel_read(AppState *state, int user_index, int channel_index);
+uint32_t channel_unread(AppState *state, int user_index, int channel_index);
+void count_mentions(AppState *state, int channel_index, int sender_index, const char *text);
+int load_read_markers(AppState *state, const char *path);
+int save_read_markers(AppState *state, const char *path);
+void restore_read_markers(AppState *state, int user_index);
 
 // Users
 int set_user_role(AppState *state, char *username, int role);
@@ -114,8 +392,286 @@ int mute_user(AppState *state, char *username, int channel_index, int minutes);
 int get_selected_user_index(AppState *state);
 void navigate_users(AppState *state, int direction);
 void start_pm_with_selected_user(AppState *state);
+void open_direct_messages(AppState *state, int peer_index);
+
+// Channel and user lists
+void roster_add_user(int user_index, const char *name);
+int roster_find_user(AppState *state, const char *name, size_t len);
+void set_user_online(AppState *state, int user_index, int online);
+void list_view_free(ListView *view);
+void list_view_scroll(ListView *view, int rows);
+int list_view_find(ListView *view, int entry);
+int list_view_filter_key(ListView *view, int ch);
+void build_channel_list(AppState *state);
+void build_user_list(AppState *state);
+
+// Text width (UTF-8 display columns)
+int codepoint_width(unsigned int cp);
+int utf8_decode(const char *s, size_t len, unsigned int *cp);
+int text_width(const char *text);
+int text_width_n(const char *text, size_t len);
+size_t text_fit(const char *text, int max_cols, int *out_width);
+void print_clipped(WINDOW *win, int y, int x, const char *text, int max_cols);
+
+// Line editor
+void editor_init(LineEditor *ed);
+void editor_free(LineEditor *ed);
+int editor_length(LineEditor *ed);
+int editor_char_at(LineEditor *ed, int pos, unsigned int *cp);
+void editor_text(LineEditor *ed, char *out, int size);
+int editor_insert_byte(LineEditor *ed, int byte);
+int editor_insert_text(LineEditor *ed, const char *text);
+void editor_backspace(LineEditor *ed);
+void editor_delete(LineEditor *ed);
+void editor_delete_word(LineEditor *ed);
+void editor_left(LineEditor *ed);
+void editor_right(LineEditor *ed);
+void editor_home(LineEditor *ed);
+void editor_end(LineEditor *ed);
+void editor_set_text(LineEditor *ed, const char *text);
+void editor_clear(LineEditor *ed);
+void editor_commit(LineEditor *ed);
+void editor_history(LineEditor *ed, int direction);
+int editor_handle_key(LineEditor *ed, int ch);
+
+// Tab completion
+#define COMPLETE_COMMANDS 0
+#define COMPLETE_USERS 1
+#define COMPLETE_CHANNELS 2
+#define COMPLETE_KINDS 3
+void completion_add(int kind, const char *word);
+void completion_remove(int kind, const char *word);
+int completion_lookup(int kind, const char *prefix, int index, char *out, size_t size);
+int complete_input(AppState *state, int repeat);
+
+// Replay and virtual clock
+#define KEY_REPLAY_LOGOUT (KEY_MAX + 1) // Script event: log out to the auth screen
+#define KEY_PASTE_BEGIN (KEY_MAX + 2)   // Bracketed paste start marker
+#define KEY_PASTE_END (KEY_MAX + 3)     // Bracketed paste end marker
+#define KEY_SHARED_EVENT (KEY_MAX + 4)  // The shared hub has news for us
+int replay_open(const char *path);
+int replay_active();
+void replay_close();
+time_t app_time();
+int read_key(WINDOW *win);
+int read_key_nowait(WINDOW *win, int wait_ms);
+
+// On-disk history and page cache
+#define DEFAULT_HISTORY_DIR "my_dispute.history" // Unless --history says otherwise
+int history_init(const char *dir, size_t budget);
+void history_open(Channel *channel);
+int history_channels(char names[][MAX_CHANNEL_NAME_LEN], int max);
+void history_close(Channel *channel);
+void history_remove(Channel *channel);
+int history_append(Channel *channel, time_t timestamp, const char *sender, const char *text,
+                   size_t text_len);
+void history_flush(Channel *channel);
+int history_get(Channel *channel, uint32_t seq, HistoryMessage *out);
+size_t history_cache_bytes();
+long history_cache_hits();
+long history_cache_misses();
+uint32_t history_first_seq(Channel *channel);
+void history_set_retention(Channel *channel, RetentionPolicy *policy);
+int history_retention(Channel *channel, RetentionPolicy *policy);
+void history_save_access(Channel *channel, const char *text, size_t len);
+char *history_load_access(Channel *channel);
+int history_start_compactor(long rate);
+void history_stop_compactor();
+long history_reclaimed_bytes();
+long history_compaction_rate();
+long history_archived_bytes();
+long history_archived_raw_bytes();
+
+// Block compression
+size_t compress_block(const char *src, size_t len, char *dst, size_t capacity, const char *dict,
+                      size_t dict_len);
+int decompress_block(const char *src, size_t len, char *dst, size_t raw_len, const char *dict,
+                     size_t dict_len);
+size_t train_dictionary(const char *samples, size_t len, char *dict, size_t capacity);
+uint32_t checksum32(const char *data, size_t len);
+
+// Direct messages
+Conversation *dm_find(int user_a, int user_b);
+Conversation *dm_send(int from, int to, const char *text, time_t timestamp);
+void dm_append(Conversation *conv, uint32_t sender_id, const char *text, time_t timestamp);
+Message *dm_message(Conversation *conv, uint32_t index);
+const char *dm_text(Conversation *conv, Message *msg);
+void dm_mark_read(Conversation *conv, int user_index);
+uint32_t dm_unread(Conversation *conv, int user_index);
+Conversation *dm_conversation(int user_a, int user_b);
+long dm_conversation_count();
+size_t dm_memory_usage();
+void dm_free_all();
+
+// Offline inboxes
+#define DEFAULT_INBOX_DIR "my_dispute.inbox"
+int inbox_init(const char *dir);
+void inbox_queue_direct(AppState *state, int from, int to, const char *text, time_t timestamp);
+void inbox_queue_mention(AppState *state, int user_index, uint32_t sender_id, int channel_index,
+                         const char *text, time_t timestamp);
+int inbox_deliver(AppState *state, int user_index);
+long inbox_queued();
+long inbox_delivered();
+void inbox_free_all();
+
+// Rate limiting
+void rate_limit_set(int scope, uint32_t rate, uint32_t burst);
+int rate_limit_configure(const char *spec);
+int rate_limit_check(AppState *state, int user_index, int channel_index);
+int rate_limit_notice(AppState *state, int user_index, int scope, char *text, size_t size);
+long rate_limit_dropped();
+
+// Shared-memory transport (ring pairs, hub and clients)
+void shm_ring_init(ShmRing *ring);
+int shm_ring_write(ShmRing *ring, int type, const void *data, size_t len);
+const void *shm_ring_peek(ShmRing *ring, int *type, size_t *len);
+void shm_ring_consume(ShmRing *ring);
+void shm_sleep_begin(uint32_t *waiting);
+void shm_sleep_end(uint32_t *waiting);
+int shm_wake_needed(uint32_t *waiting);
+int shm_hub_open(const char *name);
+void shm_hub_publish(const char *channel_name, const char *sender, const char *text, size_t len,
+                     time_t timestamp);
+uint64_t shm_hub_epoch();
+long shm_hub_published();
+int shm_hub_channel_count();
+const char *shm_hub_channel_name(int index);
+uint64_t shm_hub_last_seq(int index);
+const char *shm_hub_message(int index, uint64_t seq, time_t *timestamp, const char **sender,
+                            size_t *len);
+int shm_hub_relay();
+int shm_hub_sleep_begin();
+void shm_hub_sleep_end();
+int shm_hub_fds(struct pollfd *fds);
+void shm_hub_events(struct pollfd *fds, int count);
+void shm_hub_stats(TransportStats *out);
+void shm_hub_close();
+int shm_client_attach(const char *name);
+int shm_client_attached();
+int shm_client_wait(struct pollfd *fds, int count, int timeout_ms);
+int shm_client_send(AppState *state, int channel_index, const char *text, time_t timestamp);
+int shm_client_poll(AppState *state);
+int shm_client_position(uint64_t *epoch, char names[][MAX_CHANNEL_NAME_LEN], uint64_t *seqs,
+                        int max);
+void shm_client_resume(uint64_t epoch, char names[][MAX_CHANNEL_NAME_LEN], const uint64_t *seqs,
+                       int count);
+void shm_client_detach();
+
+// Remote terminals (hub socket server, router, client and the link either
+// kind uses)
+int net_listen(const char *address);
+int net_load_secret(const char *path);
+int net_load_move_secret(const char *path);
+int net_read_secret(const char *path, char *out);
+int net_secret_matches(const char *expected, const char *secret);
+int net_server_open(const char *address, size_t high_water);
+int net_server_relay();
+int net_server_fds(struct pollfd *fds);
+void net_server_events(struct pollfd *fds, int count);
+void net_server_stats(TransportStats *out);
+void net_server_close();
+void net_submit(const char *channel, const char *sender, const char *text, size_t len,
+                time_t timestamp);
+int net_router_add_shard(const char *address);
+int net_router_relay();
+int net_router_fds(struct pollfd *fds);
+int net_router_events(struct pollfd *fds, int count);
+void net_router_stats(TransportStats *out);
+void net_router_close();
+int net_client_connect(const char *address);
+int net_client_attached();
+int net_client_position(uint64_t *epoch, char names[][MAX_CHANNEL_NAME_LEN], uint64_t *seqs,
+                        int max);
+void net_client_resume(uint64_t epoch, char names[][MAX_CHANNEL_NAME_LEN], const uint64_t *seqs,
+                       int count);
+int net_client_wait(struct pollfd *fds, int count, int timeout_ms);
+int net_client_send(AppState *state, int channel_index, const char *text, time_t timestamp);
+int net_client_presence(AppState *state, int online);
+int net_client_direct(AppState *state, int recipient, const char *text, time_t timestamp);
+int net_client_move(const char *channel, int shard);
+int net_client_poll(AppState *state);
+void net_client_close();
+int link_attached();
+int link_wait(struct pollfd *fds, int count, int timeout_ms);
+int link_send(AppState *state, int channel_index, const char *text, time_t timestamp);
+void link_presence(AppState *state, int online);
+int link_direct(AppState *state, int recipient, const char *text, time_t timestamp);
+int link_move(const char *channel, int shard);
+int link_poll(AppState *state);
+int link_position(uint64_t *epoch, char names[][MAX_CHANNEL_NAME_LEN], uint64_t *seqs, int max);
+void link_resume(uint64_t epoch, char names[][MAX_CHANNEL_NAME_LEN], const uint64_t *seqs,
+                 int count);
+void link_close();
+
+// Read replicas (change log, primary side, replica side)
+void replication_log_start();
+const char *replication_log_data(size_t *len);
+long replication_apply_log(AppState *state, const char *data, size_t len);
+void replication_log_user(AppState *state, int user_index);
+void replication_log_role(int user_index, int role);
+void replication_log_mute(AppState *state, int user_index, int channel_index);
+void replication_log_create(const char *name);
+void replication_log_delete(const char *name);
+void replication_log_access(Channel *channel);
+void replication_log_append(Channel *channel, uint32_t sender_id, const char *text, size_t len,
+                            time_t timestamp);
+void replication_log_notice(Channel *channel);
+int replication_load_secret(const char *path);
+int replication_serve(const char *path);
+int replication_follow(const char *path);
+int replication_catch_up(AppState *state, int timeout_ms);
+int replication_active();
+int replication_read_only();
+int replication_fds(struct pollfd *fds);
+int replication_timeout_ms();
+int replication_events(AppState *state, struct pollfd *fds, int count);
+int replication_poll(AppState *state);
+int replication_promote(AppState *state);
+void replication_status(char *out, size_t size);
+void replication_stats(TransportStats *out);
+void replication_close();
+
+// Statistics
+void histogram_record(Histogram *h, long value);
+long histogram_percentile(Histogram *h, double p);
+long stats_now_ns();
+void stats_record(int metric, long value);
+long stats_percentile(int metric, double p);
+unsigned long stats_samples(int metric);
+const char *stats_metric_name(int metric);
+void stats_count_message();
+long stats_message_rate();
+long stats_messages_ingested();
+long stats_bytes_written();
+void stats_watch_output();
+void stats_begin_output();
+void stats_end_output();
+
+// Metrics endpoint
+void metrics_count(int counter, long n);
+void metrics_observe(int histogram, long ns);
+int metrics_sampled();
+const char *metrics_text(AppState *state, size_t *len);
+int metrics_open(const char *address);
+int metrics_active();
+int metrics_fds(struct pollfd *fds);
+void metrics_events(AppState *state, struct pollfd *fds, int count);
+void metrics_close();
 
 // Messaging
+Message *append_message(Channel *channel, uint32_t sender_id, const char *sender, const char *text,
+                        time_t timestamp);
+Message *channel_message(Channel *channel, int index);
+const char *message_text(Channel *channel, Message *msg);
+const char *sender_name(AppState *state, uint32_t sender_id);
+int sender_width(AppState *state, uint32_t sender_id);
+void post_system_message(Channel *channel, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void deliver_message(AppState *state, int channel_index, uint32_t sender_id, const char *text,
+                     time_t timestamp);
+int relayed_channel(AppState *state, const char *name);
+uint32_t relayed_sender(AppState *state, const char *name);
+int relayed_user(AppState *state, int user_index);
 int send_message(AppState *state, char *text);
 int send_private_message(AppState *state, char *username, char *text);
 int add_reaction(AppState *state, int message_index, char reaction);
@@ -0,0 +1,2899 @@
+#include "my_dispute.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Remote terminals served by the hub over TCP or a Unix socket.
+//
+// `my_dispute_hub --listen ADDRESS` serves the shared channels to any
+// number of `my_dispute --connect ADDRESS`, typically from SSH sessions on
+// other hosts. Messages a remote terminal sends are published like those
+// of same-host clients (shm.c), and every terminal is sent what the
+// hub's history segment holds.
+//
+// A stalled terminal must not make the hub hold messages for it. Each
+// connection has one fixed outbound buffer of high_water bytes plus one
+// frame, and the hub queues frames for it only while less than high_water
+// bytes are pending. A connection that reaches the mark keeps nothing
+// else: per channel it remembers only the next sequence number to send,
+// and once its socket has drained to half the mark it resumes from there,
+// reading the messages back out of the shared history. Messages that the
+// history dropped in the meantime are reported to the terminal as a gap.
+// So a slow terminal costs the same memory as a fast one, and the hub
+// never waits for any socket.
+//
+// Every hub channel numbers its messages with a 64-bit sequence that only
+// grows, and each hub run has an epoch of its own. A terminal's HELLO
+// carries the epoch and the last sequence it has of each channel; on a
+// reconnect to the same run it is sent only the messages after those, as
+// long as the shared history still holds them. A channel it is further
+// behind in than that starts from a snapshot of the NET_SNAPSHOT_MESSAGES
+// newest messages after a gap frame, and so does one it knows nothing of
+// (without the gap). The client reconnects by itself when the connection
+// drops, so a short network blip costs a few kilobytes, and a restarted
+// terminal resumes from the position saved with its read markers.
+//
+// Terminals also tell the hub who is logged in on them (PRESENCE), and the
+// hub passes on who is online anywhere, so direct messages can go to users
+// on other terminals (DIRECT). A name already logged in through another
+// connection is refused (TAKEN), so no terminal can claim someone else's
+// direct messages; routers vouch for their own terminals. The hub delivers a direct message to the
+// connections its recipient is logged in through, and drops it if there
+// are none; the sender keeps their copy either way.
+//
+// A hub started with --shard ADDRESS (repeatable) is a router: it serves
+// remote terminals as above, but owns no channel and keeps no history.
+// Each channel belongs to one shard hub, found by hashing its name, and
+// the router forwards what terminals post to it. What the shard publishes
+// comes back to the router, which numbers it in seqs of its own that run
+// on across moves, and hands it at once to every terminal waiting for
+// exactly that message. A terminal that joins or falls behind is caught
+// up from the shard's history instead: the router asks the shard to
+// REPLAY a chunk of the channel for it and passes on what comes back.
+// So a router holds no messages, and a cluster serves as many channels as
+// its shards together (NET_MAX_ROUTED). A terminal that has no room for a
+// channel says so (IGNORE) and is sent nothing of it from then on.
+//
+// Users are homed on shards the same way, and presence and direct
+// messages go through the recipient's home shard, so several routers can
+// front the same shards. The router merges the shards' presence into one
+// view.
+//
+// A channel moves to another shard on a MOVE from a terminal. The router
+// holds new messages for the channel and sends the old shard a FENCE
+// behind everything it already forwarded. The shard answers with the
+// channel's last seq. Once the router has received up to that seq, it
+// forwards the held messages to the new shard, which owns the channel
+// from then on. Nothing is lost or reordered. Where each channel lives
+// is kept in the router; only one router should move channels.
+//
+// A hub listens on loopback unless given a host. Listening beyond this
+// host takes a shared secret (--secret FILE on the hub, its terminals and
+// its routers), which every HELLO must carry; without one, only processes
+// on this host can connect, as with the shared-memory hub. Either way a
+// terminal may only send as, and direct messages only come from, users
+// it has said are logged in through it. Routers, which forward for many
+// terminals, say so in their HELLO.
+//
+// Frames are a FrameHeader and len payload bytes in host byte order, so
+// both ends must share it.
+
+#define NET_VERSION 5
+
+// Messages a terminal with nothing to resume from is sent per channel
+#define NET_SNAPSHOT_MESSAGES 100
+
+#define FRAME_HELLO 1   // Terminal to hub: HelloFrame and its last seqs, first
+#define HELLO_ROUTER 1  // HelloFrame flag: a router forwarding for its terminals
+
+#define FRAME_SEND 2    // Terminal to hub: SendFrame followed by the text
+#define FRAME_CHANNEL 3 // Hub to terminal: ChannelFrame, before its messages
+#define FRAME_MESSAGE 4 // Hub to terminal: MessageFrame followed by the text
+#define FRAME_GAP 5     // Hub to terminal: GapFrame
+#define FRAME_WELCOME 6 // Hub to terminal: WelcomeFrame, before anything else
+#define FRAME_PRESENCE 7 // Both ways: PresenceFrame
+#define FRAME_DIRECT 8   // Both ways: DirectFrame followed by the text
+#define FRAME_MOVE 9     // Terminal to router: MoveFrame
+#define FRAME_FENCE 10   // Router to shard: FenceFrame without a seq
+#define FRAME_FENCED 11  // Shard to router: FenceFrame with the channel's last seq
+#define FRAME_TAKEN 12   // Hub to terminal: PresenceFrame it refused, the name being in use
+#define FRAME_IGNORE 13  // Terminal to hub: ChannelFrame of a channel it has no room for
+#define FRAME_REPLAY 14  // Router to shard: ReplayFrame asking for messages again
+#define FRAME_REPLAYED 15   // Shard to router: MessageFrame whose channel is the replay's tag
+#define FRAME_REPLAY_END 16 // Shard to router: the ReplayFrame, once all it still has is sent,
+                            // with from the oldest seq it has
+
+#define MAX_FRAME (sizeof(FrameHeader) + sizeof(SendFrame) + MAX_MESSAGE_LEN)
+#define MAX_HELLO (sizeof(FrameHeader) + sizeof(HelloFrame) + NET_MAX_ROUTED * sizeof(uint64_t))
+#define SERVER_IN_BYTES (MAX_HELLO + 4 * MAX_FRAME)
+#define CLIENT_IN_BYTES (64 * 1024)
+#define CONTROL_BYTES (64 * 1024)        // Direct messages queued per connection, at most
+#define SHARD_OUT_BYTES (16 * 1024 * 1024) // Frames held for a shard, at most
+#define MOVE_HELD_BYTES (1024 * 1024)      // Messages held for a moving channel, at most
+#define MOVE_TIMEOUT_NS 10000000000L       // A move not finished by then is given up
+#define NET_MAX_REPLAYS 64      // Replays a router has asked of its shards at once, at most
+#define NET_REPLAY_MESSAGES 256 // Messages asked for by one replay, at most
+#define UNSUBSCRIBED UINT64_MAX // next_seq of a channel the terminal ignores
+
+typedef struct
+{
+  uint32_t len; // Payload bytes
+  uint32_t type;
+} FrameHeader;
+
+typedef struct
+{
+  uint32_t version;
+  uint32_t channel_count; // Channels of the epoch the terminal has heard of
+  uint64_t epoch;         // Hub run its seqs come from, 0 if none
+  uint32_t flags;         // HELLO_*
+  char secret[NET_SECRET_LEN]; // The hub's shared secret, zero-padded
+  // channel_count uint64_t follow: the last seq it has of each channel
+} HelloFrame;
+
+typedef struct
+{
+  uint64_t epoch;
+} WelcomeFrame;
+
+typedef struct
+{
+  int64_t timestamp;
+  char sender[MAX_USERNAME_LEN];
+  char channel[MAX_CHANNEL_NAME_LEN];
+} SendFrame;
+
+typedef struct
+{
+  uint32_t channel; // Index in the hub's history
+  char name[MAX_CHANNEL_NAME_LEN];
+} ChannelFrame;
+
+typedef struct
+{
+  int64_t timestamp;
+  uint64_t seq;
+  uint32_t channel;
+  char sender[MAX_USERNAME_LEN];
+} MessageFrame;
+
+// Messages from..to of a channel that the terminal will never be sent
+typedef struct
+{
+  uint32_t channel;
+  uint64_t from;
+  uint64_t to;
+} GapFrame;
+
+typedef struct
+{
+  char user[MAX_USERNAME_LEN];
+  uint32_t online;
+} PresenceFrame;
+
+typedef struct
+{
+  int64_t timestamp;
+  char sender[MAX_USERNAME_LEN];
+  char recipient[MAX_USERNAME_LEN];
+} DirectFrame;
+
+typedef struct
+{
+  char channel[MAX_CHANNEL_NAME_LEN];
+  uint32_t shard;                  // Index in the router's --shard list
+  char secret[NET_SECRET_LEN];     // The router's move secret, zero-padded
+} MoveFrame;
+
+typedef struct
+{
+  char channel[MAX_CHANNEL_NAME_LEN];
+  uint32_t move;     // Router's number for the move, echoed in the reply
+  uint64_t last_seq;
+} FenceFrame;
+
+// Messages from..to of a shard channel, sent again to a router
+typedef struct
+{
+  uint32_t tag; // Router's number for the replay, echoed in every reply
+  char channel[MAX_CHANNEL_NAME_LEN];
+  uint64_t from;
+  uint64_t to;
+} ReplayFrame;
+
+// A replay a shard is working through
+typedef struct
+{
+  ReplayFrame frame;
+  int channel; // Index in the hub's history, -1 if it has no such channel
+  uint64_t next;
+} ReplayRequest;
+
+typedef struct
+{
+  int fd;
+  int index;   // In connections
+  long serial; // Tells a later connection at the same index apart
+  int greeted; // HELLO arrived; nothing is queued before it
+  int router;  // The peer is a router, which sends for users of its own
+  char *out;   // Frames not yet written, high_water + MAX_FRAME bytes
+  size_t out_len;
+  size_t out_sent;
+  char in[SERVER_IN_BYTES];
+  size_t in_len;
+  long seen_published; // shm_hub_published() when last filled
+  int behind;          // Stopped at the high-water mark with messages left
+  int announced;       // Channels the terminal has been told about
+  int resumed;         // Channels whose next_seq came with the HELLO
+  uint64_t next_seq[NET_MAX_ROUTED]; // Next message to queue, per hub channel
+  char replaying[NET_MAX_ROUTED];    // On a router: a replay of the channel is on its way
+  ReplayRequest replays[NET_MAX_REPLAYS]; // On a shard: what the router asked for again
+  int replay_count;
+  char *control;                   // Direct messages and fence replies waiting for room
+  size_t control_len;
+  size_t control_capacity;
+  uint64_t presence_seen;          // Presence changes the terminal has been sent
+  char (*users)[MAX_USERNAME_LEN]; // Logged in through this connection
+  int user_count;
+  int user_capacity;
+} Connection;
+
+// Whether a user is online through any connection, or on a router, in
+// what the shards report
+typedef struct
+{
+  char name[MAX_USERNAME_LEN];
+  int count;        // Connections the user is logged in through
+  uint64_t changed; // presence_version when count last became or stopped being 0
+} PresenceEntry;
+
+static char net_secret[NET_SECRET_LEN];  // Shared secret, zero-padded; empty if none
+static char move_secret[NET_SECRET_LEN]; // Taken with MOVE frames, likewise
+
+// Read a secret from the first line of a file into out, zero-padded.
+// Returns 0 after saying why not.
+int net_read_secret(const char *path, char *out)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    perror(path);
+    return 0;
+  }
+  char line[256];
+  int ok = fgets(line, sizeof(line), file) != NULL;
+  fclose(file);
+  line[ok ? strcspn(line, "\r\n") : 0] = '\0';
+  if (!line[0])
+  {
+    fprintf(stderr, "%s: no secret on the first line\n", path);
+    return 0;
+  }
+  memset(out, 0, NET_SECRET_LEN);
+  memcpy(out, line, strnlen(line, NET_SECRET_LEN));
+  return 1;
+}
+
+int net_load_secret(const char *path)
+{
+  return net_read_secret(path, net_secret);
+}
+
+// The secret a router takes moves with, and a terminal sends them with
+int net_load_move_secret(const char *path)
+{
+  return net_read_secret(path, move_secret);
+}
+
+// Whether a frame carries the expected secret, compared in constant time
+int net_secret_matches(const char *expected, const char *secret)
+{
+  unsigned char differ = 0;
+  for (int i = 0; i < NET_SECRET_LEN; i++)
+  {
+    differ |= expected[i] ^ secret[i];
+  }
+  return differ == 0;
+}
+
+// Resolve "PATH" (anything with a slash) to a Unix socket address, or
+// "[HOST:]PORT" to a TCP one. Without a host the address is loopback; a
+// server given the host "*" binds to every interface.
+static int resolve(const char *address, int passive, struct sockaddr_storage *addr,
+                   socklen_t *len)
+{
+  memset(addr, 0, sizeof(*addr));
+  if (strchr(address, '/'))
+  {
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    if (strlen(address) >= sizeof(un->sun_path))
+    {
+      return 0;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address);
+    *len = sizeof(struct sockaddr_un);
+    return 1;
+  }
+
+  char host[256] = "";
+  const char *port = strrchr(address, ':');
+  if (port)
+  {
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    port++;
+  }
+  else
+  {
+    port = address;
+  }
+
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int any = passive && strcmp(host, "*") == 0;
+  hints.ai_flags = any ? AI_PASSIVE : 0;
+  struct addrinfo *found;
+  if (getaddrinfo(any ? NULL : host[0] ? host : "127.0.0.1", port, &hints, &found) != 0)
+  {
+    return 0;
+  }
+  memcpy(addr, found->ai_addr, found->ai_addrlen);
+  *len = found->ai_addrlen;
+  freeaddrinfo(found);
+  return 1;
+}
+
+static void no_delay(int fd)
+{
+  int one = 1;
+  if (fd >= 0)
+  {
+    // Fails harmlessly on Unix sockets
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+}
+
+// Listen on an address as resolve() reads it, non-blocking. Returns the
+// descriptor, or -1 after saying why not.
+int net_listen(const char *address)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  if (!resolve(address, 1, &addr, &addr_len))
+  {
+    fprintf(stderr, "Invalid listen address '%s'\n", address);
+    return -1;
+  }
+  if (addr.ss_family == AF_UNIX)
+  {
+    // A socket file left by a process that did not exit cleanly
+    unlink(address);
+  }
+
+  int one = 1;
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(fd, (struct sockaddr *)&addr, addr_len) != 0 || listen(fd, 64) != 0)
+  {
+    fprintf(stderr, "Can't listen on '%s': %s\n", address, strerror(errno));
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// Hub side
+
+static int listen_fd = -1;
+static char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static size_t high_water = NET_DEFAULT_HIGH_WATER;
+static Connection *connections[NET_MAX_CONNECTIONS];
+static int polled[NET_MAX_CONNECTIONS]; // Connection behind each pollfd after the first
+static long connections_served = 0;
+static long resyncs = 0;
+static long skipped_messages = 0;
+static PresenceEntry *presence = NULL;
+static int presence_count = 0;
+static int presence_capacity = 0;
+static uint64_t presence_version = 0;
+static long controls_queued = 0; // Frames put in any connection's control queue
+static long directs_dropped = 0;
+static long refused_frames = 0; // Sends and direct messages from users not logged in there,
+                                // logins of names in use, moves without the move secret
+
+// Router side, below
+static int routing();
+static void route_presence(const char *user, int online);
+static void route_direct(const DirectFrame *frame, const char *text, size_t len);
+static void start_move(const char *channel, uint32_t shard);
+static uint64_t routed_epoch();
+static long routed_news();
+static int fill_routed(Connection *conn);
+
+// Whether only processes on this host can reach an address
+static int local_address(const struct sockaddr_storage *addr)
+{
+  if (addr->ss_family == AF_INET)
+  {
+    return ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr) >> 24 == 127;
+  }
+  if (addr->ss_family == AF_INET6)
+  {
+    const struct in6_addr *in6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+    return IN6_IS_ADDR_LOOPBACK(in6) || (IN6_IS_ADDR_V4MAPPED(in6) && in6->s6_addr[12] == 127);
+  }
+  return addr->ss_family == AF_UNIX;
+}
+
+int net_server_open(const char *address, size_t queue_bytes)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  if (!net_secret[0] && resolve(address, 1, &addr, &addr_len) && !local_address(&addr))
+  {
+    fprintf(stderr, "Listening on '%s' lets other hosts in; give the hub --secret FILE\n",
+            address);
+    return 0;
+  }
+
+  high_water = queue_bytes > MAX_FRAME ? queue_bytes : MAX_FRAME;
+  listen_fd = net_listen(address);
+  if (listen_fd < 0)
+  {
+    return 0;
+  }
+  if (strchr(address, '/'))
+  {
+    snprintf(listen_path, sizeof(listen_path), "%s", address);
+  }
+  return 1;
+}
+
+static size_t pending(Connection *conn)
+{
+  return conn->out_len - conn->out_sent;
+}
+
+// Append a frame to a connection's queue. Callers only queue while less
+// than high_water bytes are pending, so one frame always fits.
+static void queue_frame(Connection *conn, int type, const void *data, size_t len,
+                        const char *text, size_t text_len)
+{
+  FrameHeader header = {len + text_len, type};
+  size_t need = sizeof(header) + len + text_len;
+  if (conn->out_len + need > high_water + MAX_FRAME)
+  {
+    memmove(conn->out, conn->out + conn->out_sent, pending(conn));
+    conn->out_len -= conn->out_sent;
+    conn->out_sent = 0;
+  }
+  char *p = conn->out + conn->out_len;
+  memcpy(p, &header, sizeof(header));
+  memcpy(p + sizeof(header), data, len);
+  if (text_len)
+  {
+    memcpy(p + sizeof(header) + len, text, text_len);
+  }
+  conn->out_len += need;
+}
+
+// Move waiting direct messages and fence replies to the queue, whole
+// frames only, as far as the high-water mark allows
+static void fill_control(Connection *conn)
+{
+  size_t pos = 0;
+  while (pos < conn->control_len && pending(conn) < high_water)
+  {
+    FrameHeader header;
+    memcpy(&header, conn->control + pos, sizeof(header));
+    queue_frame(conn, header.type, conn->control + pos + sizeof(header), header.len, NULL, 0);
+    pos += sizeof(header) + header.len;
+  }
+  memmove(conn->control, conn->control + pos, conn->control_len - pos);
+  conn->control_len -= pos;
+}
+
+// Queue who came online or went offline since the terminal was last told
+static void fill_presence(Connection *conn)
+{
+  if (conn->presence_seen == presence_version)
+  {
+    return;
+  }
+  for (int i = 0; i < presence_count; i++)
+  {
+    if (presence[i].changed > conn->presence_seen)
+    {
+      if (pending(conn) >= high_water)
+      {
+        // Sent again from the start next time; repeats do no harm
+        return;
+      }
+      PresenceFrame frame = {{0}, presence[i].count > 0};
+      snprintf(frame.user, sizeof(frame.user), "%s", presence[i].name);
+      queue_frame(conn, FRAME_PRESENCE, &frame, sizeof(frame), NULL, 0);
+    }
+  }
+  conn->presence_seen = presence_version;
+}
+
+// Send a router what it asked for again, in the order asked, as far as
+// the high-water mark allows. Messages the history no longer holds are
+// left out, which the router reports to its terminals as a gap.
+static void fill_replays(Connection *conn)
+{
+  while (conn->replay_count > 0 && pending(conn) < high_water)
+  {
+    ReplayRequest *request = &conn->replays[0];
+    uint64_t last = request->channel >= 0 ? shm_hub_last_seq(request->channel) : 0;
+    uint64_t to = request->frame.to < last ? request->frame.to : last;
+    while (request->next <= to && pending(conn) < high_water)
+    {
+      time_t timestamp;
+      const char *sender;
+      size_t len;
+      const char *text =
+          shm_hub_message(request->channel, request->next, &timestamp, &sender, &len);
+      if (text)
+      {
+        MessageFrame frame = {0};
+        frame.timestamp = timestamp;
+        frame.seq = request->next;
+        frame.channel = request->frame.tag;
+        snprintf(frame.sender, sizeof(frame.sender), "%s", sender);
+        queue_frame(conn, FRAME_REPLAYED, &frame, sizeof(frame), text, len);
+      }
+      request->next++;
+    }
+    if (request->next <= to || pending(conn) >= high_water)
+    {
+      return;
+    }
+    ReplayFrame end = request->frame;
+    end.from = last > SHM_HISTORY_SLOTS ? last - SHM_HISTORY_SLOTS + 1 : 1;
+    queue_frame(conn, FRAME_REPLAY_END, &end, sizeof(end), NULL, 0);
+    memmove(conn->replays, conn->replays + 1, --conn->replay_count * sizeof(ReplayRequest));
+  }
+}
+
+// Queue what the terminal has not been sent yet, up to the high-water
+// mark. Returns the number of messages queued.
+static int fill(Connection *conn)
+{
+  if (routing())
+  {
+    return fill_routed(conn);
+  }
+  int queued = 0;
+  int channels = shm_hub_channel_count();
+  fill_control(conn);
+  fill_presence(conn);
+  while (conn->announced < channels && pending(conn) < high_water)
+  {
+    int index = conn->announced++;
+    ChannelFrame frame = {0};
+    frame.channel = index;
+    snprintf(frame.name, sizeof(frame.name), "%s", shm_hub_channel_name(index));
+    queue_frame(conn, FRAME_CHANNEL, &frame, sizeof(frame), NULL, 0);
+    if (conn->next_seq[index] == UNSUBSCRIBED)
+    {
+      continue;
+    }
+
+    // Resume right after what the terminal has while the history still
+    // holds it, and start from a snapshot otherwise
+    uint64_t last = shm_hub_last_seq(index);
+    uint64_t oldest = last > SHM_HISTORY_SLOTS ? last - SHM_HISTORY_SLOTS + 1 : 1;
+    uint64_t snapshot = last > NET_SNAPSHOT_MESSAGES ? last - NET_SNAPSHOT_MESSAGES + 1 : 1;
+    uint64_t resume = index < conn->resumed ? conn->next_seq[index] : 0;
+    if (resume > last + 1)
+    {
+      resume = last + 1;
+    }
+    conn->next_seq[index] = resume >= oldest ? resume : snapshot;
+    if (resume && resume < oldest)
+    {
+      GapFrame gap = {index, resume, snapshot - 1};
+      queue_frame(conn, FRAME_GAP, &gap, sizeof(gap), NULL, 0);
+    }
+  }
+
+  int behind = conn->announced < channels;
+  for (int c = 0; c < conn->announced; c++)
+  {
+    uint64_t last = shm_hub_last_seq(c);
+    while (conn->next_seq[c] <= last && pending(conn) < high_water)
+    {
+      time_t timestamp;
+      const char *sender;
+      size_t len;
+      const char *text = shm_hub_message(c, conn->next_seq[c], &timestamp, &sender, &len);
+      if (!text)
+      {
+        // The history moved on while the terminal was behind
+        uint64_t oldest = last - SHM_HISTORY_SLOTS + 1;
+        GapFrame gap = {c, conn->next_seq[c], oldest - 1};
+        queue_frame(conn, FRAME_GAP, &gap, sizeof(gap), NULL, 0);
+        skipped_messages += oldest - conn->next_seq[c];
+        conn->next_seq[c] = oldest;
+        continue;
+      }
+
+      MessageFrame frame = {0};
+      frame.timestamp = timestamp;
+      frame.channel = c;
+      frame.seq = conn->next_seq[c]++;
+      snprintf(frame.sender, sizeof(frame.sender), "%s", sender);
+      queue_frame(conn, FRAME_MESSAGE, &frame, sizeof(frame), text, len);
+      queued++;
+    }
+    behind = behind || conn->next_seq[c] <= last;
+  }
+  fill_replays(conn);
+
+  behind = behind || conn->control_len > 0 || conn->presence_seen != presence_version ||
+           conn->replay_count > 0;
+  if (behind && !conn->behind)
+  {
+    resyncs++;
+  }
+  conn->behind = behind;
+  return queued;
+}
+
+// Write as much of the queue as the socket takes. Returns 0 if the
+// connection failed.
+static int flush(Connection *conn)
+{
+  while (pending(conn) > 0)
+  {
+    ssize_t sent = send(conn->fd, conn->out + conn->out_sent, pending(conn),
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    conn->out_sent += sent;
+  }
+  conn->out_sent = 0;
+  conn->out_len = 0;
+  return 1;
+}
+
+// Count a user in or out of the hub's presence
+static void presence_change(const char *user, int delta)
+{
+  PresenceEntry *entry = NULL;
+  for (int i = 0; i < presence_count && !entry; i++)
+  {
+    if (strcmp(presence[i].name, user) == 0)
+    {
+      entry = &presence[i];
+    }
+  }
+  if (!entry)
+  {
+    if (delta <= 0)
+    {
+      return;
+    }
+    if (presence_count == presence_capacity)
+    {
+      presence_capacity = presence_capacity ? presence_capacity * 2 : 64;
+      presence = realloc(presence, sizeof(PresenceEntry) * presence_capacity);
+      if (!presence)
+      {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    entry = &presence[presence_count++];
+    snprintf(entry->name, sizeof(entry->name), "%s", user);
+    entry->count = 0;
+  }
+
+  int was_online = entry->count > 0;
+  entry->count = entry->count + delta > 0 ? entry->count + delta : 0;
+  if ((entry->count > 0) != was_online)
+  {
+    entry->changed = ++presence_version;
+  }
+}
+
+// What a router learns from a shard: online or not, however many
+// connections that is there
+static void presence_assign(const char *user, int online)
+{
+  for (int i = 0; i < presence_count; i++)
+  {
+    if (strcmp(presence[i].name, user) == 0)
+    {
+      presence_change(user, (online ? 1 : 0) - presence[i].count);
+      return;
+    }
+  }
+  presence_change(user, online ? 1 : 0);
+}
+
+static int find_user(Connection *conn, const char *user)
+{
+  for (int i = 0; i < conn->user_count; i++)
+  {
+    if (strcmp(conn->users[i], user) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Whether a user is logged in through a connection other than conn
+static int logged_in_elsewhere(Connection *conn, const char *user)
+{
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+  {
+    if (connections[i] && connections[i] != conn && find_user(connections[i], user) >= 0)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A user logged in or out through a connection. A hub counts them itself;
+// a router leaves that to the user's home shard.
+static void connection_presence(Connection *conn, const char *user, int online)
+{
+  int index = find_user(conn, user);
+  if (online && index < 0)
+  {
+    if (conn->user_count == conn->user_capacity)
+    {
+      conn->user_capacity = conn->user_capacity ? conn->user_capacity * 2 : 4;
+      conn->users = realloc(conn->users, MAX_USERNAME_LEN * conn->user_capacity);
+      if (!conn->users)
+      {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    snprintf(conn->users[conn->user_count++], MAX_USERNAME_LEN, "%s", user);
+  }
+  else if (!online && index >= 0)
+  {
+    memcpy(conn->users[index], conn->users[--conn->user_count], MAX_USERNAME_LEN);
+  }
+  else
+  {
+    return;
+  }
+
+  if (routing())
+  {
+    route_presence(user, online);
+  }
+  else
+  {
+    presence_change(user, online ? 1 : -1);
+  }
+}
+
+// Keep a frame for the connection until its queue has room. Direct
+// messages beyond CONTROL_BYTES are dropped; fence replies never are.
+static int queue_control(Connection *conn, int type, const void *data, size_t len,
+                         const char *text, size_t text_len)
+{
+  FrameHeader header = {len + text_len, type};
+  size_t need = sizeof(header) + len + text_len;
+  if (type == FRAME_DIRECT && conn->control_len + need > CONTROL_BYTES)
+  {
+    return 0;
+  }
+  if (conn->control_len + need > conn->control_capacity)
+  {
+    conn->control_capacity = conn->control_capacity ? conn->control_capacity * 2 : 4096;
+    if (conn->control_capacity < conn->control_len + need)
+    {
+      conn->control_capacity = conn->control_len + need;
+    }
+    conn->control = realloc(conn->control, conn->control_capacity);
+    if (!conn->control)
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  char *p = conn->control + conn->control_len;
+  memcpy(p, &header, sizeof(header));
+  memcpy(p + sizeof(header), data, len);
+  if (text_len)
+  {
+    memcpy(p + sizeof(header) + len, text, text_len);
+  }
+  conn->control_len += need;
+  controls_queued++;
+  return 1;
+}
+
+// Hand a direct message to every connection its recipient is logged in
+// through
+static void deliver_direct(const DirectFrame *frame, const char *text, size_t len)
+{
+  char recipient[MAX_USERNAME_LEN];
+  snprintf(recipient, sizeof(recipient), "%.*s", MAX_USERNAME_LEN - 1, frame->recipient);
+  int delivered = 0;
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+  {
+    Connection *conn = connections[i];
+    if (conn && conn->greeted && find_user(conn, recipient) >= 0)
+    {
+      delivered += queue_control(conn, FRAME_DIRECT, frame, sizeof(DirectFrame), text, len);
+    }
+  }
+  if (!delivered)
+  {
+    directs_dropped++;
+  }
+}
+
+static void drop_connection(int index)
+{
+  Connection *conn = connections[index];
+  while (conn->user_count > 0)
+  {
+    char user[MAX_USERNAME_LEN];
+    memcpy(user, conn->users[conn->user_count - 1], MAX_USERNAME_LEN);
+    connection_presence(conn, user, 0);
+  }
+  close(conn->fd);
+  free(conn->out);
+  free(conn->control);
+  free(conn->users);
+  free(conn);
+  connections[index] = NULL;
+}
+
+static void accept_connections()
+{
+  int fd;
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+  {
+    int index = 0;
+    while (index < NET_MAX_CONNECTIONS && connections[index])
+    {
+      index++;
+    }
+    if (index == NET_MAX_CONNECTIONS)
+    {
+      close(fd);
+      continue;
+    }
+
+    Connection *conn = calloc(1, sizeof(Connection));
+    char *out = malloc(high_water + MAX_FRAME);
+    if (!conn || !out)
+    {
+      perror("malloc");
+      exit(1);
+    }
+    conn->fd = fd;
+    conn->index = index;
+    conn->serial = ++connections_served;
+    conn->out = out;
+    no_delay(fd);
+    connections[index] = conn;
+  }
+}
+
+// Act on one frame from a terminal. Returns 0 to drop the connection.
+static int handle_frame(Connection *conn, int type, const char *payload, size_t len)
+{
+  if (type == FRAME_HELLO)
+  {
+    HelloFrame hello;
+    if (len < sizeof(hello) || conn->greeted)
+    {
+      return 0;
+    }
+    memcpy(&hello, payload, sizeof(hello));
+    if (hello.version != NET_VERSION || hello.channel_count > NET_MAX_ROUTED ||
+        len < sizeof(hello) + hello.channel_count * sizeof(uint64_t) ||
+        (net_secret[0] && !net_secret_matches(net_secret, hello.secret)))
+    {
+      return 0;
+    }
+    conn->router = (hello.flags & HELLO_ROUTER) != 0;
+
+    // Seqs from another hub run mean nothing here
+    uint64_t epoch = routing() ? routed_epoch() : shm_hub_epoch();
+    if (hello.epoch == epoch)
+    {
+      conn->resumed = hello.channel_count;
+      for (int i = 0; i < conn->resumed; i++)
+      {
+        uint64_t seen;
+        memcpy(&seen, payload + sizeof(hello) + i * sizeof(seen), sizeof(seen));
+        conn->next_seq[i] = seen + 1;
+      }
+    }
+    WelcomeFrame welcome = {epoch};
+    queue_frame(conn, FRAME_WELCOME, &welcome, sizeof(welcome), NULL, 0);
+    conn->greeted = 1;
+    conn->seen_published = -1;
+  }
+  else if (type == FRAME_SEND && conn->greeted && len >= sizeof(SendFrame))
+  {
+    SendFrame send;
+    memcpy(&send, payload, sizeof(send));
+    char channel[MAX_CHANNEL_NAME_LEN];
+    char sender[MAX_USERNAME_LEN];
+    snprintf(channel, sizeof(channel), "%.*s", MAX_CHANNEL_NAME_LEN - 1, send.channel);
+    snprintf(sender, sizeof(sender), "%.*s", MAX_USERNAME_LEN - 1, send.sender);
+    if (!conn->router && find_user(conn, sender) < 0)
+    {
+      refused_frames++;
+      return 1;
+    }
+    net_submit(channel, sender, payload + sizeof(send), len - sizeof(send), send.timestamp);
+  }
+  else if (type == FRAME_PRESENCE && conn->greeted && len >= sizeof(PresenceFrame))
+  {
+    PresenceFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    char user[MAX_USERNAME_LEN];
+    snprintf(user, sizeof(user), "%.*s", MAX_USERNAME_LEN - 1, frame.user);
+    if (user[0] && frame.online && !conn->router && logged_in_elsewhere(conn, user))
+    {
+      refused_frames++;
+      queue_control(conn, FRAME_TAKEN, &frame, sizeof(frame), NULL, 0);
+    }
+    else if (user[0])
+    {
+      connection_presence(conn, user, frame.online != 0);
+    }
+  }
+  else if (type == FRAME_DIRECT && conn->greeted && len >= sizeof(DirectFrame))
+  {
+    DirectFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    frame.sender[MAX_USERNAME_LEN - 1] = '\0';
+    if (!conn->router && find_user(conn, frame.sender) < 0)
+    {
+      refused_frames++;
+      return 1;
+    }
+    if (routing())
+    {
+      route_direct(&frame, payload + sizeof(frame), len - sizeof(frame));
+    }
+    else
+    {
+      deliver_direct(&frame, payload + sizeof(frame), len - sizeof(frame));
+    }
+  }
+  else if (type == FRAME_MOVE && conn->greeted && len >= sizeof(MoveFrame) && routing())
+  {
+    MoveFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    if (!move_secret[0] || !net_secret_matches(move_secret, frame.secret))
+    {
+      refused_frames++;
+      return 1;
+    }
+    char channel[MAX_CHANNEL_NAME_LEN];
+    snprintf(channel, sizeof(channel), "%.*s", MAX_CHANNEL_NAME_LEN - 1, frame.channel);
+    start_move(channel, frame.shard);
+  }
+  else if (type == FRAME_IGNORE && conn->greeted && len >= sizeof(ChannelFrame))
+  {
+    // Before the channels are announced again after a reconnect, only
+    // indexes of the run the terminal resumed mean anything
+    ChannelFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    if (frame.channel < (uint32_t)conn->announced || frame.channel < (uint32_t)conn->resumed)
+    {
+      conn->next_seq[frame.channel] = UNSUBSCRIBED;
+    }
+  }
+  else if (type == FRAME_FENCE && conn->greeted && len >= sizeof(FenceFrame) && !routing())
+  {
+    // Every message this router forwarded before the fence is published,
+    // since frames are handled in order
+    FenceFrame fence;
+    memcpy(&fence, payload, sizeof(fence));
+    fence.channel[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    fence.last_seq = 0;
+    for (int i = 0; i < shm_hub_channel_count(); i++)
+    {
+      if (strcmp(shm_hub_channel_name(i), fence.channel) == 0)
+      {
+        fence.last_seq = shm_hub_last_seq(i);
+      }
+    }
+    queue_control(conn, FRAME_FENCED, &fence, sizeof(fence), NULL, 0);
+  }
+  else if (type == FRAME_REPLAY && conn->greeted && conn->router && len >= sizeof(ReplayFrame) &&
+           !routing())
+  {
+    if (conn->replay_count == NET_MAX_REPLAYS)
+    {
+      return 0;
+    }
+    ReplayRequest *request = &conn->replays[conn->replay_count++];
+    memcpy(&request->frame, payload, sizeof(request->frame));
+    request->frame.channel[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    request->channel = -1;
+    for (int i = 0; i < shm_hub_channel_count(); i++)
+    {
+      if (strcmp(shm_hub_channel_name(i), request->frame.channel) == 0)
+      {
+        request->channel = i;
+      }
+    }
+    request->next = request->frame.from;
+    conn->seen_published = -1;
+  }
+  return 1;
+}
+
+// Read what a terminal sent and act on every complete frame. Returns 0 if
+// the connection ended or broke the protocol.
+static int receive(Connection *conn)
+{
+  ssize_t got =
+      recv(conn->fd, conn->in + conn->in_len, SERVER_IN_BYTES - conn->in_len, MSG_DONTWAIT);
+  if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    return 0;
+  }
+  if (got < 0)
+  {
+    return 1;
+  }
+  conn->in_len += got;
+
+  size_t pos = 0;
+  while (conn->in_len - pos >= sizeof(FrameHeader))
+  {
+    FrameHeader header;
+    memcpy(&header, conn->in + pos, sizeof(header));
+    // A HELLO with every channel's seq can be larger than other frames
+    if (header.len > (header.type == FRAME_HELLO ? MAX_HELLO : MAX_FRAME) - sizeof(header))
+    {
+      return 0;
+    }
+    if (conn->in_len - pos < sizeof(header) + header.len)
+    {
+      break;
+    }
+    if (!handle_frame(conn, header.type, conn->in + pos + sizeof(header), header.len))
+    {
+      return 0;
+    }
+    pos += sizeof(header) + header.len;
+  }
+  memmove(conn->in, conn->in + pos, conn->in_len - pos);
+  conn->in_len -= pos;
+  return 1;
+}
+
+// Bring every connection up to date with the history, as far as its queue
+// allows, and write what its socket takes. Returns the number of messages
+// queued.
+int net_server_relay()
+{
+  // Anything a connection might need to be sent changes one of these
+  long published =
+      (routing() ? routed_news() : shm_hub_published()) + presence_version + controls_queued;
+  int queued = 0;
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+  {
+    Connection *conn = connections[i];
+    if (!conn || !conn->greeted)
+    {
+      continue;
+    }
+    // Up to date, or behind and still draining what it has
+    if ((conn->seen_published == published && !conn->behind) ||
+        (conn->behind && pending(conn) > high_water / 2))
+    {
+      continue;
+    }
+    conn->seen_published = published;
+    queued += fill(conn);
+    if (!flush(conn))
+    {
+      drop_connection(i);
+    }
+  }
+  return queued;
+}
+
+// Descriptors the hub polls for remote terminals. Returns how many were
+// written to fds (at most 1 + NET_MAX_CONNECTIONS), 0 when not listening.
+int net_server_fds(struct pollfd *fds)
+{
+  if (listen_fd < 0)
+  {
+    return 0;
+  }
+  int count = 0;
+  fds[count++] = (struct pollfd){listen_fd, POLLIN, 0};
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+  {
+    if (connections[i])
+    {
+      short events = POLLIN | (pending(connections[i]) ? POLLOUT : 0);
+      polled[count - 1] = i;
+      fds[count++] = (struct pollfd){connections[i]->fd, events, 0};
+    }
+  }
+  return count;
+}
+
+// Handle what poll() reported for the descriptors from net_server_fds
+void net_server_events(struct pollfd *fds, int count)
+{
+  if (count == 0)
+  {
+    return;
+  }
+  if (fds[0].revents & POLLIN)
+  {
+    accept_connections();
+  }
+  for (int f = 1; f < count; f++)
+  {
+    int index = polled[f - 1];
+    if (!fds[f].revents || !connections[index])
+    {
+      continue;
+    }
+    int ok = 1;
+    if (fds[f].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      ok = receive(connections[index]);
+    }
+    if (ok && (fds[f].revents & POLLOUT))
+    {
+      ok = flush(connections[index]);
+    }
+    if (!ok)
+    {
+      drop_connection(index);
+    }
+  }
+}
+
+// Connected terminals and what is queued for them, for the metrics
+// endpoint
+void net_server_stats(TransportStats *out)
+{
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+  {
+    Connection *conn = connections[i];
+    if (!conn)
+    {
+      continue;
+    }
+    size_t queued = pending(conn) + conn->control_len;
+    out->count++;
+    out->queued_bytes += queued;
+    out->deepest_bytes = queued > out->deepest_bytes ? queued : out->deepest_bytes;
+    out->memory_bytes += sizeof(Connection) + high_water + MAX_FRAME + conn->control_capacity +
+                         (size_t)conn->user_capacity * MAX_USERNAME_LEN;
+  }
+}
+
+void net_server_close()
+{
+  if (listen_fd < 0)
+  {
+    return;
+  }
+  printf("Served %ld remote terminals; %ld resyncs from history, %ld messages skipped, "
+         "%ld direct messages undeliverable, %ld frames refused\n",
+         connections_served, resyncs, skipped_messages, directs_dropped, refused_frames);
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+  {
+    if (connections[i])
+    {
+      drop_connection(i);
+    }
+  }
+  free(presence);
+  presence = NULL;
+  presence_count = presence_capacity = 0;
+  close(listen_fd);
+  listen_fd = -1;
+  if (listen_path[0])
+  {
+    unlink(listen_path);
+  }
+}
+
+// Client side
+
+static char server_address[256]; // Empty unless linked to a hub
+static int server_fd = -1;       // -1 while waiting to reconnect
+static char *server_in = NULL;
+static size_t server_in_len = 0;
+static uint64_t server_epoch = 0; // Hub run the names and seqs below are from
+static int server_channel_count = 0;
+static char server_channels[NET_MAX_ROUTED][MAX_CHANNEL_NAME_LEN]; // Hub channel names by index
+static uint64_t server_seen[NET_MAX_ROUTED]; // Last seq received, per hub channel
+static char server_ignored[NET_MAX_ROUTED];  // Hub channels this terminal has no room for
+static long retry_at = 0;                  // stats_now_ns() of the next reconnect attempt
+static long retry_delay = 0;
+static int reconnected = 0; // Not yet reported to the user
+static char server_user[MAX_USERNAME_LEN]; // Logged in here, as last told to the hub
+
+#define RETRY_FIRST_NS 250000000L
+#define RETRY_MAX_NS 8000000000L
+#define CONNECT_TIMEOUT_MS 2000
+
+// Write all of data, blocking if need be
+static int send_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (sent <= 0)
+    {
+      return 0;
+    }
+    data += sent;
+    len -= sent;
+  }
+  return 1;
+}
+
+// Connect to a hub, giving up after CONNECT_TIMEOUT_MS so an unreachable
+// one does not freeze the caller. Returns a blocking socket, or -1 with
+// errno set.
+static int dial(const char *address)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  if (!resolve(address, 0, &addr, &addr_len))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, addr_len) != 0)
+  {
+    struct pollfd pending_connect = {fd, POLLOUT, 0};
+    int error = errno;
+    socklen_t error_len = sizeof(error);
+    if (error != EINPROGRESS)
+    {
+      close(fd);
+      errno = error;
+      return -1;
+    }
+    if (poll(&pending_connect, 1, CONNECT_TIMEOUT_MS) <= 0)
+    {
+      close(fd);
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+    if (error)
+    {
+      close(fd);
+      errno = error;
+      return -1;
+    }
+  }
+  fcntl(fd, F_SETFL, 0);
+  no_delay(fd);
+  return fd;
+}
+
+// Say hello with the last seq received of each channel of epoch
+static int send_hello(int fd, uint64_t epoch, int channel_count, const uint64_t *seen, int flags)
+{
+  char buffer[MAX_HELLO];
+  size_t seqs = channel_count * sizeof(uint64_t);
+  FrameHeader header = {sizeof(HelloFrame) + seqs, FRAME_HELLO};
+  HelloFrame hello = {NET_VERSION, channel_count, epoch, flags, {0}};
+  memcpy(hello.secret, net_secret, NET_SECRET_LEN);
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &hello, sizeof(hello));
+  memcpy(buffer + sizeof(header) + sizeof(hello), seen, seqs);
+  return send_all(fd, buffer, sizeof(header) + sizeof(hello) + seqs);
+}
+
+// Tell the hub to send nothing more of a channel
+static int send_ignore(int fd, int channel)
+{
+  char buffer[sizeof(FrameHeader) + sizeof(ChannelFrame)];
+  FrameHeader header = {sizeof(ChannelFrame), FRAME_IGNORE};
+  ChannelFrame frame = {0};
+  frame.channel = channel;
+  memcpy(frame.name, server_channels[channel], MAX_CHANNEL_NAME_LEN);
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &frame, sizeof(frame));
+  return send_all(fd, buffer, sizeof(buffer));
+}
+
+static int send_presence(int fd, const char *user, int online)
+{
+  char buffer[sizeof(FrameHeader) + sizeof(PresenceFrame)];
+  FrameHeader header = {sizeof(PresenceFrame), FRAME_PRESENCE};
+  PresenceFrame frame = {{0}, online};
+  snprintf(frame.user, sizeof(frame.user), "%s", user);
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &frame, sizeof(frame));
+  return send_all(fd, buffer, sizeof(buffer));
+}
+
+// Connect and say hello, resuming from what this terminal already has, and
+// say again which channels it ignores and who is logged in here. Returns 0
+// with errno set on failure.
+static int open_connection()
+{
+  int fd = dial(server_address);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  int ok = send_hello(fd, server_epoch, server_channel_count, server_seen, 0);
+  for (int i = 0; ok && i < server_channel_count; i++)
+  {
+    ok = !server_ignored[i] || send_ignore(fd, i);
+  }
+  if (!ok || (server_user[0] && !send_presence(fd, server_user, 1)))
+  {
+    close(fd);
+    return 0;
+  }
+  server_fd = fd;
+  server_in_len = 0;
+  retry_delay = 0;
+  return 1;
+}
+
+int net_client_connect(const char *address)
+{
+  if (strlen(address) >= sizeof(server_address))
+  {
+    fprintf(stderr, "Invalid hub address '%s'\n", address);
+    return 0;
+  }
+  strcpy(server_address, address);
+  server_in = malloc(CLIENT_IN_BYTES);
+  if (!server_in)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  server_epoch = 0;
+  server_channel_count = 0;
+
+  if (!open_connection())
+  {
+    fprintf(stderr, "Can't reach a hub at '%s': %s\n", address, strerror(errno));
+    net_client_close();
+    return 0;
+  }
+  return 1;
+}
+
+// The hub run and the last seq received of each of its channels, for the
+// read markers to save
+int net_client_position(uint64_t *epoch, char names[][MAX_CHANNEL_NAME_LEN], uint64_t *seqs,
+                        int max)
+{
+  if (!server_address[0] || !server_epoch)
+  {
+    return 0;
+  }
+  int count = server_channel_count < max ? server_channel_count : max;
+  *epoch = server_epoch;
+  memcpy(names, server_channels, count * sizeof(server_channels[0]));
+  memcpy(seqs, server_seen, count * sizeof(server_seen[0]));
+  return count;
+}
+
+// Carry on from a position saved by an earlier run of this terminal. The
+// hello already sent knew nothing, so the connection is opened again with
+// the position; a hub of another run answers it with a fresh start.
+void net_client_resume(uint64_t epoch, char names[][MAX_CHANNEL_NAME_LEN], const uint64_t *seqs,
+                       int count)
+{
+  if (!server_address[0] || !epoch || (server_epoch && epoch != server_epoch))
+  {
+    return;
+  }
+  if (count > NET_MAX_ROUTED)
+  {
+    count = NET_MAX_ROUTED;
+  }
+  if (server_epoch != epoch)
+  {
+    server_channel_count = 0;
+    memset(server_channels, 0, sizeof(server_channels));
+    memset(server_seen, 0, sizeof(server_seen));
+    memset(server_ignored, 0, sizeof(server_ignored));
+  }
+  server_epoch = epoch;
+  for (int i = 0; i < count; i++)
+  {
+    if (!server_channels[i][0])
+    {
+      memcpy(server_channels[i], names[i], MAX_CHANNEL_NAME_LEN);
+      server_channels[i][MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    }
+    server_seen[i] = seqs[i] > server_seen[i] ? seqs[i] : server_seen[i];
+  }
+  if (count > server_channel_count)
+  {
+    server_channel_count = count;
+  }
+
+  if (server_fd >= 0)
+  {
+    close(server_fd);
+    server_fd = -1;
+    server_in_len = 0;
+  }
+  if (!open_connection())
+  {
+    retry_at = 0;
+  }
+}
+
+// Linked to a hub, even while reconnecting to it
+int net_client_attached()
+{
+  return server_address[0] != '\0';
+}
+
+void net_client_close()
+{
+  if (server_fd >= 0)
+  {
+    close(server_fd);
+  }
+  server_fd = -1;
+  server_address[0] = '\0';
+  server_user[0] = '\0';
+  free(server_in);
+  server_in = NULL;
+}
+
+// The connection dropped: keep the seqs and try again shortly, backing off
+// while the hub stays away
+static void lose_connection(AppState *state)
+{
+  close(server_fd);
+  server_fd = -1;
+  server_in_len = 0;
+  retry_delay = retry_delay ? retry_delay * 2 : RETRY_FIRST_NS;
+  if (retry_delay > RETRY_MAX_NS)
+  {
+    retry_delay = RETRY_MAX_NS;
+  }
+  retry_at = stats_now_ns() + retry_delay;
+  post_system_message(&state->channels[state->current_channel_index],
+                      "Lost the connection to the hub; reconnecting");
+}
+
+static int try_reconnect()
+{
+  if (open_connection())
+  {
+    reconnected = 1;
+    return 1;
+  }
+  retry_delay = retry_delay * 2 > RETRY_MAX_NS ? RETRY_MAX_NS : retry_delay * 2;
+  retry_at = stats_now_ns() + retry_delay;
+  return 0;
+}
+
+// Sleep until one of the caller's fds is ready, timeout_ms passes or the
+// hub has sent something. The caller's revents are filled in. Returns 1
+// for the hub (net_client_poll picks it up), 0 otherwise. While
+// disconnected, reconnect attempts happen in here between keys.
+int net_client_wait(struct pollfd *fds, int count, int timeout_ms)
+{
+  if (server_fd < 0)
+  {
+    long wait_ns = retry_at - stats_now_ns();
+    int wait_ms = wait_ns > 0 ? wait_ns / 1000000 + 1 : 0;
+    if (timeout_ms >= 0 && timeout_ms < wait_ms)
+    {
+      poll(fds, count, timeout_ms);
+      return 0;
+    }
+    if (wait_ms > 0 && poll(fds, count, wait_ms) != 0)
+    {
+      return 0;
+    }
+    return try_reconnect();
+  }
+
+  struct pollfd all[LINK_MAX_WAIT_FDS + 1];
+  memcpy(all, fds, sizeof(struct pollfd) * count);
+  all[count] = (struct pollfd){server_fd, POLLIN, 0};
+  if (poll(all, count + 1, timeout_ms) <= 0)
+  {
+    return 0;
+  }
+  memcpy(fds, all, sizeof(struct pollfd) * count);
+  return all[count].revents != 0;
+}
+
+// Send a message to the hub. Returns 0 if it is unreachable.
+int net_client_send(AppState *state, int channel_index, const char *text, time_t timestamp)
+{
+  if (server_fd < 0)
+  {
+    return 0;
+  }
+
+  char buffer[sizeof(FrameHeader) + sizeof(SendFrame) + MAX_MESSAGE_LEN];
+  size_t len = strnlen(text, MAX_MESSAGE_LEN - 1);
+  FrameHeader header = {sizeof(SendFrame) + len, FRAME_SEND};
+  SendFrame send = {0};
+  send.timestamp = timestamp;
+  snprintf(send.sender, sizeof(send.sender), "%s",
+           state->users[state->current_user_index].username);
+  snprintf(send.channel, sizeof(send.channel), "%s", state->channels[channel_index].name);
+
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &send, sizeof(send));
+  memcpy(buffer + sizeof(header) + sizeof(send), text, len);
+  return send_all(server_fd, buffer, sizeof(header) + sizeof(send) + len);
+}
+
+// Tell the hub the current user logged in here, or that whoever did
+// logged out; a login is said again after a reconnect. Returns 0 if the
+// hub is unreachable.
+int net_client_presence(AppState *state, int online)
+{
+  char user[MAX_USERNAME_LEN];
+  if (online)
+  {
+    snprintf(server_user, sizeof(server_user), "%s",
+             state->users[state->current_user_index].username);
+    strcpy(user, server_user);
+  }
+  else
+  {
+    strcpy(user, server_user);
+    server_user[0] = '\0';
+  }
+  return user[0] && server_fd >= 0 && send_presence(server_fd, user, online);
+}
+
+// Send a direct message to a user on another terminal. Returns 0 if the
+// hub is unreachable.
+int net_client_direct(AppState *state, int recipient, const char *text, time_t timestamp)
+{
+  if (server_fd < 0)
+  {
+    return 0;
+  }
+
+  char buffer[sizeof(FrameHeader) + sizeof(DirectFrame) + MAX_MESSAGE_LEN];
+  size_t len = strnlen(text, MAX_MESSAGE_LEN - 1);
+  FrameHeader header = {sizeof(DirectFrame) + len, FRAME_DIRECT};
+  DirectFrame frame = {0};
+  frame.timestamp = timestamp;
+  snprintf(frame.sender, sizeof(frame.sender), "%s",
+           state->users[state->current_user_index].username);
+  snprintf(frame.recipient, sizeof(frame.recipient), "%s", state->users[recipient].username);
+
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &frame, sizeof(frame));
+  memcpy(buffer + sizeof(header) + sizeof(frame), text, len);
+  return send_all(server_fd, buffer, sizeof(header) + sizeof(frame) + len);
+}
+
+// Ask a router to move a channel to its shard-th shard. Returns 0 if it
+// is unreachable; a hub that routes nothing ignores the request.
+int net_client_move(const char *channel, int shard)
+{
+  if (server_fd < 0)
+  {
+    return 0;
+  }
+  char buffer[sizeof(FrameHeader) + sizeof(MoveFrame)];
+  FrameHeader header = {sizeof(MoveFrame), FRAME_MOVE};
+  MoveFrame frame = {{0}, shard, {0}};
+  snprintf(frame.channel, sizeof(frame.channel), "%s", channel);
+  memcpy(frame.secret, move_secret, NET_SECRET_LEN);
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &frame, sizeof(frame));
+  return send_all(server_fd, buffer, sizeof(buffer));
+}
+
+// Local channel for a hub channel index, -1 if unknown. The hub is told
+// to stop sending a channel this terminal has no room for.
+static int server_channel(AppState *state, uint32_t channel)
+{
+  if (channel >= NET_MAX_ROUTED || !server_channels[channel][0])
+  {
+    return -1;
+  }
+  int local = relayed_channel(state, server_channels[channel]);
+  if (local < 0 && !server_ignored[channel])
+  {
+    server_ignored[channel] = 1;
+    send_ignore(server_fd, channel);
+  }
+  return local;
+}
+
+// Apply one frame from the hub. Returns the number of messages added.
+static int apply_frame(AppState *state, int type, const char *payload, size_t len)
+{
+  if (type == FRAME_WELCOME && len >= sizeof(WelcomeFrame))
+  {
+    WelcomeFrame welcome;
+    memcpy(&welcome, payload, sizeof(welcome));
+    if (welcome.epoch != server_epoch)
+    {
+      // A new hub run: its channels are announced again from scratch
+      server_epoch = welcome.epoch;
+      server_channel_count = 0;
+      memset(server_channels, 0, sizeof(server_channels));
+      memset(server_seen, 0, sizeof(server_seen));
+      memset(server_ignored, 0, sizeof(server_ignored));
+    }
+  }
+  else if (type == FRAME_CHANNEL && len >= sizeof(ChannelFrame))
+  {
+    ChannelFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    if (frame.channel < NET_MAX_ROUTED)
+    {
+      snprintf(server_channels[frame.channel], MAX_CHANNEL_NAME_LEN, "%.*s",
+               MAX_CHANNEL_NAME_LEN - 1, frame.name);
+      if ((int)frame.channel >= server_channel_count)
+      {
+        server_channel_count = frame.channel + 1;
+      }
+    }
+  }
+  else if (type == FRAME_MESSAGE && len >= sizeof(MessageFrame))
+  {
+    MessageFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    int local = server_channel(state, frame.channel);
+    if (local < 0)
+    {
+      return 0;
+    }
+    server_seen[frame.channel] = frame.seq;
+
+    char sender[MAX_USERNAME_LEN];
+    char text[MAX_MESSAGE_LEN];
+    size_t text_len = len - sizeof(frame);
+    snprintf(sender, sizeof(sender), "%.*s", MAX_USERNAME_LEN - 1, frame.sender);
+    snprintf(text, sizeof(text), "%.*s", (int)text_len, payload + sizeof(frame));
+    deliver_message(state, local, relayed_sender(state, sender), text, frame.timestamp);
+    return 1;
+  }
+  else if (type == FRAME_GAP && len >= sizeof(GapFrame))
+  {
+    GapFrame gap;
+    memcpy(&gap, payload, sizeof(gap));
+    int local = server_channel(state, gap.channel);
+    if (local >= 0)
+    {
+      server_seen[gap.channel] = gap.to;
+      post_system_message(&state->channels[local],
+                          "%llu messages were missed while this terminal fell behind",
+                          (unsigned long long)(gap.to - gap.from + 1));
+    }
+  }
+  else if (type == FRAME_PRESENCE && len >= sizeof(PresenceFrame))
+  {
+    PresenceFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    char user[MAX_USERNAME_LEN];
+    snprintf(user, sizeof(user), "%.*s", MAX_USERNAME_LEN - 1, frame.user);
+    uint32_t index = relayed_sender(state, user);
+    // Whoever is logged in here is online whatever the hub last heard
+    if (index != SYSTEM_SENDER_ID && (int)index != state->current_user_index)
+    {
+      set_user_online(state, index, frame.online != 0);
+    }
+    return 1;
+  }
+  else if (type == FRAME_TAKEN && len >= sizeof(PresenceFrame))
+  {
+    PresenceFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    char user[MAX_USERNAME_LEN];
+    snprintf(user, sizeof(user), "%.*s", MAX_USERNAME_LEN - 1, frame.user);
+    if (strcmp(user, server_user) == 0)
+    {
+      // Not said again on a reconnect
+      server_user[0] = '\0';
+      post_system_message(&state->channels[state->current_channel_index],
+                          "'%s' is logged in on another terminal of the hub; nothing can be "
+                          "sent through the hub as them from here",
+                          user);
+    }
+    return 1;
+  }
+  else if (type == FRAME_DIRECT && len >= sizeof(DirectFrame))
+  {
+    DirectFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    char sender[MAX_USERNAME_LEN];
+    char recipient[MAX_USERNAME_LEN];
+    char text[MAX_MESSAGE_LEN];
+    snprintf(sender, sizeof(sender), "%.*s", MAX_USERNAME_LEN - 1, frame.sender);
+    snprintf(recipient, sizeof(recipient), "%.*s", MAX_USERNAME_LEN - 1, frame.recipient);
+    snprintf(text, sizeof(text), "%.*s", (int)(len - sizeof(frame)), payload + sizeof(frame));
+    uint32_t from = relayed_sender(state, sender);
+    int to = roster_find_user(state, recipient, strlen(recipient));
+    if (to >= 0 && from != SYSTEM_SENDER_ID)
+    {
+      dm_send(from, to, text, frame.timestamp);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Apply what the hub has sent since the last call. Returns the number of
+// messages added. Reads a bounded amount, so a flood still lets keys in.
+int net_client_poll(AppState *state)
+{
+  if (!server_address[0])
+  {
+    return 0;
+  }
+  if (server_fd < 0 && (stats_now_ns() < retry_at || !try_reconnect()))
+  {
+    return 0;
+  }
+  if (reconnected)
+  {
+    reconnected = 0;
+    post_system_message(&state->channels[state->current_channel_index],
+                        "Reconnected to the hub");
+  }
+
+  int applied = 0;
+  for (int reads = 0; reads < 16; reads++)
+  {
+    ssize_t got = recv(server_fd, server_in + server_in_len, CLIENT_IN_BYTES - server_in_len,
+                       MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+      break;
+    }
+    if (got <= 0)
+    {
+      lose_connection(state);
+      return applied;
+    }
+    server_in_len += got;
+
+    size_t pos = 0;
+    while (server_in_len - pos >= sizeof(FrameHeader))
+    {
+      FrameHeader header;
+      memcpy(&header, server_in + pos, sizeof(header));
+      if (header.len > MAX_FRAME - sizeof(header))
+      {
+        net_client_close();
+        post_system_message(&state->channels[state->current_channel_index],
+                            "The hub sent something unreadable; disconnected");
+        return applied;
+      }
+      if (server_in_len - pos < sizeof(header) + header.len)
+      {
+        break;
+      }
+      applied += apply_frame(state, header.type, server_in + pos + sizeof(header), header.len);
+      pos += sizeof(header) + header.len;
+    }
+    memmove(server_in, server_in + pos, server_in_len - pos);
+    server_in_len -= pos;
+  }
+  return applied;
+}
+
+// Router side
+
+typedef struct
+{
+  char address[256];
+  int fd; // -1 while waiting to reconnect
+  char *in;
+  size_t in_len;
+  char *out; // Frames for the shard, held while it is away
+  size_t out_len;
+  size_t out_sent;
+  size_t out_capacity;
+  uint64_t epoch;
+  int channel_count;
+  char channels[MAX_CHANNELS][MAX_CHANNEL_NAME_LEN]; // Shard channel names by index
+  uint64_t seen[MAX_CHANNELS];                       // Last seq received, per shard channel
+  int routed[MAX_CHANNELS];                          // Router channel of each, -1 if none
+  long retry_at;
+  long retry_delay;
+} Shard;
+
+// A channel on its way to another shard
+typedef struct
+{
+  char channel[MAX_CHANNEL_NAME_LEN]; // Empty when the slot is free
+  int from;
+  int to;
+  uint32_t number;   // Echoed by the fence reply, so a late one is not taken for another move
+  long started;      // stats_now_ns() when the fence was queued
+  int fenced;        // The old shard answered the fence
+  uint64_t last_seq; // Its last seq of the channel then
+  char *held;        // SEND frames posted since the move began
+  size_t held_len;
+  size_t held_capacity;
+} Move;
+
+// Seqs of a channel that one run of one shard published: the router's
+// seq of a message is the shard's plus offset, modulo 2^64
+typedef struct
+{
+  int shard;
+  uint64_t epoch; // The shard run
+  uint64_t first; // Router seq of the first message of the span
+  uint64_t offset;
+} Span;
+
+#define ROUTED_SPANS 8 // Spans kept per channel; older messages are no longer replayed
+
+// A channel the shards have published, as the router numbers it for its
+// terminals
+typedef struct
+{
+  char name[MAX_CHANNEL_NAME_LEN];
+  int shard;         // Owner: takes the channel's messages and publishes them
+  uint64_t last_seq; // Router seq of the newest message
+  Span spans[ROUTED_SPANS];
+  int span_count;
+} Routed;
+
+// A replay asked of a shard for a terminal
+typedef struct
+{
+  int used;
+  int shard;
+  int conn;     // Index in connections
+  long serial;  // Of that connection, which may have gone since
+  int channel;  // Index in routed
+  uint64_t offset;
+  int stopped;  // The terminal's queue filled; the rest is asked for again
+} Replay;
+
+static Shard shards[NET_MAX_SHARDS];
+static int shard_count = 0;
+static Move moves[MAX_CHANNELS];
+static Routed routed[NET_MAX_ROUTED];
+static int routed_count = 0;
+static uint64_t router_epoch = 0;
+static long routed_changes = 0; // Messages and channels the terminals may not have yet
+static Replay replays[NET_MAX_REPLAYS];
+static long replayed_messages = 0;
+static long routed_messages = 0;
+static long held_messages = 0;
+static long moves_done = 0;
+static long moves_refused = 0;
+static long moves_aborted = 0;
+static uint32_t moves_started = 0;
+static long shard_drops = 0; // Frames a shard was away too long to be held for
+static long shard_gaps = 0;  // Messages a shard skipped because the router fell behind
+
+static int routing()
+{
+  return shard_count > 0;
+}
+
+// FNV-1a, so every router places a name on the same shard
+static int hash_shard(const char *name)
+{
+  uint32_t hash = 2166136261u;
+  for (const char *p = name; *p; p++)
+  {
+    hash = (hash ^ (unsigned char)*p) * 16777619u;
+  }
+  return hash % shard_count;
+}
+
+static uint64_t routed_epoch()
+{
+  return router_epoch;
+}
+
+static long routed_news()
+{
+  return routed_changes;
+}
+
+static int find_routed(const char *channel)
+{
+  for (int i = 0; i < routed_count; i++)
+  {
+    if (strcmp(routed[i].name, channel) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// The router channel for a name a shard announced, added the first time
+static int add_routed(const char *channel)
+{
+  int index = find_routed(channel);
+  if (index >= 0 || routed_count == NET_MAX_ROUTED)
+  {
+    return index;
+  }
+  index = routed_count++;
+  memset(&routed[index], 0, sizeof(Routed));
+  snprintf(routed[index].name, sizeof(routed[index].name), "%s", channel);
+  routed[index].shard = hash_shard(channel);
+  routed_changes++;
+  return index;
+}
+
+// Shard a channel is on: where it was moved, or where its name hashes to
+static int owner(const char *channel)
+{
+  int index = find_routed(channel);
+  return index >= 0 ? routed[index].shard : hash_shard(channel);
+}
+
+static void append_frame(char **buffer, size_t *len, size_t *capacity, int type, const void *data,
+                         size_t data_len, const char *text, size_t text_len)
+{
+  FrameHeader header = {data_len + text_len, type};
+  size_t need = sizeof(header) + data_len + text_len;
+  if (*len + need > *capacity)
+  {
+    size_t grown = *capacity ? *capacity * 2 : 4096;
+    while (grown < *len + need)
+    {
+      grown *= 2;
+    }
+    *buffer = realloc(*buffer, grown);
+    if (!*buffer)
+    {
+      perror("realloc");
+      exit(1);
+    }
+    *capacity = grown;
+  }
+  memcpy(*buffer + *len, &header, sizeof(header));
+  memcpy(*buffer + *len + sizeof(header), data, data_len);
+  if (text_len)
+  {
+    memcpy(*buffer + *len + sizeof(header) + data_len, text, text_len);
+  }
+  *len += need;
+}
+
+// Queue a frame for a shard, held while it is away up to SHARD_OUT_BYTES.
+// Fences and replays are never dropped, or the move or the terminal they
+// belong to would wait for them forever.
+static void shard_queue(Shard *shard, int type, const void *data, size_t len, const char *text,
+                        size_t text_len)
+{
+  if (type != FRAME_FENCE && type != FRAME_REPLAY && shard->out_len - shard->out_sent + len + text_len > SHARD_OUT_BYTES)
+  {
+    shard_drops++;
+    return;
+  }
+  if (shard->out_sent > 0 && shard->out_sent == shard->out_len)
+  {
+    shard->out_len = shard->out_sent = 0;
+  }
+  append_frame(&shard->out, &shard->out_len, &shard->out_capacity, type, data, len, text,
+               text_len);
+}
+
+// Write what the shard's socket takes. Returns 0 if the connection failed.
+static int shard_flush(Shard *shard)
+{
+  while (shard->fd >= 0 && shard->out_sent < shard->out_len)
+  {
+    ssize_t sent = send(shard->fd, shard->out + shard->out_sent, shard->out_len - shard->out_sent,
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    shard->out_sent += sent;
+  }
+  if (shard->out_sent == shard->out_len)
+  {
+    shard->out_sent = shard->out_len = 0;
+  }
+  return 1;
+}
+
+// Connect to a shard, resuming its channels, and tell it again who is
+// logged in through this router. Frames held meanwhile go out after.
+static int shard_connect(int index)
+{
+  Shard *shard = &shards[index];
+  int fd = dial(shard->address);
+  int ok = fd >= 0 && send_hello(fd, shard->epoch, shard->channel_count, shard->seen, HELLO_ROUTER);
+  for (int i = 0; ok && i < NET_MAX_CONNECTIONS; i++)
+  {
+    for (int u = 0; ok && connections[i] && u < connections[i]->user_count; u++)
+    {
+      if (hash_shard(connections[i]->users[u]) == index)
+      {
+        ok = send_presence(fd, connections[i]->users[u], 1);
+      }
+    }
+  }
+  if (!ok)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    shard->retry_delay = shard->retry_delay ? shard->retry_delay * 2 : RETRY_FIRST_NS;
+    if (shard->retry_delay > RETRY_MAX_NS)
+    {
+      shard->retry_delay = RETRY_MAX_NS;
+    }
+    shard->retry_at = stats_now_ns() + shard->retry_delay;
+    return 0;
+  }
+  shard->fd = fd;
+  shard->in_len = 0;
+  shard->retry_delay = 0;
+  return 1;
+}
+
+// Route channels across shard hubs as well as serving terminals. Each
+// shard is connected to here, so a missing one is reported at once.
+int net_router_add_shard(const char *address)
+{
+  if (shard_count == NET_MAX_SHARDS || strlen(address) >= sizeof(shards[0].address))
+  {
+    fprintf(stderr, "Can't add shard '%s'\n", address);
+    return 0;
+  }
+  Shard *shard = &shards[shard_count];
+  memset(shard, 0, sizeof(Shard));
+  strcpy(shard->address, address);
+  memset(shard->routed, -1, sizeof(shard->routed));
+  if (!router_epoch)
+  {
+    router_epoch = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ stats_now_ns();
+  }
+  shard->in = malloc(CLIENT_IN_BYTES);
+  if (!shard->in)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  shard->fd = -1;
+  shard_count++;
+  if (!shard_connect(shard_count - 1))
+  {
+    fprintf(stderr, "Can't reach shard '%s': %s\n", address, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+static void abort_move(Move *move);
+
+// A message a terminal posted: published here, or forwarded to the shard
+// that owns its channel when routing. Messages for a channel that is
+// moving wait for the move to finish.
+void net_submit(const char *channel, const char *sender, const char *text, size_t len,
+                time_t timestamp)
+{
+  if (!routing())
+  {
+    shm_hub_publish(channel, sender, text, len, timestamp);
+    return;
+  }
+  if (len > MAX_MESSAGE_LEN - 1)
+  {
+    len = MAX_MESSAGE_LEN - 1;
+  }
+  SendFrame send = {0};
+  send.timestamp = timestamp;
+  snprintf(send.sender, sizeof(send.sender), "%s", sender);
+  snprintf(send.channel, sizeof(send.channel), "%s", channel);
+
+  for (int i = 0; i < MAX_CHANNELS; i++)
+  {
+    Move *move = &moves[i];
+    if (move->channel[0] && strcmp(move->channel, channel) == 0)
+    {
+      if (move->held_len + sizeof(FrameHeader) + sizeof(send) + len > MOVE_HELD_BYTES)
+      {
+        abort_move(move);
+        break;
+      }
+      append_frame(&move->held, &move->held_len, &move->held_capacity, FRAME_SEND, &send,
+                   sizeof(send), text, len);
+      held_messages++;
+      return;
+    }
+  }
+  shard_queue(&shards[owner(channel)], FRAME_SEND, &send, sizeof(send), text, len);
+  routed_messages++;
+}
+
+// Presence is kept by each user's home shard
+static void route_presence(const char *user, int online)
+{
+  PresenceFrame frame = {{0}, online};
+  snprintf(frame.user, sizeof(frame.user), "%s", user);
+  shard_queue(&shards[hash_shard(user)], FRAME_PRESENCE, &frame, sizeof(frame), NULL, 0);
+}
+
+// A direct message goes through its recipient's home shard, which knows
+// which routers they are logged in through
+static void route_direct(const DirectFrame *frame, const char *text, size_t len)
+{
+  char recipient[MAX_USERNAME_LEN];
+  snprintf(recipient, sizeof(recipient), "%.*s", MAX_USERNAME_LEN - 1, frame->recipient);
+  shard_queue(&shards[hash_shard(recipient)], FRAME_DIRECT, frame, sizeof(DirectFrame), text,
+              len);
+}
+
+// Begin moving a channel the shards have published to another shard.
+// Unknown channels are refused, since the router has nowhere to keep them.
+static void start_move(const char *channel, uint32_t shard)
+{
+  int from = owner(channel);
+  if (find_routed(channel) < 0 || shard >= (uint32_t)shard_count || (int)shard == from)
+  {
+    moves_refused++;
+    return;
+  }
+  int free_slot = -1;
+  for (int i = 0; i < MAX_CHANNELS; i++)
+  {
+    if (moves[i].channel[0] && strcmp(moves[i].channel, channel) == 0)
+    {
+      moves_refused++;
+      return; // One move at a time per channel
+    }
+    if (!moves[i].channel[0] && free_slot < 0)
+    {
+      free_slot = i;
+    }
+  }
+  if (free_slot < 0)
+  {
+    moves_refused++;
+    return;
+  }
+
+  Move *move = &moves[free_slot];
+  snprintf(move->channel, sizeof(move->channel), "%s", channel);
+  move->from = from;
+  move->to = shard;
+  move->number = ++moves_started;
+  move->started = stats_now_ns();
+  move->fenced = 0;
+  move->held_len = 0;
+
+  // Behind everything already forwarded for the channel
+  FenceFrame fence = {{0}, move->number, 0};
+  snprintf(fence.channel, sizeof(fence.channel), "%s", channel);
+  shard_queue(&shards[from], FRAME_FENCE, &fence, sizeof(fence), NULL, 0);
+}
+
+// Last seq received from a shard of a channel, 0 if it has none
+static uint64_t shard_seen(Shard *shard, const char *channel)
+{
+  for (int i = 0; i < shard->channel_count; i++)
+  {
+    if (strcmp(shard->channels[i], channel) == 0)
+    {
+      return shard->seen[i];
+    }
+  }
+  return 0;
+}
+
+// Send what was held for a moving channel to a shard, in order, and free
+// the move's slot
+static void release_held(Move *move, Shard *shard)
+{
+  size_t pos = 0;
+  while (pos < move->held_len)
+  {
+    FrameHeader header;
+    memcpy(&header, move->held + pos, sizeof(header));
+    shard_queue(shard, header.type, move->held + pos + sizeof(header), header.len, NULL, 0);
+    pos += sizeof(header) + header.len;
+    routed_messages++;
+  }
+  free(move->held);
+  memset(move, 0, sizeof(Move));
+}
+
+// Give up on a move whose fence went unanswered too long or that held
+// too much: the old shard keeps the channel and gets the held messages,
+// behind everything forwarded to it before
+static void abort_move(Move *move)
+{
+  release_held(move, &shards[move->from]);
+  moves_aborted++;
+}
+
+// Finish moves whose old shard has sent everything up to the fence: the
+// new shard owns the channel and is sent what was held meanwhile
+static int finish_moves()
+{
+  int finished = 0;
+  for (int i = 0; i < MAX_CHANNELS; i++)
+  {
+    Move *move = &moves[i];
+    if (move->channel[0] && stats_now_ns() - move->started > MOVE_TIMEOUT_NS)
+    {
+      abort_move(move);
+    }
+    if (!move->channel[0] || !move->fenced ||
+        shard_seen(&shards[move->from], move->channel) < move->last_seq)
+    {
+      continue;
+    }
+
+    routed[find_routed(move->channel)].shard = move->to;
+    release_held(move, &shards[move->to]);
+    moves_done++;
+    finished++;
+  }
+  return finished;
+}
+
+// Tell a terminal it will never be sent messages from..to of a channel
+static void routed_gap(Connection *conn, int channel, uint64_t from, uint64_t to)
+{
+  GapFrame gap = {channel, from, to};
+  queue_frame(conn, FRAME_GAP, &gap, sizeof(gap), NULL, 0);
+  skipped_messages += to - from + 1;
+  conn->next_seq[channel] = to + 1;
+}
+
+// The span a router seq of a channel is in, -1 if older than them all,
+// and the last seq of the span
+static int find_span(Routed *channel, uint64_t seq, uint64_t *end)
+{
+  int span = channel->span_count - 1;
+  while (span >= 0 && channel->spans[span].first > seq)
+  {
+    span--;
+  }
+  *end = span + 1 < channel->span_count ? channel->spans[span + 1].first - 1 : channel->last_seq;
+  return span;
+}
+
+// Ask the shard that published a terminal's next message of a channel to
+// send a chunk from there again. What no shard can send any more, being
+// from a span too old or from a shard run that has ended, is a gap.
+static void request_replay(Connection *conn, int index)
+{
+  Routed *channel = &routed[index];
+  while (conn->next_seq[index] <= channel->last_seq && pending(conn) < high_water)
+  {
+    uint64_t from = conn->next_seq[index];
+    uint64_t end;
+    int span = find_span(channel, from, &end);
+    if (span < 0)
+    {
+      routed_gap(conn, index, from, end);
+      continue;
+    }
+    Span *run = &channel->spans[span];
+    Shard *shard = &shards[run->shard];
+    if (run->epoch != shard->epoch)
+    {
+      routed_gap(conn, index, from, end);
+      continue;
+    }
+
+    int slot = 0;
+    while (slot < NET_MAX_REPLAYS && replays[slot].used)
+    {
+      slot++;
+    }
+    if (shard->fd < 0 || slot == NET_MAX_REPLAYS)
+    {
+      return; // Asked again once the shard is back or a replay ends
+    }
+    ReplayFrame frame = {slot, {0}, from - run->offset, 0};
+    frame.to = (end - from < NET_REPLAY_MESSAGES ? end : from + NET_REPLAY_MESSAGES - 1) -
+               run->offset;
+    memcpy(frame.channel, channel->name, MAX_CHANNEL_NAME_LEN);
+    shard_queue(shard, FRAME_REPLAY, &frame, sizeof(frame), NULL, 0);
+    replays[slot] = (Replay){1, run->shard, conn->index, conn->serial, index, run->offset, 0};
+    conn->replaying[index] = 1;
+    return;
+  }
+}
+
+// fill() for a router's terminal: announce the channels it has not heard
+// of and start replays of whatever it lacks. The messages are queued as
+// the replies come in (replayed), and new ones as they arrive (route).
+static int fill_routed(Connection *conn)
+{
+  fill_control(conn);
+  fill_presence(conn);
+  while (conn->announced < routed_count && pending(conn) < high_water)
+  {
+    int index = conn->announced++;
+    ChannelFrame frame = {0};
+    frame.channel = index;
+    snprintf(frame.name, sizeof(frame.name), "%s", routed[index].name);
+    queue_frame(conn, FRAME_CHANNEL, &frame, sizeof(frame), NULL, 0);
+    if (conn->next_seq[index] == UNSUBSCRIBED)
+    {
+      continue;
+    }
+
+    // Resume right after what the terminal has, and start from the newest
+    // messages otherwise; a replay finds out whether the shard still has
+    // them
+    uint64_t last = routed[index].last_seq;
+    uint64_t snapshot = last > NET_SNAPSHOT_MESSAGES ? last - NET_SNAPSHOT_MESSAGES + 1 : 1;
+    uint64_t resume = index < conn->resumed ? conn->next_seq[index] : 0;
+    conn->next_seq[index] = !resume ? snapshot : resume > last + 1 ? last + 1 : resume;
+  }
+
+  int behind = conn->announced < routed_count;
+  for (int c = 0; c < conn->announced; c++)
+  {
+    if (conn->next_seq[c] <= routed[c].last_seq)
+    {
+      behind = 1;
+      if (!conn->replaying[c])
+      {
+        request_replay(conn, c);
+      }
+    }
+  }
+
+  behind = behind || conn->control_len > 0 || conn->presence_seen != presence_version;
+  if (behind && !conn->behind)
+  {
+    resyncs++;
+  }
+  conn->behind = behind;
+  return 0;
+}
+
+// A message the owner of its channel published: numbered in the router's
+// seqs and queued for every terminal waiting for exactly this one. The
+// others are behind and get it by replay. Returns 1 if it was new.
+static int route(Shard *shard, int index, const MessageFrame *published, const char *text,
+                 size_t len)
+{
+  Routed *channel = &routed[index];
+  if (&shards[channel->shard] != shard)
+  {
+    return 0; // From a shard the channel has moved off
+  }
+
+  // The first message from a new owner, or a restarted one, carries on
+  // from the last seq
+  Span *run = channel->span_count ? &channel->spans[channel->span_count - 1] : NULL;
+  if (!run || &shards[run->shard] != shard || run->epoch != shard->epoch)
+  {
+    if (channel->span_count == ROUTED_SPANS)
+    {
+      memmove(channel->spans, channel->spans + 1, sizeof(Span) * --channel->span_count);
+    }
+    run = &channel->spans[channel->span_count++];
+    run->shard = channel->shard;
+    run->epoch = shard->epoch;
+    run->first = channel->last_seq + 1;
+    run->offset = run->first - published->seq;
+  }
+  uint64_t seq = published->seq + run->offset;
+  if (seq <= channel->last_seq)
+  {
+    return 0;
+  }
+  channel->last_seq = seq;
+  routed_changes++;
+
+  MessageFrame frame = *published;
+  frame.channel = index;
+  frame.seq = seq;
+  for (int i = 0; i < NET_MAX_CONNECTIONS; i++)
+  {
+    Connection *conn = connections[i];
+    if (conn && conn->greeted && index < conn->announced && conn->next_seq[index] == seq &&
+        pending(conn) < high_water)
+    {
+      queue_frame(conn, FRAME_MESSAGE, &frame, sizeof(frame), text, len);
+      conn->next_seq[index]++;
+    }
+  }
+  return 1;
+}
+
+// The terminal a shard's reply to a replay is for, NULL if it has gone
+static Connection *replay_target(Shard *shard, uint32_t tag)
+{
+  if (tag >= NET_MAX_REPLAYS || !replays[tag].used || &shards[replays[tag].shard] != shard)
+  {
+    return NULL;
+  }
+  Connection *conn = connections[replays[tag].conn];
+  return conn && conn->serial == replays[tag].serial ? conn : NULL;
+}
+
+// A message a shard sent again: queued for the terminal the replay is for
+// unless it has it already. Messages the shard skipped are a gap. Once the
+// terminal's queue is full the rest of the replay is left for another.
+static int replayed(Shard *shard, const MessageFrame *published, const char *text, size_t len)
+{
+  Connection *conn = replay_target(shard, published->channel);
+  if (!conn || replays[published->channel].stopped)
+  {
+    return 0;
+  }
+  Replay *replay = &replays[published->channel];
+  int index = replay->channel;
+  uint64_t seq = published->seq + replay->offset;
+  if (seq < conn->next_seq[index])
+  {
+    return 0;
+  }
+  if (seq > conn->next_seq[index] && pending(conn) < high_water)
+  {
+    routed_gap(conn, index, conn->next_seq[index], seq - 1);
+  }
+  if (seq > conn->next_seq[index] || pending(conn) >= high_water)
+  {
+    replay->stopped = 1;
+    return 0;
+  }
+  MessageFrame frame = *published;
+  frame.channel = index;
+  frame.seq = seq;
+  queue_frame(conn, FRAME_MESSAGE, &frame, sizeof(frame), text, len);
+  conn->next_seq[index]++;
+  replayed_messages++;
+  return 1;
+}
+
+// A replay is over: what the shard did not send up to its end is a gap,
+// and so is the rest of the span up to the oldest message the shard still
+// has. The terminal may then ask for more.
+static void replay_ended(Shard *shard, const ReplayFrame *frame)
+{
+  if (frame->tag >= NET_MAX_REPLAYS || !replays[frame->tag].used ||
+      &shards[replays[frame->tag].shard] != shard)
+  {
+    return;
+  }
+  Connection *conn = replay_target(shard, frame->tag);
+  Replay *replay = &replays[frame->tag];
+  if (conn)
+  {
+    // In the shard's seqs, which unlike offsets do not wrap
+    uint64_t span_end;
+    find_span(&routed[replay->channel], frame->to + replay->offset, &span_end);
+    uint64_t last = span_end - replay->offset;
+    last = frame->from - 1 < last ? frame->from - 1 : last;
+    uint64_t end = (frame->to > last ? frame->to : last) + replay->offset;
+    if (!replay->stopped && conn->next_seq[replay->channel] <= end && pending(conn) < high_water)
+    {
+      routed_gap(conn, replay->channel, conn->next_seq[replay->channel], end);
+    }
+    conn->replaying[replay->channel] = 0;
+    conn->seen_published = -1;
+  }
+  replay->used = 0;
+}
+
+// Apply one frame from a shard. Returns the number of messages published.
+static int apply_shard_frame(Shard *shard, int type, const char *payload, size_t len)
+{
+  if (type == FRAME_WELCOME && len >= sizeof(WelcomeFrame))
+  {
+    WelcomeFrame welcome;
+    memcpy(&welcome, payload, sizeof(welcome));
+    if (welcome.epoch != shard->epoch)
+    {
+      shard->epoch = welcome.epoch;
+      shard->channel_count = 0;
+      memset(shard->channels, 0, sizeof(shard->channels));
+      memset(shard->seen, 0, sizeof(shard->seen));
+      memset(shard->routed, -1, sizeof(shard->routed));
+    }
+  }
+  else if (type == FRAME_CHANNEL && len >= sizeof(ChannelFrame))
+  {
+    ChannelFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    if (frame.channel < MAX_CHANNELS)
+    {
+      snprintf(shard->channels[frame.channel], MAX_CHANNEL_NAME_LEN, "%.*s",
+               MAX_CHANNEL_NAME_LEN - 1, frame.name);
+      shard->routed[frame.channel] = add_routed(shard->channels[frame.channel]);
+      if ((int)frame.channel >= shard->channel_count)
+      {
+        shard->channel_count = frame.channel + 1;
+      }
+    }
+  }
+  else if (type == FRAME_MESSAGE && len >= sizeof(MessageFrame))
+  {
+    MessageFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    if (frame.channel >= (uint32_t)shard->channel_count || shard->routed[frame.channel] < 0)
+    {
+      return 0;
+    }
+    shard->seen[frame.channel] = frame.seq;
+    frame.sender[MAX_USERNAME_LEN - 1] = '\0';
+    return route(shard, shard->routed[frame.channel], &frame, payload + sizeof(frame),
+                 len - sizeof(frame));
+  }
+  else if (type == FRAME_REPLAYED && len >= sizeof(MessageFrame))
+  {
+    MessageFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    return replayed(shard, &frame, payload + sizeof(frame), len - sizeof(frame));
+  }
+  else if (type == FRAME_REPLAY_END && len >= sizeof(ReplayFrame))
+  {
+    ReplayFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    replay_ended(shard, &frame);
+  }
+  else if (type == FRAME_GAP && len >= sizeof(GapFrame))
+  {
+    GapFrame gap;
+    memcpy(&gap, payload, sizeof(gap));
+    if (gap.channel < MAX_CHANNELS)
+    {
+      shard->seen[gap.channel] = gap.to;
+      shard_gaps += gap.to - gap.from + 1;
+    }
+  }
+  else if (type == FRAME_PRESENCE && len >= sizeof(PresenceFrame))
+  {
+    PresenceFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    char user[MAX_USERNAME_LEN];
+    snprintf(user, sizeof(user), "%.*s", MAX_USERNAME_LEN - 1, frame.user);
+    presence_assign(user, frame.online != 0);
+  }
+  else if (type == FRAME_DIRECT && len >= sizeof(DirectFrame))
+  {
+    DirectFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    deliver_direct(&frame, payload + sizeof(frame), len - sizeof(frame));
+  }
+  else if (type == FRAME_FENCED && len >= sizeof(FenceFrame))
+  {
+    FenceFrame fence;
+    memcpy(&fence, payload, sizeof(fence));
+    fence.channel[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+      if (moves[i].channel[0] && moves[i].number == fence.move &&
+          strcmp(moves[i].channel, fence.channel) == 0 && shard == &shards[moves[i].from])
+      {
+        moves[i].fenced = 1;
+        moves[i].last_seq = fence.last_seq;
+      }
+    }
+  }
+  return 0;
+}
+
+static void shard_lost(Shard *shard)
+{
+  close(shard->fd);
+  shard->fd = -1;
+  shard->in_len = 0;
+
+  // A frame cut off part way is sent again whole; the shard threw away
+  // the part it got
+  size_t pos = 0;
+  while (pos < shard->out_sent)
+  {
+    FrameHeader header;
+    memcpy(&header, shard->out + pos, sizeof(header));
+    if (pos + sizeof(header) + header.len > shard->out_sent)
+    {
+      break;
+    }
+    pos += sizeof(header) + header.len;
+  }
+  shard->out_sent = pos;
+  shard->retry_at = stats_now_ns();
+
+  // Replays went with the connection, answered or not. Their terminals
+  // ask again, so those still to be sent are dropped.
+  size_t kept = pos;
+  while (pos < shard->out_len)
+  {
+    FrameHeader header;
+    memcpy(&header, shard->out + pos, sizeof(header));
+    size_t size = sizeof(header) + header.len;
+    if (header.type != FRAME_REPLAY)
+    {
+      memmove(shard->out + kept, shard->out + pos, size);
+      kept += size;
+    }
+    pos += size;
+  }
+  shard->out_len = kept;
+  for (int i = 0; i < NET_MAX_REPLAYS; i++)
+  {
+    if (replays[i].used && &shards[replays[i].shard] == shard)
+    {
+      Connection *conn = replay_target(shard, i);
+      if (conn)
+      {
+        conn->replaying[replays[i].channel] = 0;
+      }
+      replays[i].used = 0;
+    }
+  }
+}
+
+// Read what a shard sent and publish its messages. Returns the number
+// published, or -1 if the connection failed.
+static int shard_receive(Shard *shard)
+{
+  int published = 0;
+  for (int reads = 0; reads < 16; reads++)
+  {
+    ssize_t got =
+        recv(shard->fd, shard->in + shard->in_len, CLIENT_IN_BYTES - shard->in_len, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+      break;
+    }
+    if (got <= 0)
+    {
+      return -1;
+    }
+    shard->in_len += got;
+
+    size_t pos = 0;
+    while (shard->in_len - pos >= sizeof(FrameHeader))
+    {
+      FrameHeader header;
+      memcpy(&header, shard->in + pos, sizeof(header));
+      if (header.len > MAX_FRAME - sizeof(header))
+      {
+        return -1;
+      }
+      if (shard->in_len - pos < sizeof(header) + header.len)
+      {
+        break;
+      }
+      published += apply_shard_frame(shard, header.type, shard->in + pos + sizeof(header),
+                                     header.len);
+      pos += sizeof(header) + header.len;
+    }
+    memmove(shard->in, shard->in + pos, shard->in_len - pos);
+    shard->in_len -= pos;
+  }
+  return published;
+}
+
+// Reconnect shards that are due, finish moves and write what is queued
+// for the shards. Returns the number of moves finished.
+int net_router_relay()
+{
+  int finished = finish_moves();
+  for (int i = 0; i < shard_count; i++)
+  {
+    Shard *shard = &shards[i];
+    if (shard->fd < 0 && stats_now_ns() >= shard->retry_at)
+    {
+      shard_connect(i);
+    }
+    if (!shard_flush(shard))
+    {
+      shard_lost(shard);
+    }
+  }
+  return finished;
+}
+
+// Descriptors the router polls for its shards. Returns how many were
+// written to fds, at most NET_MAX_SHARDS.
+int net_router_fds(struct pollfd *fds)
+{
+  int count = 0;
+  for (int i = 0; i < shard_count; i++)
+  {
+    if (shards[i].fd >= 0)
+    {
+      short events = POLLIN | (shards[i].out_sent < shards[i].out_len ? POLLOUT : 0);
+      fds[count++] = (struct pollfd){shards[i].fd, events, 0};
+    }
+  }
+  return count;
+}
+
+// Handle what poll() reported for the descriptors from net_router_fds.
+// Returns the number of messages published.
+int net_router_events(struct pollfd *fds, int count)
+{
+  int published = 0;
+  for (int f = 0; f < count; f++)
+  {
+    for (int i = 0; i < shard_count && fds[f].revents; i++)
+    {
+      Shard *shard = &shards[i];
+      if (shard->fd != fds[f].fd)
+      {
+        continue;
+      }
+      int got = 0;
+      if (fds[f].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        got = shard_receive(shard);
+      }
+      if (got < 0 || ((fds[f].revents & POLLOUT) && !shard_flush(shard)))
+      {
+        shard_lost(shard);
+      }
+      else
+      {
+        published += got;
+      }
+    }
+  }
+  return published;
+}
+
+// Shards the router is connected to and the frames held for them
+void net_router_stats(TransportStats *out)
+{
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < shard_count; i++)
+  {
+    Shard *shard = &shards[i];
+    size_t queued = shard->out_len - shard->out_sent;
+    out->count += shard->fd >= 0;
+    out->queued_bytes += queued;
+    out->deepest_bytes = queued > out->deepest_bytes ? queued : out->deepest_bytes;
+    out->memory_bytes += shard->out_capacity + CLIENT_IN_BYTES;
+  }
+  if (routing())
+  {
+    out->memory_bytes += sizeof(routed) + sizeof(replays);
+  }
+}
+
+void net_router_close()
+{
+  if (!routing())
+  {
+    return;
+  }
+  printf("Routed %ld messages across %d shards and %d channels; %ld channel moves (%ld refused, "
+         "%ld given up), %ld messages held for them, %ld frames dropped for absent shards, %ld "
+         "messages skipped, %ld replayed\n",
+         routed_messages, shard_count, routed_count, moves_done, moves_refused, moves_aborted,
+         held_messages, shard_drops, shard_gaps, replayed_messages);
+  for (int i = 0; i < shard_count; i++)
+  {
+    if (shards[i].fd >= 0)
+    {
+      close(shards[i].fd);
+    }
+    free(shards[i].in);
+    free(shards[i].out);
+  }
+  for (int i = 0; i < MAX_CHANNELS; i++)
+  {
+    free(moves[i].held);
+  }
+  memset(moves, 0, sizeof(moves));
+  memset(replays, 0, sizeof(replays));
+  shard_count = 0;
+  routed_count = 0;
+}
+
+// The link to a hub a terminal uses, whichever kind it is
+
+int link_attached()
+{
+  return shm_client_attached() || net_client_attached();
+}
+
+int link_wait(struct pollfd *fds, int count, int timeout_ms)
+{
+  return net_client_attached() ? net_client_wait(fds, count, timeout_ms)
+                                : shm_client_wait(fds, count, timeout_ms);
+}
+
+int link_send(AppState *state, int channel_index, const char *text, time_t timestamp)
+{
+  return net_client_attached() ? net_client_send(state, channel_index, text, timestamp)
+                                : shm_client_send(state, channel_index, text, timestamp);
+}
+
+// Presence, direct messages and moves only travel over sockets; a
+// same-host link returns 0 for them
+void link_presence(AppState *state, int online)
+{
+  if (net_client_attached())
+  {
+    net_client_presence(state, online);
+  }
+}
+
+// Terminals sharing memory keep direct messages to themselves, as before
+int link_direct(AppState *state, int recipient, const char *text, time_t timestamp)
+{
+  return !net_client_attached() || net_client_direct(state, recipient, text, timestamp);
+}
+
+int link_move(const char *channel, int shard)
+{
+  return net_client_attached() && net_client_move(channel, shard);
+}
+
+// Both kinds return 0 while not attached
+int link_poll(AppState *state)
+{
+  return shm_client_poll(state) + net_client_poll(state);
+}
+
+// The position in the hub's history is saved with the read markers, so
+// a restarted terminal does not apply what it already has again
+int link_position(uint64_t *epoch, char names[][MAX_CHANNEL_NAME_LEN], uint64_t *seqs, int max)
+{
+  return shm_client_attached() ? shm_client_position(epoch, names, seqs, max)
+                               : net_client_position(epoch, names, seqs, max);
+}
+
+void link_resume(uint64_t epoch, char names[][MAX_CHANNEL_NAME_LEN], const uint64_t *seqs,
+                 int count)
+{
+  shm_client_resume(epoch, names, seqs, count);
+  net_client_resume(epoch, names, seqs, count);
+}
+
+void link_close()
+{
+  net_client_close();
+  shm_client_detach();
+}
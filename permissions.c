@@ -0,0 +1,353 @@
+#include "my_dispute.h"
+
+// Channel membership and permissions.
+//
+// Each channel holds two bitsets indexed by user index: its members, who
+// are the only ones to see it when it is private, and its moderators. A
+// user's permissions in a channel come from their global role and one bit
+// test in each set, so access checks on the send and render paths cost
+// the same however many users and members there are.
+//
+// Access state is saved next to the channel's history as lines of text:
+// "private 0" or "private 1", then "member <hex name>" or "moderator <hex
+// name>" per member. Users are not kept across restarts, so after one the
+// saved members are held as grants until someone logs in under that name
+// with its saved password (register_account). A channel with no saved
+// access state, such as one from an older history directory, is public.
+
+void user_set_add(uint64_t *set, int user_index)
+{
+  set[user_index >> 6] |= 1ULL << (user_index & 63);
+}
+
+void user_set_remove(uint64_t *set, int user_index)
+{
+  set[user_index >> 6] &= ~(1ULL << (user_index & 63));
+}
+
+int user_set_has(const uint64_t *set, int user_index)
+{
+  return set[user_index >> 6] >> (user_index & 63) & 1;
+}
+
+// Permission mask (PERM_*) of a user in a channel
+int channel_permissions(AppState *state, int user_index, int channel_index)
+{
+  if (user_index < 0 || channel_index < 0 || channel_index >= state->channel_count)
+  {
+    return 0;
+  }
+
+  User *user = &state->users[user_index];
+  if (user->role == ROLE_ADMIN)
+  {
+    return PERM_READ | PERM_SEND | PERM_MODERATE | PERM_ADMIN;
+  }
+
+  // Global moderators moderate the channels they can see; channel
+  // moderators moderate theirs even when private
+  Channel *channel = &state->channels[channel_index];
+  int member = !channel->is_private || user_set_has(channel->members, user_index);
+  int moderator = user_set_has(channel->moderators, user_index) ||
+                  (member && user->role == ROLE_MODERATOR);
+
+  int perms = 0;
+  if (member || moderator)
+  {
+    perms |= PERM_READ | PERM_SEND;
+  }
+  if (moderator)
+  {
+    perms |= PERM_MODERATE;
+  }
+  return perms;
+}
+
+int user_can(AppState *state, int user_index, int channel_index, int perm)
+{
+  return (channel_permissions(state, user_index, channel_index) & perm) == perm;
+}
+
+static int find_user(AppState *state, const char *username)
+{
+  return roster_find_user(state, username, strlen(username));
+}
+
+static void put_access_line(char *text, size_t *len, const char *kind, const char *username)
+{
+  *len += sprintf(text + *len, "%s ", kind);
+  for (const char *p = username; *p; p++)
+  {
+    *len += sprintf(text + *len, "%02x", (unsigned char)*p);
+  }
+  text[(*len)++] = '\n';
+}
+
+// Save a channel's access state, with the grants nobody has claimed yet
+void save_channel_access(AppState *state, Channel *channel)
+{
+  if (!channel->history)
+  {
+    return;
+  }
+
+  size_t line = 12 + 2 * MAX_USERNAME_LEN;
+  char *text = malloc(16 + line * (state->user_count + channel->grant_count));
+  if (!text)
+  {
+    perror("malloc");
+    exit(1);
+  }
+
+  size_t len = sprintf(text, "private %d\n", channel->is_private ? 1 : 0);
+  for (int i = 0; i < state->user_count; i++)
+  {
+    if (user_set_has(channel->moderators, i))
+    {
+      put_access_line(text, &len, "moderator", state->users[i].username);
+    }
+    else if (user_set_has(channel->members, i))
+    {
+      put_access_line(text, &len, "member", state->users[i].username);
+    }
+  }
+  for (int i = 0; i < channel->grant_count; i++)
+  {
+    put_access_line(text, &len, channel->grants[i].moderator ? "moderator" : "member",
+                    channel->grants[i].username);
+  }
+
+  history_save_access(channel, text, len);
+  free(text);
+}
+
+static int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// Decode a saved hex name into username; 0 if it is not a valid name
+static int decode_access_name(const char *hex, char *username)
+{
+  size_t len = strlen(hex);
+  if (len == 0 || len % 2 || len / 2 >= MAX_USERNAME_LEN)
+  {
+    return 0;
+  }
+  for (size_t i = 0; i < len / 2; i++)
+  {
+    int high = hex_digit(hex[2 * i]);
+    int low = hex_digit(hex[2 * i + 1]);
+    if (high < 0 || low < 0 || (high | low) == 0)
+    {
+      return 0;
+    }
+    username[i] = high << 4 | low;
+  }
+  username[len / 2] = '\0';
+  return 1;
+}
+
+// Load a channel's saved access state, holding its members as grants.
+// Returns 0 if it has none. Such a channel is public: its history predates
+// saved access state, and only a saved "private 1" makes a channel private.
+int load_channel_access(Channel *channel)
+{
+  free(channel->grants);
+  channel->grants = NULL;
+  channel->grant_count = 0;
+
+  char *text = history_load_access(channel);
+  if (!text)
+  {
+    channel->is_private = 0;
+    return 0;
+  }
+
+  int is_private = 0;
+  char *next;
+  for (char *line = text; *line; line = next)
+  {
+    next = strchr(line, '\n');
+    if (next)
+    {
+      *next++ = '\0';
+    }
+    else
+    {
+      next = line + strlen(line);
+    }
+
+    AccessGrant grant;
+    if (strcmp(line, "private 1") == 0)
+    {
+      is_private = 1;
+    }
+    else if ((strncmp(line, "member ", 7) == 0 && decode_access_name(line + 7, grant.username)) ||
+             (strncmp(line, "moderator ", 10) == 0 &&
+              decode_access_name(line + 10, grant.username)))
+    {
+      grant.moderator = line[1] == 'o';
+      AccessGrant *grants =
+          realloc(channel->grants, sizeof(AccessGrant) * (channel->grant_count + 1));
+      if (!grants)
+      {
+        perror("realloc");
+        exit(1);
+      }
+      channel->grants = grants;
+      channel->grants[channel->grant_count++] = grant;
+    }
+  }
+  free(text);
+  channel->is_private = is_private;
+  return 1;
+}
+
+static void drop_grant(Channel *channel, const char *username)
+{
+  for (int i = 0; i < channel->grant_count; i++)
+  {
+    if (strcmp(channel->grants[i].username, username) == 0)
+    {
+      channel->grants[i] = channel->grants[--channel->grant_count];
+      return;
+    }
+  }
+}
+
+// Hand a user who proved their saved password the memberships saved
+// under their name
+void restore_channel_access(AppState *state, int user_index)
+{
+  const char *username = state->users[user_index].username;
+  for (int i = 0; i < state->channel_count; i++)
+  {
+    Channel *channel = &state->channels[i];
+    for (int j = 0; j < channel->grant_count; j++)
+    {
+      if (strcmp(channel->grants[j].username, username) == 0)
+      {
+        user_set_add(channel->members, user_index);
+        if (channel->grants[j].moderator)
+        {
+          user_set_add(channel->moderators, user_index);
+        }
+        channel->grants[j] = channel->grants[--channel->grant_count];
+        break;
+      }
+    }
+  }
+}
+
+// Make a channel private to its members, or public again. The default
+// channels stay public so everyone always has somewhere to land.
+int set_channel_private(AppState *state, int channel_index, int is_private)
+{
+  if (channel_index < 3 || channel_index >= state->channel_count)
+  {
+    return 0;
+  }
+
+  Channel *channel = &state->channels[channel_index];
+  channel->is_private = is_private;
+  if (is_private)
+  {
+    user_set_add(channel->members, state->current_user_index);
+  }
+  save_channel_access(state, channel);
+  post_system_message(channel, "%s made this channel %s",
+                      state->users[state->current_user_index].username,
+                      is_private ? "private" : "public");
+  replication_log_access(channel);
+  replication_log_notice(channel);
+  return 1;
+}
+
+int invite_user(AppState *state, char *username, int channel_index)
+{
+  int user_index = find_user(state, username);
+  if (user_index < 0 || channel_index < 0 || channel_index >= state->channel_count)
+  {
+    return 0;
+  }
+
+  Channel *channel = &state->channels[channel_index];
+  user_set_add(channel->members, user_index);
+  drop_grant(channel, username);
+  save_channel_access(state, channel);
+
+  // They start caught up rather than with the channel's whole backlog
+  state->users[user_index].last_read[channel_index] = channel->last_seq;
+  state->users[user_index].mentions[channel_index] = 0;
+
+  post_system_message(channel, "%s was invited by %s", username,
+                      state->users[state->current_user_index].username);
+  replication_log_access(channel);
+  replication_log_notice(channel);
+  return 1;
+}
+
+int kick_user(AppState *state, char *username, int channel_index)
+{
+  int user_index = find_user(state, username);
+  if (user_index < 0 || channel_index < 0 || channel_index >= state->channel_count)
+  {
+    return 0;
+  }
+
+  // Admins can't be removed from anything
+  if (state->users[user_index].role == ROLE_ADMIN)
+  {
+    return 0;
+  }
+
+  Channel *channel = &state->channels[channel_index];
+  user_set_remove(channel->members, user_index);
+  user_set_remove(channel->moderators, user_index);
+  drop_grant(channel, username);
+  save_channel_access(state, channel);
+  post_system_message(channel, "%s was removed by %s", username,
+                      state->users[state->current_user_index].username);
+  replication_log_access(channel);
+  replication_log_notice(channel);
+  metrics_count(METRIC_KICKS, 1);
+  return 1;
+}
+
+// Toggle a user's moderator rights in one channel; moderators are members
+int toggle_channel_moderator(AppState *state, char *username, int channel_index)
+{
+  int user_index = find_user(state, username);
+  if (user_index < 0 || channel_index < 0 || channel_index >= state->channel_count)
+  {
+    return 0;
+  }
+
+  Channel *channel = &state->channels[channel_index];
+  if (user_set_has(channel->moderators, user_index))
+  {
+    user_set_remove(channel->moderators, user_index);
+    post_system_message(channel, "%s is no longer a moderator here", username);
+  }
+  else
+  {
+    user_set_add(channel->moderators, user_index);
+    user_set_add(channel->members, user_index);
+    post_system_message(channel, "%s is now a moderator here", username);
+  }
+  drop_grant(channel, username);
+  save_channel_access(state, channel);
+  replication_log_access(channel);
+  replication_log_notice(channel);
+  metrics_count(METRIC_MODERATOR_CHANGES, 1);
+  return 1;
+}
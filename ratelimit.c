@@ -0,0 +1,150 @@
+#include "my_dispute.h"
+
+// Token-bucket rate limiting on the message ingest path.
+//
+// Every user, every channel and the whole server has a bucket holding up
+// to `burst` tokens, refilled at `rate` tokens per second of app_time, so
+// replays throttle deterministically. A message costs one token from each
+// bucket that applies. The user's bucket is checked first, so a single
+// flooder runs dry on its own bucket and leaves the channel and global
+// buckets to everyone else. Every limit is off until --rate-limit sets it,
+// so pastes and scripted replays behave as they did before limits existed.
+
+// Moderators may send this many times faster than regular users
+#define RATE_MODERATOR_FACTOR 4
+
+// Seconds between throttling notices to the same user
+#define RATE_NOTICE_INTERVAL 10
+
+static RateLimit limits[RATE_SCOPES] = {
+    {0, 0}, // RATE_USER
+    {0, 0}, // RATE_CHANNEL
+    {0, 0}, // RATE_GLOBAL
+};
+
+static const char *scope_names[RATE_SCOPES] = {"user", "channel", "global"};
+
+static TokenBucket global_bucket;
+static long messages_dropped = 0;
+
+void rate_limit_set(int scope, uint32_t rate, uint32_t burst)
+{
+  limits[scope].rate = rate;
+  limits[scope].burst = burst < rate ? rate : burst;
+}
+
+// Parse "scope=rate/burst" (burst defaults to rate); a rate of 0 turns
+// that limit off
+int rate_limit_configure(const char *spec)
+{
+  for (int scope = 0; scope < RATE_SCOPES; scope++)
+  {
+    size_t len = strlen(scope_names[scope]);
+    if (strncmp(spec, scope_names[scope], len) != 0 || spec[len] != '=')
+    {
+      continue;
+    }
+
+    unsigned int rate, burst;
+    int fields = sscanf(spec + len + 1, "%u/%u", &rate, &burst);
+    if (fields < 1)
+    {
+      return 0;
+    }
+    rate_limit_set(scope, rate, fields == 2 ? burst : rate);
+    return 1;
+  }
+  return 0;
+}
+
+// Top up a bucket for the whole seconds elapsed since its last refill and
+// report whether it holds a token. A bucket never used before starts full.
+static int bucket_ready(TokenBucket *bucket, uint32_t rate, uint32_t burst, time_t now)
+{
+  if (now != bucket->refilled)
+  {
+    uint64_t elapsed = now > bucket->refilled ? (uint64_t)(now - bucket->refilled) : 0;
+    uint64_t tokens = bucket->tokens + elapsed * rate;
+    bucket->tokens = tokens < burst ? tokens : burst;
+    bucket->refilled = now;
+  }
+  return bucket->tokens > 0;
+}
+
+// Take one token from every bucket that applies to a message from a user
+// to a channel, or to a direct message when channel_index is -1. Returns
+// the scope that refused it, or -1 when it may be sent; nothing is taken
+// unless every bucket has a token.
+int rate_limit_check(AppState *state, int user_index, int channel_index)
+{
+  User *user = &state->users[user_index];
+  if (user->role == ROLE_ADMIN)
+  {
+    return -1;
+  }
+
+  time_t now = app_time();
+  TokenBucket unused = {0, 0};
+  TokenBucket *channel_bucket = channel_index >= 0 ? &state->channels[channel_index].send_bucket
+                                                   : &unused;
+  uint32_t factor = user->role == ROLE_MODERATOR ? RATE_MODERATOR_FACTOR : 1;
+  int user_limited = limits[RATE_USER].rate != 0;
+  int channel_limited = channel_index >= 0 && limits[RATE_CHANNEL].rate != 0;
+  int global_limited = limits[RATE_GLOBAL].rate != 0;
+
+  int refused = -1;
+  if (user_limited && !bucket_ready(&user->send_bucket, limits[RATE_USER].rate * factor,
+                                    limits[RATE_USER].burst * factor, now))
+  {
+    refused = RATE_USER;
+  }
+  else if (channel_limited && !bucket_ready(channel_bucket, limits[RATE_CHANNEL].rate,
+                                            limits[RATE_CHANNEL].burst, now))
+  {
+    refused = RATE_CHANNEL;
+  }
+  else if (global_limited && !bucket_ready(&global_bucket, limits[RATE_GLOBAL].rate,
+                                           limits[RATE_GLOBAL].burst, now))
+  {
+    refused = RATE_GLOBAL;
+  }
+
+  if (refused >= 0)
+  {
+    messages_dropped++;
+    user->throttled++;
+    return refused;
+  }
+
+  user->send_bucket.tokens -= user_limited;
+  channel_bucket->tokens -= channel_limited;
+  global_bucket.tokens -= global_limited;
+  return -1;
+}
+
+// Format the notice telling a throttled user that their messages are
+// being dropped. Notices are coalesced: returns 0 when one went out less
+// than RATE_NOTICE_INTERVAL ago, and each counts every message dropped
+// since the previous one.
+int rate_limit_notice(AppState *state, int user_index, int scope, char *text, size_t size)
+{
+  User *user = &state->users[user_index];
+  time_t now = app_time();
+  if (user->throttle_notice_at && now - user->throttle_notice_at < RATE_NOTICE_INTERVAL)
+  {
+    return 0;
+  }
+
+  snprintf(text, size,
+           "Slow down, %s: over the %s rate limit, messages are being dropped "
+           "(%u since the last notice)",
+           user->username, scope_names[scope], user->throttled);
+  user->throttled = 0;
+  user->throttle_notice_at = now;
+  return 1;
+}
+
+long rate_limit_dropped()
+{
+  return messages_dropped;
+}
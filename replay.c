@@ -0,0 +1,238 @@
+#include "my_dispute.h"
+
+// Scripted input replay and virtual clock.
+//
+// In replay mode keystrokes come from a script file instead of the
+// keyboard and time only advances when the script says so, which makes a
+// session (including mutes and message timestamps) fully deterministic.
+//
+// Script format, one event per line; blank lines and '#' comments are
+// ignored:
+//   type <text>      send each character of text as a keystroke
+//   key <name>       send one key: enter, tab, btab, up, down, left, right,
+//                    home, end, backspace, delete, pageup, pagedown, esc,
+//                    f10, or a decimal key code
+//   sleep <seconds>  advance the virtual clock
+//   time <epoch>     set the virtual clock
+//   paste <text>     deliver text as one bracketed paste; \n is a line break
+//   logout           log the current user out and return to the auth screen
+
+// Virtual clock start, so timestamps do not depend on when the replay runs
+#define REPLAY_EPOCH 1700000000
+
+static FILE *script = NULL;
+static int script_line = 0;
+static int script_done = 0;
+static time_t virtual_now = REPLAY_EPOCH;
+
+// Keys produced by the current script line that have not been consumed yet
+static int pending_keys[MAX_INPUT_LEN];
+static int pending_count = 0;
+static int pending_pos = 0;
+
+// Set when the pending keys arrived together, like a paste
+static int pending_burst = 0;
+
+static struct
+{
+  const char *name;
+  int key;
+} key_names[] = {
+    {"enter", '\n'},
+    {"tab", '\t'},
+    {"btab", KEY_BTAB},
+    {"up", KEY_UP},
+    {"down", KEY_DOWN},
+    {"left", KEY_LEFT},
+    {"right", KEY_RIGHT},
+    {"home", KEY_HOME},
+    {"end", KEY_END},
+    {"backspace", KEY_BACKSPACE},
+    {"delete", KEY_DC},
+    {"pageup", KEY_PPAGE},
+    {"pagedown", KEY_NPAGE},
+    {"esc", 27},
+    {"f10", KEY_F(10)},
+};
+
+int replay_open(const char *path)
+{
+  script = fopen(path, "r");
+  if (!script)
+  {
+    perror(path);
+    return 0;
+  }
+  return 1;
+}
+
+int replay_active()
+{
+  return script != NULL;
+}
+
+time_t app_time()
+{
+  if (script)
+  {
+    return virtual_now;
+  }
+  return time(NULL);
+}
+
+static void queue_key(int key)
+{
+  if (pending_count < MAX_INPUT_LEN)
+  {
+    pending_keys[pending_count++] = key;
+  }
+}
+
+static int parse_key(const char *name)
+{
+  for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++)
+  {
+    if (strcmp(key_names[i].name, name) == 0)
+    {
+      return key_names[i].key;
+    }
+  }
+
+  if (isdigit((unsigned char)name[0]))
+  {
+    return atoi(name);
+  }
+
+  return ERR;
+}
+
+// Read script lines until at least one key is pending or the script ends
+static void load_next_keys()
+{
+  char line[MAX_INPUT_LEN + 16];
+
+  pending_count = 0;
+  pending_pos = 0;
+  pending_burst = 0;
+
+  while (pending_count == 0 && fgets(line, sizeof(line), script))
+  {
+    script_line++;
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (line[0] == '\0' || line[0] == '#')
+    {
+      continue;
+    }
+
+    if (strncmp(line, "type ", 5) == 0)
+    {
+      // Queue the raw bytes so multibyte UTF-8 input replays unchanged
+      for (char *p = line + 5; *p; p++)
+      {
+        queue_key((unsigned char)*p);
+      }
+    }
+    else if (strncmp(line, "paste ", 6) == 0)
+    {
+      queue_key(KEY_PASTE_BEGIN);
+      for (char *p = line + 6; *p; p++)
+      {
+        if (p[0] == '\\' && p[1] == 'n')
+        {
+          queue_key('\n');
+          p++;
+        }
+        else
+        {
+          queue_key((unsigned char)*p);
+        }
+      }
+      queue_key(KEY_PASTE_END);
+      pending_burst = 1;
+    }
+    else if (strncmp(line, "key ", 4) == 0)
+    {
+      int key = parse_key(line + 4);
+      if (key == ERR)
+      {
+        fprintf(stderr, "replay:%d: unknown key '%s'\n", script_line, line + 4);
+        continue;
+      }
+      queue_key(key);
+    }
+    else if (strncmp(line, "sleep ", 6) == 0)
+    {
+      virtual_now += atol(line + 6);
+    }
+    else if (strncmp(line, "time ", 5) == 0)
+    {
+      virtual_now = atol(line + 5);
+    }
+    else if (strcmp(line, "logout") == 0)
+    {
+      queue_key(KEY_REPLAY_LOGOUT);
+    }
+    else
+    {
+      fprintf(stderr, "replay:%d: unknown event '%s'\n", script_line, line);
+    }
+  }
+
+  if (pending_count == 0)
+  {
+    script_done = 1;
+  }
+}
+
+// Read one key for win, from the replay script when one is loaded.
+// Once the script is exhausted every call returns F10, which backs out of
+// whatever screen is active and exits the application.
+int read_key(WINDOW *win)
+{
+  if (!script)
+  {
+    return wgetch(win);
+  }
+
+  if (pending_pos >= pending_count && !script_done)
+  {
+    load_next_keys();
+  }
+
+  if (script_done)
+  {
+    return KEY_F(10);
+  }
+
+  return pending_keys[pending_pos++];
+}
+
+// Read a key only if one is already waiting (or arrives within wait_ms),
+// returning ERR otherwise. In replay mode only the rest of a paste counts
+// as waiting, so typed text still produces one frame per key.
+int read_key_nowait(WINDOW *win, int wait_ms)
+{
+  if (script)
+  {
+    if (pending_burst && pending_pos < pending_count)
+    {
+      return pending_keys[pending_pos++];
+    }
+    return ERR;
+  }
+
+  wtimeout(win, wait_ms);
+  int ch = wgetch(win);
+  wtimeout(win, -1);
+  return ch;
+}
+
+void replay_close()
+{
+  if (script)
+  {
+    fclose(script);
+    script = NULL;
+  }
+}
@@ -0,0 +1,1300 @@
+#include "my_dispute.h"
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Read replicas fed from the primary's change log.
+//
+// A terminal started with --replicate PATH is a primary: every change to
+// its users and channels (registrations, roles, mutes, channel creation,
+// deletion and access, and every message appended to a channel) is
+// recorded with the next log sequence number (LSN) and streamed over the
+// Unix socket PATH to each connected replica. A terminal started with
+// --replica-of PATH applies those records to its own AppState. Its users
+// can log in, scroll and search there, but it refuses anything that
+// would change state until an admin runs /promote. It then stops
+// following and, if it was given --replicate too, serves replicas of its
+// own from that point.
+//
+// A replica that connects with nothing gets a snapshot: the primary's
+// current state written as the same records, then a SYNC record naming
+// the LSN the snapshot stands for. A channel's messages in the snapshot
+// are its whole readable history, read back from disk a chunk at a time
+// as the replica's socket drains, so a large history costs no more memory
+// than a small one. A replica that lost its connection
+// reconnects with the last LSN it applied. The primary keeps the newest
+// LOG_BYTES of the log and streams from there; replicas share that one
+// log and have no copies of their own. Replicas acknowledge what they
+// have applied, and the difference to the newest LSN is the lag shown in
+// /stats.
+//
+// User indices are not sent by name: a replica starts with no users and
+// adds them in log order, so its indices match the primary's. Direct
+// messages, reactions and read markers stay on each terminal.
+//
+// The log carries users' passwords, so the socket is created 0600 and a
+// replica is served only if its hello carries the primary's replica
+// secret (--replica-secret).
+
+#define REPLICATION_VERSION 2
+#define LOG_BYTES (8 * 1024 * 1024)
+#define REPLICA_IN_BYTES (256 * 1024)
+#define RETRY_NS 1000000000L
+#define SNAPSHOT_CHUNK (256 * 1024) // Snapshot bytes buffered per replica at a time
+
+#define CHANGE_USER 1   // UserChange
+#define CHANGE_ROLE 2   // RoleChange
+#define CHANGE_MUTE 3   // MuteChange
+#define CHANGE_CREATE 4 // ChannelChange
+#define CHANGE_DELETE 5 // ChannelChange
+#define CHANGE_ACCESS 6 // AccessChange
+#define CHANGE_APPEND 7 // AppendChange followed by the text
+
+// Control records are not part of the log and carry LSN 0
+#define CONTROL_HELLO 16  // Replica to primary: HelloControl, first
+#define CONTROL_ACK 17    // Replica to primary: AckControl
+#define CONTROL_SYNC 18   // Primary to replica: SyncControl, after a snapshot
+#define CONTROL_REFUSE 19 // Primary to replica: wrong secret, or it can't be resumed
+
+typedef struct
+{
+  uint32_t len; // Payload bytes
+  uint32_t type;
+  uint64_t lsn;      // 0 for snapshot and control records
+  int64_t logged_ns; // stats_now_ns() on the primary when logged
+} ChangeHeader;
+
+typedef struct
+{
+  char username[MAX_USERNAME_LEN];
+  char email[MAX_EMAIL_LEN];
+  char password[MAX_PASSWORD_LEN];
+  int32_t role;
+} UserChange;
+
+typedef struct
+{
+  uint32_t user;
+  int32_t role;
+} RoleChange;
+
+typedef struct
+{
+  int64_t until;
+  uint32_t user;
+  char channel[MAX_CHANNEL_NAME_LEN];
+} MuteChange;
+
+typedef struct
+{
+  char channel[MAX_CHANNEL_NAME_LEN];
+} ChannelChange;
+
+typedef struct
+{
+  char channel[MAX_CHANNEL_NAME_LEN];
+  int32_t is_private;
+  uint64_t members[USER_SET_WORDS];
+  uint64_t moderators[USER_SET_WORDS];
+} AccessChange;
+
+typedef struct
+{
+  int64_t timestamp;
+  uint32_t sender;
+  char channel[MAX_CHANNEL_NAME_LEN];
+} AppendChange;
+
+typedef struct
+{
+  uint32_t version;
+  uint64_t primary; // Primary the replica followed, 0 if none yet
+  uint64_t applied; // Last LSN applied, 0 for a fresh replica
+  char secret[NET_SECRET_LEN];
+} HelloControl;
+
+typedef struct
+{
+  uint64_t applied;
+} AckControl;
+
+typedef struct
+{
+  uint64_t primary;
+  uint64_t lsn;
+} SyncControl;
+
+typedef struct
+{
+  char *data;
+  size_t len;
+  size_t capacity;
+} Buffer;
+
+// Messages of a channel a snapshot has still to send
+typedef struct
+{
+  char channel[MAX_CHANNEL_NAME_LEN];
+  uint32_t next; // Seq of the next one
+  uint32_t last; // Newest when the snapshot was taken; later ones are in the log
+} SnapshotStream;
+
+typedef struct
+{
+  int fd; // -1 while the slot is free
+  int greeted;
+  Buffer snapshot; // Sent before anything from the log
+  size_t snapshot_sent;
+  int streaming; // More of the snapshot is still to be read into it
+  SnapshotStream streams[MAX_CHANNELS];
+  int stream_count;
+  int stream_index;  // Stream being read
+  uint64_t sync_lsn; // LSN the snapshot stands for
+  uint64_t cursor; // Absolute log offset of the next byte to send
+  uint64_t acked;  // Last LSN the replica reported applied
+  char in[sizeof(ChangeHeader) + sizeof(HelloControl)]; // Hello or acknowledgements
+  size_t in_len;
+} Replica;
+
+// Primary side
+static int logging = 0;
+static Buffer change_log;
+static uint64_t log_base = 0; // Absolute offset of change_log.data[0]
+static uint64_t last_lsn = 0;
+static uint64_t primary_id = 0;
+static int listen_fd = -1;
+static char serve_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static char replica_secret[NET_SECRET_LEN]; // Zero-padded; empty until loaded
+static Replica replicas[REPLICATION_MAX_REPLICAS];
+static int replicas_ready = 0;
+static int polled[REPLICATION_MAX_FDS]; // Replica behind each polled fd, -1 for others
+static AppState *snapshot_state = NULL; // State the snapshots are read from
+
+// Replica side
+static int following = 0; // Applying a primary's log, not yet promoted
+static int primary_fd = -1;
+static char follow_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static uint64_t followed_id = 0;
+static uint64_t applied_lsn = 0;
+static long apply_delay_ns = 0; // From logging to applying, for the last record
+static long retry_at = 0;
+static int refused = 0;
+static int synced = 0; // A snapshot has been applied
+static Buffer replica_in;
+
+// Make room for at least size bytes in all
+static void reserve(Buffer *buffer, size_t size)
+{
+  if (size > buffer->capacity)
+  {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < size)
+    {
+      capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    if (!buffer->data)
+    {
+      perror("realloc");
+      exit(1);
+    }
+    buffer->capacity = capacity;
+  }
+}
+
+static void put_bytes(Buffer *buffer, const void *data, size_t len)
+{
+  reserve(buffer, buffer->len + len);
+  if (len)
+  {
+    memcpy(buffer->data + buffer->len, data, len);
+  }
+  buffer->len += len;
+}
+
+static void put_record(Buffer *buffer, int type, uint64_t lsn, const void *data, size_t len,
+                       const char *text, size_t text_len)
+{
+  ChangeHeader header = {len + text_len, type, lsn, stats_now_ns()};
+  put_bytes(buffer, &header, sizeof(header));
+  put_bytes(buffer, data, len);
+  put_bytes(buffer, text, text_len);
+}
+
+static void free_buffer(Buffer *buffer)
+{
+  free(buffer->data);
+  memset(buffer, 0, sizeof(Buffer));
+}
+
+static uint64_t new_primary_id()
+{
+  return ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ stats_now_ns();
+}
+
+static socklen_t socket_address(struct sockaddr_un *addr, const char *path)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+  return sizeof(struct sockaddr_un);
+}
+
+static void drop_replica(Replica *replica)
+{
+  close(replica->fd);
+  free_buffer(&replica->snapshot);
+  replica->fd = -1;
+}
+
+static void fill_snapshot(Replica *replica);
+
+// Write what the replica has not been sent, as far as its socket takes
+// it. Returns 0 if the connection failed.
+static int flush_replica(Replica *replica)
+{
+  while (replica->greeted)
+  {
+    const char *data;
+    size_t len;
+    if (replica->snapshot_sent == replica->snapshot.len && replica->streaming)
+    {
+      replica->snapshot.len = 0;
+      replica->snapshot_sent = 0;
+      fill_snapshot(replica);
+    }
+    if (replica->snapshot_sent < replica->snapshot.len)
+    {
+      data = replica->snapshot.data + replica->snapshot_sent;
+      len = replica->snapshot.len - replica->snapshot_sent;
+    }
+    else if (replica->cursor < log_base + change_log.len)
+    {
+      data = change_log.data + (replica->cursor - log_base);
+      len = log_base + change_log.len - replica->cursor;
+    }
+    else
+    {
+      return 1;
+    }
+
+    ssize_t sent = send(replica->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (replica->snapshot_sent < replica->snapshot.len)
+    {
+      replica->snapshot_sent += sent;
+      if (replica->snapshot_sent == replica->snapshot.len && !replica->streaming)
+      {
+        free_buffer(&replica->snapshot);
+        replica->snapshot_sent = 0;
+      }
+    }
+    else
+    {
+      replica->cursor += sent;
+    }
+  }
+  return 1;
+}
+
+static int replica_pending(Replica *replica)
+{
+  return replica->snapshot_sent < replica->snapshot.len || replica->streaming ||
+         replica->cursor < log_base + change_log.len;
+}
+
+// Make room for need more bytes by forgetting the oldest half of the log.
+// Replicas that had not been sent it yet can no longer catch up.
+static void trim_log(size_t need)
+{
+  size_t drop = 0;
+  while (drop < change_log.len && (drop < change_log.len / 2 || change_log.len - drop + need > LOG_BYTES))
+  {
+    ChangeHeader header;
+    memcpy(&header, change_log.data + drop, sizeof(header));
+    drop += sizeof(header) + header.len;
+  }
+  memmove(change_log.data, change_log.data + drop, change_log.len - drop);
+  change_log.len -= drop;
+  log_base += drop;
+
+  for (int i = 0; i < REPLICATION_MAX_REPLICAS; i++)
+  {
+    if (replicas[i].fd >= 0 && replicas[i].greeted && replicas[i].cursor < log_base)
+    {
+      drop_replica(&replicas[i]);
+    }
+  }
+}
+
+// Append a change to the log and pass it on to the replicas
+static void log_change(int type, const void *data, size_t len, const char *text, size_t text_len)
+{
+  size_t need = sizeof(ChangeHeader) + len + text_len;
+  if (change_log.len + need > LOG_BYTES)
+  {
+    trim_log(need);
+  }
+  put_record(&change_log, type, ++last_lsn, data, len, text, text_len);
+
+  for (int i = 0; i < REPLICATION_MAX_REPLICAS && listen_fd >= 0; i++)
+  {
+    if (replicas[i].fd >= 0 && !flush_replica(&replicas[i]))
+    {
+      drop_replica(&replicas[i]);
+    }
+  }
+}
+
+// Start recording changes. Serving calls this; the benchmark uses it to
+// capture a log without any replica.
+void replication_log_start()
+{
+  logging = 1;
+  if (!primary_id)
+  {
+    primary_id = new_primary_id();
+  }
+}
+
+const char *replication_log_data(size_t *len)
+{
+  *len = change_log.len;
+  return change_log.data;
+}
+
+void replication_log_user(AppState *state, int user_index)
+{
+  if (!logging)
+  {
+    return;
+  }
+  User *user = &state->users[user_index];
+  UserChange change = {0};
+  snprintf(change.username, sizeof(change.username), "%s", user->username);
+  snprintf(change.email, sizeof(change.email), "%s", user->email);
+  snprintf(change.password, sizeof(change.password), "%s", user->password);
+  change.role = user->role;
+  log_change(CHANGE_USER, &change, sizeof(change), NULL, 0);
+}
+
+void replication_log_role(int user_index, int role)
+{
+  if (logging)
+  {
+    RoleChange change = {user_index, role};
+    log_change(CHANGE_ROLE, &change, sizeof(change), NULL, 0);
+  }
+}
+
+void replication_log_mute(AppState *state, int user_index, int channel_index)
+{
+  if (!logging)
+  {
+    return;
+  }
+  MuteChange change = {0};
+  change.until = state->users[user_index].muted_until[channel_index];
+  change.user = user_index;
+  snprintf(change.channel, sizeof(change.channel), "%s", state->channels[channel_index].name);
+  log_change(CHANGE_MUTE, &change, sizeof(change), NULL, 0);
+}
+
+static void log_channel(int type, const char *name)
+{
+  if (logging)
+  {
+    ChannelChange change = {{0}};
+    snprintf(change.channel, sizeof(change.channel), "%s", name);
+    log_change(type, &change, sizeof(change), NULL, 0);
+  }
+}
+
+void replication_log_create(const char *name)
+{
+  log_channel(CHANGE_CREATE, name);
+}
+
+void replication_log_delete(const char *name)
+{
+  // A channel created again under the name is not the one being sent
+  for (int i = 0; i < REPLICATION_MAX_REPLICAS && listen_fd >= 0; i++)
+  {
+    for (int s = 0; replicas[i].fd >= 0 && s < replicas[i].stream_count; s++)
+    {
+      SnapshotStream *stream = &replicas[i].streams[s];
+      if (strncmp(stream->channel, name, MAX_CHANNEL_NAME_LEN) == 0)
+      {
+        stream->next = stream->last + 1;
+      }
+    }
+  }
+  log_channel(CHANGE_DELETE, name);
+}
+
+static void access_change(Channel *channel, AccessChange *change)
+{
+  memset(change, 0, sizeof(AccessChange));
+  snprintf(change->channel, sizeof(change->channel), "%s", channel->name);
+  change->is_private = channel->is_private;
+  memcpy(change->members, channel->members, sizeof(change->members));
+  memcpy(change->moderators, channel->moderators, sizeof(change->moderators));
+}
+
+void replication_log_access(Channel *channel)
+{
+  if (logging)
+  {
+    AccessChange change;
+    access_change(channel, &change);
+    log_change(CHANGE_ACCESS, &change, sizeof(change), NULL, 0);
+  }
+}
+
+static void append_change(Channel *channel, uint32_t sender_id, time_t timestamp,
+                          AppendChange *change)
+{
+  memset(change, 0, sizeof(AppendChange));
+  change->timestamp = timestamp;
+  change->sender = sender_id;
+  snprintf(change->channel, sizeof(change->channel), "%s", channel->name);
+}
+
+void replication_log_append(Channel *channel, uint32_t sender_id, const char *text, size_t len,
+                            time_t timestamp)
+{
+  if (logging)
+  {
+    AppendChange change;
+    append_change(channel, sender_id, timestamp, &change);
+    log_change(CHANGE_APPEND, &change, sizeof(change), text, len);
+  }
+}
+
+// Log the notice a change just posted to a channel, so replicas show it
+// too. Other system messages (errors, link status) stay local.
+void replication_log_notice(Channel *channel)
+{
+  if (logging && channel->message_count > 0)
+  {
+    Message *msg = channel_message(channel, channel->message_count - 1);
+    replication_log_append(channel, msg->sender_id, message_text(channel, msg), msg->text_len,
+                           msg->timestamp);
+  }
+}
+
+// The primary's whole state as records, for a replica that has nothing.
+// Users and channels are written now; channel messages are read into the
+// snapshot by fill_snapshot as it is sent.
+static void build_snapshot(AppState *state, Replica *replica)
+{
+  Buffer *out = &replica->snapshot;
+  snapshot_state = state;
+  replica->stream_count = 0;
+  replica->stream_index = 0;
+  for (int i = 0; i < state->user_count; i++)
+  {
+    User *user = &state->users[i];
+    UserChange change = {0};
+    snprintf(change.username, sizeof(change.username), "%s", user->username);
+    snprintf(change.email, sizeof(change.email), "%s", user->email);
+    snprintf(change.password, sizeof(change.password), "%s", user->password);
+    change.role = user->role;
+    put_record(out, CHANGE_USER, 0, &change, sizeof(change), NULL, 0);
+  }
+
+  for (int c = 0; c < state->channel_count; c++)
+  {
+    Channel *channel = &state->channels[c];
+    ChannelChange create = {{0}};
+    snprintf(create.channel, sizeof(create.channel), "%s", channel->name);
+    put_record(out, CHANGE_CREATE, 0, &create, sizeof(create), NULL, 0);
+
+    AccessChange access;
+    access_change(channel, &access);
+    put_record(out, CHANGE_ACCESS, 0, &access, sizeof(access), NULL, 0);
+
+    for (int i = 0; i < state->user_count; i++)
+    {
+      if (state->users[i].muted_until[c])
+      {
+        MuteChange mute = {0};
+        mute.until = state->users[i].muted_until[c];
+        mute.user = i;
+        snprintf(mute.channel, sizeof(mute.channel), "%s", channel->name);
+        put_record(out, CHANGE_MUTE, 0, &mute, sizeof(mute), NULL, 0);
+      }
+    }
+
+    SnapshotStream *stream = &replica->streams[replica->stream_count++];
+    uint32_t oldest = channel->last_seq - channel->message_count + 1;
+    snprintf(stream->channel, sizeof(stream->channel), "%s", channel->name);
+    stream->next = channel->history && history_first_seq(channel) < oldest
+                       ? history_first_seq(channel)
+                       : oldest;
+    stream->last = channel->last_seq;
+  }
+
+  replica->sync_lsn = last_lsn;
+  replica->streaming = 1;
+  fill_snapshot(replica);
+}
+
+// Write message seq of a channel as a record: from the ring while it still
+// holds it, from on-disk history otherwise. Returns 0 if retention already
+// removed it.
+static int snapshot_message(AppState *state, Channel *channel, uint32_t seq, Buffer *out)
+{
+  AppendChange append;
+  uint32_t oldest = channel->last_seq - channel->message_count + 1;
+  if (seq >= oldest && seq <= channel->last_seq)
+  {
+    Message *msg = channel_message(channel, seq - oldest);
+    append_change(channel, msg->sender_id, msg->timestamp, &append);
+    put_record(out, CHANGE_APPEND, 0, &append, sizeof(append), message_text(channel, msg),
+               msg->text_len);
+    return 1;
+  }
+
+  HistoryMessage msg;
+  if (!history_get(channel, seq, &msg))
+  {
+    return 0;
+  }
+  int sender = roster_find_user(state, msg.sender, strlen(msg.sender));
+  append_change(channel, sender >= 0 ? (uint32_t)sender : SYSTEM_SENDER_ID, msg.timestamp,
+                &append);
+  put_record(out, CHANGE_APPEND, 0, &append, sizeof(append), msg.text, strlen(msg.text));
+  return 1;
+}
+
+// Read up to SNAPSHOT_CHUNK more of the snapshot's channel messages, and
+// the SYNC record once they are all written
+static void fill_snapshot(Replica *replica)
+{
+  Buffer *out = &replica->snapshot;
+  while (replica->stream_index < replica->stream_count && out->len < SNAPSHOT_CHUNK)
+  {
+    SnapshotStream *stream = &replica->streams[replica->stream_index];
+    int index = find_channel(snapshot_state, stream->channel);
+    if (index < 0 || stream->next > stream->last)
+    {
+      replica->stream_index++;
+      continue;
+    }
+    snapshot_message(snapshot_state, &snapshot_state->channels[index], stream->next++, out);
+  }
+
+  if (replica->stream_index == replica->stream_count)
+  {
+    SyncControl sync = {primary_id, replica->sync_lsn};
+    put_record(out, CONTROL_SYNC, 0, &sync, sizeof(sync), NULL, 0);
+    replica->streaming = 0;
+  }
+}
+
+// Absolute log offset of the record with the given LSN, or of the end of
+// the log for the LSN after the newest. Returns 0 if the log no longer
+// holds it.
+static int find_lsn(uint64_t lsn, uint64_t *offset)
+{
+  size_t pos = 0;
+  while (pos < change_log.len)
+  {
+    ChangeHeader header;
+    memcpy(&header, change_log.data + pos, sizeof(header));
+    if (header.lsn == lsn)
+    {
+      *offset = log_base + pos;
+      return 1;
+    }
+    if (header.lsn > lsn)
+    {
+      return 0;
+    }
+    pos += sizeof(header) + header.len;
+  }
+  if (lsn == last_lsn + 1)
+  {
+    *offset = log_base + change_log.len;
+    return 1;
+  }
+  return 0;
+}
+
+// A replica said hello: resume it, give it a snapshot or turn it away
+static int greet_replica(AppState *state, Replica *replica, const HelloControl *hello)
+{
+  uint64_t offset;
+  int admitted = replica_secret[0] && net_secret_matches(replica_secret, hello->secret);
+  if (hello->version != REPLICATION_VERSION)
+  {
+    return 0;
+  }
+  if (admitted && hello->applied == 0)
+  {
+    build_snapshot(state, replica);
+    replica->snapshot_sent = 0;
+    replica->cursor = log_base + change_log.len;
+  }
+  else if (admitted && hello->primary == primary_id && find_lsn(hello->applied + 1, &offset))
+  {
+    replica->cursor = offset;
+  }
+  else
+  {
+    Buffer refusal = {0};
+    put_record(&refusal, CONTROL_REFUSE, 0, NULL, 0, NULL, 0);
+    send(replica->fd, refusal.data, refusal.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    free_buffer(&refusal);
+    return 0;
+  }
+  replica->greeted = 1;
+  replica->acked = hello->applied;
+  return flush_replica(replica);
+}
+
+// Read hello and acknowledgements from a replica. Returns 0 to drop it.
+static int receive_from_replica(AppState *state, Replica *replica)
+{
+  ssize_t got = recv(replica->fd, replica->in + replica->in_len,
+                     sizeof(replica->in) - replica->in_len, MSG_DONTWAIT);
+  if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    return 0;
+  }
+  if (got < 0)
+  {
+    return 1;
+  }
+  replica->in_len += got;
+
+  size_t pos = 0;
+  while (replica->in_len - pos >= sizeof(ChangeHeader))
+  {
+    ChangeHeader header;
+    memcpy(&header, replica->in + pos, sizeof(header));
+    if (header.len > sizeof(replica->in) - sizeof(header))
+    {
+      return 0;
+    }
+    if (replica->in_len - pos < sizeof(header) + header.len)
+    {
+      break;
+    }
+    const char *payload = replica->in + pos + sizeof(header);
+    if (header.type == CONTROL_HELLO && !replica->greeted && header.len >= sizeof(HelloControl))
+    {
+      HelloControl hello;
+      memcpy(&hello, payload, sizeof(hello));
+      if (!greet_replica(state, replica, &hello))
+      {
+        return 0;
+      }
+    }
+    else if (header.type == CONTROL_ACK && header.len >= sizeof(AckControl))
+    {
+      AckControl ack;
+      memcpy(&ack, payload, sizeof(ack));
+      replica->acked = ack.applied;
+    }
+    pos += sizeof(header) + header.len;
+  }
+  memmove(replica->in, replica->in + pos, replica->in_len - pos);
+  replica->in_len -= pos;
+  return 1;
+}
+
+static void init_replicas()
+{
+  if (!replicas_ready)
+  {
+    for (int i = 0; i < REPLICATION_MAX_REPLICAS; i++)
+    {
+      replicas[i].fd = -1;
+    }
+    replicas_ready = 1;
+  }
+}
+
+// The secret a primary requires of its replicas, and a replica presents
+int replication_load_secret(const char *path)
+{
+  return net_read_secret(path, replica_secret);
+}
+
+// Serve replicas on the Unix socket path. A replica given this too serves
+// once it is promoted.
+int replication_serve(const char *path)
+{
+  if (strlen(path) >= sizeof(serve_path))
+  {
+    fprintf(stderr, "Replication socket path too long: %s\n", path);
+    return 0;
+  }
+  strcpy(serve_path, path);
+  if (following)
+  {
+    return 1;
+  }
+
+  init_replicas();
+  struct sockaddr_un addr;
+  socklen_t addr_len = socket_address(&addr, path);
+  // A socket file left by a primary that did not exit cleanly is
+  // replaced; anything else at the path is left alone
+  struct stat st;
+  if (lstat(path, &st) == 0)
+  {
+    if (!S_ISSOCK(st.st_mode))
+    {
+      fprintf(stderr, "Can't serve replicas on %s: not a socket\n", path);
+      return 0;
+    }
+    unlink(path);
+  }
+  // Nobody can connect before listen(), so the mode is set in between
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, addr_len) != 0 ||
+      chmod(path, 0600) != 0 || listen(listen_fd, REPLICATION_MAX_REPLICAS) != 0)
+  {
+    fprintf(stderr, "Can't serve replicas on %s: %s\n", path, strerror(errno));
+    if (listen_fd >= 0)
+    {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+    return 0;
+  }
+  replication_log_start();
+  return 1;
+}
+
+static int connect_primary()
+{
+  struct sockaddr_un addr;
+  socklen_t addr_len = socket_address(&addr, follow_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, addr_len) != 0)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return 0;
+  }
+
+  Buffer hello_record = {0};
+  HelloControl hello = {REPLICATION_VERSION, followed_id, applied_lsn, {0}};
+  memcpy(hello.secret, replica_secret, NET_SECRET_LEN);
+  put_record(&hello_record, CONTROL_HELLO, 0, &hello, sizeof(hello), NULL, 0);
+  int sent = send(fd, hello_record.data, hello_record.len, MSG_NOSIGNAL) ==
+             (ssize_t)hello_record.len;
+  free_buffer(&hello_record);
+  if (!sent)
+  {
+    close(fd);
+    return 0;
+  }
+  primary_fd = fd;
+  replica_in.len = 0;
+  return 1;
+}
+
+// Follow the primary serving on path, as a read-only replica
+int replication_follow(const char *path)
+{
+  if (strlen(path) >= sizeof(follow_path))
+  {
+    fprintf(stderr, "Replication socket path too long: %s\n", path);
+    return 0;
+  }
+  strcpy(follow_path, path);
+  if (!connect_primary())
+  {
+    fprintf(stderr, "No primary is serving replicas on %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  following = 1;
+  return 1;
+}
+
+// Wait for the primary's snapshot, so its users can log in here. Returns
+// 0 if it did not arrive within timeout_ms; it is still applied later.
+int replication_catch_up(AppState *state, int timeout_ms)
+{
+  long deadline = stats_now_ns() + timeout_ms * 1000000L;
+  while (following && !synced && primary_fd >= 0)
+  {
+    long wait_ns = deadline - stats_now_ns();
+    struct pollfd fd = {primary_fd, POLLIN, 0};
+    if (wait_ns <= 0 || poll(&fd, 1, wait_ns / 1000000 + 1) <= 0)
+    {
+      return 0;
+    }
+    replication_events(state, &fd, 1);
+  }
+  return synced;
+}
+
+int replication_active()
+{
+  return listen_fd >= 0 || following;
+}
+
+int replication_read_only()
+{
+  return following;
+}
+
+// Apply one record from the primary
+static void apply_change(AppState *state, int type, const char *payload, size_t len)
+{
+  if (type == CHANGE_USER && len >= sizeof(UserChange))
+  {
+    UserChange change;
+    memcpy(&change, payload, sizeof(change));
+    change.username[MAX_USERNAME_LEN - 1] = '\0';
+    change.email[MAX_EMAIL_LEN - 1] = '\0';
+    change.password[MAX_PASSWORD_LEN - 1] = '\0';
+    int current = state->current_user_index;
+    if (add_new_user(state, change.username, change.email, change.password))
+    {
+      int index = state->user_count - 1;
+      set_user_online(state, index, 0);
+      state->users[index].role = change.role;
+      state->current_user_index = current;
+    }
+  }
+  else if (type == CHANGE_ROLE && len >= sizeof(RoleChange))
+  {
+    RoleChange change;
+    memcpy(&change, payload, sizeof(change));
+    if (change.user < (uint32_t)state->user_count)
+    {
+      state->users[change.user].role = change.role;
+    }
+  }
+  else if (type == CHANGE_MUTE && len >= sizeof(MuteChange))
+  {
+    MuteChange change;
+    memcpy(&change, payload, sizeof(change));
+    change.channel[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    int channel = find_channel(state, change.channel);
+    if (channel >= 0 && change.user < (uint32_t)state->user_count)
+    {
+      state->users[change.user].muted_until[channel] = change.until;
+    }
+  }
+  else if ((type == CHANGE_CREATE || type == CHANGE_DELETE) && len >= sizeof(ChannelChange))
+  {
+    ChannelChange change;
+    memcpy(&change, payload, sizeof(change));
+    change.channel[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    if (type == CHANGE_DELETE)
+    {
+      delete_channel(state, change.channel);
+    }
+    else if (find_channel(state, change.channel) < 0 && state->channel_count < MAX_CHANNELS)
+    {
+      // The primary's "created by" notice follows as an append
+      init_channel(&state->channels[state->channel_count], change.channel);
+      save_channel_access(state, &state->channels[state->channel_count++]);
+    }
+  }
+  else if (type == CHANGE_ACCESS && len >= sizeof(AccessChange))
+  {
+    AccessChange change;
+    memcpy(&change, payload, sizeof(change));
+    change.channel[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    int channel = find_channel(state, change.channel);
+    if (channel >= 0)
+    {
+      state->channels[channel].is_private = change.is_private;
+      memcpy(state->channels[channel].members, change.members, sizeof(change.members));
+      memcpy(state->channels[channel].moderators, change.moderators, sizeof(change.moderators));
+      save_channel_access(state, &state->channels[channel]);
+    }
+  }
+  else if (type == CHANGE_APPEND && len >= sizeof(AppendChange))
+  {
+    AppendChange change;
+    memcpy(&change, payload, sizeof(change));
+    change.channel[MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    int channel = find_channel(state, change.channel);
+    if (channel >= 0 && (change.sender < (uint32_t)state->user_count ||
+                         change.sender == SYSTEM_SENDER_ID))
+    {
+      char text[MAX_MESSAGE_LEN];
+      snprintf(text, sizeof(text), "%.*s", (int)(len - sizeof(change)), payload + sizeof(change));
+      deliver_message(state, channel, change.sender, text, change.timestamp);
+    }
+  }
+}
+
+// Apply every complete record in data, as a replica does. Returns the
+// number of records applied; *used is set to the bytes they took.
+static long apply_records(AppState *state, const char *data, size_t len, size_t *used)
+{
+  long applied = 0;
+  size_t pos = 0;
+  while (len - pos >= sizeof(ChangeHeader))
+  {
+    ChangeHeader header;
+    memcpy(&header, data + pos, sizeof(header));
+    if (len - pos < sizeof(header) + header.len)
+    {
+      break;
+    }
+    const char *payload = data + pos + sizeof(header);
+    if (header.type == CONTROL_SYNC && header.len >= sizeof(SyncControl))
+    {
+      SyncControl sync;
+      memcpy(&sync, payload, sizeof(sync));
+      followed_id = sync.primary;
+      applied_lsn = sync.lsn;
+      synced = 1;
+    }
+    else if (header.type == CONTROL_REFUSE)
+    {
+      refused = 1;
+    }
+    else if (header.lsn == 0 || header.lsn > applied_lsn)
+    {
+      apply_change(state, header.type, payload, header.len);
+      applied++;
+      if (header.lsn)
+      {
+        applied_lsn = header.lsn;
+        apply_delay_ns = stats_now_ns() - header.logged_ns;
+      }
+    }
+    pos += sizeof(header) + header.len;
+  }
+  *used = pos;
+  return applied;
+}
+
+// Apply a captured log to state from its first record, as a fresh
+// replica would; the benchmark measures this
+long replication_apply_log(AppState *state, const char *data, size_t len)
+{
+  size_t used;
+  applied_lsn = 0;
+  return apply_records(state, data, len, &used);
+}
+
+static void lose_primary(AppState *state)
+{
+  close(primary_fd);
+  primary_fd = -1;
+  retry_at = stats_now_ns() + RETRY_NS;
+  if (refused)
+  {
+    post_system_message(&state->channels[state->current_channel_index],
+                        "The primary refused this replica at LSN %llu (wrong secret, or too "
+                        "far behind); restart it",
+                        (unsigned long long)applied_lsn);
+  }
+  else
+  {
+    post_system_message(&state->channels[state->current_channel_index],
+                        "Lost the primary at LSN %llu; reconnecting (an admin can /promote)",
+                        (unsigned long long)applied_lsn);
+  }
+}
+
+// Apply what the primary has sent. Returns the number of records applied.
+static long receive_from_primary(AppState *state)
+{
+  long applied = 0;
+  for (int reads = 0; reads < 16 && primary_fd >= 0; reads++)
+  {
+    reserve(&replica_in, REPLICA_IN_BYTES);
+    ssize_t got = recv(primary_fd, replica_in.data + replica_in.len,
+                       replica_in.capacity - replica_in.len, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+      break;
+    }
+    if (got <= 0)
+    {
+      lose_primary(state);
+      break;
+    }
+    replica_in.len += got;
+
+    size_t used;
+    applied += apply_records(state, replica_in.data, replica_in.len, &used);
+    memmove(replica_in.data, replica_in.data + used, replica_in.len - used);
+    replica_in.len -= used;
+    if (replica_in.len == replica_in.capacity)
+    {
+      // A record larger than the buffer: the stream can't be trusted
+      lose_primary(state);
+    }
+  }
+
+  if (applied && primary_fd >= 0)
+  {
+    Buffer ack_record = {0};
+    AckControl ack = {applied_lsn};
+    put_record(&ack_record, CONTROL_ACK, 0, &ack, sizeof(ack), NULL, 0);
+    send(primary_fd, ack_record.data, ack_record.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    free_buffer(&ack_record);
+  }
+  return applied;
+}
+
+// Descriptors to poll for replication. Returns how many were written to
+// fds, at most REPLICATION_MAX_FDS.
+int replication_fds(struct pollfd *fds)
+{
+  int count = 0;
+  if (listen_fd >= 0)
+  {
+    polled[count] = -1;
+    fds[count++] = (struct pollfd){listen_fd, POLLIN, 0};
+    for (int i = 0; i < REPLICATION_MAX_REPLICAS; i++)
+    {
+      if (replicas[i].fd >= 0)
+      {
+        short events = POLLIN | (replica_pending(&replicas[i]) ? POLLOUT : 0);
+        polled[count] = i;
+        fds[count++] = (struct pollfd){replicas[i].fd, events, 0};
+      }
+    }
+  }
+  if (primary_fd >= 0)
+  {
+    polled[count] = -1;
+    fds[count++] = (struct pollfd){primary_fd, POLLIN, 0};
+  }
+  return count;
+}
+
+// How long a poll may sleep before a reconnect attempt is due, -1 for
+// no limit
+int replication_timeout_ms()
+{
+  if (!following || primary_fd >= 0 || refused)
+  {
+    return -1;
+  }
+  long wait_ns = retry_at - stats_now_ns();
+  return wait_ns > 0 ? wait_ns / 1000000 + 1 : 0;
+}
+
+// Handle what poll() reported for the descriptors from replication_fds.
+// Returns the number of records applied, so the caller knows to redraw.
+int replication_events(AppState *state, struct pollfd *fds, int count)
+{
+  long applied = 0;
+  for (int f = 0; f < count; f++)
+  {
+    if (!fds[f].revents)
+    {
+      continue;
+    }
+    if (fds[f].fd == listen_fd)
+    {
+      int fd;
+      while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+      {
+        int slot = 0;
+        while (slot < REPLICATION_MAX_REPLICAS && replicas[slot].fd >= 0)
+        {
+          slot++;
+        }
+        if (slot == REPLICATION_MAX_REPLICAS)
+        {
+          close(fd);
+          continue;
+        }
+        memset(&replicas[slot], 0, sizeof(Replica));
+        replicas[slot].fd = fd;
+      }
+    }
+    else if (fds[f].fd == primary_fd)
+    {
+      applied += receive_from_primary(state);
+    }
+    else if (polled[f] >= 0 && replicas[polled[f]].fd == fds[f].fd)
+    {
+      Replica *replica = &replicas[polled[f]];
+      int ok = 1;
+      if (fds[f].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        ok = receive_from_replica(state, replica);
+      }
+      if (ok && (fds[f].revents & POLLOUT))
+      {
+        ok = flush_replica(replica);
+      }
+      if (!ok)
+      {
+        drop_replica(replica);
+      }
+    }
+  }
+
+  // Reconnect, resuming after the last LSN applied
+  if (following && primary_fd < 0 && !refused && stats_now_ns() >= retry_at)
+  {
+    if (connect_primary())
+    {
+      post_system_message(&state->channels[state->current_channel_index],
+                          "Reconnected to the primary at LSN %llu",
+                          (unsigned long long)applied_lsn);
+    }
+    else
+    {
+      retry_at = stats_now_ns() + RETRY_NS;
+    }
+  }
+  return applied;
+}
+
+// Take whatever replication has ready without sleeping. Returns the
+// number of records applied.
+int replication_poll(AppState *state)
+{
+  struct pollfd fds[REPLICATION_MAX_FDS];
+  int count = replication_fds(fds);
+  if (count && poll(fds, count, 0) < 0)
+  {
+    return 0;
+  }
+  return replication_events(state, fds, count);
+}
+
+// Stop following and take writes. The log continues from the last LSN
+// applied, under a new primary id, so replicas of the old primary start
+// over with a snapshot. Returns 0 if this terminal is not a replica.
+int replication_promote(AppState *state)
+{
+  if (!following)
+  {
+    return 0;
+  }
+  if (primary_fd >= 0)
+  {
+    close(primary_fd);
+    primary_fd = -1;
+  }
+  following = 0;
+  free_buffer(&replica_in);
+  primary_id = new_primary_id();
+  last_lsn = applied_lsn;
+  if (serve_path[0] && !replication_serve(serve_path))
+  {
+    post_system_message(&state->channels[state->current_channel_index],
+                        "Promoted at LSN %llu, but can't serve replicas on %s",
+                        (unsigned long long)applied_lsn, serve_path);
+    return 1;
+  }
+  post_system_message(&state->channels[state->current_channel_index],
+                      "This terminal is now the primary, from LSN %llu",
+                      (unsigned long long)applied_lsn);
+  return 1;
+}
+
+// Replication state for /stats, empty when not replicating: the LSN a
+// replica has applied and how long the last record took to arrive, or a
+// primary's replicas and how many records the furthest behind still lacks
+// Replicas being served and the log bytes not yet sent to them, for the
+// metrics endpoint
+void replication_stats(TransportStats *out)
+{
+  memset(out, 0, sizeof(*out));
+  if (listen_fd < 0)
+  {
+    return;
+  }
+  out->memory_bytes = change_log.capacity;
+  for (int i = 0; i < REPLICATION_MAX_REPLICAS; i++)
+  {
+    Replica *replica = &replicas[i];
+    if (replica->fd < 0 || !replica->greeted)
+    {
+      continue;
+    }
+    size_t queued = replica->snapshot.len - replica->snapshot_sent;
+    if (replica->cursor < log_base + change_log.len)
+    {
+      queued += log_base + change_log.len - replica->cursor;
+    }
+    out->count++;
+    out->queued_bytes += queued;
+    out->deepest_bytes = queued > out->deepest_bytes ? queued : out->deepest_bytes;
+    out->memory_bytes += replica->snapshot.capacity;
+  }
+}
+
+void replication_status(char *out, size_t size)
+{
+  if (following)
+  {
+    if (primary_fd >= 0)
+    {
+      snprintf(out, size, "lsn %llu, +%ld ms", (unsigned long long)applied_lsn,
+               apply_delay_ns / 1000000);
+    }
+    else
+    {
+      snprintf(out, size, "lsn %llu, no primary", (unsigned long long)applied_lsn);
+    }
+  }
+  else if (listen_fd >= 0)
+  {
+    int count = 0;
+    uint64_t lag = 0;
+    for (int i = 0; i < REPLICATION_MAX_REPLICAS; i++)
+    {
+      if (replicas[i].fd >= 0 && replicas[i].greeted)
+      {
+        count++;
+        if (last_lsn - replicas[i].acked > lag)
+        {
+          lag = last_lsn - replicas[i].acked;
+        }
+      }
+    }
+    snprintf(out, size, "%d replicas, lag %llu", count, (unsigned long long)lag);
+  }
+  else
+  {
+    out[0] = '\0';
+  }
+}
+
+void replication_close()
+{
+  for (int i = 0; i < REPLICATION_MAX_REPLICAS && replicas_ready; i++)
+  {
+    if (replicas[i].fd >= 0)
+    {
+      drop_replica(&replicas[i]);
+    }
+  }
+  if (listen_fd >= 0)
+  {
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(serve_path);
+  }
+  if (primary_fd >= 0)
+  {
+    close(primary_fd);
+    primary_fd = -1;
+  }
+  following = 0;
+  logging = 0;
+  free_buffer(&change_log);
+  free_buffer(&replica_in);
+}
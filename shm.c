@@ -0,0 +1,978 @@
+#include "my_dispute.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Same-host clients sharing channels through a hub process.
+//
+// The hub (my_dispute_hub) owns two shared-memory objects. The history
+// segment keeps the newest SHM_HISTORY_SLOTS messages of every shared
+// channel; only the hub writes it, and clients map it read-only and read
+// messages straight out of it. The ring segment holds one ring pair per
+// client: the client posts its messages to the hub on one ring, and the
+// hub tells the client which messages are new on the other, 16 bytes
+// per message. While both sides are busy no system call is made in either
+// direction. A consumer that runs out of work raises its waiting flag and
+// sleeps in poll() on an eventfd; only a producer that sees the flag
+// writes to that eventfd.
+//
+// Clients connect once over an abstract Unix socket to swap eventfds and
+// learn which ring pair is theirs. After that the socket only tells each
+// side when the other has gone away.
+
+#define SHM_MAGIC 0x4d445348 // "MDSH"
+
+#define RECORD_PAD 0    // Filler up to the end of the ring, so records never wrap
+#define RECORD_SEND 1   // Client to hub: SendRecord followed by the text
+#define RECORD_NOTICE 2 // Hub to client: NoticeRecord
+
+// Bytes a record with len bytes of payload takes in a ring
+#define RECORD_SPACE(len) (sizeof(RecordHeader) + (((len) + 7) & ~(size_t)7))
+
+typedef struct
+{
+  uint32_t len; // Payload bytes
+  uint32_t type;
+} RecordHeader;
+
+typedef struct
+{
+  int64_t timestamp;
+  char sender[MAX_USERNAME_LEN];
+  char channel[MAX_CHANNEL_NAME_LEN];
+  // The text follows, without a terminator
+} SendRecord;
+
+typedef struct
+{
+  uint32_t channel; // Index in the history segment
+  uint64_t seq;
+} NoticeRecord;
+
+typedef struct
+{
+  uint32_t lock; // Even while stable, odd while the hub rewrites the slot
+  uint64_t seq;
+  int64_t timestamp;
+  char sender[MAX_USERNAME_LEN];
+  uint16_t text_len;
+  char text[MAX_MESSAGE_LEN];
+} HistorySlot;
+
+typedef struct
+{
+  char name[MAX_CHANNEL_NAME_LEN];
+  uint64_t last_seq; // Newest message, published after its slot
+  HistorySlot slots[SHM_HISTORY_SLOTS];
+} SharedChannel;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t channel_count; // Published after the new channel's name
+  uint64_t epoch;         // Differs for every hub run, so seqs are only
+                          // comparable within one
+  SharedChannel channels[MAX_CHANNELS];
+} HistorySegment;
+
+typedef struct
+{
+  ShmRing to_hub;
+  ShmRing to_client;
+} RingPair;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t hub_waiting __attribute__((aligned(64))); // The hub's flag for every to_hub ring
+  RingPair clients[SHM_MAX_CLIENTS];
+} RingSegment;
+
+void shm_ring_init(ShmRing *ring)
+{
+  ring->head = 0;
+  ring->tail = 0;
+  ring->waiting = 0;
+  ring->overflowed = 0;
+}
+
+// Append a record. Returns 0, leaving the ring as it was, when it is full.
+int shm_ring_write(ShmRing *ring, int type, const void *data, size_t len)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t need = RECORD_SPACE(len);
+  size_t offset = head % SHM_RING_BYTES;
+  size_t to_end = SHM_RING_BYTES - offset;
+  size_t pad = to_end < need ? to_end : 0;
+
+  if (need > SHM_RING_BYTES / 2 || (uint32_t)(head - tail) + pad + need > SHM_RING_BYTES)
+  {
+    return 0;
+  }
+
+  if (pad)
+  {
+    RecordHeader *filler = (RecordHeader *)(ring->data + offset);
+    filler->len = pad - sizeof(RecordHeader);
+    filler->type = RECORD_PAD;
+    head += pad;
+    offset = 0;
+  }
+
+  RecordHeader *header = (RecordHeader *)(ring->data + offset);
+  header->len = len;
+  header->type = type;
+  memcpy(header + 1, data, len);
+  __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// The oldest unread record, in place, or NULL when the ring is empty. It
+// stays valid until shm_ring_consume.
+const void *shm_ring_peek(ShmRing *ring, int *type, size_t *len)
+{
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  while (ring->tail != head)
+  {
+    RecordHeader *header = (RecordHeader *)(ring->data + ring->tail % SHM_RING_BYTES);
+    if (RECORD_SPACE(header->len) > (uint32_t)(head - ring->tail))
+    {
+      return NULL;
+    }
+    if (header->type != RECORD_PAD)
+    {
+      *type = header->type;
+      *len = header->len;
+      return header + 1;
+    }
+    __atomic_store_n(&ring->tail, ring->tail + RECORD_SPACE(header->len), __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+void shm_ring_consume(ShmRing *ring)
+{
+  RecordHeader *header = (RecordHeader *)(ring->data + ring->tail % SHM_RING_BYTES);
+  __atomic_store_n(&ring->tail, ring->tail + RECORD_SPACE(header->len), __ATOMIC_RELEASE);
+}
+
+static int ring_empty(ShmRing *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+// A consumer about to sleep raises its flag and then must look for work
+// once more: anything published before the producer could see the flag
+// comes with no wakeup.
+void shm_sleep_begin(uint32_t *waiting)
+{
+  __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+void shm_sleep_end(uint32_t *waiting)
+{
+  __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+// Called by a producer after publishing: 1 if the consumer is asleep and
+// must be woken, which happens at most once per sleep
+int shm_wake_needed(uint32_t *waiting)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+         __atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL);
+}
+
+static void wake(int fd)
+{
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+  {
+    perror("eventfd");
+  }
+}
+
+static void drain_wakeups(int fd)
+{
+  uint64_t count;
+  while (read(fd, &count, sizeof(count)) > 0)
+  {
+  }
+}
+
+static void *map_segment(const char *name, const char *part, size_t size, int create, int writable)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "/my_dispute.%s.%s", name, part);
+  int fd = shm_open(path, create ? O_RDWR | O_CREAT | O_TRUNC : writable ? O_RDWR : O_RDONLY, 0600);
+  if (fd < 0)
+  {
+    perror(path);
+    return NULL;
+  }
+  if (create && ftruncate(fd, size) != 0)
+  {
+    perror(path);
+    close(fd);
+    return NULL;
+  }
+
+  void *mem = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+  {
+    perror("mmap");
+    return NULL;
+  }
+  return mem;
+}
+
+static void unlink_segment(const char *name, const char *part)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "/my_dispute.%s.%s", name, part);
+  shm_unlink(path);
+}
+
+// Abstract-namespace socket address of the hub called name
+static socklen_t hub_address(struct sockaddr_un *addr, const char *name)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "my_dispute.%s", name);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// Send len bytes and a file descriptor in one message
+static int send_fd(int sock, const void *data, size_t len, int fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {(void *)data, len};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+// Receive up to len bytes and the file descriptor sent with them (-1 if
+// none). Returns the byte count, 0 at end of file, -1 on error.
+static ssize_t recv_fd(int sock, void *data, size_t len, int *fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {data, len};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  *fd = -1;
+  ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+  {
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  return got;
+}
+
+// Hub side
+
+static char hub_name[64];
+static HistorySegment *hub_history = NULL;
+static RingSegment *hub_rings = NULL;
+static int hub_listen_fd = -1;
+static int hub_wake_fd = -1;
+static int client_sockets[SHM_MAX_CLIENTS]; // -1 while the ring pair is free
+static int client_wake_fds[SHM_MAX_CLIENTS];
+static int wake_pending[SHM_MAX_CLIENTS]; // Notices were posted since the last wakeup check
+static long relayed_messages = 0;
+static long client_wakeups = 0;
+
+// Create the shared segments and the socket clients connect to. Fails if
+// a hub of the same name is already running.
+int shm_hub_open(const char *name)
+{
+  if (strlen(name) >= sizeof(hub_name) || strchr(name, '/'))
+  {
+    fprintf(stderr, "Invalid hub name '%s'\n", name);
+    return 0;
+  }
+  strcpy(hub_name, name);
+
+  // Binding the socket first claims the name
+  struct sockaddr_un addr;
+  socklen_t addr_len = hub_address(&addr, name);
+  hub_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (hub_listen_fd < 0 || bind(hub_listen_fd, (struct sockaddr *)&addr, addr_len) != 0 ||
+      listen(hub_listen_fd, 16) != 0)
+  {
+    fprintf(stderr, "Can't start hub '%s': %s\n", name, strerror(errno));
+    return 0;
+  }
+
+  hub_history = map_segment(name, "history", sizeof(HistorySegment), 1, 1);
+  hub_rings = map_segment(name, "rings", sizeof(RingSegment), 1, 1);
+  hub_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (!hub_history || !hub_rings || hub_wake_fd < 0)
+  {
+    return 0;
+  }
+
+  hub_history->magic = SHM_MAGIC;
+  hub_history->epoch = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ stats_now_ns();
+  hub_rings->magic = SHM_MAGIC;
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    client_sockets[i] = -1;
+    client_wake_fds[i] = -1;
+  }
+  return 1;
+}
+
+// Take a client's eventfd and hand it a ring pair and the hub's eventfd
+static void accept_client()
+{
+  int sock = accept4(hub_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (sock < 0)
+  {
+    return;
+  }
+
+  char hello;
+  int wake_fd;
+  if (recv_fd(sock, &hello, 1, &wake_fd) != 1 || wake_fd < 0)
+  {
+    close(sock);
+    return;
+  }
+
+  uint32_t slot = 0;
+  while (slot < SHM_MAX_CLIENTS && client_sockets[slot] >= 0)
+  {
+    slot++;
+  }
+  if (slot == SHM_MAX_CLIENTS)
+  {
+    // Full: the reply carries no ring pair
+    uint32_t refused = UINT32_MAX;
+    send_fd(sock, &refused, sizeof(refused), hub_wake_fd);
+    close(wake_fd);
+    close(sock);
+    return;
+  }
+
+  shm_ring_init(&hub_rings->clients[slot].to_hub);
+  shm_ring_init(&hub_rings->clients[slot].to_client);
+  // A new client starts by reading everything the history holds
+  hub_rings->clients[slot].to_client.overflowed = 1;
+  client_sockets[slot] = sock;
+  client_wake_fds[slot] = wake_fd;
+  wake_pending[slot] = 0;
+  if (!send_fd(sock, &slot, sizeof(slot), hub_wake_fd))
+  {
+    close(wake_fd);
+    close(sock);
+    client_sockets[slot] = -1;
+  }
+}
+
+static void drop_client(int slot)
+{
+  close(client_sockets[slot]);
+  close(client_wake_fds[slot]);
+  client_sockets[slot] = -1;
+  client_wake_fds[slot] = -1;
+}
+
+// Index of the shared channel called name, added if there is room
+static int hub_channel(const char *name)
+{
+  uint32_t count = hub_history->channel_count;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (strcmp(hub_history->channels[i].name, name) == 0)
+    {
+      return i;
+    }
+  }
+  if (count == MAX_CHANNELS || !name[0])
+  {
+    return -1;
+  }
+
+  snprintf(hub_history->channels[count].name, MAX_CHANNEL_NAME_LEN, "%s", name);
+  __atomic_store_n(&hub_history->channel_count, count + 1, __ATOMIC_RELEASE);
+  return count;
+}
+
+// Store a message in its channel's history and tell every client about it.
+// Remote terminals (net.c) post theirs here too, and a router what its
+// shards publish.
+void shm_hub_publish(const char *channel_name, const char *sender, const char *text, size_t len,
+                     time_t timestamp)
+{
+  int index = hub_channel(channel_name);
+  if (index < 0)
+  {
+    return;
+  }
+
+  SharedChannel *channel = &hub_history->channels[index];
+  uint64_t seq = channel->last_seq + 1;
+  HistorySlot *slot = &channel->slots[seq % SHM_HISTORY_SLOTS];
+  if (len > MAX_MESSAGE_LEN - 1)
+  {
+    len = MAX_MESSAGE_LEN - 1;
+  }
+
+  // Seqlock write: readers that overlap it see an odd or changed lock
+  __atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->seq = seq;
+  slot->timestamp = timestamp;
+  snprintf(slot->sender, MAX_USERNAME_LEN, "%s", sender);
+  slot->text_len = len;
+  memcpy(slot->text, text, len);
+  slot->text[len] = '\0';
+  __atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&channel->last_seq, seq, __ATOMIC_RELEASE);
+  relayed_messages++;
+
+  // A client whose ring is full catches up from the history instead
+  NoticeRecord notice = {index, seq};
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    if (client_sockets[i] >= 0)
+    {
+      ShmRing *ring = &hub_rings->clients[i].to_client;
+      if (!shm_ring_write(ring, RECORD_NOTICE, &notice, sizeof(notice)))
+      {
+        __atomic_store_n(&ring->overflowed, 1, __ATOMIC_RELEASE);
+      }
+      wake_pending[i] = 1;
+    }
+  }
+}
+
+// Messages published since the hub started; grows whenever there is news
+uint64_t shm_hub_epoch()
+{
+  return hub_history->epoch;
+}
+
+long shm_hub_published()
+{
+  return relayed_messages;
+}
+
+int shm_hub_channel_count()
+{
+  return hub_history->channel_count;
+}
+
+const char *shm_hub_channel_name(int index)
+{
+  return hub_history->channels[index].name;
+}
+
+uint64_t shm_hub_last_seq(int index)
+{
+  return hub_history->channels[index].last_seq;
+}
+
+// A message of a shared channel, in place, or NULL when the history no
+// longer holds it. Only valid until the hub publishes again.
+const char *shm_hub_message(int index, uint64_t seq, time_t *timestamp, const char **sender,
+                            size_t *len)
+{
+  const HistorySlot *slot = &hub_history->channels[index].slots[seq % SHM_HISTORY_SLOTS];
+  if (seq == 0 || slot->seq != seq)
+  {
+    return NULL;
+  }
+  *timestamp = slot->timestamp;
+  *sender = slot->sender;
+  *len = slot->text_len;
+  return slot->text;
+}
+
+// Publish everything the clients have posted, in ring order, then wake the
+// clients that went to sleep: one wakeup per batch. Returns the number of
+// records taken.
+int shm_hub_relay()
+{
+  int moved = 0;
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    if (client_sockets[i] < 0)
+    {
+      continue;
+    }
+    ShmRing *ring = &hub_rings->clients[i].to_hub;
+    const char *record;
+    int type;
+    size_t len;
+    while ((record = shm_ring_peek(ring, &type, &len)))
+    {
+      if (type == RECORD_SEND && len >= sizeof(SendRecord))
+      {
+        const SendRecord *send = (const SendRecord *)record;
+        char channel[MAX_CHANNEL_NAME_LEN];
+        char sender[MAX_USERNAME_LEN];
+        snprintf(channel, sizeof(channel), "%.*s", MAX_CHANNEL_NAME_LEN - 1, send->channel);
+        snprintf(sender, sizeof(sender), "%.*s", MAX_USERNAME_LEN - 1, send->sender);
+        // Published here, or sent on to its shard when this hub routes
+        net_submit(channel, sender, record + sizeof(SendRecord), len - sizeof(SendRecord),
+                   send->timestamp);
+      }
+      shm_ring_consume(ring);
+      moved++;
+    }
+  }
+
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    if (wake_pending[i] && client_sockets[i] >= 0 &&
+        shm_wake_needed(&hub_rings->clients[i].to_client.waiting))
+    {
+      wake(client_wake_fds[i]);
+      client_wakeups++;
+    }
+    wake_pending[i] = 0;
+  }
+  return moved;
+}
+
+// Raise the hub's waiting flag before it polls. Returns 1 if it may sleep:
+// no ring has anything left.
+// Terminals attached to the hub and the bytes waiting in their rings to
+// the hub, for the metrics endpoint
+void shm_hub_stats(TransportStats *out)
+{
+  memset(out, 0, sizeof(*out));
+  if (!hub_rings)
+  {
+    return;
+  }
+  out->memory_bytes = sizeof(HistorySegment) + sizeof(RingSegment);
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    if (client_sockets[i] < 0)
+    {
+      continue;
+    }
+    ShmRing *ring = &hub_rings->clients[i].to_hub;
+    size_t queued = (uint32_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail);
+    out->count++;
+    out->queued_bytes += queued;
+    out->deepest_bytes = queued > out->deepest_bytes ? queued : out->deepest_bytes;
+  }
+}
+
+int shm_hub_sleep_begin()
+{
+  shm_sleep_begin(&hub_rings->hub_waiting);
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    if (client_sockets[i] >= 0 && !ring_empty(&hub_rings->clients[i].to_hub))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void shm_hub_sleep_end()
+{
+  shm_sleep_end(&hub_rings->hub_waiting);
+}
+
+// Descriptors the hub polls for its same-host clients. Returns how many
+// were written to fds (at most 2 + SHM_MAX_CLIENTS).
+int shm_hub_fds(struct pollfd *fds)
+{
+  int count = 0;
+  fds[count++] = (struct pollfd){hub_listen_fd, POLLIN, 0};
+  fds[count++] = (struct pollfd){hub_wake_fd, POLLIN, 0};
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    if (client_sockets[i] >= 0)
+    {
+      fds[count++] = (struct pollfd){client_sockets[i], POLLIN, 0};
+    }
+  }
+  return count;
+}
+
+// Handle what poll() reported for the descriptors from shm_hub_fds
+void shm_hub_events(struct pollfd *fds, int count)
+{
+  if (fds[1].revents)
+  {
+    drain_wakeups(hub_wake_fd);
+  }
+  if (fds[0].revents & POLLIN)
+  {
+    accept_client();
+  }
+  for (int f = 2; f < count; f++)
+  {
+    if (!fds[f].revents)
+    {
+      continue;
+    }
+    // Clients send nothing after the handshake, so anything readable is
+    // the end of the connection
+    char byte;
+    if (recv(fds[f].fd, &byte, 1, MSG_DONTWAIT) <= 0)
+    {
+      for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+      {
+        if (client_sockets[i] == fds[f].fd)
+        {
+          drop_client(i);
+        }
+      }
+    }
+  }
+}
+
+void shm_hub_close()
+{
+  printf("Relayed %ld messages, woke clients %ld times\n", relayed_messages, client_wakeups);
+  for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+  {
+    if (client_sockets[i] >= 0)
+    {
+      drop_client(i);
+    }
+  }
+  if (hub_history)
+  {
+    munmap(hub_history, sizeof(HistorySegment));
+    unlink_segment(hub_name, "history");
+  }
+  if (hub_rings)
+  {
+    munmap(hub_rings, sizeof(RingSegment));
+    unlink_segment(hub_name, "rings");
+  }
+  close(hub_wake_fd);
+  close(hub_listen_fd);
+}
+
+// Client side
+
+static const HistorySegment *shared_history = NULL;
+static RingSegment *client_segment = NULL;
+static RingPair *client_rings = NULL;
+static int hub_socket = -1;
+static int client_wake_fd = -1;
+static int hub_wakeup_fd = -1;
+static uint64_t seen[MAX_CHANNELS]; // Newest shared seq applied, per shared channel
+
+int shm_client_attach(const char *name)
+{
+  struct sockaddr_un addr;
+  socklen_t addr_len = hub_address(&addr, name);
+  hub_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (hub_socket < 0 || connect(hub_socket, (struct sockaddr *)&addr, addr_len) != 0)
+  {
+    fprintf(stderr, "No hub '%s' is running (start it with my_dispute_hub --name %s)\n", name,
+            name);
+    shm_client_detach();
+    return 0;
+  }
+
+  client_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  uint32_t slot;
+  if (client_wake_fd < 0 || !send_fd(hub_socket, "h", 1, client_wake_fd) ||
+      recv_fd(hub_socket, &slot, sizeof(slot), &hub_wakeup_fd) != sizeof(slot) ||
+      hub_wakeup_fd < 0)
+  {
+    fprintf(stderr, "Hub '%s' did not answer\n", name);
+    shm_client_detach();
+    return 0;
+  }
+  if (slot >= SHM_MAX_CLIENTS)
+  {
+    fprintf(stderr, "Hub '%s' is full (%d clients)\n", name, SHM_MAX_CLIENTS);
+    shm_client_detach();
+    return 0;
+  }
+
+  // The history is mapped read-only: only the hub writes it
+  shared_history = map_segment(name, "history", sizeof(HistorySegment), 0, 0);
+  client_segment = map_segment(name, "rings", sizeof(RingSegment), 0, 1);
+  if (!shared_history || !client_segment || shared_history->magic != SHM_MAGIC ||
+      client_segment->magic != SHM_MAGIC)
+  {
+    fprintf(stderr, "Hub '%s' has no usable shared memory\n", name);
+    shm_client_detach();
+    return 0;
+  }
+  client_rings = &client_segment->clients[slot];
+  memset(seen, 0, sizeof(seen));
+  return 1;
+}
+
+// Where this terminal is in the hub's history: the hub run, and the
+// newest seq applied of each shared channel. Returns the number of
+// channels, 0 if not attached.
+int shm_client_position(uint64_t *epoch, char names[][MAX_CHANNEL_NAME_LEN], uint64_t *seqs,
+                        int max)
+{
+  if (!client_rings)
+  {
+    return 0;
+  }
+  *epoch = shared_history->epoch;
+  int count = __atomic_load_n(&shared_history->channel_count, __ATOMIC_ACQUIRE);
+  if (count > max)
+  {
+    count = max;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    memcpy(names[i], shared_history->channels[i].name, MAX_CHANNEL_NAME_LEN);
+    names[i][MAX_CHANNEL_NAME_LEN - 1] = '\0';
+    seqs[i] = seen[i];
+  }
+  return count;
+}
+
+// Carry on from a position saved by an earlier run of this terminal, so
+// messages it already applied (and wrote to its history) are not applied
+// again. A position from another hub run means nothing here.
+void shm_client_resume(uint64_t epoch, char names[][MAX_CHANNEL_NAME_LEN], const uint64_t *seqs,
+                       int count)
+{
+  if (!client_rings || epoch != shared_history->epoch)
+  {
+    return;
+  }
+  uint32_t shared = __atomic_load_n(&shared_history->channel_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++)
+  {
+    for (uint32_t j = 0; j < shared; j++)
+    {
+      if (strncmp(names[i], shared_history->channels[j].name, MAX_CHANNEL_NAME_LEN) == 0)
+      {
+        seen[j] = seqs[i] > seen[j] ? seqs[i] : seen[j];
+        break;
+      }
+    }
+  }
+}
+
+int shm_client_attached()
+{
+  return client_rings != NULL;
+}
+
+void shm_client_detach()
+{
+  if (shared_history)
+  {
+    munmap((void *)shared_history, sizeof(HistorySegment));
+  }
+  if (client_segment)
+  {
+    munmap(client_segment, sizeof(RingSegment));
+  }
+  shared_history = NULL;
+  client_segment = NULL;
+  client_rings = NULL;
+
+  int *fds[] = {&hub_socket, &client_wake_fd, &hub_wakeup_fd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+  {
+    if (*fds[i] >= 0)
+    {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+}
+
+// Sleep until one of the caller's fds is ready, timeout_ms passes or the
+// hub has news. The caller's revents are filled in. Returns 1 for news
+// (shm_client_poll picks it up), 0 otherwise.
+int shm_client_wait(struct pollfd *fds, int count, int timeout_ms)
+{
+  ShmRing *ring = &client_rings->to_client;
+  shm_sleep_begin(&ring->waiting);
+  if (!ring_empty(ring) || __atomic_load_n(&ring->overflowed, __ATOMIC_ACQUIRE))
+  {
+    shm_sleep_end(&ring->waiting);
+    return 1;
+  }
+
+  struct pollfd all[LINK_MAX_WAIT_FDS + 2];
+  memcpy(all, fds, sizeof(struct pollfd) * count);
+  all[count] = (struct pollfd){client_wake_fd, POLLIN, 0};
+  all[count + 1] = (struct pollfd){hub_socket, POLLIN, 0};
+  int ready = poll(all, count + 2, timeout_ms);
+  shm_sleep_end(&ring->waiting);
+  if (ready <= 0)
+  {
+    return 0;
+  }
+  memcpy(fds, all, sizeof(struct pollfd) * count);
+  if (all[count].revents || all[count + 1].revents)
+  {
+    drain_wakeups(client_wake_fd);
+    return 1;
+  }
+  return 0;
+}
+
+// Post a message to the hub. Returns 0 if the hub is not keeping up.
+int shm_client_send(AppState *state, int channel_index, const char *text, time_t timestamp)
+{
+  char buffer[sizeof(SendRecord) + MAX_MESSAGE_LEN];
+  SendRecord *send = (SendRecord *)buffer;
+  size_t len = strnlen(text, MAX_MESSAGE_LEN - 1);
+
+  memset(send, 0, sizeof(SendRecord));
+  send->timestamp = timestamp;
+  snprintf(send->sender, sizeof(send->sender), "%s",
+           state->users[state->current_user_index].username);
+  snprintf(send->channel, sizeof(send->channel), "%s", state->channels[channel_index].name);
+  memcpy(buffer + sizeof(SendRecord), text, len);
+
+  if (!shm_ring_write(&client_rings->to_hub, RECORD_SEND, buffer, sizeof(SendRecord) + len))
+  {
+    return 0;
+  }
+  if (shm_wake_needed(&client_segment->hub_waiting))
+  {
+    wake(hub_wakeup_fd);
+  }
+  return 1;
+}
+
+// Copy one message out of the shared history. Returns 0 if the hub has
+// already reused its slot for a newer one.
+static int read_slot(const SharedChannel *channel, uint64_t seq, HistorySlot *out)
+{
+  const HistorySlot *slot = &channel->slots[seq % SHM_HISTORY_SLOTS];
+  for (int attempt = 0; attempt < 1000; attempt++)
+  {
+    uint32_t before = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+    if (before & 1)
+    {
+      continue;
+    }
+    memcpy(out, slot, offsetof(HistorySlot, text));
+    size_t len = out->text_len < MAX_MESSAGE_LEN ? out->text_len : MAX_MESSAGE_LEN - 1;
+    memcpy(out->text, slot->text, len);
+    out->text[len] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == before)
+    {
+      return out->seq == seq;
+    }
+  }
+  return 0;
+}
+
+// Apply a shared channel's messages up to seq that this terminal has not
+// seen. Messages the history no longer holds are skipped.
+static int catch_up(AppState *state, uint32_t index, uint64_t seq)
+{
+  if (index >= __atomic_load_n(&shared_history->channel_count, __ATOMIC_ACQUIRE) ||
+      seq <= seen[index])
+  {
+    return 0;
+  }
+
+  const SharedChannel *shared = &shared_history->channels[index];
+  int local = relayed_channel(state, shared->name);
+  uint64_t from = seen[index] + 1;
+  if (seq - seen[index] > SHM_HISTORY_SLOTS)
+  {
+    from = seq - SHM_HISTORY_SLOTS + 1;
+  }
+  seen[index] = seq;
+  if (local < 0)
+  {
+    return 0;
+  }
+
+  int applied = 0;
+  HistorySlot slot;
+  for (uint64_t s = from; s <= seq; s++)
+  {
+    if (read_slot(shared, s, &slot))
+    {
+      deliver_message(state, local, relayed_sender(state, slot.sender), slot.text,
+                      slot.timestamp);
+      applied++;
+    }
+  }
+  return applied;
+}
+
+// Apply everything the hub has published since the last call. Returns the
+// number of messages added.
+int shm_client_poll(AppState *state)
+{
+  if (!client_rings)
+  {
+    return 0;
+  }
+
+  // The socket only becomes readable when the hub goes away
+  char byte;
+  ssize_t got = recv(hub_socket, &byte, 1, MSG_DONTWAIT);
+  if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    shm_client_detach();
+    post_system_message(&state->channels[state->current_channel_index],
+                        "Lost the shared hub; messages now stay on this terminal");
+    return 0;
+  }
+
+  int applied = 0;
+  ShmRing *ring = &client_rings->to_client;
+  const NoticeRecord *notice;
+  int type;
+  size_t len;
+  while ((notice = shm_ring_peek(ring, &type, &len)))
+  {
+    if (type == RECORD_NOTICE && len == sizeof(NoticeRecord))
+    {
+      applied += catch_up(state, notice->channel, notice->seq);
+    }
+    shm_ring_consume(ring);
+  }
+
+  // Notices were dropped while the ring was full; the history has them
+  if (__atomic_exchange_n(&ring->overflowed, 0, __ATOMIC_ACQ_REL))
+  {
+    uint32_t count = __atomic_load_n(&shared_history->channel_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      applied += catch_up(state, i,
+                          __atomic_load_n(&shared_history->channels[i].last_seq, __ATOMIC_ACQUIRE));
+    }
+  }
+  return applied;
+}
@@ -0,0 +1,211 @@
+#include "my_dispute.h"
+#include <fcntl.h>
+
+// Low-overhead runtime statistics.
+//
+// Latencies go into HDR-style log-linear histograms: each power of two is
+// split into STATS_SUB_BUCKETS linear sub-buckets, so recording is a couple
+// of bit operations and an increment, and any percentile is accurate to
+// within 1/STATS_SUB_BUCKETS of the true value.
+
+static Histogram histograms[STATS_METRIC_COUNT];
+
+static const char *metric_names[STATS_METRIC_COUNT] = {
+    "input->doupdate",
+    "draw_channels",
+    "draw_chat",
+    "draw_users",
+    "draw_input",
+    "overlay",
+    "bytes/frame",
+};
+
+// Bytes emitted to the terminal by stats_begin_output/stats_end_output pairs
+static long bytes_written = 0;
+
+// Messages ingested, with a one-second window for the rate
+static long messages_ingested = 0;
+static long rate_window_start = 0;
+static long rate_window_count = 0;
+static long last_message_rate = 0;
+
+long stats_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bucket_index(long value)
+{
+  if (value < STATS_SUB_BUCKETS)
+  {
+    return value < 0 ? 0 : (int)value;
+  }
+
+  // Magnitude is the position of the highest set bit; the next
+  // STATS_SUB_BITS bits select the linear sub-bucket
+  int magnitude = 63 - __builtin_clzl((unsigned long)value);
+  int shift = magnitude - STATS_SUB_BITS;
+  int sub = (int)((value >> shift) & (STATS_SUB_BUCKETS - 1));
+  return (shift + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+// Smallest value that lands in a bucket, used to report percentiles
+static long bucket_value(int index)
+{
+  if (index < STATS_SUB_BUCKETS)
+  {
+    return index;
+  }
+
+  int shift = index / STATS_SUB_BUCKETS - 1;
+  int sub = index % STATS_SUB_BUCKETS;
+  return (long)(STATS_SUB_BUCKETS + sub) << shift;
+}
+
+void histogram_record(Histogram *h, long value)
+{
+  h->counts[bucket_index(value)]++;
+  h->total++;
+  if (value > h->max)
+  {
+    h->max = value;
+  }
+}
+
+long histogram_percentile(Histogram *h, double p)
+{
+  if (h->total == 0)
+  {
+    return 0;
+  }
+
+  unsigned long target = (unsigned long)(p * h->total);
+  if (target >= h->total)
+  {
+    return h->max;
+  }
+
+  unsigned long seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++)
+  {
+    seen += h->counts[i];
+    if (seen > target)
+    {
+      long value = bucket_value(i);
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+void stats_record(int metric, long value)
+{
+  histogram_record(&histograms[metric], value);
+}
+
+long stats_percentile(int metric, double p)
+{
+  return histogram_percentile(&histograms[metric], p);
+}
+
+unsigned long stats_samples(int metric)
+{
+  return histograms[metric].total;
+}
+
+const char *stats_metric_name(int metric)
+{
+  return metric_names[metric];
+}
+
+void stats_count_message()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+  messages_ingested++;
+  if (ts.tv_sec != rate_window_start)
+  {
+    // A window with no traffic in between means the rate dropped to zero
+    last_message_rate = ts.tv_sec == rate_window_start + 1 ? rate_window_count : 0;
+    rate_window_start = ts.tv_sec;
+    rate_window_count = 0;
+  }
+  rate_window_count++;
+}
+
+long stats_message_rate()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+  if (ts.tv_sec == rate_window_start)
+  {
+    return last_message_rate;
+  }
+  if (ts.tv_sec == rate_window_start + 1)
+  {
+    return rate_window_count;
+  }
+  return 0;
+}
+
+long stats_messages_ingested()
+{
+  return messages_ingested;
+}
+
+long stats_bytes_written()
+{
+  return bytes_written;
+}
+
+// Write counters of the thread that draws the screen, -1 until
+// stats_watch_output
+static int output_io_fd = -1;
+static long output_mark = 0;
+
+// Bytes the drawing thread has passed to write(2) so far. ncurses keeps its
+// own buffer and flushes it with write(2) on the terminal descriptor, never
+// through the FILE it was given, so the thread's own counters are where a
+// frame's bytes show up. Other threads (history compaction, replication)
+// have counters of their own, and the drawing thread writes nothing else
+// inside a begin/end pair.
+static long output_bytes()
+{
+  char buf[512];
+  ssize_t len = output_io_fd >= 0 ? pread(output_io_fd, buf, sizeof(buf) - 1, 0) : -1;
+  if (len <= 0)
+  {
+    return 0;
+  }
+  buf[len] = '\0';
+
+  char *wchar = strstr(buf, "wchar:");
+  return wchar ? atol(wchar + 6) : 0;
+}
+
+// Count terminal output from the calling thread, the one that draws
+void stats_watch_output()
+{
+  if (output_io_fd < 0)
+  {
+    output_io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+  }
+}
+
+// Bracket a terminal update: the bytes written in between are counted as
+// terminal output and recorded in the bytes/frame histogram
+void stats_begin_output()
+{
+  output_mark = output_bytes();
+}
+
+void stats_end_output()
+{
+  long bytes = output_bytes() - output_mark;
+  bytes_written += bytes;
+  stats_record(STATS_FRAME_BYTES, bytes);
+}
@@ -35,6 +35,40 @@ extern int get_selected_user_index(AppState *state);
 extern void navigate_users(AppState *state, int direction);
 extern void start_pm_with_selected_user(AppState *state);
 
+// Create a screen attached to /dev/null so the UI can run without a real
+// terminal (replay mode and benchmarks). Output is still fully generated.
+SCREEN *init_headless_screen(int lines, int cols)
+{
+  FILE *out = fopen("/dev/null", "w");
+  FILE *in = fopen("/dev/null", "r");
+  if (!out || !in)
+  {
+    perror("/dev/null");
+    exit(1);
+  }
+
+  if (!getenv("TERM"))
+  {
+    setenv("TERM", "xterm-256color", 1);
+  }
+
+  char value[16];
+  snprintf(value, sizeof(value), "%d", lines);
+  setenv("LINES", value, 1);
+  snprintf(value, sizeof(value), "%d", cols);
+  setenv("COLUMNS", value, 1);
+
+  SCREEN *screen = newterm(NULL, out, in);
+  if (!screen)
+  {
+    fprintf(stderr, "newterm failed for TERM=%s\n", getenv("TERM"));
+    exit(1);
+  }
+  set_term(screen);
+  stats_watch_output();
+  return screen;
+}
+
 void init_ui(AppState *state)
 {
   clear();
@@ -80,14 +114,11 @@ void init_ui(AppState *state)
   draw_channels(state->channels_win, state, false);
   draw_chat(state->chat_win, state);
   draw_users(state->users_win, state, false);
-  draw_input(state->input_win, true, "");
-
-  // Refresh all windows
-  wrefresh(state->logo_win);
-  wrefresh(state->channels_win);
-  wrefresh(state->chat_win);
-  wrefresh(state->input_win);
-  wrefresh(state->users_win);
+  state->input.full_redraw = 1;
+  draw_input(state->input_win, true, &state->input);
+
+  // Refresh all windows in one terminal update
+  doupdate();
 }
 
 void draw_logo(WINDOW *win)
@@ -120,7 +151,38 @@ void draw_logo(WINDOW *win)
 
   wattroff(win, COLOR_PAIR(COLOR_BRIGHT_RED) | A_BOLD);
 
-  wrefresh(win);
+  wnoutrefresh(win);
+}
+
+// Show a list's filter above it while one is typed
+static void draw_list_filter(WINDOW *win, ListView *list)
+{
+  if (list->filter_len == 0)
+  {
+    return;
+  }
+  char text[LIST_FILTER_LEN + 24];
+  snprintf(text, sizeof(text), "/%s (%d)", list->filter, list->count);
+  wattron(win, COLOR_PAIR(COLOR_NEON_PINK));
+  print_clipped(win, 2, 2, text, getmaxx(win) - 4);
+  wattroff(win, COLOR_PAIR(COLOR_NEON_PINK));
+}
+
+// Arrows on the right edge when a list runs past the top or bottom of
+// its rows
+static void draw_scroll_markers(WINDOW *win, ListView *list, int rows)
+{
+  int x = getmaxx(win) - 2;
+  wattron(win, COLOR_PAIR(COLOR_DARK_BLUE) | A_BOLD);
+  if (list->scroll > 0)
+  {
+    mvwprintw(win, 3, x, "▲");
+  }
+  if (list->scroll + rows < list->count)
+  {
+    mvwprintw(win, rows + 2, x, "▼");
+  }
+  wattroff(win, COLOR_PAIR(COLOR_DARK_BLUE) | A_BOLD);
 }
 
 void draw_channels(WINDOW *win, AppState *state, bool has_focus)
@@ -144,25 +206,78 @@ void draw_channels(WINDOW *win, AppState *state, bool has_focus)
     wattroff(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
   }
 
-  // Draw channel list
-  for (int i = 0; i < state->channel_count; i++)
+  // Columns available for a name between the "> " marker and the border,
+  // keeping the last one for scroll markers
+  int name_cols = width - 6;
+
+  // Draw only the rows in view of the channels the user can see, leaving
+  // the bottom of the pane to the instructions
+  int max_y = getmaxy(win);
+  int rows = max_y - 7;
+  ListView *list = &state->channel_list;
+  build_channel_list(state);
+  list_view_scroll(list, rows);
+  draw_list_filter(win, list);
+
+  for (int row = 3; row < rows + 3 && list->scroll + row - 3 < list->count; row++)
   {
-    if (i == state->current_channel_index)
+    int i = list->entries[list->scroll + row - 3];
+    bool is_selected = has_focus && list->scroll + row - 3 == list->selected;
+
+    // Unread and mention badges, right-aligned; none for the open channel
+    char badge[24] = "";
+    char mention_badge[12] = "";
+    if (i != state->current_channel_index && state->current_user_index >= 0)
+    {
+      uint32_t unread = channel_unread(state, state->current_user_index, i);
+      int mentions = state->users[state->current_user_index].mentions[i];
+      if (mentions > 0)
+      {
+        snprintf(mention_badge, sizeof(mention_badge), mentions > 99 ? "@99+ " : "@%d ", mentions);
+      }
+      if (unread > 0)
+      {
+        snprintf(badge, sizeof(badge), unread > 999 ? "999+" : "%u", unread);
+      }
+    }
+    int badge_len = strlen(badge) + strlen(mention_badge);
+    int badge_x = width - 3 - badge_len;
+    int cols = badge_len ? name_cols - badge_len - 1 : name_cols;
+
+    // The selection is the open channel unless the filter hides it
+    if (i == state->current_channel_index || is_selected)
     {
-      wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | (has_focus ? A_REVERSE : 0));
-      mvwprintw(win, i + 3, 2, "> %s", state->channels[i].name);
-      wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | (has_focus ? A_REVERSE : 0));
+      wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | (is_selected ? A_REVERSE : 0));
+      mvwprintw(win, row, 2, i == state->current_channel_index ? "> " : "  ");
+      print_clipped(win, row, 4, state->channels[i].name, cols);
+      wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | (is_selected ? A_REVERSE : 0));
     }
     else
     {
-      wattron(win, COLOR_PAIR(COLOR_GRAY));
-      mvwprintw(win, i + 3, 2, "  %s", state->channels[i].name);
-      wattroff(win, COLOR_PAIR(COLOR_GRAY));
+      // Channels with new traffic stand out from the rest
+      int attrs = badge_len ? A_BOLD : COLOR_PAIR(COLOR_GRAY);
+      wattron(win, attrs);
+      mvwprintw(win, row, 2, "  ");
+      print_clipped(win, row, 4, state->channels[i].name, cols);
+      wattroff(win, attrs);
+    }
+
+    if (mention_badge[0])
+    {
+      wattron(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+      mvwprintw(win, row, badge_x, "%s", mention_badge);
+      wattroff(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+    }
+    if (badge[0])
+    {
+      wattron(win, COLOR_PAIR(COLOR_NEON_YELLOW));
+      mvwprintw(win, row, badge_x + strlen(mention_badge), "%s", badge);
+      wattroff(win, COLOR_PAIR(COLOR_NEON_YELLOW));
     }
   }
+  draw_scroll_markers(win, list, rows);
 
   // Add navigation instructions with clearer wording
-  int max_y = getmaxy(win);
   wattron(win, COLOR_PAIR(COLOR_DARK_BLUE));
   if (has_focus)
   {
@@ -172,7 +287,7 @@ void draw_channels(WINDOW *win, AppState *state, bool has_focus)
   mvwprintw(win, max_y - 1, 2, "Tab: Switch focus");
   wattroff(win, COLOR_PAIR(COLOR_DARK_BLUE));
 
-  wrefresh(win);
+  wnoutrefresh(win);
 }
 
 void draw_users(WINDOW *win, AppState *state, bool has_focus)
@@ -196,101 +311,124 @@ void draw_users(WINDOW *win, AppState *state, bool has_focus)
     wattroff(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
   }
 
-  // Track the selected user index
-  int selected_user_idx = -1;
-  if (has_focus && state->user_count > 0)
+  // Columns available for a username after the role tag, keeping the
+  // last one for scroll markers
+  int name_cols = width - 8;
+
+  // Draw only the rows of the online user list that are in view
+  int max_y = getmaxy(win);
+  int rows = max_y - 7;
+  ListView *list = &state->user_list;
+  build_user_list(state);
+  list_view_scroll(list, rows);
+  draw_list_filter(win, list);
+  int selected_user_idx = has_focus ? get_selected_user_index(state) : -1;
+
+  for (int row = 3; row < rows + 3 && list->scroll + row - 3 < list->count; row++)
   {
-    // Get selected user from the app state or use first online user
-    selected_user_idx = get_selected_user_index(state);
-  }
+    int i = list->entries[list->scroll + row - 3];
 
-  // Draw online user list
-  int online_count = 0;
+    // Determine if this user is selected
+    bool is_selected = list->scroll + row - 3 == selected_user_idx;
 
-  for (int i = 0; i < state->user_count; i++)
-  {
-    if (state->users[i].is_online)
+    // Unread direct messages from this user, unless they are on screen.
+    // On the user's own row: mail from senders this terminal doesn't know,
+    // and notices from SYSTEM such as rate limiting.
+    char badge[12] = "";
+    Conversation *conv = NULL;
+    if (state->current_user_index >= 0 && !(state->dm_open && state->dm_peer == i))
+    {
+      conv = dm_find(state->current_user_index, i);
+    }
+    if (conv && dm_unread(conv, state->current_user_index) > 0)
     {
-      // Determine if this user is selected
-      bool is_selected = (has_focus && online_count == selected_user_idx);
+      uint32_t unread = dm_unread(conv, state->current_user_index);
+      snprintf(badge, sizeof(badge), unread > 99 ? "99+" : "%u", unread);
+    }
+    int cols = badge[0] ? name_cols - (int)strlen(badge) - 1 : name_cols;
 
-      if (is_selected)
+    if (is_selected)
+    {
+      wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | A_REVERSE);
+    }
+    else
+    {
+      wattron(win, COLOR_PAIR(COLOR_GRAY));
+    }
+
+    // Draw role indicator
+    if (state->users[i].role == ROLE_ADMIN)
+    {
+      if (!is_selected)
       {
-        wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | A_REVERSE);
+        wattroff(win, COLOR_PAIR(COLOR_GRAY));
+        wattron(win, COLOR_PAIR(COLOR_BRIGHT_RED) | A_BOLD);
       }
-      else
+      mvwprintw(win, row, 2, "[A]");
+      if (!is_selected)
       {
+        wattroff(win, COLOR_PAIR(COLOR_BRIGHT_RED) | A_BOLD);
         wattron(win, COLOR_PAIR(COLOR_GRAY));
       }
-
-      // Draw role indicator
-      if (state->users[i].role == ROLE_ADMIN)
-      {
-        if (!is_selected)
-        {
-          wattroff(win, COLOR_PAIR(COLOR_GRAY));
-          wattron(win, COLOR_PAIR(COLOR_BRIGHT_RED) | A_BOLD);
-        }
-        mvwprintw(win, online_count + 3, 2, "[A]");
-        if (!is_selected)
-        {
-          wattroff(win, COLOR_PAIR(COLOR_BRIGHT_RED) | A_BOLD);
-          wattron(win, COLOR_PAIR(COLOR_GRAY));
-        }
-        mvwprintw(win, online_count + 3, 6, "%s", state->users[i].username);
-      }
-      else if (state->users[i].role == ROLE_MODERATOR)
+      print_clipped(win, row, 6, state->users[i].username, cols);
+    }
+    else if (state->users[i].role == ROLE_MODERATOR)
+    {
+      if (!is_selected)
       {
-        if (!is_selected)
-        {
-          wattroff(win, COLOR_PAIR(COLOR_GRAY));
-          wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
-        }
-        mvwprintw(win, online_count + 3, 2, "[M]");
-        if (!is_selected)
-        {
-          wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
-          wattron(win, COLOR_PAIR(COLOR_GRAY));
-        }
-        mvwprintw(win, online_count + 3, 6, "%s", state->users[i].username);
+        wattroff(win, COLOR_PAIR(COLOR_GRAY));
+        wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
       }
-      else
+      mvwprintw(win, row, 2, "[M]");
+      if (!is_selected)
       {
-        mvwprintw(win, online_count + 3, 2, "    %s", state->users[i].username);
+        wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
+        wattron(win, COLOR_PAIR(COLOR_GRAY));
       }
+      print_clipped(win, row, 6, state->users[i].username, cols);
+    }
+    else
+    {
+      mvwprintw(win, row, 2, "    ");
+      print_clipped(win, row, 6, state->users[i].username, cols);
+    }
 
-      if (is_selected)
-      {
-        wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | A_REVERSE);
-      }
-      else
-      {
-        wattroff(win, COLOR_PAIR(COLOR_GRAY));
-      }
+    if (is_selected)
+    {
+      wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD | A_REVERSE);
+    }
+    else
+    {
+      wattroff(win, COLOR_PAIR(COLOR_GRAY));
+    }
 
-      online_count++;
+    if (badge[0])
+    {
+      wattron(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
+      mvwprintw(win, row, width - 3 - strlen(badge), "%s", badge);
+      wattroff(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
     }
   }
+  draw_scroll_markers(win, list, rows);
 
   // If no users online
-  if (online_count == 0)
+  if (list->count == 0)
   {
     wattron(win, COLOR_PAIR(COLOR_GRAY));
-    mvwprintw(win, 3, 2, "  No users online");
+    mvwprintw(win, 3, 2, list->filter_len ? "  No matching users" : "  No users online");
     wattroff(win, COLOR_PAIR(COLOR_GRAY));
   }
 
   // Add instructions if focused with clearer wording
   if (has_focus)
   {
-    int max_y = getmaxy(win);
     wattron(win, COLOR_PAIR(COLOR_DARK_BLUE));
     mvwprintw(win, max_y - 3, 2, "↑/↓: Navigate");
     mvwprintw(win, max_y - 2, 2, "Enter: Start PM");
     wattroff(win, COLOR_PAIR(COLOR_DARK_BLUE));
   }
 
-  wrefresh(win);
+  wnoutrefresh(win);
 }
 
 void format_message_time(time_t timestamp, char *buffer, size_t size)
@@ -299,6 +437,85 @@ void format_message_time(time_t timestamp, char *buffer, size_t size)
   strftime(buffer, size, "%H:%M", tm_info);
 }
 
+// Draw one message: sender, time and text clipped to the pane
+static void draw_chat_line(WINDOW *win, int line, const char *name, int name_width,
+                           time_t timestamp, const char *text, size_t text_len, int text_width)
+{
+  int width = getmaxx(win);
+  char time_buffer[10];
+  format_message_time(timestamp, time_buffer, sizeof(time_buffer));
+
+  // Username display
+  wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
+  mvwprintw(win, line, 2, "%s", name);
+  wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
+
+  // Timestamp
+  wattron(win, COLOR_PAIR(COLOR_DARK_BLUE));
+  mvwprintw(win, line, 2 + name_width + 1, "[%s]:", time_buffer);
+  wattroff(win, COLOR_PAIR(COLOR_DARK_BLUE));
+
+  // Message text, clipped to the pane using the width measured at ingest
+  int text_x = 2 + name_width + strlen(time_buffer) + 5;
+  int text_cols = width - text_x - 1;
+  wattron(win, COLOR_PAIR(COLOR_GRAY));
+  if (text_width <= text_cols)
+  {
+    mvwaddnstr(win, line, text_x, text, text_len);
+  }
+  else
+  {
+    print_clipped(win, line, text_x, text, text_cols);
+  }
+  wattroff(win, COLOR_PAIR(COLOR_GRAY));
+}
+
+// Show the open direct-message conversation in the chat pane
+static void draw_direct_messages(WINDOW *win, AppState *state)
+{
+  int width = getmaxx(win);
+  int height = getmaxy(win);
+  User *peer = &state->users[state->dm_peer];
+
+  int title_x = (width - peer->name_width - 4) / 2;
+  if (title_x < 1)
+    title_x = 1;
+  wattron(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+  mvwprintw(win, 1, title_x, "@ ");
+  print_clipped(win, 1, title_x + 2, peer->username, width - title_x - 3);
+  wattroff(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+
+  Conversation *conv = dm_find(state->current_user_index, state->dm_peer);
+  if (!conv)
+  {
+    return;
+  }
+
+  long max_messages = height - 4;
+  long max_scroll = conv->count > max_messages ? conv->count - max_messages : 0;
+  if (state->chat_scroll > max_scroll)
+  {
+    state->chat_scroll = max_scroll;
+  }
+  long end = (long)conv->count - 1 - state->chat_scroll;
+  long start = end - max_messages + 1 > 0 ? end - max_messages + 1 : 0;
+
+  for (long i = start, line = 3; i <= end; i++, line++)
+  {
+    Message *msg = dm_message(conv, i);
+    draw_chat_line(win, line, sender_name(state, msg->sender_id),
+                   sender_width(state, msg->sender_id), msg->timestamp, dm_text(conv, msg),
+                   msg->text_len, msg->width);
+  }
+
+  if (state->chat_scroll > 0)
+  {
+    wattron(win, COLOR_PAIR(COLOR_DARK_BLUE));
+    mvwprintw(win, height - 1, 2, " %d newer - PgDn ", state->chat_scroll);
+    wattroff(win, COLOR_PAIR(COLOR_DARK_BLUE));
+  }
+}
+
 void draw_chat(WINDOW *win, AppState *state)
 {
   werase(win);
@@ -307,12 +524,24 @@ void draw_chat(WINDOW *win, AppState *state)
   int width = getmaxx(win);
   int height = getmaxy(win);
 
+  if (state->dm_open)
+  {
+    draw_direct_messages(win, state);
+    wnoutrefresh(win);
+    return;
+  }
+
   // Draw channel name as title
   if (state->current_channel_index >= 0 && state->current_channel_index < state->channel_count)
   {
+    Channel *channel = &state->channels[state->current_channel_index];
+    int title_x = (width - channel->name_width - 4) / 2;
+    if (title_x < 1)
+      title_x = 1;
+
     wattron(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
-    mvwprintw(win, 1, (width - strlen(state->channels[state->current_channel_index].name) - 4) / 2,
-              "# %s", state->channels[state->current_channel_index].name);
+    mvwprintw(win, 1, title_x, "# ");
+    print_clipped(win, 1, title_x + 2, channel->name, width - title_x - 3);
     wattroff(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
   }
 
@@ -322,80 +551,335 @@ void draw_chat(WINDOW *win, AppState *state)
     Channel *channel = &state->channels[state->current_channel_index];
 
     // Calculate how many messages we can show
-    int max_messages = height - 4; // Accounting for borders and title
-    int start_idx = channel->message_count > max_messages ? channel->message_count - max_messages : 0;
+    long max_messages = height - 4; // Accounting for borders and title
+
+    // Messages from first_in_memory on are in the hot tail; older ones are
+    // paged in from on-disk history when the channel has one, back to
+    // where retention has cut it
+    long first_in_memory = (long)channel->last_seq - channel->message_count + 1;
+    long oldest = first_in_memory;
+    if (channel->history && history_first_seq(channel) < first_in_memory)
+    {
+      oldest = history_first_seq(channel);
+    }
+    long available = (long)channel->last_seq - oldest + 1;
+    long max_scroll = available > max_messages ? available - max_messages : 0;
+    if (state->chat_scroll > max_scroll)
+    {
+      state->chat_scroll = max_scroll;
+    }
+    long end = (long)channel->last_seq - state->chat_scroll;
+    long start = end - max_messages + 1 > oldest ? end - max_messages + 1 : oldest;
 
-    for (int i = start_idx, line = 3; i < channel->message_count; i++, line++)
+    for (long seq = start, line = 3; seq <= end; seq++, line++)
     {
-      Message *msg = &channel->messages[i];
-      char time_buffer[10];
-      format_message_time(msg->timestamp, time_buffer, sizeof(time_buffer));
+      Message *msg = NULL;
+      HistoryMessage old;
+      const char *name;
+      const char *text;
+      int name_width;
+      int text_width;
+      size_t text_len;
+      time_t timestamp;
+
+      if (seq >= first_in_memory)
+      {
+        msg = channel_message(channel, seq - first_in_memory);
+        name = sender_name(state, msg->sender_id);
+        name_width = sender_width(state, msg->sender_id);
+        text = message_text(channel, msg);
+        text_len = msg->text_len;
+        text_width = msg->width;
+        timestamp = msg->timestamp;
+      }
+      else if (history_get(channel, seq, &old))
+      {
+        name = old.sender;
+        name_width = old.sender_width;
+        text = old.text;
+        text_len = strlen(old.text);
+        text_width = old.width;
+        timestamp = old.timestamp;
+      }
+      else
+      {
+        continue;
+      }
 
-      // Username display
-      wattron(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
-      mvwprintw(win, line, 2, "%s", msg->sender);
-      wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN) | A_BOLD);
+      draw_chat_line(win, line, name, name_width, timestamp, text, text_len, text_width);
+
+      // Show reactions if any; they are not kept in history
+      if (msg && msg->reactions)
+      {
+        ReactionSet *reactions = &channel->reaction_sets[msg->reactions - 1];
+        int reaction_x = 2;
+        for (int r = 0; r < MAX_REACTIONS; r++)
+        {
+          if (reactions->emoji[r] && reactions->count[r] > 0)
+          {
+            wattron(win, COLOR_PAIR(COLOR_NEON_PINK));
+            mvwprintw(win, line + 1, reaction_x, "%c %d", reactions->emoji[r], reactions->count[r]);
+            wattroff(win, COLOR_PAIR(COLOR_NEON_PINK));
+            reaction_x += 5; // Space for emoji and count
+          }
+        }
+      }
+    }
 
-      // Timestamp
+    // Tell the reader there is newer traffic below
+    if (state->chat_scroll > 0)
+    {
       wattron(win, COLOR_PAIR(COLOR_DARK_BLUE));
-      mvwprintw(win, line, 2 + strlen(msg->sender) + 1, "[%s]:", time_buffer);
+      mvwprintw(win, height - 1, 2, " %d newer - PgDn ", state->chat_scroll);
       wattroff(win, COLOR_PAIR(COLOR_DARK_BLUE));
+    }
+  }
 
-      // Message text
-      wattron(win, COLOR_PAIR(COLOR_GRAY));
-      mvwprintw(win, line, 2 + strlen(msg->sender) + strlen(time_buffer) + 5, "%s", msg->text);
-      wattroff(win, COLOR_PAIR(COLOR_GRAY));
+  wnoutrefresh(win);
+}
+
+// Find the byte offset of the first character at or after display column
+// col; walks from the start of the line, so it is only used on scrolling
+static int editor_pos_at_col(LineEditor *ed, int col, int *actual_col)
+{
+  int pos = 0;
+  int x = 0;
+  int len = editor_length(ed);
+
+  while (pos < len && x < col)
+  {
+    unsigned int cp;
+    pos += editor_char_at(ed, pos, &cp);
+    x += codepoint_width(cp);
+  }
+  *actual_col = x;
+  return pos;
+}
+
+// Draw the prompt and the editor's line. Only the cells from the first
+// changed character onwards are rewritten; the whole pane is repainted
+// only when focus changes or the line scrolls horizontally.
+void draw_input(WINDOW *win, bool has_focus, LineEditor *ed)
+{
+  int field = getmaxx(win) - INPUT_FIELD_X - 1;
+  int full = ed->full_redraw || has_focus != ed->drawn_focus;
+
+  // Keep the cursor inside the field, scrolling by half a field at a time
+  // so the rescan of the line is amortized over many keystrokes
+  if (ed->cursor_col < ed->scroll_col || ed->cursor_col >= ed->scroll_col + field)
+  {
+    int target = ed->cursor_col - field / 2;
+    if (target < 0)
+    {
+      target = 0;
+    }
+    ed->scroll_pos = editor_pos_at_col(ed, target, &ed->scroll_col);
+    full = 1;
+  }
+
+  int start_pos;
+  int start_col;
 
-      // Show reactions if any
-      int reaction_x = 2;
-      for (int r = 0; r < MAX_REACTIONS; r++)
+  if (full)
+  {
+    werase(win);
+    box(win, 0, 0);
+
+    // Draw input prompt with focus indicator
+    if (has_focus)
+    {
+      wattron(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+      mvwprintw(win, 1, 2, "Enter message: ");
+      wattroff(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
+    }
+    else
+    {
+      wattron(win, COLOR_PAIR(COLOR_NEON_GREEN));
+      mvwprintw(win, 1, 2, "Enter message: ");
+      wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN));
+    }
+
+    start_pos = ed->scroll_pos;
+    start_col = ed->scroll_col;
+    ed->drawn_end_col = 0;
+  }
+  else if (ed->dirty_pos >= 0 && ed->dirty_col >= ed->scroll_col)
+  {
+    start_pos = ed->dirty_pos;
+    start_col = ed->dirty_col;
+  }
+  else if (ed->dirty_pos >= 0)
+  {
+    start_pos = ed->scroll_pos;
+    start_col = ed->scroll_col;
+  }
+  else
+  {
+    start_pos = -1;
+    start_col = 0;
+  }
+
+  if (start_pos >= 0)
+  {
+    // Display the current input text from the first changed character
+    int len = editor_length(ed);
+    int pos = start_pos;
+    int col = start_col - ed->scroll_col;
+
+    wattron(win, COLOR_PAIR(COLOR_GRAY));
+    wmove(win, 1, INPUT_FIELD_X + col);
+    while (pos < len)
+    {
+      unsigned int cp;
+      int n = editor_char_at(ed, pos, &cp);
+      int w = codepoint_width(cp);
+      if (col + w > field)
       {
-        if (msg->reactions[r] && msg->reaction_count[r] > 0)
-        {
-          wattron(win, COLOR_PAIR(COLOR_NEON_PINK));
-          mvwprintw(win, line + 1, reaction_x, "%c %d", msg->reactions[r], msg->reaction_count[r]);
-          wattroff(win, COLOR_PAIR(COLOR_NEON_PINK));
-          reaction_x += 5; // Space for emoji and count
-        }
+        break;
       }
+
+      char bytes[4];
+      for (int i = 0; i < n; i++)
+      {
+        bytes[i] = pos + i < ed->gap_start ? ed->buf[pos + i]
+                                           : ed->buf[pos + i + ed->gap_end - ed->gap_start];
+      }
+      waddnstr(win, bytes, n);
+      pos += n;
+      col += w;
     }
+
+    // Blank out whatever the previous, longer line left behind
+    for (int x = col; x < ed->drawn_end_col && x < field; x++)
+    {
+      waddch(win, ' ');
+    }
+    wattroff(win, COLOR_PAIR(COLOR_GRAY));
+    ed->drawn_end_col = col;
   }
 
-  wrefresh(win);
+  ed->dirty_pos = -1;
+  ed->full_redraw = 0;
+  ed->drawn_focus = has_focus;
+
+  // Position cursor within the visible part of the line
+  wmove(win, 1, INPUT_FIELD_X + ed->cursor_col - ed->scroll_col);
+
+  wnoutrefresh(win);
 }
 
-void draw_input(WINDOW *win, bool has_focus, char *current_input)
+// Fill the overlay window with current percentiles and memory usage
+static void render_stats(AppState *state, WINDOW *win)
 {
+  int height = getmaxy(win);
+  int row = 1;
+
   werase(win);
+  wattron(win, COLOR_PAIR(COLOR_NEON_PINK));
   box(win, 0, 0);
+  wattroff(win, COLOR_PAIR(COLOR_NEON_PINK));
 
-  // Draw input prompt with focus indicator
-  if (has_focus)
-  {
-    wattron(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
-    mvwprintw(win, 1, 2, "Enter message: ");
-    wattroff(win, COLOR_PAIR(COLOR_NEON_PINK) | A_BOLD);
-  }
-  else
+  wattron(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
+  mvwprintw(win, row++, 2, "STATS           p50 us    p99 us");
+  wattroff(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
+
+  wattron(win, COLOR_PAIR(COLOR_GRAY));
+  for (int m = STATS_INPUT_LATENCY; m <= STATS_OVERLAY; m++)
   {
-    wattron(win, COLOR_PAIR(COLOR_NEON_GREEN));
-    mvwprintw(win, 1, 2, "Enter message: ");
-    wattroff(win, COLOR_PAIR(COLOR_NEON_GREEN));
+    mvwprintw(win, row++, 2, "%-15s %9.1f %9.1f", stats_metric_name(m),
+              stats_percentile(m, 0.50) / 1000.0, stats_percentile(m, 0.99) / 1000.0);
   }
+  mvwprintw(win, row++, 2, "%-15s %9ld %9ld", "bytes/frame",
+            stats_percentile(STATS_FRAME_BYTES, 0.50), stats_percentile(STATS_FRAME_BYTES, 0.99));
+  mvwprintw(win, row++, 2, "terminal out    %9ld KB", stats_bytes_written() / 1024);
+  mvwprintw(win, row++, 2, "messages/s      %9ld (%ld total)", stats_message_rate(),
+            stats_messages_ingested());
+  mvwprintw(win, row++, 2, "history cache   %9zu KB %ld/%ld", history_cache_bytes() / 1024,
+            history_cache_hits(), history_cache_misses());
+  mvwprintw(win, row++, 2, "compaction      %9ld KB %ld KB/s", history_reclaimed_bytes() / 1024,
+            history_compaction_rate() / 1024);
+  long archived = history_archived_bytes();
+  mvwprintw(win, row++, 2, "archive         %9ld KB %.1fx", archived / 1024,
+            archived ? (double)history_archived_raw_bytes() / archived : 0.0);
+  mvwprintw(win, row++, 2, "rate limited    %9ld msgs", rate_limit_dropped());
+  mvwprintw(win, row++, 2, "direct messages %9zu KB %ld convs", dm_memory_usage() / 1024,
+            dm_conversation_count());
+  char replication[48];
+  replication_status(replication, sizeof(replication));
+  mvwprintw(win, row++, 2, "replication     %s", replication[0] ? replication : "off");
+  wattroff(win, COLOR_PAIR(COLOR_GRAY));
+
+  row++;
+  wattron(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
+  mvwprintw(win, row++, 2, "MEMORY PER CHANNEL");
+  wattroff(win, COLOR_PAIR(COLOR_NEON_YELLOW) | A_BOLD);
 
-  // Display the current input text
   wattron(win, COLOR_PAIR(COLOR_GRAY));
-  mvwprintw(win, 1, 16, "%s", current_input);
+  for (int i = 0; i < state->channel_count && row < height - 1; i++)
+  {
+    Channel *channel = &state->channels[i];
+    print_clipped(win, row, 2, channel->name, 16);
+    mvwprintw(win, row++, 19, "%6zu KB %5d msgs", channel_memory_usage(channel) / 1024,
+              channel->message_count);
+  }
   wattroff(win, COLOR_PAIR(COLOR_GRAY));
+}
+
+// Draw the /stats overlay on top of the chat pane. Its content is rebuilt
+// at most once a second and otherwise left untouched, so between refreshes
+// it adds no terminal output; its own cost is tracked separately in
+// STATS_OVERLAY and is excluded from the metrics it displays.
+void draw_stats_overlay(AppState *state)
+{
+  static time_t last_render = 0;
+
+  if (!state->show_stats)
+  {
+    return;
+  }
+
+  long start = stats_now_ns();
 
-  // Position cursor at the end of input
-  wmove(win, 1, 16 + strlen(current_input));
+  if (!state->stats_win)
+  {
+    int chat_y, chat_x;
+    getbegyx(state->chat_win, chat_y, chat_x);
+    int width = 44;
+    int height = 20 + state->channel_count;
+    int max_height = getmaxy(state->chat_win) - 2;
+    if (height > max_height)
+    {
+      height = max_height;
+    }
+    state->stats_win = newwin(height, width, chat_y + 1,
+                              chat_x + getmaxx(state->chat_win) - width - 1);
+    last_render = 0;
+  }
+
+  time_t now = time(NULL);
+  if (now != last_render)
+  {
+    render_stats(state, state->stats_win);
+    last_render = now;
+  }
 
-  wrefresh(win);
+  // The chat pane was redrawn underneath; keep the overlay on top
+  touchwin(state->stats_win);
+  wnoutrefresh(state->stats_win);
+
+  stats_record(STATS_OVERLAY, stats_now_ns() - start);
 }
 
 void handle_input(AppState *state, char *input)
 {
+  // A replica only shows what its primary sends until it is promoted
+  if (replication_read_only() && strcmp(input, "/stats") != 0 && strcmp(input, "/promote") != 0)
+  {
+    post_system_message(&state->channels[state->current_channel_index],
+                        "This terminal is a read-only replica; an admin can /promote it");
+    return;
+  }
+
   if (input[0] == '/')
   {
     // Command processing
@@ -403,8 +887,15 @@ void handle_input(AppState *state, char *input)
   }
   else
   {
-    // Regular message
-    send_message(state, input);
+    // Regular message, to the open conversation or the current channel
+    if (state->dm_open)
+    {
+      send_private_message(state, state->users[state->dm_peer].username, input);
+    }
+    else
+    {
+      send_message(state, input);
+    }
   }
 }
 
@@ -419,6 +910,11 @@ void process_command(AppState *state, char *command)
   // Skip the leading slash
   char *cmd = command + 1;
 
+  // Commands act on the current channel with the user's rights there
+  int perms = channel_permissions(state, state->current_user_index, state->current_channel_index);
+  int can_moderate = perms & PERM_MODERATE;
+  int can_admin = perms & PERM_ADMIN;
+
   if (strncmp(cmd, "msg ", 4) == 0)
   {
     // Format: /msg channel_name message
@@ -473,7 +969,7 @@ void process_command(AppState *state, char *command)
   else if (strncmp(cmd, "mute ", 5) == 0)
   {
     // Format: /mute username minutes
-    if (state->users[state->current_user_index].role >= ROLE_MODERATOR)
+    if (can_moderate)
     {
       char *args = cmd + 5;
       char username[MAX_USERNAME_LEN];
@@ -488,7 +984,7 @@ void process_command(AppState *state, char *command)
   else if (strncmp(cmd, "create ", 7) == 0)
   {
     // Format: /create channel_name
-    if (state->users[state->current_user_index].role == ROLE_ADMIN)
+    if (can_admin)
     {
       char *channel_name = cmd + 7;
       create_channel(state, channel_name);
@@ -497,16 +993,89 @@ void process_command(AppState *state, char *command)
   else if (strncmp(cmd, "delete ", 7) == 0)
   {
     // Format: /delete channel_name
-    if (state->users[state->current_user_index].role == ROLE_ADMIN)
+    if (can_admin)
     {
       char *channel_name = cmd + 7;
       delete_channel(state, channel_name);
     }
   }
+  else if (strncmp(cmd, "invite ", 7) == 0)
+  {
+    // Format: /invite username - add a member to the current channel
+    if (can_moderate)
+    {
+      invite_user(state, cmd + 7, state->current_channel_index);
+    }
+  }
+  else if (strncmp(cmd, "kick ", 5) == 0)
+  {
+    // Format: /kick username - remove a member from the current channel
+    if (can_moderate)
+    {
+      kick_user(state, cmd + 5, state->current_channel_index);
+    }
+  }
+  else if (strncmp(cmd, "mod ", 4) == 0)
+  {
+    // Format: /mod username - toggle moderator rights in the current channel
+    if (can_admin)
+    {
+      toggle_channel_moderator(state, cmd + 4, state->current_channel_index);
+    }
+  }
+  else if (strcmp(cmd, "private on") == 0 || strcmp(cmd, "private off") == 0)
+  {
+    // Format: /private on|off - restrict the current channel to its members
+    if (can_admin)
+    {
+      set_channel_private(state, state->current_channel_index, cmd[9] == 'n');
+    }
+  }
+  else if (strncmp(cmd, "retention", 9) == 0 && (cmd[9] == '\0' || cmd[9] == ' '))
+  {
+    // Format: /retention [days messages megabytes] - 0 means no limit
+    if (can_admin)
+    {
+      Channel *channel = &state->channels[state->current_channel_index];
+      RetentionPolicy policy;
+      long days = 0;
+      unsigned long messages = 0, megabytes = 0;
+
+      if (!history_retention(channel, &policy))
+      {
+        post_system_message(channel, "This channel has no on-disk history");
+      }
+      else if (sscanf(cmd + 9, "%ld %lu %lu", &days, &messages, &megabytes) == 3)
+      {
+        policy.max_age = days * 24 * 60 * 60;
+        policy.max_messages = messages;
+        policy.max_bytes = (uint64_t)megabytes * 1024 * 1024;
+        history_set_retention(channel, &policy);
+        post_system_message(channel, "Retention set to %ld days, %lu messages, %lu MB", days,
+                            messages, megabytes);
+      }
+      else
+      {
+        post_system_message(channel, "Retention: %ld days, %lu messages, %lu MB (0 = no limit)",
+                            policy.max_age / (24 * 60 * 60), (unsigned long)policy.max_messages,
+                            (unsigned long)(policy.max_bytes / (1024 * 1024)));
+      }
+    }
+  }
+  else if (strcmp(cmd, "stats") == 0)
+  {
+    // Format: /stats - toggle the statistics overlay
+    state->show_stats = !state->show_stats;
+    if (!state->show_stats && state->stats_win)
+    {
+      delwin(state->stats_win);
+      state->stats_win = NULL;
+    }
+  }
   else if (strncmp(cmd, "setrole ", 8) == 0)
   {
     // Format: /setrole username role
-    if (state->users[state->current_user_index].role == ROLE_ADMIN)
+    if (can_admin)
     {
       char *args = cmd + 8;
       char username[MAX_USERNAME_LEN];
@@ -518,4 +1087,28 @@ void process_command(AppState *state, char *command)
       set_user_role(state, username, role);
     }
   }
+  else if (strncmp(cmd, "move ", 5) == 0)
+  {
+    // Format: /move channel_name shard - place a channel on another shard
+    if (can_admin)
+    {
+      char channel_name[MAX_CHANNEL_NAME_LEN];
+      int shard = -1;
+      if (sscanf(cmd + 5, "%29s %d", channel_name, &shard) != 2 || shard < 0 ||
+          !link_move(channel_name, shard))
+      {
+        post_system_message(&state->channels[state->current_channel_index],
+                            "Moves need a terminal connected to a router: /move CHANNEL SHARD");
+      }
+    }
+  }
+  else if (strcmp(cmd, "promote") == 0)
+  {
+    // Format: /promote - stop following the primary and take writes here
+    if (can_admin && !replication_promote(state))
+    {
+      post_system_message(&state->channels[state->current_channel_index],
+                          "This terminal is not a replica");
+    }
+  }
 }
\ No newline at end of file
@@ -1,8 +1,5 @@
 #include "my_dispute.h"
 
-// Selected user index for UI navigation
-static int selected_online_user_index = 0;
-
 int set_user_role(AppState *state, char *username, int role)
 {
   // Validate role
@@ -12,15 +9,7 @@ int set_user_role(AppState *state, char *username, int role)
   }
 
   // Find user with given username
-  int user_index = -1;
-  for (int i = 0; i < state->user_count; i++)
-  {
-    if (strcmp(state->users[i].username, username) == 0)
-    {
-      user_index = i;
-      break;
-    }
-  }
+  int user_index = roster_find_user(state, username, strlen(username));
 
   // If user not found
   if (user_index == -1)
@@ -32,12 +21,7 @@ int set_user_role(AppState *state, char *username, int role)
   state->users[user_index].role = role;
 
   // Add system message to current channel about the role change
-  Channel *channel = &state->channels[state->current_channel_index];
-  if (channel->message_count < MAX_MESSAGES)
   {
-    Message *msg = &channel->messages[channel->message_count];
-    strcpy(msg->sender, "SYSTEM");
-
     const char *role_str;
     if (role == ROLE_ADMIN)
     {
@@ -52,11 +36,13 @@ int set_user_role(AppState *state, char *username, int role)
       role_str = "User";
     }
 
-    sprintf(msg->text, "%s's role has been set to %s by %s",
-            username, role_str, state->users[state->current_user_index].username);
-    msg->timestamp = time(NULL);
-    channel->message_count++;
+    post_system_message(&state->channels[state->current_channel_index],
+                        "%s's role has been set to %s by %s",
+                        username, role_str, state->users[state->current_user_index].username);
   }
+  replication_log_role(user_index, role);
+  replication_log_notice(&state->channels[state->current_channel_index]);
+  metrics_count(METRIC_ROLE_CHANGES, 1);
 
   return 1;
 }
@@ -70,15 +56,7 @@ int mute_user(AppState *state, char *username, int channel_index, int minutes)
   }
 
   // Find user with given username
-  int user_index = -1;
-  for (int i = 0; i < state->user_count; i++)
-  {
-    if (strcmp(state->users[i].username, username) == 0)
-    {
-      user_index = i;
-      break;
-    }
-  }
+  int user_index = roster_find_user(state, username, strlen(username));
 
   // If user not found
   if (user_index == -1)
@@ -86,151 +64,85 @@ int mute_user(AppState *state, char *username, int channel_index, int minutes)
     return 0;
   }
 
-  // Can't mute admins or moderators
-  if (state->users[user_index].role >= ROLE_MODERATOR)
+  // Can't mute admins or anyone who moderates this channel
+  if (user_can(state, user_index, channel_index, PERM_MODERATE))
   {
     return 0;
   }
 
   // Set mute expiry time
-  time_t now = time(NULL);
+  time_t now = app_time();
   state->users[user_index].muted_until[channel_index] = now + (minutes * 60);
 
   // Add system message to the channel about the mute
-  Channel *channel = &state->channels[channel_index];
-  if (channel->message_count < MAX_MESSAGES)
-  {
-    Message *msg = &channel->messages[channel->message_count];
-    strcpy(msg->sender, "SYSTEM");
-
-    sprintf(msg->text, "%s has been muted for %d minutes by %s",
-            username, minutes, state->users[state->current_user_index].username);
-    msg->timestamp = now;
-    channel->message_count++;
-  }
+  post_system_message(&state->channels[channel_index],
+                      "%s has been muted for %d minutes by %s",
+                      username, minutes, state->users[state->current_user_index].username);
+  replication_log_mute(state, user_index, channel_index);
+  replication_log_notice(&state->channels[channel_index]);
+  metrics_count(METRIC_MUTES, 1);
 
   return 1;
 }
 
-// Return the index of the currently selected online user
+// Return the position of the selected user in the online user list
 int get_selected_user_index(AppState *state)
 {
-  return selected_online_user_index;
+  return state->user_list.selected;
 }
 
-// Navigate through online users
+// Navigate through the listed online users, wrapping at either end
 void navigate_users(AppState *state, int direction)
 {
-  int online_count = 0;
-
-  // Count online users
-  for (int i = 0; i < state->user_count; i++)
-  {
-    if (state->users[i].is_online)
-    {
-      online_count++;
-    }
-  }
-
-  if (online_count == 0)
+  ListView *list = &state->user_list;
+  build_user_list(state);
+  if (list->count == 0)
   {
     // No online users to navigate through
-    selected_online_user_index = 0;
+    list->selected = 0;
     return;
   }
 
-  // Update selection
-  selected_online_user_index += direction;
-
-  // Wrap around if needed
-  if (selected_online_user_index < 0)
-  {
-    selected_online_user_index = online_count - 1;
-  }
-  else if (selected_online_user_index >= online_count)
-  {
-    selected_online_user_index = 0;
-  }
+  list->selected = (list->selected + direction + list->count) % list->count;
 }
 
 // Start a private message with the currently selected user
 void start_pm_with_selected_user(AppState *state)
 {
-  int current_index = 0;
-  char username[MAX_USERNAME_LEN];
-  bool found = false;
-
-  // Find the username of the selected online user
-  for (int i = 0; i < state->user_count; i++)
+  ListView *list = &state->user_list;
+  build_user_list(state);
+  if (list->selected >= list->count)
   {
-    if (state->users[i].is_online)
-    {
-      if (current_index == selected_online_user_index)
-      {
-        strcpy(username, state->users[i].username);
-        found = true;
-        break;
-      }
-      current_index++;
-    }
+    return;
   }
 
-  if (!found || strcmp(username, state->users[state->current_user_index].username) == 0)
+  int selected_user = list->entries[list->selected];
+  if (selected_user == state->current_user_index &&
+      !dm_find(selected_user, selected_user))
   {
-    // Cannot start PM with self or if user not found
+    // Cannot start PM with self, unless SYSTEM or the inbox left mail there
     return;
   }
 
-  // Create PM channel name
-  char pm_channel_name[MAX_CHANNEL_NAME_LEN];
-
-  // Sort usernames alphabetically for consistent channel naming
-  if (strcmp(state->users[state->current_user_index].username, username) < 0)
-  {
-    sprintf(pm_channel_name, "PM_%s_%s",
-            state->users[state->current_user_index].username, username);
-  }
-  else
-  {
-    sprintf(pm_channel_name, "PM_%s_%s",
-            username, state->users[state->current_user_index].username);
-  }
+  open_direct_messages(state, selected_user);
+}
 
-  // Find or create the PM channel
-  int pm_channel_index = -1;
-  for (int i = 0; i < state->channel_count; i++)
+// Show the conversation with another user in the chat pane
+void open_direct_messages(AppState *state, int peer_index)
+{
+  // Everything shown in the channel being left has been seen
+  if (!state->dm_open)
   {
-    if (strcmp(state->channels[i].name, pm_channel_name) == 0)
-    {
-      pm_channel_index = i;
-      break;
-    }
+    mark_channel_read(state, state->current_user_index, state->current_channel_index);
   }
 
-  if (pm_channel_index == -1)
-  {
-    // Create new channel if it doesn't exist
-    if (state->channel_count < MAX_CHANNELS)
-    {
-      strcpy(state->channels[state->channel_count].name, pm_channel_name);
-      state->channels[state->channel_count].message_count = 0;
-
-      // Add system message
-      Message *msg = &state->channels[state->channel_count].messages[0];
-      strcpy(msg->sender, "SYSTEM");
-      sprintf(msg->text, "Private conversation between %s and %s",
-              state->users[state->current_user_index].username, username);
-      msg->timestamp = time(NULL);
-      state->channels[state->channel_count].message_count = 1;
-
-      pm_channel_index = state->channel_count;
-      state->channel_count++;
-    }
-  }
+  state->dm_open = 1;
+  state->dm_peer = peer_index;
+  state->chat_scroll = 0;
 
-  if (pm_channel_index != -1)
+  Conversation *conv = dm_find(state->current_user_index, peer_index);
+  if (conv)
   {
-    // Switch to the PM channel
-    state->current_channel_index = pm_channel_index;
+    dm_mark_read(conv, state->current_user_index);
   }
-}
\ No newline at end of file
+}
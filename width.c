@@ -0,0 +1,198 @@
+#include "my_dispute.h"
+#include <wchar.h>
+
+// Display-width measurement for UTF-8 text.
+//
+// Everything that positions text on screen goes through text_width() so that
+// CJK, emoji and box-drawing characters are counted in terminal columns
+// rather than bytes. Pure ASCII takes a fast path that never decodes.
+
+// Cache for Basic Multilingual Plane code points, filled lazily.
+// WIDTH_UNKNOWN marks an entry that has not been looked up yet.
+#define WIDTH_UNKNOWN -2
+#define BMP_SIZE 0x10000
+static signed char bmp_width_cache[BMP_SIZE];
+static int bmp_cache_ready = 0;
+
+// Small direct-mapped cache for astral code points (most emoji live here)
+#define ASTRAL_CACHE_SIZE 1024
+static unsigned int astral_keys[ASTRAL_CACHE_SIZE];
+static signed char astral_widths[ASTRAL_CACHE_SIZE];
+
+static void init_width_cache()
+{
+  memset(bmp_width_cache, WIDTH_UNKNOWN, sizeof(bmp_width_cache));
+  memset(astral_keys, 0, sizeof(astral_keys));
+  bmp_cache_ready = 1;
+}
+
+static int lookup_width(unsigned int cp)
+{
+  int w = wcwidth((wchar_t)cp);
+
+  // Non-printable or unknown to the current locale: reserve one column so
+  // the layout stays stable instead of collapsing
+  if (w < 0)
+  {
+    w = 1;
+  }
+  return w;
+}
+
+int codepoint_width(unsigned int cp)
+{
+  if (!bmp_cache_ready)
+  {
+    init_width_cache();
+  }
+
+  if (cp < BMP_SIZE)
+  {
+    int w = bmp_width_cache[cp];
+    if (w == WIDTH_UNKNOWN)
+    {
+      w = lookup_width(cp);
+      bmp_width_cache[cp] = (signed char)w;
+    }
+    return w;
+  }
+
+  int slot = cp & (ASTRAL_CACHE_SIZE - 1);
+  if (astral_keys[slot] != cp)
+  {
+    astral_keys[slot] = cp;
+    astral_widths[slot] = (signed char)lookup_width(cp);
+  }
+  return astral_widths[slot];
+}
+
+// Decode one UTF-8 sequence starting at s (at most len bytes).
+// Returns the number of bytes consumed; malformed input consumes one byte
+// and yields U+FFFD.
+int utf8_decode(const char *s, size_t len, unsigned int *cp)
+{
+  const unsigned char *p = (const unsigned char *)s;
+  int n;
+
+  if (p[0] < 0x80)
+  {
+    *cp = p[0];
+    return 1;
+  }
+  else if ((p[0] & 0xE0) == 0xC0)
+  {
+    *cp = p[0] & 0x1F;
+    n = 2;
+  }
+  else if ((p[0] & 0xF0) == 0xE0)
+  {
+    *cp = p[0] & 0x0F;
+    n = 3;
+  }
+  else if ((p[0] & 0xF8) == 0xF0)
+  {
+    *cp = p[0] & 0x07;
+    n = 4;
+  }
+  else
+  {
+    *cp = 0xFFFD;
+    return 1;
+  }
+
+  if ((size_t)n > len)
+  {
+    *cp = 0xFFFD;
+    return 1;
+  }
+
+  for (int i = 1; i < n; i++)
+  {
+    if ((p[i] & 0xC0) != 0x80)
+    {
+      *cp = 0xFFFD;
+      return 1;
+    }
+    *cp = (*cp << 6) | (p[i] & 0x3F);
+  }
+
+  return n;
+}
+
+int text_width_n(const char *text, size_t len)
+{
+  size_t i = 0;
+
+  // ASCII fast path: one column per byte until the first non-ASCII byte
+  while (i < len && (unsigned char)text[i] < 0x80)
+  {
+    i++;
+  }
+
+  int width = (int)i;
+
+  while (i < len)
+  {
+    unsigned int cp;
+    i += utf8_decode(text + i, len - i, &cp);
+    width += codepoint_width(cp);
+  }
+
+  return width;
+}
+
+int text_width(const char *text)
+{
+  return text_width_n(text, strlen(text));
+}
+
+// Return how many bytes of text fit into max_cols display columns without
+// splitting a character. The resulting width is stored in *out_width.
+size_t text_fit(const char *text, int max_cols, int *out_width)
+{
+  size_t len = strlen(text);
+  size_t i = 0;
+  int width = 0;
+
+  while (i < len && width < max_cols)
+  {
+    unsigned int cp;
+    int n;
+    int w;
+
+    if ((unsigned char)text[i] < 0x80)
+    {
+      n = 1;
+      w = 1;
+    }
+    else
+    {
+      n = utf8_decode(text + i, len - i, &cp);
+      w = codepoint_width(cp);
+    }
+
+    if (width + w > max_cols)
+    {
+      break;
+    }
+    width += w;
+    i += n;
+  }
+
+  if (out_width)
+  {
+    *out_width = width;
+  }
+  return i;
+}
+
+// Print text at (y, x), clipped to max_cols display columns
+void print_clipped(WINDOW *win, int y, int x, const char *text, int max_cols)
+{
+  if (max_cols <= 0)
+  {
+    return;
+  }
+  size_t bytes = text_fit(text, max_cols, NULL);
+  mvwaddnstr(win, y, x, text, (int)bytes);
+}